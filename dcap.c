@@ -33,10 +33,14 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
+#include <assert.h>
 #include <errno.h>
 #include <err.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,12 +50,32 @@
 
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
 #include <pcap/pcap.h>
 
 #include <net/ethernet.h>
+#if __linux__
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#endif
+
+#if __linux__ && defined(__has_include)
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#define DCAP_HAVE_XDP	1
+#include <sys/syscall.h>
+/* pcap already has a (classic) struct bpf_insn. */
+#define bpf_insn ebpf_insn
+#include <linux/bpf.h>
+#undef bpf_insn
+#include <linux/if_xdp.h>
+#endif
+#endif
 #include <event.h>
 
 #include "dcap.h"
@@ -59,103 +83,539 @@
 #ifndef ETHERTYPE_VLAN
 #define	ETHERTYPE_VLAN		0x8100		/* IEEE 802.1Q VLAN tagging */
 #endif
+#ifndef ETHERTYPE_IPV6
+#define	ETHERTYPE_IPV6		0x86dd
+#endif
+#define	ETHERTYPE_QINQ		0x88a8		/* IEEE 802.1ad */
+#define	ETHERTYPE_QINQ_OLD	0x9100
+#define	ETHERTYPE_MPLS_UC	0x8847
+#define	ETHERTYPE_MPLS_MC	0x8848
+#define	ETHERTYPE_TEB		0x6558		/* Ethernet over gre */
+#define	ETHERTYPE_ERSPAN2	0x88be
+#define	ETHERTYPE_ERSPAN3	0x22eb
+
+#define DCAP_VXLAN_PORT		4789
+#define DCAP_DNS_PORT		53
+#define DCAP_WARN_INTERVAL	60	/* secs, see dcap_drop() */
+#define DCAP_BATCH_SLOT		2048	/* Bytes per copied pkt. Bigger
+					   ones are passed on their own. */
+/* Gives up on pkts with more hdrs than this in front of the ip pkt. */
+#define DCAP_DECAP_MAX_HDRS	16
 
 #define MAXIMUM_SNAPLEN		65535
 
+#define DCAP_MEM_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+/* pcap savefile format, for the mmap backend. */
+#define DCAP_SF_MAGIC		0xa1b2c3d4
+#define DCAP_SF_MAGIC_NSEC	0xa1b23c4d
+#define DCAP_SF_MAX_CAPLEN	262144
+
+struct dcap_sf_hdr {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+};
+
+struct dcap_sf_rec {
+	uint32_t	ts_sec;
+	uint32_t	ts_frac;	/* usec or nsec */
+	uint32_t	caplen;
+	uint32_t	len;
+};
+
+/* Record headers that have to check out before a chunk starts at one. */
+#define DCAP_MMAP_RESYNC_RECORDS	8
+
+/* Ring defaults. 128MB, close to the pcap buffer size used by
+ * dcap_init_live(). */
+#define DCAP_RING_BLOCK_SIZE	(1 << 20)
+#define DCAP_RING_BLOCK_COUNT	128
+#define DCAP_RING_RETIRE_TOV	100	/* msec */
+
+/* AF_XDP. Frames are big enough for a 1500 mtu, and the fill ring can
+ * hold every frame, so handing frames back never overflows it. */
+#define DCAP_XSK_FRAME_SIZE	4096
+#define DCAP_XSK_NUM_FRAMES	4096
+#define DCAP_XSK_FILL_SIZE	DCAP_XSK_NUM_FRAMES
+#define DCAP_XSK_RX_SIZE	2048
+
+#if DCAP_HAVE_XDP
+static void dcap_xsk_read(struct dcap *dcap);
+#endif
+
+/* Decapsulation. Each layer's handler checks one hdr, and says what comes
+ * after it, and how long it was. Vlan tags are always taken off, the rest
+ * only if they're in dcap->_decap. */
+enum dcap_layer {
+	DCAP_L_ETHER,
+	DCAP_L_VLAN,
+	DCAP_L_MPLS,
+	DCAP_L_IP,		/* Either, by the version. */
+	DCAP_L_IP4,
+	DCAP_L_IP6,
+	DCAP_L_GRE,
+	DCAP_L_ERSPAN2,
+	DCAP_L_ERSPAN3,
+	DCAP_L_VXLAN,
+	DCAP_L_MAX,
+	DCAP_L_DONE = DCAP_L_MAX,	/* This is the pkt for the callback. */
+	DCAP_L_BAD,		/* Cut short, or not something to take off. */
+};
+
+/* What comes after an ethertype, or a gre protocol, which uses the same
+ * numbers. */
+static const struct {
+	uint16_t	ethertype;
+	int		layer;
+	int		decap;		/* Needed in dcap->_decap, or 0. */
+} dcap_ethertypes[] = {
+	{ ETHERTYPE_IP,		DCAP_L_IP4,	0 },
+	{ ETHERTYPE_IPV6,	DCAP_L_IP6,	0 },
+	{ ETHERTYPE_VLAN,	DCAP_L_VLAN,	0 },
+	{ ETHERTYPE_QINQ,	DCAP_L_VLAN,	0 },
+	{ ETHERTYPE_QINQ_OLD,	DCAP_L_VLAN,	0 },
+	{ ETHERTYPE_MPLS_UC,	DCAP_L_MPLS,	DCAP_DECAP_MPLS },
+	{ ETHERTYPE_MPLS_MC,	DCAP_L_MPLS,	DCAP_DECAP_MPLS },
+	{ ETHERTYPE_TEB,	DCAP_L_ETHER,	DCAP_DECAP_GRE },
+	{ ETHERTYPE_ERSPAN2,	DCAP_L_ERSPAN2,	DCAP_DECAP_ERSPAN },
+	{ ETHERTYPE_ERSPAN3,	DCAP_L_ERSPAN3,	DCAP_DECAP_ERSPAN },
+};
+
+static inline uint16_t
+dcap_get16(const u_char *p)
+{
+	return ((uint16_t)p[0] << 8 | p[1]);
+}
+
 static int
-datalink_offset(int i)
+dcap_ethertype_layer(struct dcap *dcap, uint16_t ethertype)
 {
-	switch (i) {
-	case DLT_EN10MB:
-		i = sizeof(struct ether_header);
-		break;
-	case DLT_IEEE802:
-		i = 22;
-		break;
-	case DLT_FDDI:
-		i = 21;
-		break;
-#ifdef DLT_LOOP
-	case DLT_LOOP:
-#endif
-	case DLT_NULL:
-		i = 4;
-		break;
-	default:
-		i = -1;
-		break;
+	int		i;
+
+	for (i = 0; i < sizeof(dcap_ethertypes) / sizeof(dcap_ethertypes[0]);
+	    i++) {
+		if (dcap_ethertypes[i].ethertype != ethertype) {
+			continue;
+		}
+		if (dcap_ethertypes[i].decap != 0 &&
+		    (dcap->_decap & dcap_ethertypes[i].decap) == 0) {
+			return (DCAP_L_BAD);
+		}
+		return (dcap_ethertypes[i].layer);
 	}
-	return (i);
+	return (DCAP_L_BAD);
 }
 
-static void 
-dcap_pcap_cb(u_char *user, const struct pcap_pkthdr *pkthdr, const u_char *pkt)
+static int
+dcap_decap_ether(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
 {
-	struct ether_header	*eh;
-	uint16_t		ether_type;
-	pcap_t			*pcap = NULL;
-	struct dcap		*dcap;
-	int			length, dl, dloff;
-	char			*p;
+	*hdr_len = sizeof(struct ether_header);
+	return (dcap_ethertype_layer(dcap, dcap_get16(p + 12)));
+}
 
-	dcap = (struct dcap *) user;
-	pcap = dcap->_pcap;
+/* 802.1Q and 802.1ad tags, all the same on the wire. */
+static int
+dcap_decap_vlan(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	*hdr_len = 4;
+	return (dcap_ethertype_layer(dcap, dcap_get16(p + 2)));
+}
 
-	if (dcap->sample_rate > 1) {
-		/* Seeding is left to the user. */
-		if (random() % dcap->sample_rate != 0) {
-			return;
+/* One label stack entry. After the bottom of the stack, there's no type,
+ * so go by the first nibble: an ip version, or 0 for a pseudowire control
+ * word and then ethernet. */
+static int
+dcap_decap_mpls(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	*hdr_len = 4;
+	if ((p[2] & 0x01) == 0) {
+		return (DCAP_L_MPLS);
+	}
+	if (len < 5) {
+		return (DCAP_L_BAD);
+	}
+	switch (p[4] >> 4) {
+	case 4:
+		return (DCAP_L_IP4);
+	case 6:
+		return (DCAP_L_IP6);
+	case 0:
+		*hdr_len = 8;
+		return (DCAP_L_ETHER);
+	}
+	return (DCAP_L_BAD);
+}
+
+/* Loopback pkts have no type. Anything that isn't ip is still passed on,
+ * for the callback to deal with. */
+static int
+dcap_decap_ip(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	switch (p[0] >> 4) {
+	case 4:
+		return (DCAP_L_IP4);
+	case 6:
+		return (DCAP_L_IP6);
+	}
+	return (DCAP_L_DONE);
+}
+
+/* The outer hdr of a tunnel, or the pkt. Anything that doesn't look like
+ * a tunnel is passed on, bad hdrs and all. That includes a dns response
+ * to a client that picked the vxlan port. */
+static int
+dcap_decap_ip4(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	int		ihl;
+
+	if ((dcap->_decap & (DCAP_DECAP_GRE | DCAP_DECAP_ERSPAN |
+				DCAP_DECAP_VXLAN)) == 0) {
+		return (DCAP_L_DONE);
+	}
+	ihl = (p[0] & 0x0f) * 4;
+	if ((p[0] >> 4) != 4 || ihl < sizeof(struct ip) || ihl > len ||
+	    (dcap_get16(p + 6) & 0x3fff) != 0) {
+		/* Bad, or a fragment. */
+		return (DCAP_L_DONE);
+	}
+	if (p[9] == IPPROTO_GRE &&
+	    (dcap->_decap & (DCAP_DECAP_GRE | DCAP_DECAP_ERSPAN))) {
+		*hdr_len = ihl;
+		return (DCAP_L_GRE);
+	}
+	if (p[9] == IPPROTO_UDP && (dcap->_decap & DCAP_DECAP_VXLAN) &&
+	    len >= ihl + sizeof(struct udphdr) &&
+	    dcap_get16(p + ihl + 2) == DCAP_VXLAN_PORT &&
+	    dcap_get16(p + ihl) != DCAP_DNS_PORT) {
+		*hdr_len = ihl + sizeof(struct udphdr);
+		return (DCAP_L_VXLAN);
+	}
+	return (DCAP_L_DONE);
+}
+
+/* As above, but only when the tunnel directly follows the fixed hdr. */
+static int
+dcap_decap_ip6(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	if ((dcap->_decap & (DCAP_DECAP_GRE | DCAP_DECAP_ERSPAN |
+				DCAP_DECAP_VXLAN)) == 0) {
+		return (DCAP_L_DONE);
+	}
+	if (p[6] == IPPROTO_GRE &&
+	    (dcap->_decap & (DCAP_DECAP_GRE | DCAP_DECAP_ERSPAN))) {
+		*hdr_len = sizeof(struct ip6_hdr);
+		return (DCAP_L_GRE);
+	}
+	if (p[6] == IPPROTO_UDP && (dcap->_decap & DCAP_DECAP_VXLAN) &&
+	    len >= sizeof(struct ip6_hdr) + sizeof(struct udphdr) &&
+	    dcap_get16(p + sizeof(struct ip6_hdr) + 2) == DCAP_VXLAN_PORT &&
+	    dcap_get16(p + sizeof(struct ip6_hdr)) != DCAP_DNS_PORT) {
+		*hdr_len = sizeof(struct ip6_hdr) + sizeof(struct udphdr);
+		return (DCAP_L_VXLAN);
+	}
+	return (DCAP_L_DONE);
+}
+
+/* Version 0 gre, with any of the checksum, key and sequence fields. */
+static int
+dcap_decap_gre(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	uint16_t	flags = dcap_get16(p);
+
+	if ((flags & 0x4007) != 0) {
+		/* Routing present, or not version 0. */
+		return (DCAP_L_BAD);
+	}
+	*hdr_len = 4 + ((flags & 0x8000) ? 4 : 0) + ((flags & 0x2000) ? 4 : 0) +
+		((flags & 0x1000) ? 4 : 0);
+	return (dcap_ethertype_layer(dcap, dcap_get16(p + 2)));
+}
+
+static int
+dcap_decap_erspan2(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	*hdr_len = 8;
+	return (DCAP_L_ETHER);
+}
+
+/* With the optional platform specific subheader, if the O bit is set. */
+static int
+dcap_decap_erspan3(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	*hdr_len = (p[11] & 0x01) ? 20 : 12;
+	return (DCAP_L_ETHER);
+}
+
+static int
+dcap_decap_vxlan(struct dcap *dcap, const u_char *p, int len, int *hdr_len)
+{
+	if ((p[0] & 0x08) == 0) {
+		/* No vni. */
+		return (DCAP_L_BAD);
+	}
+	*hdr_len = 8;
+	return (DCAP_L_ETHER);
+}
+
+static const struct {
+	int		min_len;
+	int		(*handler)(struct dcap *dcap, const u_char *p, int len,
+				int *hdr_len);
+} dcap_layers[DCAP_L_MAX] = {
+	[DCAP_L_ETHER] =	{ sizeof(struct ether_header), dcap_decap_ether },
+	[DCAP_L_VLAN] =		{ 4,	dcap_decap_vlan },
+	[DCAP_L_MPLS] =		{ 4,	dcap_decap_mpls },
+	[DCAP_L_IP] =		{ 1,	dcap_decap_ip },
+	[DCAP_L_IP4] =		{ sizeof(struct ip), dcap_decap_ip4 },
+	[DCAP_L_IP6] =		{ sizeof(struct ip6_hdr), dcap_decap_ip6 },
+	[DCAP_L_GRE] =		{ 4,	dcap_decap_gre },
+	[DCAP_L_ERSPAN2] =	{ 8,	dcap_decap_erspan2 },
+	[DCAP_L_ERSPAN3] =	{ 12,	dcap_decap_erspan3 },
+	[DCAP_L_VXLAN] =	{ 8,	dcap_decap_vxlan },
+};
+
+/* Take hdrs off, starting with one of type layer, until the ip pkt. Returns
+ * it, with *lenp updated, or NULL if there's something else in the way. */
+static char *
+dcap_decap(struct dcap *dcap, int layer, char *p, int *lenp)
+{
+	int		i, hdr_len;
+
+	for (i = 0; i < DCAP_DECAP_MAX_HDRS; i++) {
+		if (*lenp < dcap_layers[layer].min_len) {
+			return (NULL);
+		}
+		hdr_len = 0;
+		layer = dcap_layers[layer].handler(dcap, (u_char *)p, *lenp,
+				&hdr_len);
+		if (layer == DCAP_L_DONE) {
+			return (p);
+		}
+		if (layer == DCAP_L_BAD || hdr_len > *lenp) {
+			return (NULL);
 		}
+		p += hdr_len;
+		*lenp -= hdr_len;
 	}
+	return (NULL);
+}
 
-	if (pkthdr->caplen != pkthdr->len) {
-		warnx("Invalid caplen: %d %d\n", pkthdr->caplen, pkthdr->len);
-		return;
+void
+dcap_set_decap(struct dcap *dcap, int decap)
+{
+	dcap->_decap = decap;
+}
+
+/* Datalinks. Each has its own handler, picked when the dcap is opened,
+ * that takes the link hdr off and hands the rest to dcap_decap(). */
+static char *
+dcap_dl_ether(struct dcap *dcap, char *p, int *lenp)
+{
+	return (dcap_decap(dcap, DCAP_L_ETHER, p, lenp));
+}
+
+/* XXX Why are we only checking for IP if it's ethernet? These take the
+ * ethertype from where it would be on ethernet. */
+static inline char *
+dcap_dl_ethertype(struct dcap *dcap, char *p, int *lenp, int dloff)
+{
+	int		layer;
+
+	layer = dcap_ethertype_layer(dcap, dcap_get16((u_char *)p + 12));
+	if (layer == DCAP_L_BAD) {
+		return (NULL);
+	}
+	*lenp -= dloff;
+	return (dcap_decap(dcap, layer, p + dloff, lenp));
+}
+
+static char *
+dcap_dl_ieee802(struct dcap *dcap, char *p, int *lenp)
+{
+	return (dcap_dl_ethertype(dcap, p, lenp, 22));
+}
+
+static char *
+dcap_dl_fddi(struct dcap *dcap, char *p, int *lenp)
+{
+	return (dcap_dl_ethertype(dcap, p, lenp, 21));
+}
+
+static char *
+dcap_dl_null(struct dcap *dcap, char *p, int *lenp)
+{
+	*lenp -= 4;
+	return (dcap_decap(dcap, DCAP_L_IP, p + 4, lenp));
+}
+
+static const struct {
+	int		dlt;
+	int		offset;		/* Link hdr length */
+	char		*(*handler)(struct dcap *dcap, char *p, int *lenp);
+} dcap_datalinks[] = {
+	{ DLT_EN10MB,	sizeof(struct ether_header), dcap_dl_ether },
+	{ DLT_IEEE802,	22,	dcap_dl_ieee802 },
+	{ DLT_FDDI,	21,	dcap_dl_fddi },
+#ifdef DLT_LOOP
+	{ DLT_LOOP,	4,	dcap_dl_null },
+#endif
+	{ DLT_NULL,	4,	dcap_dl_null },
+};
+#define DCAP_DATALINKS_COUNT \
+	(sizeof(dcap_datalinks) / sizeof(dcap_datalinks[0]))
+
+/* Index into dcap_datalinks, or -1 if dlt isn't supported. */
+static int
+dcap_datalink_find(int dlt)
+{
+	int		i;
+
+	for (i = 0; i < DCAP_DATALINKS_COUNT; i++) {
+		if (dcap_datalinks[i].dlt == dlt) {
+			return (i);
+		}
 	}
+	return (-1);
+}
+
+/* Set up the datalink handler for the dcap's pcap handle. */
+static int
+dcap_datalink_init(struct dcap *dcap)
+{
+	int		dl, i;
+
+	dl = pcap_datalink(dcap->_pcap);
+	if ((i = dcap_datalink_find(dl)) < 0) {
+		warnx("Unsupported datalink: %d", dl);
+		return (-1);
+	}
+	dcap->_dl_handler = dcap_datalinks[i].handler;
+	dcap->_dl_min_len = dcap_datalinks[i].offset + sizeof(struct ip);
+	return (0);
+}
+
+/* Pkts that can't be passed to the callback are counted (see
+ * dcap_get_stats()), and warned about at most every DCAP_WARN_INTERVAL
+ * secs, so a misconfigured mirror can't flood the log and hold up the
+ * capture. */
+static void
+dcap_drop(struct dcap *dcap, uint64_t *counter, const char *reason,
+		const struct pcap_pkthdr *pkthdr)
+{
+	time_t		now;
 
-	dl = pcap_datalink(pcap);
-	dloff = datalink_offset(dl);
-	if(dloff == -1) {
-		warnx("Unsupported datalink: %d\n", dl);
+	(*counter)++;
+	now = time(NULL);
+	if (now < dcap->_warn_next) {
 		return;
 	}
+	dcap->_warn_next = now + DCAP_WARN_INTERVAL;
+	warnx("%s: caplen=%u length=%u (%llu so far, next warning in %ds)",
+			reason, pkthdr->caplen, pkthdr->len,
+			(unsigned long long)*counter, DCAP_WARN_INTERVAL);
+}
+
+/* Hand the pkts batched so far to the batch handler. Called when the
+ * batch is full, and by each backend before the pkts in it can go away:
+ * at the end of a pcap_dispatch(), or before a ring block or XDP frames
+ * go back to the kernel. */
+static void
+dcap_batch_flush(struct dcap *dcap)
+{
+	int		n = dcap->_batch_n;
 
-	if (pkthdr->len < dloff + sizeof(struct ip)) {
-		warnx("Invalid packet: length=%d\n", pkthdr->len);
+	if (n == 0) {
 		return;
 	}
+	dcap->_batch_n = 0;
+	dcap->pkts_captured += n;
+	dcap->_batch_callback(dcap->_batch, n, dcap->user);
+}
 
-	p = (char *)pkt;
-	length = pkthdr->len;
+static void
+dcap_batch_add(struct dcap *dcap, const struct timeval *tv, int len,
+		char *p)
+{
+	struct dcap_pkt		*dp;
 
-	if(dl != DLT_NULL 
-#ifdef DLT_LOOP
-		&& dl != DLT_LOOP)
-#endif
-	{
-		eh = (struct ether_header *)p;
-		ether_type = ntohs(eh->ether_type);
-		p += dloff;
-		length -= dloff;
-
-		/* Unencapsulate 802.1Q VLAN */
-		/* XXX Only supporting 1 level. Just loop for qinq? */
-		if (ether_type == ETHERTYPE_VLAN) {
-			ether_type = ntohs(*(uint16_t *)(p + 2));
-			p += 4;
-			length -= 4;
-		}
-
-		/* XXX Why are we only checking for IP if it's ethernet? */
-		if (ether_type != ETHERTYPE_IP) {
-			warnx("Non-ip: ether_type=%d\n", ether_type); 
+	if (dcap->_batch_buf != NULL) {
+		if (len > DCAP_BATCH_SLOT) {
+			/* Too big to copy, so it's a batch of its own,
+			 * straight out of pcap's buffer. */
+			dcap_batch_flush(dcap);
+			dp = &dcap->_batch[dcap->_batch_n++];
+			dp->tv = *tv;
+			dp->len = len;
+			dp->ip_pkt = p;
+			dcap_batch_flush(dcap);
 			return;
 		}
-	} else {
-		p += dloff;
-		length -= dloff;
+		memcpy(dcap->_batch_buf + dcap->_batch_n * DCAP_BATCH_SLOT,
+				p, len);
+		p = dcap->_batch_buf + dcap->_batch_n * DCAP_BATCH_SLOT;
+	}
+	dp = &dcap->_batch[dcap->_batch_n++];
+	dp->tv = *tv;
+	dp->len = len;
+	dp->ip_pkt = p;
+	if (dcap->_batch_n == DCAP_BATCH_MAX) {
+		dcap_batch_flush(dcap);
+	}
+}
+
+/* Deliver pkts in batches of up to DCAP_BATCH_MAX to handler, instead of
+ * one at a time to the dcap_handler. */
+int
+dcap_set_batch_handler(struct dcap *dcap, dcap_batch_handler handler)
+{
+	if (dcap->_batch == NULL &&
+	    (dcap->_batch = calloc(DCAP_BATCH_MAX,
+			    sizeof(struct dcap_pkt))) == NULL) {
+		warn("calloc");
+		return (-1);
+	}
+	if (dcap->_backend == DCAP_BACKEND_PCAP && dcap->_batch_buf == NULL &&
+	    (dcap->_batch_buf = malloc(DCAP_BATCH_MAX *
+			    DCAP_BATCH_SLOT)) == NULL) {
+		warn("malloc");
+		return (-1);
+	}
+	dcap->_batch_callback = handler;
+	return (0);
+}
+
+static void 
+dcap_pcap_cb(u_char *user, const struct pcap_pkthdr *pkthdr, const u_char *pkt)
+{
+	struct dcap		*dcap = (struct dcap *)user;
+	int			length = pkthdr->len;
+	char			*p;
+
+	if (pkthdr->caplen != pkthdr->len) {
+		dcap_drop(dcap, &dcap->_drop_truncated, "Truncated packet",
+				pkthdr);
+		return;
+	}
+	if (length < dcap->_dl_min_len) {
+		dcap_drop(dcap, &dcap->_drop_runt, "Invalid packet", pkthdr);
+		return;
+	}
+	if ((p = dcap->_dl_handler(dcap, (char *)pkt, &length)) == NULL) {
+		dcap_drop(dcap, &dcap->_drop_not_ip,
+				"Non-ip, or an unknown encap", pkthdr);
+		return;
 	}
 
+	if (dcap->_batch_callback != NULL) {
+		dcap_batch_add(dcap, (const struct timeval *)&pkthdr->ts,
+				length, p);
+		return;
+	}
 	dcap->pkts_captured++;
 	dcap->_callback((struct timeval *)&pkthdr->ts, length, p, dcap->user);
 }
@@ -164,10 +624,67 @@ dcap_pcap_cb(u_char *user, const struct pcap_pkthdr *pkthdr, const u_char *pkt)
 int
 dcap_get_fd(struct dcap *dcap)
 {
+	if (dcap->_backend != DCAP_BACKEND_PCAP) {
+		return (dcap->_fd);
+	}
 	/* See man page. Apparently it's not always selectable on OS X. */
 	return (pcap_get_selectable_fd(dcap->_pcap));
 }
 
+/* The capture's pcap link type, e.g. to check a filter against. */
+int
+dcap_get_datalink(struct dcap *dcap)
+{
+	return (pcap_datalink(dcap->_pcap));
+}
+
+#if __linux__
+static inline struct tpacket_block_desc *
+dcap_ring_block(struct dcap *dcap, uint32_t i)
+{
+	return ((struct tpacket_block_desc *)
+			(dcap->_ring + (size_t)i * dcap->_ring_block_size));
+}
+
+/* Process all the blocks the kernel has handed over, then give them back.
+ * Pkts are passed straight out of the ring, no copy. */
+static void
+dcap_ring_read(struct dcap *dcap)
+{
+	struct tpacket_block_desc	*bd;
+	struct tpacket3_hdr		*hdr;
+	struct pcap_pkthdr		pkthdr;
+	uint32_t			i;
+
+	for (;;) {
+		bd = dcap_ring_block(dcap, dcap->_ring_block_cur);
+		if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+			break;
+		}
+		__sync_synchronize();
+
+		hdr = (struct tpacket3_hdr *)
+			((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			pkthdr.ts.tv_sec = hdr->tp_sec;
+			pkthdr.ts.tv_usec = hdr->tp_nsec / 1000;
+			pkthdr.caplen = hdr->tp_snaplen;
+			pkthdr.len = hdr->tp_len;
+			dcap_pcap_cb((u_char *)dcap, &pkthdr,
+					(u_char *)hdr + hdr->tp_mac);
+			hdr = (struct tpacket3_hdr *)
+				((char *)hdr + hdr->tp_next_offset);
+		}
+		dcap_batch_flush(dcap);
+
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		dcap->_ring_block_cur =
+			(dcap->_ring_block_cur + 1) % dcap->_ring_block_count;
+	}
+}
+#endif
+
 static void
 dcap_event_cb(int fd, short event, void *arg) 
 {
@@ -178,14 +695,37 @@ dcap_event_cb(int fd, short event, void *arg)
 	struct timeval	*ev_tv = NULL;
 #endif
 
+#if __linux__
+	if (dcap->_backend == DCAP_BACKEND_RING) {
+		dcap_ring_read(dcap);
+		event_add(dcap->_ev_pcap, ev_tv);
+		return;
+	}
+#endif
+#if DCAP_HAVE_XDP
+	if (dcap->_backend == DCAP_BACKEND_XDP) {
+		dcap_xsk_read(dcap);
+		event_add(dcap->_ev_pcap, ev_tv);
+		return;
+	}
+#endif
 	/* Use pcap_dispatch with cnt of -1 so entire buffer is processed. */
 	pcap_dispatch(dcap->_pcap, -1, 
 			(pcap_handler)dcap_pcap_cb, (u_char *)dcap);
+	dcap_batch_flush(dcap);
 	event_add(dcap->_ev_pcap, ev_tv);
 }
 /* Use libevent to check for readiness. */
 int
 dcap_event_set(struct dcap *dcap)
+{
+	return (dcap_event_set_base(dcap, NULL));
+}
+
+/* Same as dcap_event_set(), but on the given event base rather than the
+ * global one. Use this when running a loop per thread. */
+int
+dcap_event_set_base(struct dcap *dcap, struct event_base *base)
 {
 #if __APPLE__ && __MACH__
 	/* Not totally sure what's going on, but it seems bpf won't
@@ -200,6 +740,10 @@ dcap_event_set(struct dcap *dcap)
 #endif
 	event_set(dcap->_ev_pcap, dcap_get_fd(dcap), EV_READ,
 			dcap_event_cb, dcap);
+	if (base != NULL && event_base_set(base, dcap->_ev_pcap) < 0) {
+		warnx("event_base_set error");
+		return (-1);
+	}
 	if (event_add(dcap->_ev_pcap, ev_tv) < 0) {
 		warnx("event_add error");
 		return (-1);
@@ -274,11 +818,6 @@ dcap_init_live(char *intf_name, int promisc, char *filter,
 		return (NULL);
 	}
 
-	dcap = calloc(1, sizeof(struct dcap));
-	dcap->_pcap = pcap;
-	dcap->_callback = callback;
-	dcap->user = NULL;
-
 	/* Get the netmask. Only used for "ip broadcast" filter expression,
 	 * so doesn't really matter. */
 	if (pcap_lookupnet(intf_name, &localnet, &netmask, errbuf) < 0) {
@@ -305,41 +844,994 @@ dcap_init_live(char *intf_name, int promisc, char *filter,
 	dcap->_pcap = pcap;
 	snprintf(dcap->intf_name, sizeof(dcap->intf_name), "%s", intf_name);
 	dcap->_callback = callback;
+	if (dcap_datalink_init(dcap) < 0) {
+		pcap_close(pcap);
+		free(dcap);
+		return (NULL);
+	}
 
 	return (dcap);
 }
 
+/* Capture using our own TPACKET_V3 ring, instead of going through
+ * libpcap. Whole blocks of pkts are handed to us at a time, and processed
+ * in place. Linux only.
+ * config may be NULL for the defaults. */
 struct dcap *
-dcap_init_file(char *filename, char *filter, dcap_handler callback)
+dcap_init_ring(char *intf_name, int promisc, char *filter,
+		struct dcap_ring_config *config, dcap_handler callback)
 {
-	char			pcap_errbuf[PCAP_ERRBUF_SIZE];
-        struct bpf_program      bpf;
+#if __linux__
+	char			errbuf[PCAP_ERRBUF_SIZE];
+	struct bpf_program      bpf_program;
+	struct sock_fprog	fprog;
+	struct tpacket_req3	req;
+	struct sockaddr_ll	sll;
+	struct packet_mreq	mreq;
 	struct dcap		*dcap = NULL;
 	pcap_t			*pcap = NULL;
+	char			*ring;
+	size_t			ring_len;
+	int			fd, ifindex, version = TPACKET_V3;
 
+	if (intf_name == NULL) {
+		if ((intf_name = pcap_lookupdev(errbuf)) == NULL) {
+			warnx("%s", errbuf);
+			return (NULL);
+		}
+	}
+	if ((ifindex = if_nametoindex(intf_name)) == 0) {
+		warn("%s", intf_name);
+		return (NULL);
+	}
 
-	pcap = pcap_open_offline(filename, pcap_errbuf);
-	if (pcap == NULL) {
-		warnx("Could not open file %s (%s)\n", filename, pcap_errbuf);
+	bzero(&req, sizeof(req));
+	req.tp_block_size = DCAP_RING_BLOCK_SIZE;
+	req.tp_block_nr = DCAP_RING_BLOCK_COUNT;
+	req.tp_retire_blk_tov = DCAP_RING_RETIRE_TOV;
+	if (config != NULL) {
+		if (config->block_size != 0) {
+			req.tp_block_size = config->block_size;
+		}
+		if (config->block_count != 0) {
+			req.tp_block_nr = config->block_count;
+		}
+		if (config->retire_tov != 0) {
+			req.tp_retire_blk_tov = config->retire_tov;
+		}
+	}
+	if (req.tp_block_size % getpagesize() != 0) {
+		warnx("%s: ring block size must be a multiple of %d",
+				intf_name, getpagesize());
 		return (NULL);
 	}
+	/* Frames are variable size in V3, but the kernel still checks
+	 * these. */
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) *
+		req.tp_block_nr;
+	ring_len = (size_t)req.tp_block_size * req.tp_block_nr;
 
-	if (pcap_compile(pcap, &bpf, filter, 1, 0) < 0) {
-		warnx("filter compile failed: %s\n", pcap_geterr(pcap));
+	/* Only used to compile the filter. With a dead handle, pcap doesn't
+	 * use the linux vlan extensions, so the vlan part of the filter
+	 * won't match. That's ok - the kernel strips the tag before the
+	 * socket filter runs, so tagged pkts match the untagged part. */
+	if ((pcap = pcap_open_dead(DLT_EN10MB, MAXIMUM_SNAPLEN)) == NULL) {
+		warnx("pcap_open_dead failed");
+		return (NULL);
+	}
+	if (pcap_compile(pcap, &bpf_program, filter, 1, 0) < 0) {
+		warnx("%s", pcap_geterr(pcap));
 		pcap_close(pcap);
 		return (NULL);
 	}
 
-	if (pcap_setfilter(pcap, &bpf) < 0) {
-		warnx("Pcap setfilter failed: %s\n", pcap_geterr(pcap));
+	/* Bind with protocol 0, so nothing is received until the filter
+	 * and ring are in place. */
+	if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+		warn("%s: socket", intf_name);
+		pcap_freecode(&bpf_program);
 		pcap_close(pcap);
 		return (NULL);
 	}
-	
+
+	fprog.len = bpf_program.bf_len;
+	fprog.filter = (struct sock_filter *)bpf_program.bf_insns;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+				&fprog, sizeof(fprog)) < 0) {
+		warn("%s: SO_ATTACH_FILTER", intf_name);
+		goto fail;
+	}
+	pcap_freecode(&bpf_program);
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+				&version, sizeof(version)) < 0) {
+		warn("%s: PACKET_VERSION", intf_name);
+		goto fail;
+	}
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING,
+				&req, sizeof(req)) < 0) {
+		warn("%s: PACKET_RX_RING", intf_name);
+		goto fail;
+	}
+	ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (ring == MAP_FAILED) {
+		warn("%s: mmap ring", intf_name);
+		goto fail;
+	}
+
+	bzero(&sll, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		warn("%s: bind", intf_name);
+		munmap(ring, ring_len);
+		goto fail;
+	}
+
+	if (promisc) {
+		bzero(&mreq, sizeof(mreq));
+		mreq.mr_ifindex = ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+					&mreq, sizeof(mreq)) < 0) {
+			warn("%s: Can't set promiscuous mode", intf_name);
+			munmap(ring, ring_len);
+			goto fail;
+		}
+	}
+
 	dcap = calloc(1, sizeof(struct dcap));
+	dcap->_backend = DCAP_BACKEND_RING;
 	dcap->_pcap = pcap;
+	dcap->_fd = fd;
+	dcap->_ring = ring;
+	dcap->_ring_block_size = req.tp_block_size;
+	dcap->_ring_block_count = req.tp_block_nr;
+	snprintf(dcap->intf_name, sizeof(dcap->intf_name), "%s", intf_name);
 	dcap->_callback = callback;
-	dcap->user = NULL;
+	dcap_datalink_init(dcap);	/* Ethernet, can't fail. */
+
+	return (dcap);
+
+fail:
+	pcap_freecode(&bpf_program);
+	close(fd);
+	pcap_close(pcap);
+	return (NULL);
+#else
+	warnx("ring capture not supported");
+	return (NULL);
+#endif
+}
+
+#if DCAP_HAVE_XDP
+/* Per queue AF_XDP socket and rings. */
+struct dcap_xsk {
+	int			queue_id;
+	char			*umem;
+	size_t			umem_len;
+
+	void			*rx_map;
+	size_t			rx_map_len;
+	uint32_t		*rx_prod;
+	uint32_t		*rx_cons;
+	struct xdp_desc		*rx_desc;
+
+	void			*fill_map;
+	size_t			fill_map_len;
+	uint32_t		*fill_prod;
+	uint32_t		*fill_cons;
+	uint64_t		*fill_desc;
+
+	/* Never used since we don't transmit, but the kernel requires it. */
+	void			*comp_map;
+	size_t			comp_map_len;
+
+	uint64_t		rx_pkts;
+};
+
+/* The XDP program and socket map are shared by all the queues on the
+ * interface. Only one interface is supported. */
+static struct {
+	int		ifindex;
+	int		prog_fd;
+	int		map_fd;
+	int		link_fd;
+	int		refs;
+} xdp_prog;
+
+static int
+dcap_bpf(int cmd, union bpf_attr *attr)
+{
+	return (syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+/* Minimal eBPF assembler, with jumps to labels. Backward jumps are fine
+ * as long as they don't make a loop. */
+#define XDP_ASM_MAX_INSNS	128
+#define XDP_ASM_MAX_FIXUPS	32
+enum { XDP_L_L3, XDP_L_UDP, XDP_L_IP6, XDP_L_DNS, XDP_L_PASS, XDP_L_MAX };
+struct xdp_asm {
+	struct ebpf_insn	insns[XDP_ASM_MAX_INSNS];
+	int			n;
+	int			labels[XDP_L_MAX];
+	struct {
+		int		insn;
+		int		label;
+	} fixups[XDP_ASM_MAX_FIXUPS];
+	int			n_fixups;
+};
+
+static void
+xa_emit(struct xdp_asm *a, uint8_t code, uint8_t dst, uint8_t src,
+		int16_t off, int32_t imm)
+{
+	struct ebpf_insn	*insn;
+
+	assert(a->n < XDP_ASM_MAX_INSNS);
+	insn = &a->insns[a->n++];
+	bzero(insn, sizeof(*insn));
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+}
+
+static void
+xa_jmp(struct xdp_asm *a, uint8_t code, uint8_t dst, uint8_t src,
+		int32_t imm, int label)
+{
+	assert(a->n_fixups < XDP_ASM_MAX_FIXUPS);
+	a->fixups[a->n_fixups].insn = a->n;
+	a->fixups[a->n_fixups].label = label;
+	a->n_fixups++;
+	xa_emit(a, code, dst, src, 0, imm);
+}
+
+static void
+xa_label(struct xdp_asm *a, int label)
+{
+	a->labels[label] = a->n;
+}
+
+static void
+xa_resolve(struct xdp_asm *a)
+{
+	int		i, insn;
+
+	for (i = 0; i < a->n_fixups; i++) {
+		insn = a->fixups[i].insn;
+		a->insns[insn].off = a->labels[a->fixups[i].label] - insn - 1;
+	}
+}
+
+#define XA_MOV_IMM(a, dst, imm)	\
+	xa_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define XA_MOV_REG(a, dst, src)	\
+	xa_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define XA_ALU_IMM(a, op, dst, imm)	\
+	xa_emit(a, BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define XA_ADD_REG(a, dst, src)	\
+	xa_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, dst, src, 0, 0)
+#define XA_LDX(a, size, dst, src, off)	\
+	xa_emit(a, BPF_LDX | (size) | BPF_MEM, dst, src, off, 0)
+#define XA_JMP_IMM(a, op, dst, imm, label)	\
+	xa_jmp(a, BPF_JMP | (op) | BPF_K, dst, 0, imm, label)
+#define XA_JMP_REG(a, op, dst, src, label)	\
+	xa_jmp(a, BPF_JMP | (op) | BPF_X, dst, src, 0, label)
+
+/* Builds the pre-filter. Same test as build_pcap_filter() with no encap:
+ * ipv4 (optionally one vlan tag), udp, src port 53 (or 5353), and valid
+ * recursive response flags. With enable_ip6, also ipv6 with udp straight
+ * after the fixed header. Matches are redirected to the AF_XDP socket
+ * for the rx queue; everything else goes on to the kernel as usual.
+ *
+ * Pkt loads are in network byte order, so the constants are too. */
+static int
+xdp_prog_build(struct xdp_asm *a, int map_fd, int enable_mdns, int enable_ip6)
+{
+	/* r1 ctx, r2 data, r3 data_end, r4 bounds check, r5 scratch,
+	 * r6 ctx (saved), r7 l3/l4 header. */
+	bzero(a, sizeof(*a));
+
+	XA_MOV_REG(a, BPF_REG_6, BPF_REG_1);
+	XA_LDX(a, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data));
+	XA_LDX(a, BPF_W, BPF_REG_3, BPF_REG_6,
+			offsetof(struct xdp_md, data_end));
+
+	/* Ethernet */
+	XA_MOV_REG(a, BPF_REG_7, BPF_REG_2);
+	XA_ALU_IMM(a, BPF_ADD, BPF_REG_7, sizeof(struct ether_header));
+	XA_JMP_REG(a, BPF_JGT, BPF_REG_7, BPF_REG_3, XDP_L_PASS);
+	XA_LDX(a, BPF_H, BPF_REG_5, BPF_REG_2, 12);
+	XA_JMP_IMM(a, BPF_JNE, BPF_REG_5, htons(ETHERTYPE_VLAN), XDP_L_L3);
+	XA_ALU_IMM(a, BPF_ADD, BPF_REG_7, 4);
+	XA_JMP_REG(a, BPF_JGT, BPF_REG_7, BPF_REG_3, XDP_L_PASS);
+	XA_LDX(a, BPF_H, BPF_REG_5, BPF_REG_2, 16);
+
+	/* IP - not fragmented, udp */
+	xa_label(a, XDP_L_L3);
+	if (enable_ip6) {
+		XA_JMP_IMM(a, BPF_JEQ, BPF_REG_5, htons(ETHERTYPE_IPV6),
+				XDP_L_IP6);
+	}
+	XA_JMP_IMM(a, BPF_JNE, BPF_REG_5, htons(ETHERTYPE_IP), XDP_L_PASS);
+	XA_MOV_REG(a, BPF_REG_4, BPF_REG_7);
+	XA_ALU_IMM(a, BPF_ADD, BPF_REG_4, sizeof(struct ip));
+	XA_JMP_REG(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_L_PASS);
+	XA_LDX(a, BPF_B, BPF_REG_5, BPF_REG_7, offsetof(struct ip, ip_p));
+	XA_JMP_IMM(a, BPF_JNE, BPF_REG_5, IPPROTO_UDP, XDP_L_PASS);
+	XA_LDX(a, BPF_H, BPF_REG_5, BPF_REG_7, offsetof(struct ip, ip_off));
+	XA_ALU_IMM(a, BPF_AND, BPF_REG_5, htons(IP_MF | IP_OFFMASK));
+	XA_JMP_IMM(a, BPF_JNE, BPF_REG_5, 0, XDP_L_PASS);
+	XA_LDX(a, BPF_B, BPF_REG_5, BPF_REG_7, 0);
+	XA_ALU_IMM(a, BPF_AND, BPF_REG_5, 0x0f);
+	XA_ALU_IMM(a, BPF_LSH, BPF_REG_5, 2);
+	XA_JMP_IMM(a, BPF_JLT, BPF_REG_5, sizeof(struct ip), XDP_L_PASS);
+	XA_ADD_REG(a, BPF_REG_7, BPF_REG_5);
+
+	/* UDP and dns header */
+	xa_label(a, XDP_L_UDP);
+	XA_MOV_REG(a, BPF_REG_4, BPF_REG_7);
+	XA_ALU_IMM(a, BPF_ADD, BPF_REG_4, sizeof(struct udphdr) + 12);
+	XA_JMP_REG(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_L_PASS);
+	XA_LDX(a, BPF_H, BPF_REG_5, BPF_REG_7, 0);
+	XA_JMP_IMM(a, BPF_JEQ, BPF_REG_5, htons(53), XDP_L_DNS);
+	if (enable_mdns) {
+		XA_JMP_IMM(a, BPF_JEQ, BPF_REG_5, htons(5353), XDP_L_DNS);
+	}
+	XA_JMP_IMM(a, BPF_JA, 0, 0, XDP_L_PASS);
+
+	/* qr=1, rd=1, ra=1, rcode=0. */
+	xa_label(a, XDP_L_DNS);
+	XA_LDX(a, BPF_H, BPF_REG_5, BPF_REG_7, sizeof(struct udphdr) + 2);
+	XA_ALU_IMM(a, BPF_AND, BPF_REG_5, htons(0x8187));
+	XA_JMP_IMM(a, BPF_JNE, BPF_REG_5, htons(0x8180), XDP_L_PASS);
+
+	/* return bpf_redirect_map(&xsks, rx_queue_index, XDP_PASS) */
+	XA_LDX(a, BPF_W, BPF_REG_2, BPF_REG_6,
+			offsetof(struct xdp_md, rx_queue_index));
+	xa_emit(a, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+			0, map_fd);
+	xa_emit(a, 0, 0, 0, 0, 0);
+	XA_MOV_IMM(a, BPF_REG_3, XDP_PASS);
+	xa_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+	xa_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	xa_label(a, XDP_L_PASS);
+	XA_MOV_IMM(a, BPF_REG_0, XDP_PASS);
+	xa_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	/* IPv6 - no extension headers, udp. Out of the way of the ipv4
+	 * path, and jumps back to udp. */
+	if (enable_ip6) {
+		xa_label(a, XDP_L_IP6);
+		XA_MOV_REG(a, BPF_REG_4, BPF_REG_7);
+		XA_ALU_IMM(a, BPF_ADD, BPF_REG_4, sizeof(struct ip6_hdr));
+		XA_JMP_REG(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_L_PASS);
+		XA_LDX(a, BPF_B, BPF_REG_5, BPF_REG_7,
+				offsetof(struct ip6_hdr, ip6_nxt));
+		XA_JMP_IMM(a, BPF_JNE, BPF_REG_5, IPPROTO_UDP, XDP_L_PASS);
+		XA_ALU_IMM(a, BPF_ADD, BPF_REG_7, sizeof(struct ip6_hdr));
+		XA_JMP_IMM(a, BPF_JA, 0, 0, XDP_L_UDP);
+	}
+
+	xa_resolve(a);
+	return (a->n);
+}
+
+static void
+xdp_prog_release(void)
+{
+	if (--xdp_prog.refs > 0) {
+		return;
+	}
+	/* Closing the link detaches the program. */
+	if (xdp_prog.link_fd >= 0) {
+		close(xdp_prog.link_fd);
+	}
+	if (xdp_prog.prog_fd >= 0) {
+		close(xdp_prog.prog_fd);
+	}
+	if (xdp_prog.map_fd >= 0) {
+		close(xdp_prog.map_fd);
+	}
+	bzero(&xdp_prog, sizeof(xdp_prog));
+}
+
+/* Load and attach the pre-filter, if not done already.
+ * Returns 0 on success, -1 on error. */
+static int
+xdp_prog_attach(char *intf_name, int ifindex, int n_queues, int enable_mdns,
+		int enable_ip6)
+{
+	static char		log_buf[16384];
+	struct xdp_asm		a[1];
+	union bpf_attr		attr;
+	int			n_insns;
+
+	if (xdp_prog.refs > 0) {
+		if (xdp_prog.ifindex != ifindex) {
+			warnx("%s: XDP already attached to another interface",
+					intf_name);
+			return (-1);
+		}
+		xdp_prog.refs++;
+		return (0);
+	}
+	xdp_prog.ifindex = ifindex;
+	xdp_prog.prog_fd = xdp_prog.map_fd = xdp_prog.link_fd = -1;
+	xdp_prog.refs = 1;
+
+	bzero(&attr, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = n_queues;
+	if ((xdp_prog.map_fd = dcap_bpf(BPF_MAP_CREATE, &attr)) < 0) {
+		warn("%s: XSKMAP create", intf_name);
+		goto fail;
+	}
+
+	n_insns = xdp_prog_build(a, xdp_prog.map_fd, enable_mdns, enable_ip6);
+	bzero(&attr, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long)a->insns;
+	attr.insn_cnt = n_insns;
+	attr.license = (uint64_t)(unsigned long)"Dual BSD/GPL";
+	attr.log_buf = (uint64_t)(unsigned long)log_buf;
+	attr.log_size = sizeof(log_buf);
+	attr.log_level = 1;
+	log_buf[0] = '\0';
+	if ((xdp_prog.prog_fd = dcap_bpf(BPF_PROG_LOAD, &attr)) < 0) {
+		warn("%s: XDP program load: %s", intf_name, log_buf);
+		goto fail;
+	}
+
+	/* Needs a 5.9+ kernel. The driver's native mode is used if it has
+	 * one, otherwise generic. */
+	bzero(&attr, sizeof(attr));
+	attr.link_create.prog_fd = xdp_prog.prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	if ((xdp_prog.link_fd = dcap_bpf(BPF_LINK_CREATE, &attr)) < 0) {
+		warn("%s: XDP attach", intf_name);
+		goto fail;
+	}
+
+	return (0);
+
+fail:
+	xdp_prog_release();
+	return (-1);
+}
+
+static void
+dcap_xsk_free(struct dcap_xsk *xsk)
+{
+	if (xsk->rx_map != NULL) {
+		munmap(xsk->rx_map, xsk->rx_map_len);
+	}
+	if (xsk->fill_map != NULL) {
+		munmap(xsk->fill_map, xsk->fill_map_len);
+	}
+	if (xsk->comp_map != NULL) {
+		munmap(xsk->comp_map, xsk->comp_map_len);
+	}
+	if (xsk->umem != NULL) {
+		munmap(xsk->umem, xsk->umem_len);
+	}
+	free(xsk);
+}
+
+static void *
+dcap_xsk_mmap(int fd, size_t len, off_t pgoff)
+{
+	void		*p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, pgoff);
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+/* Set up the umem and rings on fd, and bind it to the queue.
+ * Returns NULL on error. */
+static struct dcap_xsk *
+dcap_xsk_setup(int fd, char *intf_name, int ifindex, int queue_id)
+{
+	struct dcap_xsk		*xsk;
+	struct xdp_umem_reg	mr;
+	struct xdp_mmap_offsets	off;
+	struct sockaddr_xdp	sxdp;
+	socklen_t		optlen = sizeof(off);
+	int			fill_size = DCAP_XSK_FILL_SIZE;
+	int			rx_size = DCAP_XSK_RX_SIZE;
+	int			comp_size = 1;
+	uint32_t		i;
+
+	if ((xsk = calloc(1, sizeof(struct dcap_xsk))) == NULL) {
+		return (NULL);
+	}
+	xsk->queue_id = queue_id;
+
+	xsk->umem_len = (size_t)DCAP_XSK_FRAME_SIZE * DCAP_XSK_NUM_FRAMES;
+	xsk->umem = mmap(NULL, xsk->umem_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		xsk->umem = NULL;
+		warn("%s: umem", intf_name);
+		goto fail;
+	}
+	bzero(&mr, sizeof(mr));
+	mr.addr = (uint64_t)(unsigned long)xsk->umem;
+	mr.len = xsk->umem_len;
+	mr.chunk_size = DCAP_XSK_FRAME_SIZE;
+	if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0 ||
+	    setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING,
+		    &fill_size, sizeof(fill_size)) < 0 ||
+	    setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+		    &comp_size, sizeof(comp_size)) < 0 ||
+	    setsockopt(fd, SOL_XDP, XDP_RX_RING,
+		    &rx_size, sizeof(rx_size)) < 0) {
+		warn("%s: AF_XDP ring setup", intf_name);
+		goto fail;
+	}
+	if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		warn("%s: XDP_MMAP_OFFSETS", intf_name);
+		goto fail;
+	}
+
+	xsk->rx_map_len = off.rx.desc + rx_size * sizeof(struct xdp_desc);
+	xsk->fill_map_len = off.fr.desc + fill_size * sizeof(uint64_t);
+	xsk->comp_map_len = off.cr.desc + comp_size * sizeof(uint64_t);
+	xsk->rx_map = dcap_xsk_mmap(fd, xsk->rx_map_len, XDP_PGOFF_RX_RING);
+	xsk->fill_map = dcap_xsk_mmap(fd, xsk->fill_map_len,
+			XDP_UMEM_PGOFF_FILL_RING);
+	xsk->comp_map = dcap_xsk_mmap(fd, xsk->comp_map_len,
+			XDP_UMEM_PGOFF_COMPLETION_RING);
+	if (xsk->rx_map == NULL || xsk->fill_map == NULL ||
+	    xsk->comp_map == NULL) {
+		warn("%s: AF_XDP ring mmap", intf_name);
+		goto fail;
+	}
+	xsk->rx_prod = (uint32_t *)((char *)xsk->rx_map + off.rx.producer);
+	xsk->rx_cons = (uint32_t *)((char *)xsk->rx_map + off.rx.consumer);
+	xsk->rx_desc = (struct xdp_desc *)((char *)xsk->rx_map + off.rx.desc);
+	xsk->fill_prod = (uint32_t *)((char *)xsk->fill_map + off.fr.producer);
+	xsk->fill_cons = (uint32_t *)((char *)xsk->fill_map + off.fr.consumer);
+	xsk->fill_desc = (uint64_t *)((char *)xsk->fill_map + off.fr.desc);
+
+	/* Hand all the frames to the kernel. */
+	for (i = 0; i < DCAP_XSK_NUM_FRAMES; i++) {
+		xsk->fill_desc[i & (DCAP_XSK_FILL_SIZE - 1)] =
+			(uint64_t)i * DCAP_XSK_FRAME_SIZE;
+	}
+	__atomic_store_n(xsk->fill_prod, DCAP_XSK_NUM_FRAMES,
+			__ATOMIC_RELEASE);
+
+	/* Try zero-copy first. */
+	bzero(&sxdp, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue_id;
+	sxdp.sxdp_flags = XDP_ZEROCOPY;
+	if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		sxdp.sxdp_flags = XDP_COPY;
+		if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+			warn("%s: AF_XDP bind queue %d", intf_name, queue_id);
+			goto fail;
+		}
+	}
+
+	return (xsk);
+
+fail:
+	dcap_xsk_free(xsk);
+	return (NULL);
+}
+
+/* Process everything on the rx ring, then hand the frames back. No
+ * timestamps from AF_XDP, so all pkts in a batch get the same one. */
+static void
+dcap_xsk_read(struct dcap *dcap)
+{
+	struct dcap_xsk		*xsk = dcap->_xsk;
+	struct pcap_pkthdr	pkthdr;
+	struct xdp_desc		*desc;
+	uint32_t		prod, cons, fill_prod;
+	u_char			*pkt;
+
+	prod = __atomic_load_n(xsk->rx_prod, __ATOMIC_ACQUIRE);
+	cons = *xsk->rx_cons;
+	if (prod == cons) {
+		return;
+	}
+	gettimeofday(&pkthdr.ts, NULL);
+	fill_prod = *xsk->fill_prod;
+
+	for (; cons != prod; cons++) {
+		desc = &xsk->rx_desc[cons & (DCAP_XSK_RX_SIZE - 1)];
+		pkt = (u_char *)xsk->umem + desc->addr;
+		pkthdr.caplen = pkthdr.len = desc->len;
+
+		/* The XDP program only does the coarse match. Run the full
+		 * filter, e.g., the multi-proc clause or -f. */
+		if (pcap_offline_filter(&dcap->_bpf, &pkthdr, pkt) != 0) {
+			dcap_pcap_cb((u_char *)dcap, &pkthdr, pkt);
+		}
+		xsk->rx_pkts++;
+
+		/* Back to the fill ring. In aligned mode, the chunk start
+		 * is the frame address. */
+		xsk->fill_desc[fill_prod++ & (DCAP_XSK_FILL_SIZE - 1)] =
+			desc->addr & ~((uint64_t)DCAP_XSK_FRAME_SIZE - 1);
+	}
+	dcap_batch_flush(dcap);
+
+	__atomic_store_n(xsk->rx_cons, cons, __ATOMIC_RELEASE);
+	__atomic_store_n(xsk->fill_prod, fill_prod, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Number of rx queues on the interface, for dcap_init_xdp(). Queues that
+ * share an irq are still listed separately.
+ * Returns 0 on error. */
+int
+dcap_xdp_queue_count(char *intf_name)
+{
+	char		path[256];
+	int		n;
+
+	for (n = 0; ; n++) {
+		snprintf(path, sizeof(path), "/sys/class/net/%s/queues/rx-%d",
+				intf_name, n);
+		if (access(path, F_OK) != 0) {
+			break;
+		}
+	}
+	return (n);
+}
+
+/* Capture from one rx queue using AF_XDP. An XDP program attached to the
+ * interface does a coarse version of the default filter in the driver,
+ * and only matching pkts are copied (or not, with zero-copy drivers) to
+ * userspace. The complete filter still runs in userspace, but on far
+ * fewer pkts. Open one per rx queue, each with its own thread.
+ * Returns NULL if XDP isn't available, so the caller can fall back to
+ * dcap_init_live(). */
+struct dcap *
+dcap_init_xdp(char *intf_name, int queue_id, char *filter, int enable_mdns,
+		int enable_ip6, dcap_handler callback)
+{
+#if DCAP_HAVE_XDP
+	struct dcap		*dcap = NULL;
+	struct dcap_xsk		*xsk;
+	pcap_t			*pcap;
+	int			fd, ifindex, n_queues;
+	uint32_t		key = queue_id;
+	union bpf_attr		attr;
+
+	if ((ifindex = if_nametoindex(intf_name)) == 0) {
+		warn("%s", intf_name);
+		return (NULL);
+	}
+	if ((n_queues = dcap_xdp_queue_count(intf_name)) == 0) {
+		n_queues = 1;
+	}
+	if (queue_id >= n_queues) {
+		warnx("%s: no rx queue %d", intf_name, queue_id);
+		return (NULL);
+	}
+
+	if ((pcap = pcap_open_dead(DLT_EN10MB, MAXIMUM_SNAPLEN)) == NULL) {
+		warnx("pcap_open_dead failed");
+		return (NULL);
+	}
+	dcap = calloc(1, sizeof(struct dcap));
+	dcap->_backend = DCAP_BACKEND_XDP;
+	dcap->_pcap = pcap;
+	dcap->_fd = -1;
+	snprintf(dcap->intf_name, sizeof(dcap->intf_name), "%s", intf_name);
+	dcap->_callback = callback;
+	dcap_datalink_init(dcap);	/* Ethernet, can't fail. */
+
+	if (pcap_compile(pcap, &dcap->_bpf, filter, 1, 0) < 0) {
+		warnx("%s", pcap_geterr(pcap));
+		pcap_close(pcap);
+		free(dcap);
+		return (NULL);
+	}
+
+	if (xdp_prog_attach(intf_name, ifindex, n_queues, enable_mdns,
+				enable_ip6) < 0) {
+		pcap_freecode(&dcap->_bpf);
+		pcap_close(pcap);
+		free(dcap);
+		return (NULL);
+	}
+
+	if ((fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+		warn("%s: AF_XDP socket", intf_name);
+		goto fail;
+	}
+	dcap->_fd = fd;
+	if ((xsk = dcap_xsk_setup(fd, intf_name, ifindex, queue_id)) == NULL) {
+		goto fail;
+	}
+	dcap->_xsk = xsk;
+
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = xdp_prog.map_fd;
+	attr.key = (uint64_t)(unsigned long)&key;
+	attr.value = (uint64_t)(unsigned long)&fd;
+	if (dcap_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		warn("%s: XSKMAP update", intf_name);
+		goto fail;
+	}
+
+	return (dcap);
+
+fail:
+	dcap_close(dcap);
+	return (NULL);
+#else
+	warnx("XDP capture not supported");
+	return (NULL);
+#endif
+}
+
+/* Replace the filter of a live capture, e.g. to change what's sampled.
+ * Call it from the thread that reads the dcap, not from inside the
+ * callback. Not supported for files.
+ * Returns 0 on success, -1 on error. */
+int
+dcap_set_filter(struct dcap *dcap, char *filter)
+{
+	struct bpf_program	bpf_program;
+#if __linux__
+	struct sock_fprog	fprog;
+#endif
+
+	if (dcap->_backend == DCAP_BACKEND_MMAP) {
+		warnx("%s: can't change the filter", dcap->intf_name);
+		return (-1);
+	}
+	if (pcap_compile(dcap->_pcap, &bpf_program, filter, 1, 0) < 0) {
+		warnx("%s", pcap_geterr(dcap->_pcap));
+		return (-1);
+	}
+
+	switch (dcap->_backend) {
+#if __linux__
+	case DCAP_BACKEND_RING:
+		/* Replaces the old one atomically. */
+		fprog.len = bpf_program.bf_len;
+		fprog.filter = (struct sock_filter *)bpf_program.bf_insns;
+		if (setsockopt(dcap->_fd, SOL_SOCKET, SO_ATTACH_FILTER,
+					&fprog, sizeof(fprog)) < 0) {
+			warn("%s: SO_ATTACH_FILTER", dcap->intf_name);
+			pcap_freecode(&bpf_program);
+			return (-1);
+		}
+		pcap_freecode(&bpf_program);
+		break;
+#endif
+#if DCAP_HAVE_XDP
+	case DCAP_BACKEND_XDP:
+		/* Only run in userspace, by this thread. */
+		pcap_freecode(&dcap->_bpf);
+		dcap->_bpf = bpf_program;
+		break;
+#endif
+	default:
+		if (pcap_setfilter(dcap->_pcap, &bpf_program) < 0) {
+			warnx("%s", pcap_geterr(dcap->_pcap));
+			pcap_freecode(&bpf_program);
+			return (-1);
+		}
+		pcap_freecode(&bpf_program);
+		break;
+	}
+
+	return (0);
+}
+
+#if __linux__ && defined(PACKET_FANOUT_CBPF)
+/* DCAP_FANOUT_CLIENT. The program's return mod the group size picks the
+ * socket. The client is the dst of a response and the src of its query,
+ * so both addrs are hashed together, which keeps a client, and its
+ * queries for -Q, on one socket as long as it uses one resolver. For v6,
+ * only the low 32 bits of each. Anything else goes to the first socket.
+ * The offsets are from the network hdr, wherever the link hdr ends. */
+static int
+dcap_set_fanout_client(struct dcap *dcap)
+{
+	struct sock_filter	insns[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF + 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 5),
+		/* ip src and dst. */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_JMP | BPF_JA, 5),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 7),
+		/* ip6 src and dst. */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 36),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		/* Mix, so the mod doesn't just take the low bits. */
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog	fprog;
+
+	fprog.len = sizeof(insns) / sizeof(insns[0]);
+	fprog.filter = insns;
+	/* Set for the whole group, each socket just sets it again. */
+	if (setsockopt(dcap_get_fd(dcap), SOL_PACKET, PACKET_FANOUT_DATA,
+				&fprog, sizeof(fprog)) < 0) {
+		warn("%s: PACKET_FANOUT_DATA", dcap->intf_name);
+		return (-1);
+	}
+	return (0);
+}
+#endif
+
+/* Join the live capture to a PACKET_FANOUT group. The kernel then splits
+ * pkts across all the sockets in the group, instead of each capture
+ * running the filter on every pkt. Linux only.
+ * Returns 0 on success, -1 on error. */
+int
+dcap_set_fanout(struct dcap *dcap, uint16_t group_id,
+		enum dcap_fanout_mode mode)
+{
+#if __linux__ && defined(PACKET_FANOUT)
+	int		fanout_type, fanout_arg;
+
+	switch (mode) {
+	case DCAP_FANOUT_HASH:
+		/* Defrag so all the fragments of a pkt hash the same. */
+		fanout_type = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+		break;
+	case DCAP_FANOUT_CPU:
+		fanout_type = PACKET_FANOUT_CPU;
+		break;
+	case DCAP_FANOUT_LB:
+		fanout_type = PACKET_FANOUT_LB;
+		break;
+#ifdef PACKET_FANOUT_QM
+	case DCAP_FANOUT_QUEUE:
+		/* The rx queue mod the group size picks the socket, so
+		 * with a socket per queue, each queue has its own. */
+		fanout_type = PACKET_FANOUT_QM;
+		break;
+#endif
+#ifdef PACKET_FANOUT_CBPF
+	case DCAP_FANOUT_CLIENT:
+		fanout_type = PACKET_FANOUT_CBPF;
+		break;
+#endif
+	default:
+		warnx("Unknown fanout mode: %d", mode);
+		return (-1);
+	}
+	fanout_arg = group_id | (fanout_type << 16);
+
+	if (setsockopt(dcap_get_fd(dcap), SOL_PACKET, PACKET_FANOUT,
+				&fanout_arg, sizeof(fanout_arg)) < 0) {
+		warn("%s: PACKET_FANOUT", dcap->intf_name);
+		return (-1);
+	}
+#ifdef PACKET_FANOUT_CBPF
+	if (mode == DCAP_FANOUT_CLIENT && dcap_set_fanout_client(dcap) < 0) {
+		return (-1);
+	}
+#endif
+	return (0);
+#else
+	warnx("PACKET_FANOUT not supported");
+	return (-1);
+#endif
+}
+
+struct dcap *
+dcap_init_file(char *filename, char *filter, dcap_handler callback)
+{
+	char			pcap_errbuf[PCAP_ERRBUF_SIZE];
+        struct bpf_program      bpf;
+	struct dcap		*dcap = NULL;
+	pcap_t			*pcap = NULL;
+
+
+	pcap = pcap_open_offline(filename, pcap_errbuf);
+	if (pcap == NULL) {
+		warnx("Could not open file %s (%s)", filename, pcap_errbuf);
+		return (NULL);
+	}
+
+	if (pcap_compile(pcap, &bpf, filter, 1, 0) < 0) {
+		warnx("filter compile failed: %s", pcap_geterr(pcap));
+		pcap_close(pcap);
+		return (NULL);
+	}
+
+	if (pcap_setfilter(pcap, &bpf) < 0) {
+		warnx("Pcap setfilter failed: %s", pcap_geterr(pcap));
+		pcap_close(pcap);
+		return (NULL);
+	}
+	
+	dcap = calloc(1, sizeof(struct dcap));
+	dcap->_pcap = pcap;
+	dcap->_callback = callback;
+	dcap->user = NULL;
+	if (dcap_datalink_init(dcap) < 0) {
+		pcap_close(pcap);
+		free(dcap);
+		return (NULL);
+	}
+
+	return (dcap);
+}
+
+/* Like dcap_init_file(), but reads every pkt that matches the filter into
+ * memory up front, for dcap_loop_mem(). Used for benchmarking, so file I/O
+ * and the filter don't count towards the processing time. */
+struct dcap *
+dcap_init_mem(char *filename, char *filter, dcap_handler callback)
+{
+	struct dcap		*dcap;
+	struct pcap_pkthdr	*pkthdr;
+	const u_char		*pkt;
+	size_t			rec_len, mem_size = 0;
+	char			*mem;
+	int			rv, dloff;
+
+	if ((dcap = dcap_init_file(filename, filter, callback)) == NULL) {
+		return (NULL);
+	}
+
+	/* Like the kernel's capture ring, keep the network header aligned. */
+	dloff = dcap_datalinks[dcap_datalink_find(
+			pcap_datalink(dcap->_pcap))].offset;
+	dcap->_mem_data_off = DCAP_MEM_ALIGN(sizeof(struct pcap_pkthdr) +
+			dloff) - dloff;
+
+	/* The filter is set on the handle, so only matches come back. */
+	while ((rv = pcap_next_ex(dcap->_pcap, &pkthdr, &pkt)) == 1) {
+		rec_len = DCAP_MEM_ALIGN(dcap->_mem_data_off + pkthdr->caplen);
+		if (dcap->_mem_len + rec_len > mem_size) {
+			mem_size = mem_size ? mem_size * 2 : 1 << 20;
+			if ((mem = realloc(dcap->_mem, mem_size)) == NULL) {
+				warnx("Could not load file %s: out of memory",
+						filename);
+				dcap_close(dcap);
+				return (NULL);
+			}
+			dcap->_mem = mem;
+		}
+		memcpy(dcap->_mem + dcap->_mem_len, pkthdr,
+				sizeof(struct pcap_pkthdr));
+		memcpy(dcap->_mem + dcap->_mem_len + dcap->_mem_data_off, pkt,
+				pkthdr->caplen);
+		dcap->_mem_len += rec_len;
+		dcap->_mem_pkts++;
+	}
+	if (rv == -1) {
+		warnx("Could not read file %s (%s)", filename,
+				pcap_geterr(dcap->_pcap));
+		dcap_close(dcap);
+		return (NULL);
+	}
 
 	return (dcap);
 }
@@ -348,38 +1840,413 @@ void
 dcap_loop_all(struct dcap *dcap)
 {
 	pcap_loop(dcap->_pcap, -1, dcap_pcap_cb, (u_char *)dcap);
+	dcap_batch_flush(dcap);
+}
+
+/* Run the pkts loaded by dcap_init_mem() through the callback n_loops
+ * times. */
+void
+dcap_loop_mem(struct dcap *dcap, int n_loops)
+{
+	struct pcap_pkthdr	*pkthdr;
+	size_t			off;
+	int			i;
+
+	for (i = 0; i < n_loops; i++) {
+		for (off = 0; off < dcap->_mem_len;
+				off += DCAP_MEM_ALIGN(dcap->_mem_data_off +
+					pkthdr->caplen)) {
+			pkthdr = (struct pcap_pkthdr *)(dcap->_mem + off);
+			dcap_pcap_cb((u_char *)dcap, pkthdr,
+					(u_char *)pkthdr + dcap->_mem_data_off);
+		}
+	}
+	dcap_batch_flush(dcap);
+}
+
+static uint32_t
+dcap_sf32(struct dcap *dcap, uint32_t v)
+{
+	return (dcap->_mmap_swapped ? __builtin_bswap32(v) : v);
+}
+
+/* Record header at off, in host order. */
+static void
+dcap_sf_rec_get(struct dcap *dcap, size_t off, struct dcap_sf_rec *rec)
+{
+	/* Records aren't aligned. */
+	memcpy(rec, dcap->_mem + off, sizeof(struct dcap_sf_rec));
+	rec->ts_sec = dcap_sf32(dcap, rec->ts_sec);
+	rec->ts_frac = dcap_sf32(dcap, rec->ts_frac);
+	rec->caplen = dcap_sf32(dcap, rec->caplen);
+	rec->len = dcap_sf32(dcap, rec->len);
+}
+
+/* Map a classic pcap file (not pcapng), to process in parallel with
+ * dcap_mmap_split(), dcap_mmap_dup() and dcap_loop_mmap(). The filter is
+ * run in userspace, like libpcap does for files. */
+struct dcap *
+dcap_init_mmap(char *filename, char *filter, dcap_handler callback)
+{
+	struct dcap_sf_hdr	hdr;
+	struct dcap_sf_rec	rec;
+	struct stat		st;
+	struct dcap		*dcap;
+	pcap_t			*pcap;
+	char			*map;
+	int			fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		warn("%s", filename);
+		return (NULL);
+	}
+	if (fstat(fd, &st) < 0) {
+		warn("%s", filename);
+		close(fd);
+		return (NULL);
+	}
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		warnx("%s: not a pcap file", filename);
+		close(fd);
+		return (NULL);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("%s: mmap", filename);
+		return (NULL);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	dcap = calloc(1, sizeof(struct dcap));
+	dcap->_backend = DCAP_BACKEND_MMAP;
+	dcap->_mem = map;
+	dcap->_mem_len = st.st_size;
+	dcap->_mmap_owner = 1;
+	dcap->_callback = callback;
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (hdr.magic == __builtin_bswap32(DCAP_SF_MAGIC) ||
+	    hdr.magic == __builtin_bswap32(DCAP_SF_MAGIC_NSEC)) {
+		dcap->_mmap_swapped = 1;
+	}
+	hdr.magic = dcap_sf32(dcap, hdr.magic);
+	if (hdr.magic != DCAP_SF_MAGIC && hdr.magic != DCAP_SF_MAGIC_NSEC) {
+		warnx("%s: not a pcap file", filename);
+		goto fail;
+	}
+	dcap->_mmap_nsec = (hdr.magic == DCAP_SF_MAGIC_NSEC);
+	dcap->_mmap_snaplen = dcap_sf32(dcap, hdr.snaplen);
+	dcap->_mmap_linktype = dcap_sf32(dcap, hdr.linktype);
+	if (dcap->_mmap_snaplen == 0 ||
+	    dcap->_mmap_snaplen > DCAP_SF_MAX_CAPLEN) {
+		dcap->_mmap_snaplen = DCAP_SF_MAX_CAPLEN;
+	}
+	if (dcap->_mem_len >= sizeof(hdr) + sizeof(rec)) {
+		dcap_sf_rec_get(dcap, sizeof(hdr), &rec);
+		dcap->_mmap_ts_first = rec.ts_sec;
+	}
+
+	pcap = pcap_open_dead(dcap->_mmap_linktype, dcap->_mmap_snaplen);
+	if (pcap == NULL) {
+		warnx("pcap_open_dead failed");
+		goto fail;
+	}
+	dcap->_pcap = pcap;
+	if (dcap_datalink_init(dcap) < 0) {
+		pcap_close(pcap);
+		goto fail;
+	}
+	if (pcap_compile(pcap, &dcap->_bpf, filter, 1, 0) < 0) {
+		warnx("filter compile failed: %s", pcap_geterr(pcap));
+		pcap_close(pcap);
+		goto fail;
+	}
+
+	return (dcap);
+
+fail:
+	munmap(map, dcap->_mem_len);
+	free(dcap);
+	return (NULL);
+}
+
+/* Another dcap for the same mapped file, with its own user and counters.
+ * Close these before the original. */
+struct dcap *
+dcap_mmap_dup(struct dcap *orig)
+{
+	struct dcap	*dcap;
+	pcap_t		*pcap;
+
+	pcap = pcap_open_dead(orig->_mmap_linktype, orig->_mmap_snaplen);
+	if (pcap == NULL) {
+		warnx("pcap_open_dead failed");
+		return (NULL);
+	}
+	dcap = calloc(1, sizeof(struct dcap));
+	memcpy(dcap, orig, sizeof(struct dcap));
+	dcap->_pcap = pcap;
+	dcap->_mmap_owner = 0;
+	dcap->pkts_captured = 0;
+	dcap->_drop_truncated = 0;
+	dcap->_drop_runt = 0;
+	dcap->_drop_not_ip = 0;
+	dcap->_warn_next = 0;
+	dcap->_batch_callback = NULL;
+	dcap->_batch = NULL;
+	dcap->_batch_n = 0;
+	dcap->_batch_buf = NULL;
+	dcap->user = NULL;
+	if (orig->_batch_callback != NULL &&
+	    dcap_set_batch_handler(dcap, orig->_batch_callback) < 0) {
+		dcap_close(dcap);
+		return (NULL);
+	}
+	return (dcap);
+}
+
+/* Returns 1 if a record could start at off: it and the next few record
+ * headers have sane lengths and timestamps, and end inside the file. */
+static int
+dcap_mmap_resync_ok(struct dcap *dcap, size_t off)
+{
+	struct dcap_sf_rec	rec;
+	uint32_t		frac_max;
+	int			i;
+
+	frac_max = dcap->_mmap_nsec ? 1000000000 : 1000000;
+	for (i = 0; i < DCAP_MMAP_RESYNC_RECORDS; i++) {
+		if (off == dcap->_mem_len) {
+			return (1);
+		}
+		if (off + sizeof(rec) > dcap->_mem_len) {
+			return (0);
+		}
+		dcap_sf_rec_get(dcap, off, &rec);
+		if (rec.caplen == 0 || rec.caplen > rec.len ||
+		    rec.caplen > dcap->_mmap_snaplen ||
+		    rec.len > DCAP_SF_MAX_CAPLEN ||
+		    rec.ts_frac >= frac_max ||
+		    rec.ts_sec + 3600 < dcap->_mmap_ts_first ||
+		    rec.ts_sec > dcap->_mmap_ts_first + 366 * 86400) {
+			return (0);
+		}
+		off += sizeof(rec) + rec.caplen;
+	}
+	return (off <= dcap->_mem_len);
+}
+
+/* Split the file into at least min_chunks pieces, and more if needed to
+ * keep them to about chunk_size, all starting on record boundaries.
+ * There's no index to go by, so each boundary is found by scanning
+ * forward to where a run of plausible record headers starts.
+ * Returns the number of chunks, n. *offsetsp is set to n + 1 offsets, to
+ * be freed by the caller; chunk i is [offsets[i], offsets[i + 1]). */
+int
+dcap_mmap_split(struct dcap *dcap, int min_chunks, size_t chunk_size,
+		size_t **offsetsp)
+{
+	size_t		start = sizeof(struct dcap_sf_hdr), off, *offsets;
+	int		i, n_chunks;
+
+	n_chunks = (dcap->_mem_len - start) / chunk_size + 1;
+	if (n_chunks < min_chunks) {
+		n_chunks = min_chunks;
+	}
+	if ((offsets = calloc(n_chunks + 1, sizeof(size_t))) == NULL) {
+		err(1, "calloc");
+	}
+	offsets[0] = start;
+	offsets[n_chunks] = dcap->_mem_len;
+	for (i = 1; i < n_chunks; i++) {
+		off = start + (dcap->_mem_len - start) / n_chunks * i;
+		if (off < offsets[i - 1]) {
+			off = offsets[i - 1];
+		}
+		while (off < dcap->_mem_len && !dcap_mmap_resync_ok(dcap, off)) {
+			off++;
+		}
+		offsets[i] = off;
+	}
+	*offsetsp = offsets;
+	return (n_chunks);
+}
+
+/* Run the records in [start, end) through the filter and the callback.
+ * Returns the offset after the last record, which is end unless the file
+ * is truncated or end wasn't really on a record boundary. */
+size_t
+dcap_loop_mmap(struct dcap *dcap, size_t start, size_t end)
+{
+	struct pcap_pkthdr	pkthdr;
+	struct dcap_sf_rec	rec;
+	u_char			*pkt;
+	size_t			off;
+
+	for (off = start; off < end; off += sizeof(rec) + rec.caplen) {
+		if (off + sizeof(rec) > dcap->_mem_len) {
+			break;
+		}
+		dcap_sf_rec_get(dcap, off, &rec);
+		if (off + sizeof(rec) + rec.caplen > dcap->_mem_len) {
+			break;
+		}
+		pkthdr.ts.tv_sec = rec.ts_sec;
+		pkthdr.ts.tv_usec = dcap->_mmap_nsec ? rec.ts_frac / 1000 :
+			rec.ts_frac;
+		pkthdr.caplen = rec.caplen;
+		pkthdr.len = rec.len;
+		pkt = (u_char *)dcap->_mem + off + sizeof(rec);
+		if (pcap_offline_filter(&dcap->_bpf, &pkthdr, pkt) != 0) {
+			dcap_pcap_cb((u_char *)dcap, &pkthdr, pkt);
+		}
+	}
+	dcap_batch_flush(dcap);
+	return (off);
 }
 
 void
 dcap_close(struct dcap *dcap)
 {
+#if __linux__
+	if (dcap->_backend == DCAP_BACKEND_RING) {
+		munmap(dcap->_ring,
+			(size_t)dcap->_ring_block_size *
+			dcap->_ring_block_count);
+		close(dcap->_fd);
+	}
+#endif
+#if DCAP_HAVE_XDP
+	if (dcap->_backend == DCAP_BACKEND_XDP) {
+		if (dcap->_fd >= 0) {
+			close(dcap->_fd);
+		}
+		if (dcap->_xsk != NULL) {
+			dcap_xsk_free(dcap->_xsk);
+		}
+		pcap_freecode(&dcap->_bpf);
+		xdp_prog_release();
+	}
+#endif
+	if (dcap->_backend == DCAP_BACKEND_MMAP) {
+		if (dcap->_mmap_owner) {
+			munmap(dcap->_mem, dcap->_mem_len);
+			pcap_freecode(&dcap->_bpf);
+		}
+		dcap->_mem = NULL;
+	}
 	pcap_close(dcap->_pcap);
+	free(dcap->_mem);
+	free(dcap->_batch);
+	free(dcap->_batch_buf);
 	free(dcap);
 }
 
-struct dcap_stat *
-dcap_get_stats(struct dcap *dcap)
+/* The kernel's counters are added into the dcap's totals as they're read,
+ * with dcap_stats_lock held. The rest are only written by the thread
+ * capturing, and read here atomically, so any thread can get the stats of
+ * any dcap. */
+static pthread_mutex_t	dcap_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define DCAP_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static void
+dcap_get_kernel_stats(struct dcap *dcap, struct dcap_stat *ds)
 {
-	static struct dcap_stat		ds;
 	struct pcap_stat		ps;
 
-	bzero(&ds, sizeof(ds));
-	ds.captured = dcap->pkts_captured;
+#if __linux__
+	if (dcap->_backend == DCAP_BACKEND_RING) {
+		struct tpacket_stats_v3		tps;
+		socklen_t			len = sizeof(tps);
+		uint32_t			i;
+
+		bzero(&tps, sizeof(tps));
+		if (getsockopt(dcap->_fd, SOL_PACKET, PACKET_STATISTICS,
+					&tps, &len) < 0) {
+			warn("PACKET_STATISTICS");
+		} else {
+			/* Same as pcap - tp_packets includes the drops. */
+			dcap->_ring_recv += tps.tp_packets;
+			dcap->_ring_drop += tps.tp_drops;
+			ds->ps_valid = 1;
+		}
+		ds->ps_recv = dcap->_ring_recv;
+		ds->ps_drop = dcap->_ring_drop;
+
+		ds->ring_blocks_count = dcap->_ring_block_count;
+		for (i = 0; i < dcap->_ring_block_count; i++) {
+			if (DCAP_LOAD(dcap_ring_block(dcap, i)->
+					hdr.bh1.block_status) &
+					TP_STATUS_USER) {
+				ds->ring_blocks_used++;
+			}
+		}
+		return;
+	}
+#endif
+#if DCAP_HAVE_XDP
+	if (dcap->_backend == DCAP_BACKEND_XDP) {
+		struct xdp_statistics		xs;
+		socklen_t			len = sizeof(xs);
+		struct dcap_xsk			*xsk = dcap->_xsk;
+
+		/* Unlike PACKET_STATISTICS, these aren't reset on read. */
+		bzero(&xs, sizeof(xs));
+		if (getsockopt(dcap->_fd, SOL_XDP, XDP_STATISTICS,
+					&xs, &len) < 0) {
+			warn("XDP_STATISTICS");
+		} else {
+			ds->ps_valid = 1;
+			ds->ps_drop = xs.rx_dropped + xs.rx_ring_full;
+			ds->ps_recv = DCAP_LOAD(xsk->rx_pkts) + ds->ps_drop;
+		}
+		ds->ring_blocks_count = DCAP_XSK_RX_SIZE;
+		ds->ring_blocks_used = DCAP_LOAD(*xsk->rx_prod) -
+			DCAP_LOAD(*xsk->rx_cons);
+		return;
+	}
+#endif
 
 	/* pcap stats not valid for file. */
-	if (pcap_file(dcap->_pcap) == NULL) {
+	if (dcap->_backend == DCAP_BACKEND_PCAP &&
+	    pcap_file(dcap->_pcap) == NULL) {
 		bzero(&ps, sizeof(ps));
 		if (pcap_stats(dcap->_pcap, &ps) < 0) {
 			warnx("pcap_stats: %s", pcap_geterr(dcap->_pcap));
 		} else {
-			ds.ps_valid = 1;
-			ds.ps_recv = ps.ps_recv;
-			ds.ps_drop = ps.ps_drop;
-			ds.ps_ifdrop = ps.ps_ifdrop;
+			/* Only 32 bits, so add up the differences. That
+			 * works as long as they don't wrap more than once
+			 * between reads. */
+			dcap->_pcap_recv += (uint32_t)(ps.ps_recv -
+					dcap->_pcap_last.ps_recv);
+			dcap->_pcap_drop += (uint32_t)(ps.ps_drop -
+					dcap->_pcap_last.ps_drop);
+			dcap->_pcap_ifdrop += (uint32_t)(ps.ps_ifdrop -
+					dcap->_pcap_last.ps_ifdrop);
+			dcap->_pcap_last = ps;
+			ds->ps_valid = 1;
+			ds->ps_recv = dcap->_pcap_recv;
+			ds->ps_drop = dcap->_pcap_drop;
+			ds->ps_ifdrop = dcap->_pcap_ifdrop;
 		}
 	}
+}
+
+/* Fills in ds. */
+void
+dcap_get_stats(struct dcap *dcap, struct dcap_stat *ds)
+{
+	bzero(ds, sizeof(*ds));
+	ds->captured = DCAP_LOAD(dcap->pkts_captured);
+	ds->truncated = DCAP_LOAD(dcap->_drop_truncated);
+	ds->runts = DCAP_LOAD(dcap->_drop_runt);
+	ds->not_ip = DCAP_LOAD(dcap->_drop_not_ip);
 
-	return (&ds);
+	pthread_mutex_lock(&dcap_stats_lock);
+	dcap_get_kernel_stats(dcap, ds);
+	pthread_mutex_unlock(&dcap_stats_lock);
 }
 
 
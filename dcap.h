@@ -18,40 +18,171 @@
 
 typedef void (*dcap_handler)(struct timeval *tv, int pkt_len, char *ip_pkt, void *user);
 
+/* Batches of pkts, see dcap_set_batch_handler(). The pkts are only valid
+ * until the handler returns. */
+#define DCAP_BATCH_MAX		64
+struct dcap_pkt {
+	struct timeval	tv;
+	int		len;
+	char		*ip_pkt;
+};
+typedef void (*dcap_batch_handler)(struct dcap_pkt *pkts, int n, void *user);
+
+enum dcap_backend {
+	DCAP_BACKEND_PCAP,	/* libpcap, live or file. */
+	DCAP_BACKEND_RING,	/* AF_PACKET TPACKET_V3 ring. Linux only. */
+	DCAP_BACKEND_XDP,	/* AF_XDP socket per rx queue, fed by an
+				   XDP pre-filter. Linux only. */
+	DCAP_BACKEND_MMAP,	/* mmapped pcap file, read in chunks. */
+};
+
+/* Encapsulations to take off before the callback, see dcap_set_decap().
+ * Any number of vlan tags always are. */
+#define DCAP_DECAP_MPLS		0x01	/* Label stacks. */
+#define DCAP_DECAP_GRE		0x02	/* ip and ethernet over gre. */
+#define DCAP_DECAP_ERSPAN	0x04	/* Types II and III. */
+#define DCAP_DECAP_VXLAN	0x08	/* udp port 4789. */
+
+/* TPACKET_V3 ring parameters. Zero for the defaults. */
+struct dcap_ring_config {
+	uint32_t	block_size;	/* Bytes. Multiple of the page size. */
+	uint32_t	block_count;
+	uint32_t	retire_tov;	/* Block retire timeout, msec. */
+};
+
 struct dcap {
 	char		intf_name[128];		/* Read-only */
-	uint32_t	pkts_captured;		/* Read-only */
+	uint64_t	pkts_captured;		/* Read-only */
 	void		*user;			/* Read/write */
-	uint16_t	sample_rate;		/* Read/write - 0 or 1 to
-						   disable sampling */
 
 	/* Private vars */
-	pcap_t		*_pcap;
+	int		_backend;
+	pcap_t		*_pcap;		/* With the ring backend, a dead
+					   handle for compiling filters. */
 	struct event	_ev_pcap[1];
 	dcap_handler	_callback;
+	int		_decap;		/* DCAP_DECAP_ flags */
+
+	/* Link hdr handler for the pcap's datalink, see dcap_pcap_cb(). */
+	char		*(*_dl_handler)(struct dcap *dcap, char *pkt,
+				int *lenp);
+	int		_dl_min_len;	/* Link hdr plus an ip hdr. */
+	uint64_t	_drop_truncated;
+	uint64_t	_drop_runt;
+	uint64_t	_drop_not_ip;
+	time_t		_warn_next;
+
+	/* Batches, if there's a batch handler. With the pcap backend, the
+	 * pkts are copied to _batch_buf, since pcap can reuse its buffer
+	 * for the next pkt. */
+	dcap_batch_handler _batch_callback;
+	struct dcap_pkt	*_batch;
+	int		_batch_n;
+	char		*_batch_buf;
+
+	/* Ring backend */
+	int		_fd;
+	char		*_ring;
+	uint32_t	_ring_block_size;
+	uint32_t	_ring_block_count;
+	uint32_t	_ring_block_cur;
+	uint64_t	_ring_recv;	/* Totals, since the kernel resets */
+	uint64_t	_ring_drop;	/*  its counters on each read. */
+
+	/* XDP backend. Rings are in dcap.c. */
+	struct dcap_xsk	*_xsk;
+	struct bpf_program _bpf;	/* Full filter, run in userspace. */
+
+	/* In-memory replay, see dcap_init_mem(). Records are a
+	 * pcap_pkthdr, then the pkt at _mem_data_off, padded to 8 bytes. */
+	char		*_mem;
+	size_t		_mem_len;
+	size_t		_mem_data_off;
+	uint32_t	_mem_pkts;
+
+	/* Live pcap backend. Totals of pcap_stats(), whose counters are
+	 * only 32 bits, and what it said the last time. */
+	uint64_t	_pcap_recv;
+	uint64_t	_pcap_drop;
+	uint64_t	_pcap_ifdrop;
+	struct pcap_stat _pcap_last;
+
+	/* mmap backend. _mem and _mem_len are the whole file, shared with
+	 * the dcap_mmap_dup() copies, as is _bpf. */
+	int		_mmap_owner;
+	int		_mmap_swapped;	/* Other endian file. */
+	int		_mmap_nsec;	/* ns timestamps. */
+	uint32_t	_mmap_snaplen;
+	uint32_t	_mmap_linktype;
+	uint32_t	_mmap_ts_first;	/* First record, for resyncing. */
+};
+
+/* PACKET_FANOUT modes, see dcap_set_fanout(). */
+enum dcap_fanout_mode {
+	DCAP_FANOUT_HASH,	/* By flow hash, addrs and ports, so one
+				 * client's queries from different ports can
+				 * land on different sockets. */
+	DCAP_FANOUT_CPU,	/* By the cpu the pkt arrived on. */
+	DCAP_FANOUT_LB,		/* Round-robin. */
+	DCAP_FANOUT_QUEUE,	/* By the NIC rx queue it came in on. */
+	DCAP_FANOUT_CLIENT,	/* By the client, with a cBPF program. */
 };
 
+/* See dcap_get_stats(). The counters are totals since the dcap was
+ * opened. */
 struct dcap_stat {
 	int	ps_valid;	/* pcap stats only valid for live capture. */
 	/* pcap stats */
-	uint32_t ps_recv;
-	uint32_t ps_drop;
-	uint32_t ps_ifdrop;
+	uint64_t ps_recv;
+	uint64_t ps_drop;
+	uint64_t ps_ifdrop;
+
+	uint64_t captured;
+
+	/* Pkts dropped before the callback. */
+	uint64_t truncated;	/* caplen short of the length. */
+	uint64_t runts;		/* Too short for a link and ip hdr. */
+	uint64_t not_ip;	/* Or an unknown, or bad, encap. */
 
-	uint32_t captured;
+	/* Ring backends only. Blocks (descriptors for XDP) waiting on
+	 * userspace, out of the total. When used reaches count, the kernel
+	 * starts dropping. */
+	uint32_t ring_blocks_used;
+	uint32_t ring_blocks_count;
 };
 
 
 struct dcap * dcap_init_file(char *filename, char *filter,
 		dcap_handler callback);
+struct dcap * dcap_init_mem(char *filename, char *filter,
+		dcap_handler callback);
+struct dcap * dcap_init_mmap(char *filename, char *filter,
+		dcap_handler callback);
+struct dcap * dcap_mmap_dup(struct dcap *dcap);
+int dcap_mmap_split(struct dcap *dcap, int min_chunks, size_t chunk_size,
+		size_t **offsetsp);
 struct dcap * dcap_init_live(char *intf_name, int promisc, char *filter,
 		dcap_handler callback);
+struct dcap * dcap_init_ring(char *intf_name, int promisc, char *filter,
+		struct dcap_ring_config *config, dcap_handler callback);
+int dcap_xdp_queue_count(char *intf_name);
+struct dcap * dcap_init_xdp(char *intf_name, int queue_id, char *filter,
+		int enable_mdns, int enable_ip6, dcap_handler callback);
 int dcap_event_set(struct dcap *dcap);
+int dcap_event_set_base(struct dcap *dcap, struct event_base *base);
+int dcap_set_filter(struct dcap *dcap, char *filter);
+void dcap_set_decap(struct dcap *dcap, int decap);
+int dcap_set_batch_handler(struct dcap *dcap, dcap_batch_handler handler);
+int dcap_set_fanout(struct dcap *dcap, uint16_t group_id,
+		enum dcap_fanout_mode mode);
 int dcap_get_fd(struct dcap *dcap);
+int dcap_get_datalink(struct dcap *dcap);
 void dcap_loop_all(struct dcap *dcap);
+void dcap_loop_mem(struct dcap *dcap, int n_loops);
+size_t dcap_loop_mmap(struct dcap *dcap, size_t start, size_t end);
 void dcap_close(struct dcap *dcap);
 
-struct dcap_stat * dcap_get_stats(struct dcap *dcap);
+void dcap_get_stats(struct dcap *dcap, struct dcap_stat *ds);
 
 #endif /* __DCAP_H__*/
 
@@ -46,15 +46,148 @@
      names		[variable] Each is a Nul terminated string.
      ips		[variable] Word-aligned, starts at names + names_len,
      			           each is 4 bytes.
+     hits		[4 bytes] Only with DNSFLOW_FLAG_HITS. Number of
+     				  identical responses aggregated into the set.
+     ts_sec		[4 bytes] Only with DNSFLOW_FLAG_TTL (-L). When the
+     ts_usec		[4 bytes]   response was captured (the first one,
+     				    with hits).
+     min_ttl		[4 bytes] Only with DNSFLOW_FLAG_TTL. The lowest
+     				  ttl of the answers in the set, 0 if
+     				  none had one.
+     ttls		[4 bytes each] Only with DNSFLOW_FLAG_RR_TTLS (-L
+     				  rr). The ttl of the answer each name after
+     				  the first came from, then of each ip.
+     rtt		[4 bytes] Only with DNSFLOW_FLAG_RTT (-Q). Usec from
+     				  the client's query to the response (the
+     				  first one, with hits), 0 if the query
+     				  wasn't seen.
+
+   Compressed Data Set (version 3, DNSFLOW_FLAG_COMPRESSED):
+     client_ip		[varint] Zigzag delta from the previous set's
+     				 client_ip in the pkt (0 for the first).
+     names_count	[1 byte]
+     ips_count		[1 byte]
+     names		[variable] Each is a varint, v. If v & 1, a
+     				   (v >> 1) byte dns wire name follows, and
+     				   is added to the pkt's name table.
+     				   Otherwise, it's entry (v >> 1) of the
+     				   name table.
+     ips		[variable] The first is 4 bytes, the rest are
+     				   zigzag varint deltas from the previous ip.
+     hits		[varint] Only with DNSFLOW_FLAG_HITS.
+     ts_sec		[varint] Only with DNSFLOW_FLAG_TTL. Zigzag delta
+     				 from the previous set's ts_sec in the pkt,
+     				 or from 0 for the first.
+     ts_usec		[varint] Only with DNSFLOW_FLAG_TTL.
+     min_ttl		[varint] Only with DNSFLOW_FLAG_TTL.
+     ttls		[varint each] Only with DNSFLOW_FLAG_RR_TTLS.
+     rtt		[varint] Only with DNSFLOW_FLAG_RTT.
+     Varints are LEB128 (7 bits per byte, low bits first). Nothing is
+     padded or aligned.
+
+   IPv6 Data Set (version 4, -6):
+     family		[1 byte] 4 or 6.
+     Then a family 4 set is the same as a version 2 set, or a version 3
+     set with DNSFLOW_FLAG_COMPRESSED. Sets with an ipv6 client or AAAA
+     answers are family 6, with every address 16 bytes; ipv4 ones are
+     v4-mapped (::ffff:a.b.c.d). Uncompressed, the client_ip and ips are
+     16 bytes each, and the ips are still word-aligned from the start of
+     the pkt. With DNSFLOW_FLAG_COMPRESSED, each address is prefix coded:
+     a byte n, the number of leading bytes that are the same as the
+     previous address, then the other 16 - n bytes. client_ip is coded
+     against the previous family 6 client_ip in the pkt, and each ip
+     against the previous ip in the set (for the first ones, ::).
 
     Stats Set:
       pkts_captured	[4 bytes]
       pkts_received	[4 bytes]
       pkts_dropped	[4 bytes]
       pkts_ifdropped	[4 bytes] Only supported on some platforms.
-      sample_rate	[4 bytes]
+      sample_rate	[4 bytes] The current rate, with adaptive sampling.
+      The counters are the low 32 bits of totals since startup. See the
+      Stats Set v3 for all of them.
+
+    Extended Stats, after the Stats Set (DNSFLOW_FLAG_STATS_EXT):
+      drops_count	[1 byte]
+      stages_count	[1 byte] 0 unless stage timing is on (-t).
+      pipes_count	[1 byte] 0 unless pipelined (-W).
+      exports_count	[1 byte] 0 unless exporting over tcp (-D).
+      drops		[4 bytes each] Pkts dropped at each early return in
+      					dcap or the capture callback.
+      stages		[16 bytes each] Per processing stage, since the
+      					last stats pkt: samples, and the
+					p50, p99 and p999 times in ns.
+      pipes		[12 bytes each] The capture to parse rings, then
+      					the parse to export bufs: slots in
+					use, slots in total, and the pkts
+					(flow pkts for export) dropped
+					because they were full.
+      exports		[24 bytes each] Per tcp collector, in -D order: bytes
+      					spooled, spool size, frames sent,
+					frames dropped because the spool was
+					full, times the socket was full, and
+					connects.
+
+    Stats Set v3 (version 5, -B), in its own pkt after the Stats Set:
+      ts_sec		[4 bytes]
+      sample_rate	[4 bytes] As in the Stats Set.
+      workers_count	[1 byte]
+      drops_count	[1 byte]
+      prefilter_count	[1 byte]
+      pipes_count	[1 byte] 0 unless pipelined (-W).
+      reserved		[4 bytes]
+      totals		[variable] Counters, summed over the workers.
+      pipes		[16 bytes each] Slots in use and in total (4
+      					bytes each), and the pkts dropped
+					(8 bytes), as in the Extended Stats.
+      workers		[variable] Per thread:
+        id		[1 byte]
+        role		[1 byte] 0 inline, 1 capture, 2 parse, 3 export.
+        reserved	[2 bytes]
+        sample_rate	[4 bytes] What its filter samples at. Until it
+        				  picks up a change, not the current
+					  rate.
+        ring_used	[4 bytes] Capture ring blocks (XDP descriptors)
+        				  waiting on it, or for a parse
+					  thread, slots in use in its -W
+					  rings.
+        ring_size	[4 bytes]
+        counters	[variable] Its own.
+      Counters are 8 bytes each, since startup: pkts_captured,
+      pkts_received, pkts_dropped, pkts_ifdropped, export_pkts,
+      export_bytes, export_errors, export_dropped, then drops_count drops
+      (as in the Extended Stats) and prefilter_count dns pre-filter
+      results.
+
+    Top-K Set (DNSFLOW_FLAG_TOPK, -a):
+      ts_sec		[4 bytes] When the window ended.
+      window_sec	[4 bytes] How long it was, about a stats interval.
+      sets		[4 bytes] Sets counted in the window.
+      clients_count	[1 byte]
+      names_count	[1 byte]
+      reserved		[2 bytes]
+      clients		[20 bytes each] The client (16 bytes, ipv4 ones
+      					v4-mapped) and its sets. Most
+					first.
+      names		[variable] Sets for the qname (4 bytes), then the
+      				   uncompressed dns wire name. Most first.
+      Counts are Count-Min estimates, never under the true count. There
+      are up to -a's top_n of each.
+
+   TCP Export (-D):
+     A stream of frames, each a 4 byte length (network order) and then a
+     flow pkt, exactly as it would have been sent over udp.
+
+   Sharded Export (-k):
+     Each data pkt only holds sets for the clients of one dst, and goes to
+     that dst alone. Every dst gets its own stats pkts. Sequence numbers
+     are per dst.
  */
+#if __linux__
+#define _GNU_SOURCE		/* CPU_SET, pthread_setaffinity_np */
+#endif
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -62,32 +195,59 @@
 #include <sys/wait.h>
 #if __linux__
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #endif
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <err.h>
 #include <assert.h>
+#include <pthread.h>
+#if __linux__
+#include <sched.h>
+#endif
 
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
 #include <pcap/pcap.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <net/ethernet.h>
 
 #include <ldns/ldns.h>
 #include <event.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "dcap.h"
+#include "hist.h"
+#include "dnsflow_ring.h"
+#include "dnsflow_anon.h"
+
+#if DNSFLOW_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
 
 
 /* Define a MAX/MIN macros, if we don't already have then. */
@@ -100,12 +260,127 @@
 
 #define DNSFLOW_MAX_PARSE		255
 #define DNSFLOW_PKT_MAX_SIZE		65535
-#define DNSFLOW_PKT_TARGET_SIZE		1200
+#define DNSFLOW_PKT_TARGET_SIZE		1200	/* Default, see -S */
+#define DNSFLOW_PKT_TARGET_MIN		64
+#define DNSFLOW_PKT_TARGET_MAX		65507	/* Max udp payload */
+/* Flow pkt bufs have room for this much past the target size, so a set
+ * that starts below the target always fits. A set that doesn't fit in an
+ * empty buf is dropped. */
+#define DNSFLOW_PKT_SET_ROOM		8192
 #define DNSFLOW_VERSION			2
+#define DNSFLOW_VERSION_COMPRESSED	3
+#define DNSFLOW_VERSION_IP6		4
+#define DNSFLOW_VERSION_STATS		5	/* -B */
 #define DNSFLOW_PORT			5300
 #define DNSFLOW_UDP_MAX_DSTS		10
+#define DNSFLOW_RING_MB			64	/* -H, default */
+/* -D. Most collectors, the default spool size, and the longest wait
+ * between connects. */
+#define DNSFLOW_TCP_MAX_DSTS		10
+#define DNSFLOW_TCP_SPOOL_MB		16
+#define DNSFLOW_TCP_SPOOL_MB_MAX	4096
+#define DNSFLOW_TCP_BACKOFF_MAX		60	/* sec */
+/* -k. Shards below DNSFLOW_SHARD_UDP are the -u dsts, one per address for
+ * as long as a dsts list still in use has it, so there are enough for a
+ * reload to replace every dst. The rest are the -D collectors, by
+ * position. Each dst has DNSFLOW_SHARD_VNODES points on the hash ring. */
+#define DNSFLOW_SHARD_UDP		(2 * DNSFLOW_UDP_MAX_DSTS)
+#define DNSFLOW_SHARD_MAX		(DNSFLOW_SHARD_UDP + \
+					 DNSFLOW_TCP_MAX_DSTS)
+#define DNSFLOW_SHARD_VNODES		64
+#define DNSFLOW_SHARD_SEED		0x5bd1e995
+/* -c. Longest filter expression in the config file, and the longest push
+ * or stats interval. */
+#define DNSFLOW_CONFIG_FILTER_MAX	4096
+#define DNSFLOW_INTERVAL_MAX		3600
+/* Aggregation (-A). Sets with more name and ip data than fits in an entry
+ * aren't aggregated. */
+#define DNSFLOW_AGG_DATA_SIZE		480
+#define DNSFLOW_AGG_NONE		0xffffffff
+/* Query matching (-Q). Outstanding queries are kept for
+ * DNSFLOW_RTT_TIMEOUT ms by default, in buckets of a cache line. */
+#define DNSFLOW_RTT_TIMEOUT		3000
+#define DNSFLOW_RTT_TIMEOUT_MAX		60000
+#define DNSFLOW_RTT_BUCKET_SLOTS	8
+/* Top clients and names (-a). Count-Min sketches of DNSFLOW_TOPK_DEPTH
+ * rows, and per worker, DNSFLOW_TOPK_CANDS candidates for each entry
+ * reported. */
+#define DNSFLOW_TOPK_MAX		32
+#define DNSFLOW_TOPK_DEPTH		4
+#define DNSFLOW_TOPK_WIDTH		16384	/* Power of 2 */
+#define DNSFLOW_TOPK_CANDS		4
+#define DNSFLOW_TOPK_KEY_MAX		(LDNS_MAX_DOMAINLEN + 1)
+
+/* Finished data pkts queued per worker before they're all sent with one
+ * sendmmsg(). */
+#define DNSFLOW_EXPORT_BATCH		16
+/* Pkts from dcap come in batches. Pkts this far ahead in the batch are
+ * prefetched. */
+#define DNSFLOW_PREFETCH_AHEAD		4
+/* Max segments in one UDP_SEGMENT send, from the kernel. */
+#define DNSFLOW_GSO_MAX_SEGS		64
+/* Parallel -r (-T with -r). The file is split into chunks of about this
+ * size, and at least a few per thread. With -O, each thread can have this
+ * many chunks done and waiting to be sent. */
+#define DNSFLOW_CHUNK_SIZE		(32 * 1024 * 1024)
+#define DNSFLOW_CHUNKS_PER_THREAD	4
+#define DNSFLOW_CHUNKS_AHEAD		2
+/* Sampling (-s). The hash is the high 16 bits of the key times 2^32 / phi
+ * (Fibonacci hashing), so rates go up to 2^16. With adaptive sampling,
+ * the rate doubles when more than 1/DNSFLOW_SAMPLE_DROP_RATIO of the pkts
+ * were dropped in a stats interval, and halves after
+ * DNSFLOW_SAMPLE_QUIET intervals with none. */
+#define DNSFLOW_SAMPLE_MULT		2654435761U
+#define DNSFLOW_SAMPLE_RATE_MAX		65536
+#define DNSFLOW_SAMPLE_DROP_RATIO	1000
+#define DNSFLOW_SAMPLE_QUIET		6
+/* Pipelined processing (-W). Each capture thread has a ring to each parse
+ * thread, of DNSFLOW_PIPE_SLOTS slots by default. Each parse thread has
+ * DNSFLOW_PIPE_BUFS flow pkt bufs, on top of its export batch, going
+ * round between it and the export thread. When there's nothing to do,
+ * the parse and export threads poll DNSFLOW_PIPE_SPINS times, then sleep
+ * for DNSFLOW_PIPE_SLEEP_US between polls. A busy parse thread runs its
+ * timers every DNSFLOW_PIPE_TIMER_PASSES passes over its rings. */
+#define DNSFLOW_MAX_WORKERS		64	/* Threads, of any kind */
+#define DNSFLOW_MAX_CPUS		1024	/* In the whole host */
+#define DNSFLOW_PIPE_MAX		16	/* Parse threads */
+#define DNSFLOW_PIPE_SLOTS		1024
+#define DNSFLOW_PIPE_SLOT_SIZE		4096
+#define DNSFLOW_PIPE_DNS_MAX		(DNSFLOW_PIPE_SLOT_SIZE - \
+		offsetof(struct dnsflow_pipe_rec, pr_dns))
+#define DNSFLOW_PIPE_BUFS		64
+#define DNSFLOW_PIPE_BURST		32	/* Recs per ring per pass */
+#define DNSFLOW_PIPE_SPINS		1000
+#define DNSFLOW_PIPE_SLEEP_US		50
+#define DNSFLOW_PIPE_TIMER_PASSES	1024
+/* Generated filters (-E can make them long), and how deep the -E vlan
+ * and mpls stacks can be. */
+#define DNSFLOW_FILTER_MAX		65536
+#define DNSFLOW_VLAN_DEPTH_MAX		2
+#define DNSFLOW_MPLS_DEPTH_MAX		4
+#define DNSFLOW_MPLS_DEPTH		2	/* Default with -E mpls */
+/* Per worker arenas. Slabs are a hugepage, or a multiple of one for big
+ * allocations. */
+#define DNSFLOW_SLAB_SIZE		(2 * 1024 * 1024)
+#define DNSFLOW_ARENA_ALIGN		64	/* A cache line */
+#if __linux__ && !defined(UDP_SEGMENT)
+#define UDP_SEGMENT			103	/* Linux 4.18+ */
+#endif
 
 #define DNSFLOW_FLAG_STATS		0x0001
+#define DNSFLOW_FLAG_COMPRESSED		0x0002
+#define DNSFLOW_FLAG_HITS		0x0004
+#define DNSFLOW_FLAG_STATS_EXT		0x0008
+#define DNSFLOW_FLAG_TTL		0x0010
+#define DNSFLOW_FLAG_RR_TTLS		0x0020
+#define DNSFLOW_FLAG_RTT		0x0040
+#define DNSFLOW_FLAG_TOPK		0x0080
+
+/* Per pkt name table for compressed sets. The hash is just for finding
+ * names already in the pkt; past DNSFLOW_CNAMES_MAX, names are always
+ * sent literally. */
+#define DNSFLOW_CNAMES_MAX		1024
+#define DNSFLOW_CNAMES_HASH_SIZE	4096	/* Power of 2 */
 
 #define DNSFLOW_SETS_COUNT_MAX		255
 struct dnsflow_hdr {
@@ -123,17 +398,149 @@ struct dnsflow_set_hdr {
 	uint8_t			ips_count;
 	uint16_t		names_len;
 };
+#define DNSFLOW_NAME_BUF_SIZE		\
+	(DNSFLOW_MAX_PARSE * (LDNS_MAX_DOMAINLEN + 1))
 struct dns_data_set {
 	uint8_t 		*names[DNSFLOW_MAX_PARSE];
 	int			name_lens[DNSFLOW_MAX_PARSE];
 	int			num_names;
 	in_addr_t		ips[DNSFLOW_MAX_PARSE];
 	int			num_ips;
+	/* AAAA answers, with -6. */
+	struct in6_addr		ips6[DNSFLOW_MAX_PARSE];
+	int			num_ips6;
+
+	/* For -L. The ttl of the answer each name (but the qname) and ip
+	 * came from, the lowest of all of them, and when the response was
+	 * captured. */
+	uint32_t		name_ttls[DNSFLOW_MAX_PARSE];
+	uint32_t		ip_ttls[DNSFLOW_MAX_PARSE];
+	uint32_t		ip6_ttls[DNSFLOW_MAX_PARSE];
+	uint32_t		min_ttl;
+	struct timeval		tv;
+	uint32_t		rtt;		/* -Q, usec */
+
+	/* Backing store for the names when using the native parser. With the
+	 * ldns parser, names point into the ldns_pkt. */
+	uint8_t			name_buf[DNSFLOW_NAME_BUF_SIZE];
+	int			name_buf_len;
+};
+
+/* Pre-filter results, see dnsflow_dns_prefilter(). Order is part of the
+ * v3 stats format, only add to the end. */
+enum dns_prefilter_result {
+	DNS_PREFILTER_PASS,
+	DNS_PREFILTER_SHORT,		/* Truncated header or question. */
+	DNS_PREFILTER_FLAGS,		/* Not a valid recursive response. */
+	DNS_PREFILTER_QDCOUNT,		/* Not exactly one question. */
+	DNS_PREFILTER_ANCOUNT,		/* No answers. */
+	DNS_PREFILTER_QTYPE,		/* Not an A (or with -6, AAAA)
+					   query. */
+	DNS_PREFILTER_QUERY,		/* With -Q, an A (or AAAA) query. */
+	DNS_PREFILTER_MAX,
+};
+static const char *dns_prefilter_names[DNS_PREFILTER_MAX] = {
+	"passed", "short", "flags", "qdcount", "ancount", "qtype", "query",
+};
+
+/* Early returns from dnsflow_dcap_cb(). Order is part of the extended
+ * stats format, only add to the end. */
+enum dnsflow_drop {
+	DNSFLOW_DROP_NOT_IP,		/* Bad ipv4 (or ipv6) hdr. */
+	DNSFLOW_DROP_NOT_UDP,
+	DNSFLOW_DROP_ENCAP,		/* Bad pkt inside the encap. */
+	DNSFLOW_DROP_UDP_LEN,
+	DNSFLOW_DROP_PREFILTER,		/* See dns_prefilter_result. */
+	DNSFLOW_DROP_PARSE,		/* Failed to extract. */
+	DNSFLOW_DROP_SAMPLED,		/* Not sampled, and the filter
+					   didn't already take it out. */
+	DNSFLOW_DROP_PIPE,		/* -W, the parse ring was full (or
+					   the pkt didn't fit in a slot). */
+	DNSFLOW_DROP_SET_SIZE,		/* The set was too big for a flow
+					   pkt buf. */
+	DNSFLOW_DROP_TRUNCATED,		/* These three are dropped in dcap,
+					   see struct dcap_stat. */
+	DNSFLOW_DROP_RUNT,
+	DNSFLOW_DROP_UNKNOWN_ENCAP,
+	DNSFLOW_DROP_MAX,
+};
+static const char *dnsflow_drop_names[DNSFLOW_DROP_MAX] = {
+	"not_ip", "not_udp", "encap", "udp_len", "prefilter", "parse",
+	"sampled", "pipe", "set_size", "truncated", "runt", "unknown_encap",
+};
+
+/* Tunnels for -E, as the filter matches them: from an ipv4 outer hdr
+ * without options, to an inner ip hdr at a fixed offset. So each layout
+ * is its own entry. dcap takes them apart whatever the layout. */
+struct dnsflow_tunnel {
+	const char	*dt_name;
+	int		dt_decap;	/* DCAP_DECAP_ */
+	const char	*dt_match;	/* Outer hdrs */
+	int		dt_type_offset;	/* Ethertype of the inner pkt */
+	int		dt_offset;	/* Inner ip hdr */
+};
+static const struct dnsflow_tunnel dnsflow_tunnels[] = {
+	/* gre, without and with a key, then ethernet over gre. */
+	{ "gre", DCAP_DECAP_GRE, "ip[9] = 47 and ip[20:2] = 0", 22, 24 },
+	{ "gre", DCAP_DECAP_GRE, "ip[9] = 47 and ip[20:2] = 0x2000", 22, 28 },
+	{ "gre", DCAP_DECAP_GRE,
+		"ip[9] = 47 and ip[20:2] = 0 and ip[22:2] = 0x6558", 36, 38 },
+	/* gre with a sequence number, erspan, ethernet. For type III,
+	 * with and without the platform specific subheader. */
+	{ "erspan", DCAP_DECAP_ERSPAN,
+		"ip[9] = 47 and ip[20:2] = 0x1000 and ip[22:2] = 0x88be",
+		48, 50 },
+	{ "erspan", DCAP_DECAP_ERSPAN,
+		"ip[9] = 47 and ip[20:2] = 0x1000 and ip[22:2] = 0x22eb and "
+		"ip[39] & 1 = 0", 52, 54 },
+	{ "erspan", DCAP_DECAP_ERSPAN,
+		"ip[9] = 47 and ip[20:2] = 0x1000 and ip[22:2] = 0x22eb and "
+		"ip[39] & 1 = 1", 60, 62 },
+	/* udp, vxlan, ethernet. */
+	{ "vxlan", DCAP_DECAP_VXLAN, "ip[9] = 17 and ip[22:2] = 4789",
+		48, 50 },
+};
+#define DNSFLOW_TUNNELS_COUNT	\
+	(sizeof(dnsflow_tunnels) / sizeof(dnsflow_tunnels[0]))
+
+/* The -W pipeline stages, for the extended stats. */
+enum dnsflow_pipe_stage {
+	DNSFLOW_PIPE_PARSE,		/* Capture to parse rings. */
+	DNSFLOW_PIPE_EXPORT,		/* Parse to export bufs. */
+	DNSFLOW_PIPE_STAGE_MAX,
+};
+
+/* Timed stages of dnsflow_dcap_cb(), with -t. Send is only timed when a
+ * batch actually goes out, and isn't included in build. */
+enum dnsflow_stage {
+	DNSFLOW_STAGE_IP_UDP,		/* ip/udp and encap checks. */
+	DNSFLOW_STAGE_DNS_CHECK,	/* Pre-filter. */
+	DNSFLOW_STAGE_EXTRACT,		/* Parse. */
+	DNSFLOW_STAGE_BUILD,		/* Aggregate and/or pkt build. */
+	DNSFLOW_STAGE_SEND,
+	DNSFLOW_STAGE_MAX,
+};
+static const char *dnsflow_stage_names[DNSFLOW_STAGE_MAX] = {
+	"ip_udp", "dns_check", "extract", "build", "send",
+};
+
+/* How dns pkts are parsed. */
+enum dnsflow_parser {
+	DNSFLOW_PARSER_NATIVE,		/* Straight from the wire. */
+	DNSFLOW_PARSER_LDNS,		/* Fallback, using ldns_wire2pkt(). */
+	DNSFLOW_PARSER_VERIFY,		/* Native, checked against ldns. */
+};
+
+/* What goes in the sets with -L. */
+enum dnsflow_ttl_mode {
+	DNSFLOW_TTL_NONE,
+	DNSFLOW_TTL_SET,		/* Capture time and the lowest ttl. */
+	DNSFLOW_TTL_RR,			/* And the ttl of every answer. */
 };
 
 struct dnsflow_data_pkt {
-	/* Variable sized pkt, allocate maximum size when it's a data pkt. */
-	char				pkt[1]; /* DNSFLOW_PKT_MAX_SIZE */
+	/* Variable sized pkt, see dnsflow_data_buf_new(). */
+	char				pkt[1]; /* Up to pkt_buf_max */
 };
 
 
@@ -144,16 +551,99 @@ struct dnsflow_stats_pkt {
 	uint32_t	pkts_ifdropped; /* according to pcap, only supported
 					   on some platforms */
 	uint32_t	sample_rate;
+
+	/* DNSFLOW_FLAG_STATS_EXT */
+	uint8_t		drops_count;
+	uint8_t		stages_count;
+	uint8_t		pipes_count;
+	uint8_t		exports_count;
+	uint32_t	drops[DNSFLOW_DROP_MAX];
+	struct {
+		uint32_t	samples;
+		uint32_t	p50_ns;
+		uint32_t	p99_ns;
+		uint32_t	p999_ns;
+	} stages[DNSFLOW_STAGE_MAX];
+	/* Then the pipes, right after the stages_count stages. Room for
+	 * them here, for when all the stages are there. */
+	struct dnsflow_stats_pipe {
+		uint32_t	used;
+		uint32_t	size;
+		uint32_t	overflows;
+	} pipes_space[DNSFLOW_PIPE_STAGE_MAX];
+	/* Then the exports, one per -D collector, after the pipes. */
+	struct dnsflow_stats_export {
+		uint32_t	queued;
+		uint32_t	size;
+		uint32_t	sent;
+		uint32_t	dropped;
+		uint32_t	stalls;
+		uint32_t	connects;
+	} exports_space[DNSFLOW_TCP_MAX_DSTS];
+};
+
+/* Each thread's counters, host order. For the v3 stats, see
+ * dnsflow_get_counters(). */
+#define DNSFLOW_COUNTERS_MAX	(8 + DNSFLOW_DROP_MAX + DNS_PREFILTER_MAX)
+struct dnsflow_counters {
+	uint64_t	ct_captured;
+	uint64_t	ct_received;
+	uint64_t	ct_dropped;
+	uint64_t	ct_ifdropped;
+	uint64_t	ct_export_sent;
+	uint64_t	ct_export_bytes;
+	uint64_t	ct_export_errors;
+	uint64_t	ct_export_dropped;
+	uint64_t	ct_drops[DNSFLOW_DROP_MAX];
+	uint64_t	ct_prefilter[DNS_PREFILTER_MAX];
+};
+
+/* -W rings, host order. */
+struct dnsflow_pipe_stat {
+	uint32_t	pt_used;
+	uint32_t	pt_size;
+	uint64_t	pt_overflows;
+};
+
+struct dnsflow_stats3_pkt {
+	uint32_t	ts_sec;
+	uint32_t	sample_rate;
+	uint8_t		workers_count;
+	uint8_t		drops_count;
+	uint8_t		prefilter_count;
+	uint8_t		pipes_count;
+	uint32_t	reserved;
+	/* The totals, pipes and workers. */
+	uint8_t		entries[(DNSFLOW_MAX_WORKERS + 1) *
+			(16 + DNSFLOW_COUNTERS_MAX * sizeof(uint64_t)) +
+			DNSFLOW_PIPE_STAGE_MAX * 16];
+};
+
+struct dnsflow_topk_pkt {
+	uint32_t	ts_sec;
+	uint32_t	window_sec;
+	uint32_t	sets;
+	uint8_t		clients_count;
+	uint8_t		names_count;
+	uint16_t	reserved;
+	uint8_t		entries[DNSFLOW_TOPK_MAX * (sizeof(struct in6_addr) +
+			2 * sizeof(uint32_t) + DNSFLOW_TOPK_KEY_MAX)];
 };
 
 enum dnsflow_buf_type {
 	DNSFLOW_DATA,
 	DNSFLOW_STATS,
+	DNSFLOW_STATS3,
+	DNSFLOW_TOPK,
 };
 struct dnsflow_buf {
 	uint32_t		db_type;	/* What's in the union */
 	uint32_t		db_len;		/* Size of what's in the pkt,
 						   db_pkt_hdr and below. */
+	int32_t			db_shard;	/* -k, where it goes, or -1
+						   for every dst. */
+	struct sockaddr_in	db_dst;		/* -k, a udp db_shard's
+						   address. */
 
 	uint32_t		db_loop_hdr;	/* Holds PF_ type when dumping
 						   straight to pcap file. */
@@ -161,9 +651,15 @@ struct dnsflow_buf {
 	union {
 		struct dnsflow_data_pkt		data_pkt;
 		struct dnsflow_stats_pkt	stats_pkt;
+		struct dnsflow_stats3_pkt	stats3_pkt;
+		struct dnsflow_topk_pkt		topk_pkt;
 	} DB_dat;
 };
 
+/* A data pkt, from db_pkt_hdr on. Taken from the buf, not the hdr, so the
+ * compiler doesn't bound the writes by the size of the hdr. */
+#define DB_PKT(db)	((char *)(db) + offsetof(struct dnsflow_buf, db_pkt_hdr))
+
 /* pcap record headers for saved files */
 struct pcap_timeval {
     bpf_int32 tv_sec;		/* seconds */
@@ -187,14 +683,357 @@ struct jmirror_hdr {
 
 #define db_data_pkt	DB_dat.data_pkt
 #define db_stats_pkt	DB_dat.stats_pkt
+#define db_stats3_pkt	DB_dat.stats3_pkt
+#define db_topk_pkt	DB_dat.topk_pkt
+
+/* An aggregated set. The names (uncompressed wire format), the ips and
+ * then any AAAA ips are stored inline. */
+struct dnsflow_agg_entry {
+	uint32_t		ae_hash;
+	uint32_t		ae_lru_prev;	/* Towards most recent. */
+	uint32_t		ae_lru_next;
+	in_addr_t		ae_client_ip;
+	struct in6_addr		ae_client6;	/* If ae_client_is6. */
+	uint32_t		ae_hits;
+	uint32_t		ae_min_ttl;	/* Over the hits, for -L. */
+	struct timeval		ae_tv;		/* The first hit. */
+	uint32_t		ae_rtt;		/* The first with a query. */
+	uint8_t			ae_names_count;
+	uint8_t			ae_ips_count;
+	uint16_t		ae_names_len;
+	uint8_t			ae_client_is6;
+	uint8_t			ae_ips6_count;	/* After the ips. */
+	uint8_t			ae_data[DNSFLOW_AGG_DATA_SIZE];
+};
+
+/* Fixed size table of sets seen in the current window. Open addressing
+ * (linear probing) on an index of entry numbers, so entries never move,
+ * and an lru list for evicting when the table is full. */
+struct dnsflow_agg {
+	struct dnsflow_agg_entry	*ag_entries;
+	uint32_t		ag_n_entries;
+	uint32_t		ag_n_used;
+	uint32_t		*ag_index;	/* entry + 1, 0 is empty */
+	uint32_t		ag_index_mask;
+	uint32_t		ag_lru_head;	/* Most recent. */
+	uint32_t		ag_lru_tail;
+	time_t			ag_window_start;
+};
+
+/* Outstanding queries, for -Q. A slot has a tag from the hash of (client
+ * ip, client port, dns id, qname), 0 if the slot is free, and the low 32
+ * bits of the query's capture time in usec. */
+struct dnsflow_rtt_bucket {
+	uint32_t		rb_tags[DNSFLOW_RTT_BUCKET_SLOTS];
+	uint32_t		rb_times[DNSFLOW_RTT_BUCKET_SLOTS];
+};
+
+/* Fixed size table of buckets, by pkt time. The table is also a timing
+ * wheel, with a 1 ms tick: each tick sweeps the next slice of buckets, so
+ * every bucket is swept once per timeout, and queries that were never
+ * answered are counted and freed. Lookups don't trust the sweep, they
+ * check the age too. */
+struct dnsflow_rtt {
+	struct dnsflow_rtt_bucket	*rt_buckets;
+	uint32_t			rt_n_buckets;	/* A power of 2. */
+	uint32_t			rt_timeout;	/* ms */
+	uint64_t			rt_tick;	/* Last swept, in ms. */
+};
+
+/* -a. A Count-Min sketch, and the keys most likely to be on top, with
+ * their estimates when they were last counted. Past tk_n, once it's full,
+ * a key only gets in by beating tk_min, the lowest there. */
+struct dnsflow_topk_cand {
+	uint32_t		kc_hash;
+	uint32_t		kc_count;
+	int			kc_len;
+	uint8_t			kc_key[DNSFLOW_TOPK_KEY_MAX];
+};
+struct dnsflow_topk {
+	uint32_t		tk_counts[DNSFLOW_TOPK_DEPTH][DNSFLOW_TOPK_WIDTH];
+	int			tk_n;
+	uint32_t		tk_min;
+	struct dnsflow_topk_cand	tk_cands[DNSFLOW_TOPK_MAX *
+						 DNSFLOW_TOPK_CANDS];
+};
+
+/* -a. What a worker counted in one window: by client, and by qname. */
+struct dnsflow_topk_win {
+	uint32_t		tw_sets;
+	struct dnsflow_topk	tw_clients;
+	struct dnsflow_topk	tw_names;
+};
+
+/* -z. Recent clients' mappings, direct mapped by hash, so a client that
+ * comes back costs a compare instead of 32 (or 128) AES blocks. Every slot
+ * starts out holding the mapping of 0.0.0.0 (::), so there's no need to
+ * mark empty ones. */
+#define DNSFLOW_ANON_CACHE4		8192	/* Power of 2 */
+#define DNSFLOW_ANON_CACHE6		2048	/* Power of 2 */
+struct dnsflow_anon_cache {
+	struct dnsflow_anon_slot4 {
+		in_addr_t	a4_orig;
+		in_addr_t	a4_anon;
+	} ac_ip4[DNSFLOW_ANON_CACHE4];
+	struct dnsflow_anon_slot6 {
+		struct in6_addr	a6_orig;
+		struct in6_addr	a6_anon;
+	} ac_ip6[DNSFLOW_ANON_CACHE6];
+};
+
+/* Per worker memory: the worker itself, its flow pkt bufs, parse scratch
+ * space, -A and -Q tables and -W rings. It's all carved out of slabs, which are
+ * on hugepages if any are reserved (vm.nr_hugepages), and normal pages
+ * otherwise, so only what gets touched is resident. Everything is
+ * allocated when the workers are set up, and it's only given back all at
+ * once, with the worker. */
+struct dnsflow_slab {
+	struct dnsflow_slab	*sl_next;
+	size_t			sl_size;
+	size_t			sl_used;	/* Including this hdr. */
+	int			sl_huge;
+};
+struct dnsflow_arena {
+	struct dnsflow_slab	*ar_slabs;	/* The one being used first. */
+	size_t			ar_mapped;	/* Bytes, in all the slabs. */
+	size_t			ar_huge;	/* Of ar_mapped. */
+};
+
+/* Lock-free single producer, single consumer ring of fixed size slots,
+ * for -W. head is only written by the producer and tail by the consumer.
+ * Each is on its own cache line, with that side's cached copy of the
+ * other one, so the two sides only share a line when the cache is
+ * stale. */
+struct dnsflow_spsc {
+	char			*sp_slots;
+	uint32_t		sp_mask;	/* Slots - 1, a power of 2. */
+	uint32_t		sp_slot_size;
+
+	uint32_t		sp_head __attribute__((aligned(64)));
+	uint32_t		sp_tail_cache;	/* Producer's */
+
+	uint32_t		sp_tail __attribute__((aligned(64)));
+	uint32_t		sp_head_cache;	/* Consumer's */
+};
+
+/* A response in a capture to parse ring. */
+struct dnsflow_pipe_rec {
+	struct timeval		pr_tv;
+	uint32_t		pr_rtt;		/* -Q */
+	in_addr_t		pr_client_ip;
+	uint16_t		pr_dns_len;
+	uint8_t			pr_client_is6;
+	struct in6_addr		pr_client6;	/* If pr_client_is6. */
+	char			pr_dns[1];	/* pr_dns_len */
+};
+
+/* What a worker does. Normally there's a single inline worker on the main
+ * event loop. With -T, each worker has its own thread, event base and
+ * dcap, and the kernel fans pkts out across them. With -W, the capture
+ * workers only get as far as the prefilter, and pass the rest on to the
+ * parse workers, which pass the flow pkts on to the export worker. */
+enum dnsflow_worker_role {
+	DNSFLOW_WORKER_INLINE,
+	DNSFLOW_WORKER_CAPTURE,
+	DNSFLOW_WORKER_PARSE,
+	DNSFLOW_WORKER_EXPORT,
+};
+static const char *dnsflow_worker_role_names[] = {
+	"inline", "capture", "parse", "export",
+};
+
+/* -n. Where the capture NIC is, from sysfs. A queue's cpu is the one its
+ * irq goes to, if it only goes to one. */
+struct dnsflow_topo {
+	int		tp_node;		/* -1 if unknown */
+	char		tp_local_list[256];	/* As in sysfs */
+	int		tp_n_local;
+	int		tp_local[DNSFLOW_MAX_CPUS];
+	int		tp_n_queues;
+	int		tp_queue_irq[DNSFLOW_MAX_WORKERS];	/* -1 if */
+	int		tp_queue_cpu[DNSFLOW_MAX_WORKERS];	/* unknown */
+};
+
+/* A piece of the -r file, for parallel processing. */
+struct dnsflow_chunk {
+	size_t			dc_start;	/* File offsets */
+	size_t			dc_end;
+	struct dnsflow_worker	*dc_dw;		/* Who processed it. */
+	int			dc_done;
+
+	/* With -O, the chunk's flow pkts, held until all the chunks before
+	 * it are sent. Each is a uint32_t length, the int32_t db_shard, the
+	 * db_dst, then the pkt from db_pkt_hdr on. */
+	char			*dc_out;
+	size_t			dc_out_len;
+	size_t			dc_out_size;
+};
+/* What's in front of each pkt in dc_out. */
+#define DNSFLOW_CHUNK_REC	(2 * sizeof(uint32_t) + sizeof(struct sockaddr_in))
+
+/* Compressed pkt state, reset with each new pkt. Table entries are
+ * offsets of the literal names in the pkt. Hash slots from previous pkts
+ * are told apart by the generation. With -k, each shard has one, and its
+ * own pkt in ps_buf. */
+struct dnsflow_pkt_state {
+	struct dnsflow_buf	*ps_buf;	/* -k only */
+	int			ps_shard;	/* -1 without -k */
+	struct sockaddr_in	ps_dst;		/* A udp ps_shard's */
+	uint32_t		ps_cname_gen;
+	int			ps_cnames_n;
+	uint16_t		ps_cname_off[DNSFLOW_CNAMES_MAX];
+	uint8_t			ps_cname_len[DNSFLOW_CNAMES_MAX];
+	struct {
+		uint32_t	gen;
+		uint16_t	idx;
+	} ps_cname_hash[DNSFLOW_CNAMES_HASH_SIZE];
+	uint32_t		ps_last_client;
+	struct in6_addr		ps_last_client6;	/* Version 4 */
+	uint32_t		ps_last_ts;		/* -L */
+};
+
+struct dnsflow_worker {
+	int			dw_id;		/* 0-based */
+	int			dw_role;	/* dnsflow_worker_role */
+	struct dnsflow_arena	dw_arena;	/* Where this came from. */
+	pthread_t		dw_thread;
+	int			dw_cpu;		/* Pinned cpu, or -1. */
+	struct event_base	*dw_ev_base;	/* NULL for the global base. */
+	struct dcap		*dw_dcap;
+	uint32_t		dw_sample_rate;	/* What dw_dcap's filter
+						   samples at. */
+	uint32_t		dw_filter_gen;	/* filter_gen dw_dcap's
+						   filter was set at. */
+
+	/* pkt building. dw_data_buf is the next unused export buf, or with
+	 * -k, the current shard's own buf. */
+	struct dnsflow_buf	*dw_data_buf;
+	struct dnsflow_pkt_state	*dw_pkt;	/* dw_pkt_one, or the
+							   current shard's */
+	struct dnsflow_pkt_state	dw_pkt_one;
+	struct dnsflow_pkt_state	*dw_shards[DNSFLOW_SHARD_MAX];	/* -k */
+	time_t			dw_last_send;
+	struct event		dw_push_ev;
+	struct timeval		dw_push_tv;
+
+	/* Export queue. Finished bufs wait here until the batch is full or
+	 * the push timer fires. */
+	struct dnsflow_buf	*dw_export_bufs[DNSFLOW_EXPORT_BATCH];
+	int			dw_export_queued;
+	struct dnsflow_chunk	*dw_chunk;	/* With -O, where finished
+						   pkts go instead. */
+
+	/* Parse scratch space. */
+	struct dns_data_set	*dw_data_set;
+	struct dns_data_set	*dw_ldns_data;	/* Only for -V */
+
+	/* Counters. Written only by this worker. */
+	uint64_t		dw_prefilter_counts[DNS_PREFILTER_MAX];
+	uint32_t		dw_parser_mismatches;
+	uint64_t		dw_export_sent;		/* pkts, per dst */
+	uint64_t		dw_export_errors;	/* failed sends */
+	uint64_t		dw_export_dropped;	/* batches */
+	uint64_t		dw_export_bytes;
+
+	/* Aggregation, NULL if not enabled. */
+	struct dnsflow_agg	*dw_agg;
+	struct dns_data_set	*dw_agg_set;	/* For emitting entries. */
+	uint32_t		dw_agg_hits;	/* Sets merged into others. */
+	uint32_t		dw_agg_evicted;
+	uint32_t		dw_agg_bypassed;	/* Too big. */
+
+	/* -a, NULL if not enabled. The worker counts into dw_topk[gen & 1]
+	 * for the last topk_gen it saw, dw_topk_gen. The other one is the
+	 * stats timer's. */
+	struct dnsflow_topk_win	*dw_topk[2];
+	uint32_t		dw_topk_gen;
+
+	/* -c, the last dsts_gen seen and the dsts list it went with, see
+	 * dnsflow_dsts_ack(). */
+	uint64_t		dw_dsts_gen;
+	struct dnsflow_dsts	*dw_dsts;
+
+	/* -Q, NULL if not enabled. Only in workers that capture. */
+	struct dnsflow_rtt	*dw_rtt;
+	uint32_t		dw_rtt_queries;
+	uint32_t		dw_rtt_matched;
+	uint32_t		dw_rtt_expired;	/* Never answered. */
+	uint32_t		dw_rtt_evicted;	/* Bucket was full. */
+
+	/* -z, NULL if not enabled. dw_anon_names is where the hashed names
+	 * go, from one set to the next. */
+	struct dnsflow_anon_cache	*dw_anon_cache;
+	uint8_t			*dw_anon_names;
+	uint64_t		dw_anon_hits;
+	uint64_t		dw_anon_misses;
+	uint64_t		dw_anon_ticks;	/* With -b */
+
+	/* -W. For capture workers, the rings to each parse worker. For
+	 * parse workers, the rings from each capture worker, and the flow
+	 * pkt bufs going to the export worker and coming back. */
+	struct dnsflow_spsc	*dw_pipe[DNSFLOW_MAX_WORKERS];
+	int			dw_pipe_n;
+	struct dnsflow_spsc	*dw_bufs_full;
+	struct dnsflow_spsc	*dw_bufs_free;
+	uint64_t		dw_pipe_overflows;	/* Flow pkts dropped,
+							   no free bufs. */
+	int			dw_pipe_done;	/* -r, all sent on. */
+
+	uint64_t		dw_drops[DNSFLOW_DROP_MAX];
+	struct hist		dw_stage_hist[DNSFLOW_STAGE_MAX];	/* -t */
+	uint64_t		dw_send_ticks;	/* Total, to take out of
+						   build. */
+};
+
+/* With -t, record the time since t in the stage's histogram, and start
+ * the next stage. */
+#define DW_STAGE_END(dw, stage, t) do {					\
+	if (stage_timing) {						\
+		uint64_t	_now = hist_ticks();			\
+		hist_add(&(dw)->dw_stage_hist[(stage)], _now - (t));	\
+		(t) = _now;						\
+	}								\
+} while (0)
+
+/* The -u dsts. Replaced as a whole on a reload, so a sender sees either
+ * the old list or the new one. */
+struct dnsflow_dsts {
+	int			ds_n;
+	struct sockaddr_in	ds_addrs[DNSFLOW_UDP_MAX_DSTS];
+
+	/* -k, each addr's shard, and the hash ring over these and the -D
+	 * collectors, sorted by point. */
+	int			ds_shards[DNSFLOW_UDP_MAX_DSTS];
+	int			ds_n_vnodes;
+	struct dnsflow_vnode {
+		uint32_t	vn_point;
+		uint32_t	vn_shard;
+	} ds_vnodes[(DNSFLOW_UDP_MAX_DSTS + DNSFLOW_TCP_MAX_DSTS) *
+		DNSFLOW_SHARD_VNODES];
+
+	/* Once it's been replaced, the dsts_gen that was bumped to, and
+	 * the list replaced before it. See dnsflow_dsts_reap(). */
+	uint64_t		ds_retired_gen;
+	struct dnsflow_dsts	*ds_retired_next;
+};
+
+/* -c. What can be changed with a SIGHUP. Settings left out of the file
+ * keep their command line values. */
+struct dnsflow_config {
+	struct dnsflow_dsts	cf_dsts;
+	uint32_t		cf_sample_min;
+	uint32_t		cf_sample_max;
+	int			cf_push_sec;
+	int			cf_stats_sec;
+	/* Empty for -f, or the default. */
+	char			cf_filter[DNSFLOW_CONFIG_FILTER_MAX];
+};
 
 /*** Globals ***/
 /* pkt building */
-static uint32_t			sequence_number = 1;
-static struct dnsflow_buf	*data_buf = NULL;
-static time_t			last_send = 0;
+static uint32_t			sequence_number = 1;	/* Shared by all
+							   workers. */
 
-static struct event		push_ev;
 static struct timeval		push_tv = {1, 0};
 
 static struct event		stats_ev;
@@ -205,7 +1044,8 @@ static struct event		check_parent_ev;
 static struct timeval		check_parent_tv = {1, 0};
 #endif
 
-static struct event		sigterm_ev, sigint_ev, sigchld_ev;
+static struct event		sigterm_ev, sigint_ev, sigchld_ev, sigusr1_ev;
+static struct event		sighup_ev;
 
 /* config */
 
@@ -215,17 +1055,190 @@ static uint16_t pcap_record_dst_port = 0;
 /* jmirror dest port (*network* byte order) - typically 30030 */
 static uint16_t jmirror_dst_port = 0;
 
-static int 			udp_num_dsts = 0;
-static struct sockaddr_in	dst_so_addrs[DNSFLOW_UDP_MAX_DSTS];
+/* Senders load dsts once per batch. A reload swaps in a new list, then
+ * bumps dsts_gen. Each worker acks the gen it's seen in between batches,
+ * and the lists it replaced are kept until every worker has acked a gen
+ * they were replaced by. */
+static struct dnsflow_dsts	dsts_cmdline;		/* -u */
+static struct dnsflow_dsts	*dsts = &dsts_cmdline;
+static struct dnsflow_dsts	*dsts_retired = NULL;
+static uint64_t			dsts_gen = 0;
+
+/* -c */
+static char			*config_file = NULL;
+static struct dnsflow_config	config_cmdline;
+
+static int			udp_socket = -1;
+
+/* For a collector on the same host. -H, a shared memory ring (see
+ * dnsflow_ring.h), and -U, a SOCK_SEQPACKET unix socket the collector
+ * listens on. The unix socket is reconnected at most once a sec, and is
+ * only used with unix_lock held. It's non-blocking, except with -r, where
+ * there's nothing to lose by waiting for the collector. */
+static struct dnsflow_ring	*export_ring = NULL;
+static char			*unix_path = NULL;
+static int			unix_socket = -1;
+static int			unix_wait = 0;
+static time_t			unix_retry = 0;
+static pthread_mutex_t		unix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* -D, tcp (optionally tls) collectors. Flow pkts are framed straight into
+ * tc_spool, and written out from there. Senders write from their own
+ * thread while the socket has room. When it doesn't, tc_stalled is set
+ * and the main loop takes over the writes until it drains; meanwhile
+ * senders only spool. Only the main loop connects and closes. All of it
+ * is with tc_lock held, except tc_up, which -k reads without it.
+ *
+ * tc_frame <= tc_head <= tc_tail index the spool. Everything before
+ * tc_head is written, and tc_frame is where the frame tc_head is in
+ * starts, so a reconnect can start over from a whole frame. */
+enum dnsflow_tcp_state {
+	DNSFLOW_TCP_DOWN,		/* Waiting for tc_retry_ev. */
+	DNSFLOW_TCP_CONNECTING,		/* Including the tls handshake. */
+	DNSFLOW_TCP_UP,
+	DNSFLOW_TCP_FAILED,		/* By a sender, main loop to close. */
+};
+struct dnsflow_tcp {
+	struct sockaddr_in	tc_addr;
+	char			tc_name[INET_ADDRSTRLEN + 8];	/* ip:port */
+	int			tc_drop_new;	/* Full spool, drop the new
+						   frame instead of the oldest */
+	int			tc_wait;	/* -r, blocking, no events */
+	pthread_mutex_t		tc_lock;
+	int			tc_up;		/* Not since it was lost */
+	int			tc_fd;
+	int			tc_state;
+	int			tc_stalled;
+	int			tc_backoff;	/* sec */
+	int			tc_wake[2];	/* Senders to the main loop */
+	struct event		tc_wake_ev;
+	struct event		tc_read_ev;
+	struct event		tc_write_ev;
+	struct event		tc_retry_ev;
+
+	uint8_t			*tc_spool;
+	uint64_t		tc_mask;
+	uint64_t		tc_frame;
+	uint64_t		tc_head;
+	uint64_t		tc_tail;
+
+	uint32_t		tc_sent;	/* Frames */
+	uint32_t		tc_dropped;
+	uint32_t		tc_stalls;
+	uint32_t		tc_connects;
+#if DNSFLOW_TLS
+	SSL_CTX			*tc_tls_ctx;
+	SSL			*tc_ssl;
+	int			tc_tls_len;	/* SSL_write() to repeat */
+	int			tc_tls_want;	/* And what it's waiting for */
+#endif
+};
+static struct dnsflow_tcp	*tcp_exports[DNSFLOW_TCP_MAX_DSTS];
+static int			n_tcp_exports = 0;
+static char			*tcp_ca_file = NULL;	/* -e */
+
+/* -k. Each set goes to one dst, by client. Each shard numbers its own
+ * pkts, so every dst sees a sequence without gaps. */
+static int			shard_export = 0;
+static uint32_t			shard_seqs[DNSFLOW_SHARD_MAX];
+
+/* -a. The stats timer merges and empties each worker's idle sketches,
+ * then bumps topk_gen. A worker that sees the new gen switches to the ones
+ * that were just emptied, and leaves what it had for the next timer, so
+ * neither side locks. Windows are between bumps: the merged one from
+ * topk_last to topk_start, and since then, the current one. */
+static uint32_t			topk_gen = 0;
+static time_t			topk_start, topk_last;
+
+/* Flow pkt size. With -G, this is also the UDP_SEGMENT size. */
+static int			pkt_target_size = DNSFLOW_PKT_TARGET_SIZE;
+static int			pkt_sets_max = DNSFLOW_SETS_COUNT_MAX;
+/* Room in each flow pkt buf, from db_pkt_hdr on. */
+static uint32_t			pkt_buf_max;
+static int			udp_gso_size = 0;	/* 0 if not using gso */
+static int			export_compress = 0;	/* v3 data sets */
+static int			enable_ip6 = 0;		/* -6, v4 data sets */
+/* -E. dcap takes off any number of vlan tags, but the filter only
+ * matches this many. */
+static int			decap_flags = 0;	/* DCAP_DECAP_ */
+static int			vlan_depth = 1;
+static int			mpls_depth = 0;
+static uint32_t			agg_n_entries = 0;	/* 0 if disabled */
+static int			agg_window = 1;		/* sec */
+static uint32_t			rtt_n_buckets = 0;	/* 0 if disabled */
+static int			topk_n = 0;		/* -a, 0 if disabled */
+static struct dnsflow_anon	*anon = NULL;		/* -z */
+static int			anon_keep_labels = -1;	/* -1, leave names */
+static int			rtt_timeout = DNSFLOW_RTT_TIMEOUT;	/* ms */
+static int			stage_timing = 0;
+static int			stats_v3 = 0;		/* -B */
+static int			bench_loops = 0;	/* -b */
+static int			offline_ordered = 0;	/* -O */
+
+static int			dns_parser = DNSFLOW_PARSER_NATIVE;
+static int			ttl_mode = DNSFLOW_TTL_NONE;	/* -L */
+
+/* Sampling. sample_rate is the current rate, 0 or 1 for none. With
+ * adaptive sampling (sample_rate_max != 0), the main thread moves it
+ * between sample_rate_min and sample_rate_max, and the workers pick it up
+ * in their push timer. */
+static uint32_t			sample_rate = 0;
+static uint32_t			sample_rate_min = 0;
+static uint32_t			sample_rate_max = 0;
+static int			sample_qname = 0;	/* -q */
+
+/* How the default filter was built, to rebuild it with a new sample rate.
+ * Unused with -f. build_pcap_filter() returns a static buf, so after
+ * startup, only call it with filter_lock held.
+ *
+ * A reload that changes the filter sets filter_default and filter_user
+ * under filter_lock, then bumps filter_gen. The workers set the new one
+ * on their own dcap in their push timer. */
+static int			filter_default = 0;
+static char			*filter_cmdline = NULL;	/* -f */
+static char			*filter_user = NULL;	/* -f or -c */
+static uint32_t			filter_gen = 0;
+static int			filter_fixed = 0;	/* -x */
+static struct {
+	int		encap_offset;
+	int		proc_i;
+	int		n_procs;
+	int		enable_mdns;
+} filter_args;
+static pthread_mutex_t		filter_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static pcap_t			*pc_dump = NULL;
 static pcap_dumper_t		*pdump = NULL;
+static pthread_mutex_t		pdump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dnsflow_worker	*workers[DNSFLOW_MAX_WORKERS];
+static int			n_workers = 0;
+
+/* -W */
+static int			pipe_threads = 0;	/* 0 if not pipelined */
+static uint32_t			pipe_slots = DNSFLOW_PIPE_SLOTS;
+static struct dnsflow_worker	*pipe_parsers[DNSFLOW_PIPE_MAX];
+static int			n_pipe_parsers = 0;
+static int			pipe_wait = 0;	/* -r, wait for room in the
+						   rings instead of dropping */
+static int			pipe_eof = 0;	/* -r, capture is finished */
+
+/* Parallel -r */
+static struct dnsflow_chunk	*chunks = NULL;
+static int			n_chunks = 0;
+static int			chunks_next = 0;	/* Next to process */
+static int			chunks_sent = 0;	/* -O, next to send */
+static pthread_mutex_t		chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		chunks_cond = PTHREAD_COND_INITIALIZER;
 
 #define MAX_MPROC_CHILDREN	64
 static pid_t			mproc_children[MAX_MPROC_CHILDREN];
 static int			n_mproc_children = 0;
 static pid_t			my_pid;
 
+/* Only defined when linked with alloc_count.c, see make bench. */
+uint64_t dnsflow_alloc_count(void) __attribute__((weak));
+
 
 static void
 _log(const char *format, ...)
@@ -249,21 +1262,471 @@ jitter_tv(struct timeval *tv)
 	return (tv);
 }
 
+static uint32_t
+dnsflow_next_seq(void)
+{
+	return (__sync_fetch_and_add(&sequence_number, 1));
+}
+
+/* With -k, a shard's pkts are numbered on their own. */
+static uint32_t
+dnsflow_shard_seq(int shard)
+{
+	if (shard < 0) {
+		return (dnsflow_next_seq());
+	}
+	return (__sync_add_and_fetch(&shard_seqs[shard], 1));
+}
+
+/* A slab of at least size bytes, zeroed. */
+static struct dnsflow_slab *
+dnsflow_slab_new(size_t size)
+{
+	struct dnsflow_slab	*sl;
+	void			*p = MAP_FAILED;
+	int			huge = 0;
+
+	size = (size + DNSFLOW_SLAB_SIZE - 1) & ~(size_t)(DNSFLOW_SLAB_SIZE - 1);
+#ifdef MAP_HUGETLB
+	/* Fails straight away if there aren't enough reserved. */
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	huge = p != MAP_FAILED;
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			err(1, "mmap");
+		}
+	}
+	sl = p;
+	sl->sl_size = size;
+	sl->sl_used = (sizeof(struct dnsflow_slab) + DNSFLOW_ARENA_ALIGN - 1) &
+		~(size_t)(DNSFLOW_ARENA_ALIGN - 1);
+	sl->sl_huge = huge;
+	return (sl);
+}
+
+/* Zeroed, and cache line aligned. Never fails. */
+static void *
+dnsflow_arena_alloc(struct dnsflow_arena *ar, size_t size)
+{
+	struct dnsflow_slab	*sl = ar->ar_slabs;
+	void			*p;
+
+	size = (size + DNSFLOW_ARENA_ALIGN - 1) &
+		~(size_t)(DNSFLOW_ARENA_ALIGN - 1);
+	if (sl == NULL || sl->sl_size - sl->sl_used < size) {
+		sl = dnsflow_slab_new(DNSFLOW_ARENA_ALIGN + size);
+		ar->ar_mapped += sl->sl_size;
+		if (sl->sl_huge) {
+			ar->ar_huge += sl->sl_size;
+		}
+		if (ar->ar_slabs != NULL && sl->sl_size - sl->sl_used - size <
+		    ar->ar_slabs->sl_size - ar->ar_slabs->sl_used) {
+			/* A big one. Keep using the current slab for the
+			 * small ones. */
+			sl->sl_next = ar->ar_slabs->sl_next;
+			ar->ar_slabs->sl_next = sl;
+		} else {
+			sl->sl_next = ar->ar_slabs;
+			ar->ar_slabs = sl;
+		}
+	}
+	p = (char *)sl + sl->sl_used;
+	sl->sl_used += size;
+	return (p);
+}
+
+static void
+dnsflow_arena_free(struct dnsflow_arena *ar)
+{
+	struct dnsflow_slab	*sl, *next;
+
+	for (sl = ar->ar_slabs; sl != NULL; sl = next) {
+		next = sl->sl_next;
+		munmap(sl, sl->sl_size);
+	}
+	bzero(ar, sizeof(struct dnsflow_arena));
+}
+
+/* n_slots is rounded up to a power of 2. */
+static struct dnsflow_spsc *
+dnsflow_spsc_new(struct dnsflow_arena *ar, uint32_t n_slots,
+		uint32_t slot_size)
+{
+	struct dnsflow_spsc	*sp;
+	uint32_t		n = 1;
+
+	while (n < n_slots) {
+		n <<= 1;
+	}
+	sp = dnsflow_arena_alloc(ar, sizeof(struct dnsflow_spsc));
+	sp->sp_slots = dnsflow_arena_alloc(ar, (size_t)n * slot_size);
+	sp->sp_mask = n - 1;
+	sp->sp_slot_size = slot_size;
+	return (sp);
+}
+
+/* Producer. Returns the next free slot, or NULL if the ring is full. Fill
+ * it in, then dnsflow_spsc_push(). */
+static inline void *
+dnsflow_spsc_slot(struct dnsflow_spsc *sp)
+{
+	if (sp->sp_head - sp->sp_tail_cache > sp->sp_mask) {
+		sp->sp_tail_cache = __atomic_load_n(&sp->sp_tail,
+				__ATOMIC_ACQUIRE);
+		if (sp->sp_head - sp->sp_tail_cache > sp->sp_mask) {
+			return (NULL);
+		}
+	}
+	return (sp->sp_slots +
+			(size_t)(sp->sp_head & sp->sp_mask) * sp->sp_slot_size);
+}
+
+static inline void
+dnsflow_spsc_push(struct dnsflow_spsc *sp)
+{
+	__atomic_store_n(&sp->sp_head, sp->sp_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer. Returns the oldest full slot, or NULL if the ring is empty.
+ * dnsflow_spsc_pop() when done with it. */
+static inline void *
+dnsflow_spsc_peek(struct dnsflow_spsc *sp)
+{
+	if (sp->sp_tail == sp->sp_head_cache) {
+		sp->sp_head_cache = __atomic_load_n(&sp->sp_head,
+				__ATOMIC_ACQUIRE);
+		if (sp->sp_tail == sp->sp_head_cache) {
+			return (NULL);
+		}
+	}
+	return (sp->sp_slots +
+			(size_t)(sp->sp_tail & sp->sp_mask) * sp->sp_slot_size);
+}
+
+static inline void
+dnsflow_spsc_pop(struct dnsflow_spsc *sp)
+{
+	__atomic_store_n(&sp->sp_tail, sp->sp_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Slots in use. From any thread, so only a snapshot. tail first, so it's
+ * never ahead of head. */
+static uint32_t
+dnsflow_spsc_used(struct dnsflow_spsc *sp)
+{
+	uint32_t	tail;
+
+	tail = __atomic_load_n(&sp->sp_tail, __ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&sp->sp_head, __ATOMIC_ACQUIRE) - tail);
+}
+
+/* Picks the parse worker for a client key. Not the sampling hash, or with
+ * both -s and -W, the sampled clients could all land on a few workers.
+ * (The murmur3 finalizer.) */
+static inline uint32_t
+dnsflow_pipe_hash(uint32_t key)
+{
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+	return (key);
+}
+
+/* Back off when a pipeline thread has nothing to do: poll for a while,
+ * then sleep between polls. n is what the last poll found. */
+static void
+dnsflow_pipe_idle(int n, int *idle)
+{
+	if (n > 0) {
+		*idle = 0;
+	} else if (*idle < DNSFLOW_PIPE_SPINS) {
+		(*idle)++;
+	} else {
+		usleep(DNSFLOW_PIPE_SLEEP_US);
+	}
+}
+
+/* Counters only written by their own worker are read with this, from any
+ * thread. */
+#define DW_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* Sum the capture stats of all the workers into ds. */
+static void
+dnsflow_get_stats(struct dcap_stat *ds)
+{
+	struct dcap_stat	wds;
+	int			i;
+
+	bzero(ds, sizeof(struct dcap_stat));
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i]->dw_dcap == NULL) {
+			continue;
+		}
+		/* On linux, pcap_stats() is just a getsockopt. */
+		dcap_get_stats(workers[i]->dw_dcap, &wds);
+		ds->ps_valid |= wds.ps_valid;
+		ds->ps_recv += wds.ps_recv;
+		ds->ps_drop += wds.ps_drop;
+		ds->ps_ifdrop += wds.ps_ifdrop;
+		ds->captured += wds.captured;
+		ds->truncated += wds.truncated;
+		ds->runts += wds.runts;
+		ds->not_ip += wds.not_ip;
+		ds->ring_blocks_used += wds.ring_blocks_used;
+		ds->ring_blocks_count += wds.ring_blocks_count;
+	}
+}
+
+/* Sum of the drop counters and stage histograms over all workers. The
+ * drops made in dcap come from ds, see dnsflow_get_stats(). */
+static void
+dnsflow_get_worker_stats(struct dcap_stat *ds, uint64_t *drops,
+		struct hist *hists)
+{
+	int		i, j;
+
+	bzero(drops, DNSFLOW_DROP_MAX * sizeof(uint64_t));
+	bzero(hists, DNSFLOW_STAGE_MAX * sizeof(struct hist));
+	drops[DNSFLOW_DROP_TRUNCATED] = ds->truncated;
+	drops[DNSFLOW_DROP_RUNT] = ds->runts;
+	drops[DNSFLOW_DROP_UNKNOWN_ENCAP] = ds->not_ip;
+	for (i = 0; i < n_workers; i++) {
+		for (j = 0; j < DNSFLOW_DROP_MAX; j++) {
+			drops[j] += DW_LOAD(workers[i]->dw_drops[j]);
+		}
+		if (!stage_timing) {
+			continue;
+		}
+		for (j = 0; j < DNSFLOW_STAGE_MAX; j++) {
+			hist_merge(&hists[j], &workers[i]->dw_stage_hist[j]);
+		}
+	}
+}
+
+/* -D, a tcp collector's spool and counters. */
+static void
+dnsflow_get_tcp_stats(struct dnsflow_tcp *tc, struct dnsflow_stats_export *ex)
+{
+	pthread_mutex_lock(&tc->tc_lock);
+	ex->queued = tc->tc_tail - tc->tc_frame;
+	ex->size = MIN(tc->tc_mask + 1, UINT32_MAX);
+	ex->sent = tc->tc_sent;
+	ex->dropped = tc->tc_dropped;
+	ex->stalls = tc->tc_stalls;
+	ex->connects = tc->tc_connects;
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+/* -W ring usage, summed over all the rings at each stage. */
+static void
+dnsflow_get_pipe_stats(struct dnsflow_pipe_stat *pipes)
+{
+	struct dnsflow_worker	*dw;
+	int			i, j;
+
+	bzero(pipes, DNSFLOW_PIPE_STAGE_MAX * sizeof(*pipes));
+	for (i = 0; i < n_workers; i++) {
+		pipes[DNSFLOW_PIPE_PARSE].pt_overflows +=
+			DW_LOAD(workers[i]->dw_drops[DNSFLOW_DROP_PIPE]);
+	}
+	for (i = 0; i < n_pipe_parsers; i++) {
+		dw = pipe_parsers[i];
+		for (j = 0; j < dw->dw_pipe_n; j++) {
+			pipes[DNSFLOW_PIPE_PARSE].pt_used +=
+				dnsflow_spsc_used(dw->dw_pipe[j]);
+			pipes[DNSFLOW_PIPE_PARSE].pt_size +=
+				dw->dw_pipe[j]->sp_mask + 1;
+		}
+		pipes[DNSFLOW_PIPE_EXPORT].pt_used +=
+			dnsflow_spsc_used(dw->dw_bufs_full);
+		pipes[DNSFLOW_PIPE_EXPORT].pt_size +=
+			DNSFLOW_PIPE_BUFS + DNSFLOW_EXPORT_BATCH;
+		pipes[DNSFLOW_PIPE_EXPORT].pt_overflows +=
+			DW_LOAD(dw->dw_pipe_overflows);
+	}
+}
+
+/* -B. A worker's counters, with the ones dcap keeps for it. Each is read
+ * atomically, but together they're not a snapshot of one moment. Also the
+ * ring usage, see the v3 stats format. */
+static void
+dnsflow_get_counters(struct dnsflow_worker *dw, struct dnsflow_counters *ct,
+		uint32_t *ring_used, uint32_t *ring_size)
+{
+	struct dcap_stat	ds;
+	int			i;
+
+	bzero(ct, sizeof(*ct));
+	*ring_used = *ring_size = 0;
+	if (dw->dw_dcap != NULL) {
+		dcap_get_stats(dw->dw_dcap, &ds);
+		ct->ct_captured = ds.captured;
+		ct->ct_received = ds.ps_recv;
+		ct->ct_dropped = ds.ps_drop;
+		ct->ct_ifdropped = ds.ps_ifdrop;
+		ct->ct_drops[DNSFLOW_DROP_TRUNCATED] = ds.truncated;
+		ct->ct_drops[DNSFLOW_DROP_RUNT] = ds.runts;
+		ct->ct_drops[DNSFLOW_DROP_UNKNOWN_ENCAP] = ds.not_ip;
+		*ring_used = ds.ring_blocks_used;
+		*ring_size = ds.ring_blocks_count;
+	} else if (dw->dw_role == DNSFLOW_WORKER_PARSE) {
+		for (i = 0; i < dw->dw_pipe_n; i++) {
+			*ring_used += dnsflow_spsc_used(dw->dw_pipe[i]);
+			*ring_size += dw->dw_pipe[i]->sp_mask + 1;
+		}
+	}
+	ct->ct_export_sent = DW_LOAD(dw->dw_export_sent);
+	ct->ct_export_bytes = DW_LOAD(dw->dw_export_bytes);
+	ct->ct_export_errors = DW_LOAD(dw->dw_export_errors);
+	ct->ct_export_dropped = DW_LOAD(dw->dw_export_dropped);
+	for (i = 0; i < DNSFLOW_DROP_MAX; i++) {
+		ct->ct_drops[i] += DW_LOAD(dw->dw_drops[i]);
+	}
+	for (i = 0; i < DNS_PREFILTER_MAX; i++) {
+		ct->ct_prefilter[i] = DW_LOAD(dw->dw_prefilter_counts[i]);
+	}
+}
+
 static void
 dnsflow_print_stats(struct dcap_stat *ds)
 {
-	_log("%u packets captured", ds->captured);
+	static struct hist	hists[DNSFLOW_STAGE_MAX];
+	uint64_t		drops[DNSFLOW_DROP_MAX];
+	struct dnsflow_pipe_stat	pipes[DNSFLOW_PIPE_STAGE_MAX];
+	struct dnsflow_stats_export	ex;
+	char		buf[512];
+	uint64_t	counts[DNS_PREFILTER_MAX];
+	uint32_t	mismatches = 0;
+	uint64_t	sent = 0, errors = 0, dropped = 0;
+	uint32_t	agg_hits = 0, agg_evicted = 0, agg_bypassed = 0;
+	uint32_t	rtt_queries = 0, rtt_matched = 0, rtt_expired = 0;
+	uint32_t	rtt_evicted = 0;
+	uint64_t	anon_hits = 0, anon_misses = 0;
+	size_t		mapped = 0, huge = 0;
+	int		i, j, len = 0;
+
+	bzero(counts, sizeof(counts));
+	for (i = 0; i < n_workers; i++) {
+		mapped += DW_LOAD(workers[i]->dw_arena.ar_mapped);
+		huge += DW_LOAD(workers[i]->dw_arena.ar_huge);
+		for (j = 0; j < DNS_PREFILTER_MAX; j++) {
+			counts[j] += DW_LOAD(workers[i]->
+					dw_prefilter_counts[j]);
+		}
+		mismatches += DW_LOAD(workers[i]->dw_parser_mismatches);
+		sent += DW_LOAD(workers[i]->dw_export_sent);
+		errors += DW_LOAD(workers[i]->dw_export_errors);
+		dropped += DW_LOAD(workers[i]->dw_export_dropped);
+		agg_hits += DW_LOAD(workers[i]->dw_agg_hits);
+		agg_evicted += DW_LOAD(workers[i]->dw_agg_evicted);
+		agg_bypassed += DW_LOAD(workers[i]->dw_agg_bypassed);
+		rtt_queries += DW_LOAD(workers[i]->dw_rtt_queries);
+		rtt_matched += DW_LOAD(workers[i]->dw_rtt_matched);
+		rtt_expired += DW_LOAD(workers[i]->dw_rtt_expired);
+		rtt_evicted += DW_LOAD(workers[i]->dw_rtt_evicted);
+		anon_hits += DW_LOAD(workers[i]->dw_anon_hits);
+		anon_misses += DW_LOAD(workers[i]->dw_anon_misses);
+	}
+
+	_log("%llu packets captured", (unsigned long long)ds->captured);
 	if (ds->ps_valid) {
-		_log("%u packets received by filter", ds->ps_recv);
-		_log("%u packets dropped by kernel", ds->ps_drop);
-		_log("%u packets dropped by interface", ds->ps_ifdrop);
+		_log("%llu packets received by filter",
+				(unsigned long long)ds->ps_recv);
+		_log("%llu packets dropped by kernel",
+				(unsigned long long)ds->ps_drop);
+		_log("%llu packets dropped by interface",
+				(unsigned long long)ds->ps_ifdrop);
+	}
+	if (ds->ring_blocks_count != 0) {
+		_log("%u/%u ring blocks in use", ds->ring_blocks_used,
+				ds->ring_blocks_count);
+	}
+	if (sample_rate > 1 || sample_rate_max != 0) {
+		_log("sample_rate %u", sample_rate);
+	}
+	if (pipe_threads > 0) {
+		dnsflow_get_pipe_stats(pipes);
+		_log("pipe: parse rings %u/%u in use, %llu dropped; "
+			"export bufs %u/%u in use, %llu dropped",
+			pipes[DNSFLOW_PIPE_PARSE].pt_used,
+			pipes[DNSFLOW_PIPE_PARSE].pt_size,
+			(unsigned long long)
+			pipes[DNSFLOW_PIPE_PARSE].pt_overflows,
+			pipes[DNSFLOW_PIPE_EXPORT].pt_used,
+			pipes[DNSFLOW_PIPE_EXPORT].pt_size,
+			(unsigned long long)
+			pipes[DNSFLOW_PIPE_EXPORT].pt_overflows);
+	}
+	for (i = 0; i < DNS_PREFILTER_MAX; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, " %s=%llu",
+				dns_prefilter_names[i],
+				(unsigned long long)counts[i]);
+	}
+	_log("dns pre-filter:%s", buf);
+	if (dns_parser == DNSFLOW_PARSER_VERIFY) {
+		_log("%u dns parser mismatches", mismatches);
+	}
+	dnsflow_get_worker_stats(ds, drops, hists);
+	for (i = 0, len = 0; i < DNSFLOW_DROP_MAX; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, " %s=%llu",
+				dnsflow_drop_names[i],
+				(unsigned long long)drops[i]);
+	}
+	_log("drops:%s", buf);
+	for (i = 0; stage_timing && i < DNSFLOW_STAGE_MAX; i++) {
+		/* Since startup. */
+		_log("stage %s: n=%u p50=%.0fns p99=%.0fns p999=%.0fns",
+			dnsflow_stage_names[i], hist_count(&hists[i]),
+			hist_ticks_to_ns(hist_percentile(&hists[i], 50)),
+			hist_ticks_to_ns(hist_percentile(&hists[i], 99)),
+			hist_ticks_to_ns(hist_percentile(&hists[i], 99.9)));
+	}
+
+	_log("export: sent=%llu send_errors=%llu dropped_batches=%llu",
+			(unsigned long long)sent, (unsigned long long)errors,
+			(unsigned long long)dropped);
+	if (export_ring != NULL) {
+		_log("ring: used=%lluKB size=%lluKB full=%llu",
+			(unsigned long long)(export_ring->r_hdr->rh_head -
+				export_ring->r_hdr->rh_tail) / 1024,
+			(unsigned long long)export_ring->r_hdr->rh_size / 1024,
+			(unsigned long long)dnsflow_ring_drops(export_ring));
+	}
+	for (i = 0; i < n_tcp_exports; i++) {
+		dnsflow_get_tcp_stats(tcp_exports[i], &ex);
+		_log("tcp %s: queued=%uKB spool=%uKB sent=%u dropped=%u "
+				"stalls=%u connects=%u", tcp_exports[i]->tc_name,
+				ex.queued / 1024, ex.size / 1024, ex.sent,
+				ex.dropped, ex.stalls, ex.connects);
+	}
+	if (agg_n_entries > 0) {
+		_log("aggregation: hits=%u evicted=%u bypassed=%u",
+				agg_hits, agg_evicted, agg_bypassed);
 	}
+	if (rtt_n_buckets > 0) {
+		_log("queries: parked=%u matched=%u expired=%u evicted=%u",
+				rtt_queries, rtt_matched, rtt_expired,
+				rtt_evicted);
+	}
+	if (anon != NULL) {
+		_log("anonymise: cache hits=%llu misses=%llu",
+				(unsigned long long)anon_hits,
+				(unsigned long long)anon_misses);
+	}
+	_log("memory: %zu KB in worker slabs, %zu KB of it on hugepages",
+			mapped / 1024, huge / 1024);
 }
 
 static void
-clean_exit(struct dcap *dcap)
+clean_exit(void)
 {
-	struct dcap_stat		*ds;
+	struct dcap_stat		ds[1];
 	int				i;
 
 	if (n_mproc_children != 0) {
@@ -274,9 +1737,11 @@ clean_exit(struct dcap *dcap)
 	}
 
 	_log("Shutting down.");
-	ds = dcap_get_stats(dcap);
+	dnsflow_get_stats(ds);
 	dnsflow_print_stats(ds);
 	if (pdump != NULL) {
+		/* Workers may still be running. Left locked until exit. */
+		pthread_mutex_lock(&pdump_lock);
 		pcap_dump_close(pdump);
 		pcap_close(pc_dump);
 	}
@@ -288,12 +1753,10 @@ clean_exit(struct dcap *dcap)
 static void
 check_parent_cb(int fd, short event, void *arg) 
 {
-	struct dcap			*dcap = (struct dcap *)arg;
-
 	if (getppid() == 1) {
 		/* orphaned */
 		_log("parent exited");
-		clean_exit(dcap);
+		clean_exit();
 	}
 	evtimer_add(&check_parent_ev, &check_parent_tv);
 }
@@ -302,7 +1765,7 @@ check_parent_cb(int fd, short event, void *arg)
 /* When running in multi-proc mode, if the parent dies, want to make sure the
  * children exit. */
 static void
-check_parent_setup(struct dcap *dcap)
+check_parent_setup(void)
 {
 #if __linux__
 	/* Linux provides a more efficient way to check for parent exit. */
@@ -311,7 +1774,7 @@ check_parent_setup(struct dcap *dcap)
 	}
 #else
 	bzero(&check_parent_ev, sizeof(check_parent_ev));
-	evtimer_set(&check_parent_ev, check_parent_cb, dcap);
+	evtimer_set(&check_parent_ev, check_parent_cb, NULL);
 	evtimer_add(&check_parent_ev, &check_parent_tv);
 #endif
 }
@@ -344,90 +1807,839 @@ mproc_fork(int num_procs)
 	return (1);
 }
 
-/* encap_offset is the number of bytes between the end of the udp header
- * and the start of the encapsulated ip header.
- * Ie., the length of foo bar: ip udp (foo bar) ip udp dns
- * 
- * proc_i and num_procs use 1-based numbering.
- * */
-static char *
-build_pcap_filter(int encap_offset, int proc_i, int num_procs, int enable_mdns)
+/* Parse a list of cpus, in the same format as the kernel's cpulist files.
+ * E.g., "0,2,4-7".
+ * Returns the number of cpus, or -1 on error. */
+static int
+parse_cpu_list(const char *str, int *cpus, int max_cpus)
 {
-	/* Note: according to pcap-filter(7), udp offsets only work for ipv4.
-	 * (Would have to use ip6 offsets.) */
-
-	/* Offsets from start of udp. */
-	int udp_offset = 0;	/* Offset from udp to encap udp. */
-	/* Label offsets used. */
-	int src_port_offset = 0;
-	int dns_flags_offset = 10;
-
-	/* Offsets from start of ip. */
-	int ip_offset = 0;	/* Offset from ip to encap ip. */
-	/* Label offsets used. */
-	int dst_ip_offset = 16;
+	const char	*p = str;
+	char		*end;
+	long		first, last;
+	int		n = 0;
+
+	while (*p != '\0') {
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0) {
+			return (-1);
+		}
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first) {
+				return (-1);
+			}
+		}
+		for (; first <= last; first++) {
+			if (n == max_cpus) {
+				return (-1);
+			}
+			cpus[n++] = first;
+		}
+		p = end;
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0' && *p != '\n') {
+			return (-1);
+		} else {
+			break;
+		}
+	}
+	return (n);
+}
 
-	/* Buffers to build pcap filter */
-	char port_filter[1024];
-	char dns_resp_filter[1024];
-	char multi_proc_filter[1024];
-	/* The final filter returned in static buf. */
-	static char full_filter_ret[1024];
+/* The first line of a small file, like the ones in sysfs and procfs,
+ * without the newline. Returns -1 if it can't be read. */
+static int
+read_first_line(const char *path, char *buf, size_t len)
+{
+	FILE		*fp;
+	int		rv = -1;
 
-	if (encap_offset != 0) {
-		/* udp, encap, ip, udp */
-		udp_offset = sizeof(struct udphdr) + encap_offset +
-			sizeof(struct ip);
-		/* ip, udp, encap, ip */
-		ip_offset = sizeof(struct ip) + sizeof(struct udphdr) +
-			encap_offset;
+	if ((fp = fopen(path, "r")) == NULL) {
+		return (-1);
 	}
+	if (fgets(buf, len, fp) != NULL) {
+		buf[strcspn(buf, "\n")] = '\0';
+		rv = 0;
+	}
+	fclose(fp);
+	return (rv);
+}
 
-	/* Port filter - Match src port 53 (and optionally 5353). */
-	if (enable_mdns) {
-		snprintf(port_filter, sizeof(port_filter),
-			"(udp[%d:2] = 53 or udp[%d:2] = 5353)",
-			src_port_offset + udp_offset,
-			src_port_offset + udp_offset);
-	} else {
-		snprintf(port_filter, sizeof(port_filter),
-			"udp[%d:2] = 53", src_port_offset + udp_offset);
+/* The numa node a cpu is on, or -1. */
+static int
+dnsflow_cpu_node(int cpu)
+{
+	char		path[64];
+	DIR		*dir;
+	struct dirent	*de;
+	int		node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL) {
+		return (-1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "node", 4) == 0 &&
+		    isdigit((unsigned char)de->d_name[4])) {
+			node = atoi(de->d_name + 4);
+			break;
+		}
 	}
+	closedir(dir);
+	return (node);
+}
 
-	/* Base dns filter - combine port and flag filters. */
-	/* Match valid recursive response flags.
-	 * qr=1, rd=1, ra=1, rcode=0.
-	 * XXX Could also pull out just A/AAAA. */
-	snprintf(dns_resp_filter, sizeof(dns_resp_filter),
-			"udp and %s and udp[%d:2] & 0x8187 = 0x8180",
-			port_filter, dns_flags_offset + udp_offset);
+/* The rx queue an irq is for, from its name in /proc/interrupts. Drivers
+ * name them differently, e.g. eth0-TxRx-3, i40e-eth0-TxRx-3, eth0-rx-3,
+ * mlx5_comp3@pci:0000:03:00.0 or virtio0-input.3, but the queue is the
+ * number at the end. -1 if it isn't an rx queue's. */
+static int
+dnsflow_irq_queue(const char *name)
+{
+	char		lower[128];
+	const char	*p, *end;
+	int		i;
 
-	if (num_procs > 1) {
-		/* Add multi-proc filter.
-		 * Select based on mod of client ip.  Probably never a problem,
-		 * but doing offset from ip, so ip options will break view into
-		 * encap.
-		 * Using the client ip as the load balance key. Useful to keep
-		 * each client in same stream. Another possibility would be
-		 * the udp checksum, assuming it's set.  */
-		snprintf(multi_proc_filter, sizeof(multi_proc_filter),
-			"%s and ip[%d:4] - ip[%d:4] / %u * %u = %u",
-			dns_resp_filter, dst_ip_offset + ip_offset,
-			dst_ip_offset + ip_offset, num_procs, num_procs,
-			proc_i - 1);
-	} else {
-		/* Just copy base dns filter. */
-		snprintf(multi_proc_filter, sizeof(multi_proc_filter),
-				"%s", dns_resp_filter);
+	for (i = 0; name[i] != '\0' && i < sizeof(lower) - 1; i++) {
+		lower[i] = tolower((unsigned char)name[i]);
 	}
+	lower[i] = '\0';
+	if (strstr(lower, "rx") == NULL && strstr(lower, "comp") == NULL &&
+	    strstr(lower, "input") == NULL) {
+		return (-1);
+	}
+	if ((end = strchr(name, '@')) == NULL) {
+		end = name + strlen(name);
+	}
+	for (p = end; p > name && isdigit((unsigned char)p[-1]); p--)
+		;
+	return (p == end ? -1 : atoi(p));
+}
+
+/* Whether an irq's name has the interface's in it as a whole word, so
+ * eth1 isn't taken for eth10. */
+static int
+dnsflow_irq_named(const char *name, const char *intf_name)
+{
+	size_t		len = strlen(intf_name);
+	const char	*p;
+
+	for (p = name; len > 0 && (p = strstr(p, intf_name)) != NULL; p++) {
+		if ((p == name || !isalnum((unsigned char)p[-1])) &&
+		    !isalnum((unsigned char)p[len])) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/* Add the irqs in an msi_irqs dir to irqs. */
+static int
+dnsflow_msi_irqs(const char *path, int *irqs, int n, int max)
+{
+	DIR		*dir;
+	struct dirent	*de;
+
+	if ((dir = opendir(path)) == NULL) {
+		return (n);
+	}
+	while (n < max && (de = readdir(dir)) != NULL) {
+		if (isdigit((unsigned char)de->d_name[0])) {
+			irqs[n++] = atoi(de->d_name);
+		}
+	}
+	closedir(dir);
+	return (n);
+}
+
+/* Find each rx queue's irq, and the cpu it goes to. The irqs are the
+ * NIC's msi irqs (or for virtio, its pci device's), and any others named
+ * after the interface. */
+static void
+dnsflow_topo_queues(const char *intf_name, struct dnsflow_topo *tp)
+{
+	char		path[256], *line = NULL, *name, *end;
+	size_t		line_len = 0;
+	FILE		*fp;
+	int		irqs[4096], cpus[DNSFLOW_MAX_CPUS];
+	int		n_irqs = 0, irq, q, i, n, mine;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs",
+			intf_name);
+	n_irqs = dnsflow_msi_irqs(path, irqs, n_irqs, 4096);
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/../msi_irqs",
+			intf_name);
+	n_irqs = dnsflow_msi_irqs(path, irqs, n_irqs, 4096);
+
+	if ((fp = fopen("/proc/interrupts", "r")) == NULL) {
+		return;
+	}
+	while (getline(&line, &line_len, fp) > 0) {
+		irq = strtol(line, &end, 10);
+		if (end == line || *end != ':') {
+			continue;
+		}
+		/* The name is the last field. */
+		end = line + strlen(line);
+		while (end > line && isspace((unsigned char)end[-1])) {
+			*--end = '\0';
+		}
+		for (name = end; name > line &&
+		    !isspace((unsigned char)name[-1]); name--)
+			;
+		for (i = 0, mine = dnsflow_irq_named(name, intf_name);
+		    !mine && i < n_irqs; i++) {
+			mine = irqs[i] == irq;
+		}
+		q = dnsflow_irq_queue(name);
+		if (!mine || q < 0 || q >= tp->tp_n_queues ||
+		    tp->tp_queue_irq[q] >= 0) {
+			continue;
+		}
+		tp->tp_queue_irq[q] = irq;
+		/* One that can go to any of several cpus, like the default
+		 * 0-N, doesn't say which. */
+		snprintf(path, sizeof(path),
+				"/proc/irq/%d/effective_affinity_list", irq);
+		n = read_first_line(path, line, line_len) < 0 ? -1 :
+			parse_cpu_list(line, cpus, DNSFLOW_MAX_CPUS);
+		if (n != 1) {
+			snprintf(path, sizeof(path),
+					"/proc/irq/%d/smp_affinity_list", irq);
+			n = read_first_line(path, line, line_len) < 0 ? -1 :
+				parse_cpu_list(line, cpus, DNSFLOW_MAX_CPUS);
+		}
+		if (n == 1) {
+			tp->tp_queue_cpu[q] = cpus[0];
+		}
+	}
+	free(line);
+	fclose(fp);
+}
+
+static void
+dnsflow_topo_read(const char *intf_name, struct dnsflow_topo *tp)
+{
+	char		path[256], buf[32];
+	int		i;
+
+	bzero(tp, sizeof(*tp));
+	tp->tp_node = -1;
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+			intf_name);
+	if (read_first_line(path, buf, sizeof(buf)) == 0) {
+		tp->tp_node = atoi(buf);
+	}
+
+	/* A NIC on a single node host, or a virtual one, usually says -1.
+	 * Then all the cpus are as good as each other. */
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist",
+			intf_name);
+	if (tp->tp_node < 0 || read_first_line(path, tp->tp_local_list,
+				sizeof(tp->tp_local_list)) < 0) {
+		snprintf(path, sizeof(path), tp->tp_node < 0 ?
+				"/sys/devices/system/cpu/online" :
+				"/sys/devices/system/node/node%d/cpulist",
+				tp->tp_node);
+		if (read_first_line(path, tp->tp_local_list,
+					sizeof(tp->tp_local_list)) < 0) {
+			tp->tp_local_list[0] = '\0';
+		}
+	}
+	tp->tp_n_local = parse_cpu_list(tp->tp_local_list, tp->tp_local,
+			DNSFLOW_MAX_CPUS);
+	if (tp->tp_n_local < 0) {
+		tp->tp_n_local = 0;
+	}
+
+	tp->tp_n_queues = MIN(dcap_xdp_queue_count((char *)intf_name),
+			DNSFLOW_MAX_WORKERS);
+	for (i = 0; i < DNSFLOW_MAX_WORKERS; i++) {
+		tp->tp_queue_irq[i] = tp->tp_queue_cpu[i] = -1;
+	}
+	dnsflow_topo_queues(intf_name, tp);
+}
+
+static int
+dnsflow_cpu_listed(const int *cpus, int n, int cpu)
+{
+	int		i;
+
+	for (i = 0; i < n; i++) {
+		if (cpus[i] == cpu) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+/* -n without -K. Capture worker i goes on rx queue i's cpu, so with -x or
+ * the queue fanout, its pkts are processed where they arrived. Then the
+ * rest of the NIC's local cpus, for the -W workers. A queue whose cpu
+ * isn't known, isn't local, or is another queue's too, gets a local cpu
+ * no queue has, and only once they've all been given out, one that's
+ * shared. Returns the number of cpus. */
+static int
+dnsflow_topo_cpus(struct dnsflow_topo *tp, int *cpus, int max_cpus)
+{
+	int		i, j, k = 0, n, cpu;
+
+	if (tp->tp_n_local == 0) {
+		return (0);
+	}
+	n = MIN(tp->tp_n_queues, max_cpus);
+	for (i = 0; i < n; i++) {
+		cpu = tp->tp_queue_cpu[i];
+		cpus[i] = cpu >= 0 && dnsflow_cpu_listed(tp->tp_local,
+				tp->tp_n_local, cpu) &&
+			!dnsflow_cpu_listed(cpus, i, cpu) ? cpu : -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (cpus[i] >= 0) {
+			continue;
+		}
+		for (j = 0; j < tp->tp_n_local &&
+		    dnsflow_cpu_listed(cpus, n, tp->tp_local[(k + j) %
+			    tp->tp_n_local]); j++) {
+			;
+		}
+		if (j == tp->tp_n_local) {
+			/* More queues than cpus. */
+			j = 0;
+		}
+		cpus[i] = tp->tp_local[(k + j) % tp->tp_n_local];
+		k = (k + j + 1) % tp->tp_n_local;
+	}
+	for (i = 0; i < tp->tp_n_local && n < max_cpus; i++) {
+		if (!dnsflow_cpu_listed(cpus, n, tp->tp_local[i])) {
+			cpus[n++] = tp->tp_local[i];
+		}
+	}
+	return (n);
+}
+
+/* -n. Prefer the NIC's node for every allocation from here on, the pcap
+ * buffers, capture rings and worker slabs included, and keep anything that
+ * isn't pinned to a cpu of its own on the node's cpus. Threads and -M
+ * procs inherit both. */
+static void
+dnsflow_topo_bind(struct dnsflow_topo *tp)
+{
+#if __linux__
+	unsigned long	mask[DNSFLOW_MAX_CPUS / (8 * sizeof(long))];
+	cpu_set_t	set;
+	int		i, bits = 8 * sizeof(long);
+
+	if (tp->tp_node >= 0 && tp->tp_node < DNSFLOW_MAX_CPUS) {
+		bzero(mask, sizeof(mask));
+		mask[tp->tp_node / bits] |= 1UL << (tp->tp_node % bits);
+		/* maxnode is one more than the bits in the mask. */
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+					sizeof(mask) * 8 + 1) < 0) {
+			_log("numa: can't prefer memory on node %d: %s",
+					tp->tp_node, strerror(errno));
+		}
+	}
+	if (tp->tp_n_local > 0) {
+		CPU_ZERO(&set);
+		for (i = 0; i < tp->tp_n_local; i++) {
+			if (tp->tp_local[i] < CPU_SETSIZE) {
+				CPU_SET(tp->tp_local[i], &set);
+			}
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			_log("numa: can't run on cpus %s: %s",
+					tp->tp_local_list, strerror(errno));
+		}
+	}
+#endif
+}
+
+/* -n. Log where everything ended up. */
+static void
+dnsflow_topo_report(const char *intf_name, struct dnsflow_topo *tp,
+		int by_queue)
+{
+	struct dnsflow_worker	*dw;
+	char			buf[512];
+	int			i, q, node, n_captures = 0, len;
+
+	if (tp->tp_node >= 0) {
+		_log("numa: %s is on node %d, local cpus %s, memory from "
+				"node %d", intf_name, tp->tp_node,
+				tp->tp_local_list, tp->tp_node);
+	} else {
+		_log("numa: %s has no numa node, using cpus %s", intf_name,
+				tp->tp_local_list);
+	}
+	for (i = 0, len = 0; i < tp->tp_n_queues &&
+	    len < sizeof(buf); i++) {
+		if (tp->tp_queue_irq[i] < 0) {
+			len += snprintf(buf + len, sizeof(buf) - len, " %d=?", i);
+		} else {
+			len += snprintf(buf + len, sizeof(buf) - len,
+					" %d=irq%d/cpu%d", i,
+					tp->tp_queue_irq[i],
+					tp->tp_queue_cpu[i]);
+		}
+	}
+	_log("numa: %d rx queues%s%s", tp->tp_n_queues,
+			tp->tp_n_queues > 0 ? ":" : "",
+			tp->tp_n_queues > 0 ? buf : "");
+
+	for (i = 0; i < n_workers; i++) {
+		dw = workers[i];
+		if (dw->dw_role == DNSFLOW_WORKER_INLINE ||
+		    dw->dw_role == DNSFLOW_WORKER_CAPTURE) {
+			n_captures++;
+		}
+	}
+	for (i = 0; i < n_workers; i++) {
+		dw = workers[i];
+		node = dw->dw_cpu >= 0 ? dnsflow_cpu_node(dw->dw_cpu) : -1;
+		len = snprintf(buf, sizeof(buf), "numa: worker %d (%s) cpu %d",
+				dw->dw_id, dnsflow_worker_role_names[dw->dw_role],
+				dw->dw_cpu);
+		if (node >= 0) {
+			len += snprintf(buf + len, sizeof(buf) - len,
+					" node %d%s", node,
+					tp->tp_node >= 0 && node != tp->tp_node ?
+					" (not local)" : "");
+		}
+		if (by_queue && i < n_captures) {
+			len += snprintf(buf + len, sizeof(buf) - len,
+					", rx queue");
+			for (q = i; q < tp->tp_n_queues &&
+			    len < sizeof(buf); q += n_captures) {
+				len += snprintf(buf + len, sizeof(buf) - len,
+						" %d", q);
+			}
+		}
+		_log("%s", buf);
+	}
+}
+
+/* -s, and sample in the config file. min[:max]. Returns -1 if it doesn't
+ * parse. */
+static int
+parse_sample_rate(const char *str, uint32_t *min, uint32_t *max)
+{
+	int		rv;
+
+	*min = 0;
+	*max = 0;
+	rv = sscanf(str, "%u:%u", min, max);
+	if (*min == 0) {
+		*min = 1;
+	}
+	if (rv < 1 || *min > DNSFLOW_SAMPLE_RATE_MAX ||
+	    (rv == 2 && (*max <= *min || *max > DNSFLOW_SAMPLE_RATE_MAX))) {
+		return (-1);
+	}
+	if (rv == 1) {
+		*max = 0;
+	}
+	return (0);
+}
+
+/* -u, and dst in the config file. Returns -1 if the list is full or it's
+ * not an ipv4 address. */
+static int
+parse_dst(const char *str, struct dnsflow_dsts *ds)
+{
+	struct sockaddr_in	*so_addr;
+
+	if (ds->ds_n == DNSFLOW_UDP_MAX_DSTS) {
+		return (-1);
+	}
+	so_addr = &ds->ds_addrs[ds->ds_n];
+	bzero(so_addr, sizeof(struct sockaddr_in));
+	so_addr->sin_family = AF_INET;
+	so_addr->sin_port = htons(DNSFLOW_PORT);
+	if (inet_pton(AF_INET, str, &so_addr->sin_addr) != 1) {
+		return (-1);
+	}
+	ds->ds_n++;
+	return (0);
+}
+
+/* -D, ip[:port[:spool_mb[:old|new]]]. Returns -1 if it doesn't parse. */
+static int
+parse_tcp_dst(const char *str, struct sockaddr_in *so_addr, int *spool_mb,
+		int *drop_new)
+{
+	char		buf[64], *tok, *last, *end;
+	long		v;
+	int		i;
+
+	if (strlen(str) >= sizeof(buf)) {
+		return (-1);
+	}
+	strcpy(buf, str);
+	bzero(so_addr, sizeof(struct sockaddr_in));
+	so_addr->sin_family = AF_INET;
+	so_addr->sin_port = htons(DNSFLOW_PORT);
+	*spool_mb = DNSFLOW_TCP_SPOOL_MB;
+	*drop_new = 0;
+	for (i = 0, tok = strtok_r(buf, ":", &last); tok != NULL;
+	    i++, tok = strtok_r(NULL, ":", &last)) {
+		if (i == 0) {
+			if (inet_pton(AF_INET, tok, &so_addr->sin_addr) != 1) {
+				return (-1);
+			}
+		} else if (i == 3) {
+			if (strcmp(tok, "new") == 0) {
+				*drop_new = 1;
+			} else if (strcmp(tok, "old") != 0) {
+				return (-1);
+			}
+		} else if (i < 3) {
+			v = strtol(tok, &end, 10);
+			if (*end != '\0' || v < 1 || v > (i == 1 ? 65535 :
+						DNSFLOW_TCP_SPOOL_MB_MAX)) {
+				return (-1);
+			}
+			if (i == 1) {
+				so_addr->sin_port = htons(v);
+			} else {
+				*spool_mb = v;
+			}
+		} else {
+			return (-1);
+		}
+	}
+	return (i == 0 ? -1 : 0);
+}
+
+/* -E, a comma separated list of: qinq, mpls[:depth], and the
+ * dnsflow_tunnels names. Returns -1 if it doesn't parse. */
+static int
+parse_decap(const char *str)
+{
+	char		buf[256], *tok, *last, *end;
+	long		depth;
+	int		i, found;
+
+	if (strlen(str) >= sizeof(buf)) {
+		return (-1);
+	}
+	strcpy(buf, str);
+	for (tok = strtok_r(buf, ",", &last); tok != NULL;
+	    tok = strtok_r(NULL, ",", &last)) {
+		if (strcmp(tok, "qinq") == 0) {
+			vlan_depth = DNSFLOW_VLAN_DEPTH_MAX;
+			continue;
+		}
+		if (strncmp(tok, "mpls", 4) == 0 &&
+		    (tok[4] == '\0' || tok[4] == ':')) {
+			depth = DNSFLOW_MPLS_DEPTH;
+			if (tok[4] == ':') {
+				depth = strtol(tok + 5, &end, 10);
+				if (end == tok + 5 || *end != '\0' ||
+				    depth < 1 || depth > DNSFLOW_MPLS_DEPTH_MAX) {
+					return (-1);
+				}
+			}
+			decap_flags |= DCAP_DECAP_MPLS;
+			mpls_depth = depth;
+			continue;
+		}
+		for (i = 0, found = 0; i < DNSFLOW_TUNNELS_COUNT; i++) {
+			if (strcmp(tok, dnsflow_tunnels[i].dt_name) == 0) {
+				decap_flags |= dnsflow_tunnels[i].dt_decap;
+				found = 1;
+			}
+		}
+		if (!found) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/* Append to a filter being built in buf. */
+static void
+filter_cat(char *buf, size_t size, const char *format, ...)
+{
+	va_list		ap;
+	size_t		len = strlen(buf);
+
+	va_start(ap, format);
+	if (vsnprintf(buf + len, size - len, format, ap) >= size - len) {
+		errx(1, "filter too long");
+	}
+	va_end(ap);
+}
+
+/* The dns response part of the filter for ipv4, after the udp check.
+ * udp and ip are the pcap protos to use for the udp and ip hdrs, and
+ * udp_off and ip_off where the hdrs are from there. With query set, it's
+ * the query part for -Q instead: the client is the src, and the flags are
+ * a standard query's. */
+static void
+build_filter_dns4_dir(char *buf, size_t size, const char *udp, int udp_off,
+		const char *ip, int ip_off, int proc_i, int num_procs,
+		int enable_mdns, uint32_t rate, int query)
+{
+	/* Offsets from start of udp. */
+	int port_offset = query ? 2 : 0;
+	int dns_flags_offset = 10;
+	/* Offsets from start of ip. */
+	int client_ip_offset = query ? 12 : 16;
+	int len;
+
+	/* Port filter - Match src (or for queries, dst) port 53, and
+	 * optionally 5353. */
+	if (enable_mdns) {
+		len = snprintf(buf, size, "(%s[%d:2] = 53 or %s[%d:2] = 5353)",
+			udp, port_offset + udp_off,
+			udp, port_offset + udp_off);
+	} else {
+		len = snprintf(buf, size, "%s[%d:2] = 53",
+			udp, port_offset + udp_off);
+	}
+
+	/* Match valid recursive response flags.
+	 * qr=1, rd=1, ra=1, rcode=0.
+	 * Or for a standard query, qr=0, opcode=0.
+	 * XXX Could also pull out just A/AAAA. */
+	if (query) {
+		len += snprintf(buf + len, size - len,
+			" and %s[%d:2] & 0xf800 = 0",
+			udp, dns_flags_offset + udp_off);
+	} else {
+		len += snprintf(buf + len, size - len,
+			" and %s[%d:2] & 0x8187 = 0x8180",
+			udp, dns_flags_offset + udp_off);
+	}
+
+	if (num_procs > 1) {
+		/* Add multi-proc filter.
+		 * Select based on mod of client ip.  Probably never a problem,
+		 * but doing offset from ip, so ip options will break view into
+		 * encap.
+		 * Using the client ip as the load balance key. Useful to keep
+		 * each client in same stream. Another possibility would be
+		 * the udp checksum, assuming it's set.  */
+		len += snprintf(buf + len, size - len,
+			" and %s[%d:4] - %s[%d:4] / %u * %u = %u",
+			ip, client_ip_offset + ip_off,
+			ip, client_ip_offset + ip_off,
+			num_procs, num_procs, proc_i - 1);
+	}
+
+	/* Sampling. BPF arithmetic is 32 bit unsigned, so it's the same
+	 * hash as in C. The client ip is the key, like above. */
+	if (rate > 1) {
+		snprintf(buf + len, size - len,
+			" and ((%s[%d:4] * %u) >> 16) - "
+			"((%s[%d:4] * %u) >> 16) / %u * %u = 0",
+			ip, client_ip_offset + ip_off, DNSFLOW_SAMPLE_MULT,
+			ip, client_ip_offset + ip_off, DNSFLOW_SAMPLE_MULT,
+			rate, rate);
+	}
+}
+
+/* Same again for ipv6, from the start of the ip6 hdr, which is at off
+ * from proto ip6. Only matches when udp directly follows the fixed
+ * header, there's no way to skip extension headers here. The multi-proc
+ * and sampling key is the low 4 bytes of the client ip. */
+static void
+build_filter_dns6_dir(char *buf, size_t size, const char *ip6, int off,
+		int proc_i, int num_procs, int enable_mdns, uint32_t rate,
+		int query)
+{
+	int port_offset = query ? 42 : 40;
+	int client_ip_offset = query ? 20 : 36;
+	int len;
+
+	len = snprintf(buf, size, "%s[%d] = 17 and ", ip6, off + 6);
+	if (enable_mdns) {
+		len += snprintf(buf + len, size - len,
+			"(%s[%d:2] = 53 or %s[%d:2] = 5353)",
+			ip6, off + port_offset, ip6, off + port_offset);
+	} else {
+		len += snprintf(buf + len, size - len, "%s[%d:2] = 53",
+			ip6, off + port_offset);
+	}
+	if (query) {
+		len += snprintf(buf + len, size - len,
+			" and %s[%d:2] & 0xf800 = 0", ip6, off + 50);
+	} else {
+		len += snprintf(buf + len, size - len,
+			" and %s[%d:2] & 0x8187 = 0x8180", ip6, off + 50);
+	}
+	if (num_procs > 1) {
+		len += snprintf(buf + len, size - len,
+			" and %s[%d:4] - %s[%d:4] / %u * %u = %u",
+			ip6, off + client_ip_offset, ip6, off + client_ip_offset,
+			num_procs, num_procs, proc_i - 1);
+	}
+	if (rate > 1) {
+		snprintf(buf + len, size - len,
+			" and ((%s[%d:4] * %u) >> 16) - "
+			"((%s[%d:4] * %u) >> 16) / %u * %u = 0",
+			ip6, off + client_ip_offset, DNSFLOW_SAMPLE_MULT,
+			ip6, off + client_ip_offset, DNSFLOW_SAMPLE_MULT,
+			rate, rate);
+	}
+}
+
+/* The response part, and with -Q, or the query part. */
+static void
+build_filter_dns4(char *buf, size_t size, const char *udp, int udp_off,
+		const char *ip, int ip_off, int proc_i, int num_procs,
+		int enable_mdns, uint32_t rate)
+{
+	char	resp[1024], query[1024];
+
+	build_filter_dns4_dir(resp, sizeof(resp), udp, udp_off, ip, ip_off,
+			proc_i, num_procs, enable_mdns, rate, 0);
+	buf[0] = '\0';
+	if (rtt_n_buckets == 0) {
+		filter_cat(buf, size, "%s", resp);
+		return;
+	}
+	build_filter_dns4_dir(query, sizeof(query), udp, udp_off, ip, ip_off,
+			proc_i, num_procs, enable_mdns, rate, 1);
+	filter_cat(buf, size, "((%s) or (%s))", resp, query);
+}
 
+static void
+build_filter_dns6(char *buf, size_t size, const char *ip6, int off,
+		int proc_i, int num_procs, int enable_mdns, uint32_t rate)
+{
+	char	resp[1024], query[1024];
+
+	build_filter_dns6_dir(resp, sizeof(resp), ip6, off, proc_i, num_procs,
+			enable_mdns, rate, 0);
+	buf[0] = '\0';
+	if (rtt_n_buckets == 0) {
+		filter_cat(buf, size, "%s", resp);
+		return;
+	}
+	build_filter_dns6_dir(query, sizeof(query), ip6, off, proc_i,
+			num_procs, enable_mdns, rate, 1);
+	filter_cat(buf, size, "((%s) or (%s))", resp, query);
+}
+
+/* encap_offset is the number of bytes between the end of the udp header
+ * and the start of the encapsulated ip header.
+ * Ie., the length of foo bar: ip udp (foo bar) ip udp dns
+ * 
+ * proc_i and num_procs use 1-based numbering.
+ *
+ * With rate > 1, only pkts to 1 in rate clients (by dnsflow_sample_hash())
+ * match.
+ *
+ * The -E tunnels and vlan/mpls stacks are added from decap_flags,
+ * vlan_depth and mpls_depth.
+ * */
+static char *
+build_pcap_filter(int encap_offset, int proc_i, int num_procs, int enable_mdns,
+		uint32_t rate)
+{
+	/* Note: according to pcap-filter(7), udp offsets only work for ipv4.
+	 * The -6 clause uses ip6 offsets instead. */
+
+	/* Offsets from start of udp. */
+	int udp_offset = 0;	/* Offset from udp to encap udp. */
+
+	/* Offsets from start of ip. */
+	int ip_offset = 0;	/* Offset from ip to encap ip. */
+
+	const struct dnsflow_tunnel	*dt;
+	int				i, v, m, n_clauses = 0;
+
+	/* Buffers to build pcap filter */
+	char dns_filter[2048];
+	char clauses[2 * DNSFLOW_TUNNELS_COUNT + 2][2048];
+	char inner_filter[DNSFLOW_FILTER_MAX / 4];
+	/* The final filter returned in static buf. */
+	static char full_filter_ret[DNSFLOW_FILTER_MAX];
+
+	if (encap_offset != 0) {
+		/* udp, encap, ip, udp */
+		udp_offset = sizeof(struct udphdr) + encap_offset +
+			sizeof(struct ip);
+		/* ip, udp, encap, ip */
+		ip_offset = sizeof(struct ip) + sizeof(struct udphdr) +
+			encap_offset;
+	}
+
+	/* filter_cat() appends, and exits if a clause doesn't fit. */
+	bzero(clauses, sizeof(clauses));
+	build_filter_dns4(dns_filter, sizeof(dns_filter), "udp", udp_offset,
+			"ip", ip_offset, proc_i, num_procs, enable_mdns, rate);
+	filter_cat(clauses[n_clauses++], sizeof(clauses[0]), "udp and %s",
+			dns_filter);
+
+	if (enable_ip6) {
+		/* No encap. */
+		build_filter_dns6(dns_filter, sizeof(dns_filter), "ip6", 0,
+				proc_i, num_procs, enable_mdns, rate);
+		filter_cat(clauses[n_clauses++], sizeof(clauses[0]),
+				"ip6 and %s", dns_filter);
+	}
+
+	/* The -E tunnels, with an ipv4 outer hdr without options. The inner
+	 * ipv4 hdr can't have options either. */
+	for (i = 0; i < DNSFLOW_TUNNELS_COUNT; i++) {
+		dt = &dnsflow_tunnels[i];
+		if ((decap_flags & dt->dt_decap) == 0) {
+			continue;
+		}
+		build_filter_dns4(dns_filter, sizeof(dns_filter),
+			"ip", dt->dt_offset + sizeof(struct ip),
+			"ip", dt->dt_offset, proc_i, num_procs, enable_mdns,
+			rate);
+		filter_cat(clauses[n_clauses++], sizeof(clauses[0]),
+			"ip and %s and ip[%d:2] = 0x0800 and ip[%d] = 0x45 "
+			"and ip[%d] = 17 and %s", dt->dt_match,
+			dt->dt_type_offset, dt->dt_offset, dt->dt_offset + 9,
+			dns_filter);
+		if (!enable_ip6) {
+			continue;
+		}
+		build_filter_dns6(dns_filter, sizeof(dns_filter), "ip",
+			dt->dt_offset, proc_i, num_procs, enable_mdns, rate);
+		filter_cat(clauses[n_clauses++], sizeof(clauses[0]),
+			"ip and %s and ip[%d:2] = 0x86dd and "
+			"ip[%d] & 0xf0 = 0x60 and %s", dt->dt_match,
+			dt->dt_type_offset, dt->dt_offset, dns_filter);
+	}
+
+	/* and and or have the same precedence. */
+	inner_filter[0] = '\0';
+	for (i = 0; i < n_clauses; i++) {
+		filter_cat(inner_filter, sizeof(inner_filter),
+			n_clauses == 1 ? "%s%s" : "%s(%s)",
+			i == 0 ? "" : " or ", clauses[i]);
+	}
 
-	/* The final filter returned in static buf. Incorporates one level
-	 * of vlan encapsulation. */
+	/* The final filter returned in static buf. Incorporates vlan
+	 * encapsulation, one level unless -E asks for more, and any
+	 * mpls label stacks from -E. */
 	bzero(full_filter_ret, sizeof(full_filter_ret));
-	snprintf(full_filter_ret, sizeof(full_filter_ret),
-			"(%s) or (vlan and (%s))",
-			multi_proc_filter, multi_proc_filter);
+	for (v = 0; v <= vlan_depth; v++) {
+		for (m = 0; m <= mpls_depth; m++) {
+			filter_cat(full_filter_ret, sizeof(full_filter_ret),
+				"%s(", v + m == 0 ? "" : " or ");
+			for (i = 0; i < v; i++) {
+				filter_cat(full_filter_ret,
+					sizeof(full_filter_ret), "vlan and ");
+			}
+			for (i = 0; i < m; i++) {
+				filter_cat(full_filter_ret,
+					sizeof(full_filter_ret), "mpls and ");
+			}
+			filter_cat(full_filter_ret, sizeof(full_filter_ret),
+				v + m == 0 ? "%s)" : "(%s))", inner_filter);
+		}
+	}
 
 	return (full_filter_ret);
 }
@@ -531,27 +2743,113 @@ udp4_check(int pkt_len, struct ip *ip)
 	return (udphdr);
 }
 
-/* Sanity/buffer-len checks.
- * Returns pointer to udp data, or NULL on error.
- * On success, ip_ret and udphdr_ret will point to the headers. */
-static char *
-ip_udp_check(int pkt_len, char *ip_pkt,
-		struct ip **ip_ret, struct udphdr **udphdr_ret)
+/* IPv6 checks - version, payload len. */
+static struct ip6_hdr *
+ip6_check(int pkt_len, char *ip_pkt)
 {
-	char			*udp_data = NULL;
-	struct ip		*ip = NULL;
-	struct udphdr		*udphdr = NULL;
-
-	*ip_ret = NULL;
-	*udphdr_ret = NULL;
-
-	/* XXX Count/log number of bad pkts. */
-	/* XXX Need to pull in ip/udp checksumming and fragment handling. */
+	struct ip6_hdr	*ip6 = (struct ip6_hdr *)ip_pkt;
 
-	if ((ip = ip4_check(pkt_len, ip_pkt)) == NULL) {
-		return NULL;
+	if (pkt_len < sizeof(struct ip6_hdr)) {
+		return (NULL);
+	}
+	if ((ip6->ip6_vfc >> 4) != 6) {
+		return (NULL);
+	}
+	if (pkt_len < sizeof(struct ip6_hdr) + ntohs(ip6->ip6_plen)) {
+		return (NULL);
+	}
+
+	return (ip6);
+}
+
+/* Max extension headers skipped before giving up. */
+#define IP6_EXT_HDRS_MAX	8
+
+/* Skips the extension headers to get to udp. Fragments are dropped, only
+ * an atomic fragment (offset 0, no more fragments) is let through. */
+static struct udphdr *
+udp6_check(int pkt_len, struct ip6_hdr *ip6)
+{
+	uint8_t		*p = (uint8_t *)ip6;
+	struct ip6_frag	*frag;
+	struct udphdr	*udphdr;
+	int		i, nxt = ip6->ip6_nxt;
+	int		off = sizeof(struct ip6_hdr), ext_len;
+
+	for (i = 0; nxt != IPPROTO_UDP; i++) {
+		if (i == IP6_EXT_HDRS_MAX || pkt_len < off + 8) {
+			return (NULL);
+		}
+		switch (nxt) {
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_DSTOPTS:
+			ext_len = (p[off + 1] + 1) * 8;
+			break;
+		case IPPROTO_AH:
+			ext_len = (p[off + 1] + 2) * 4;
+			break;
+		case IPPROTO_FRAGMENT:
+			frag = (struct ip6_frag *)(p + off);
+			if ((frag->ip6f_offlg &
+				(IP6F_OFF_MASK | IP6F_MORE_FRAG)) != 0) {
+				return (NULL);
+			}
+			ext_len = sizeof(struct ip6_frag);
+			break;
+		default:
+			/* ESP, no next header, or not udp. */
+			return (NULL);
+		}
+		nxt = p[off];
+		off += ext_len;
+	}
+	if (pkt_len < off + sizeof(struct udphdr)) {
+		return (NULL);
+	}
+	udphdr = (struct udphdr *)(p + off);
+	if (pkt_len < off + ntohs(udphdr->uh_ulen)) {
+		return (NULL);
+	}
+
+	return (udphdr);
+}
+
+/* Sanity/buffer-len checks.
+ * Returns pointer to udp data, or NULL on error.
+ * On success, udphdr_ret and one of ip_ret or ip6_ret (with -6) will
+ * point to the headers. ipv4 is tried first, so it's no slower with -6. */
+static char *
+ip_udp_check(int pkt_len, char *ip_pkt, struct ip **ip_ret,
+		struct ip6_hdr **ip6_ret, struct udphdr **udphdr_ret)
+{
+	char			*udp_data = NULL;
+	struct ip		*ip = NULL;
+	struct ip6_hdr		*ip6 = NULL;
+	struct udphdr		*udphdr = NULL;
+
+	*ip_ret = NULL;
+	*ip6_ret = NULL;
+	*udphdr_ret = NULL;
+
+	/* XXX Count/log number of bad pkts. */
+	/* XXX Need to pull in ip/udp checksumming and fragment handling. */
+
+	if ((ip = ip4_check(pkt_len, ip_pkt)) == NULL) {
+		if (!enable_ip6 ||
+		    (ip6 = ip6_check(pkt_len, ip_pkt)) == NULL) {
+			return NULL;
+		}
+		*ip6_ret = ip6;
+		if ((udphdr = udp6_check(pkt_len, ip6)) == NULL) {
+			return NULL;
+		}
+		*udphdr_ret = udphdr;
+		return ((char *)udphdr + sizeof(struct udphdr));
 	}
 
+	/* So the caller can tell a bad ip hdr from a bad udp hdr. */
+	*ip_ret = ip;
 	if ((udphdr = udp4_check(pkt_len, ip)) == NULL) {
 		return NULL;
 	}
@@ -566,12 +2864,14 @@ ip_udp_check(int pkt_len, char *ip_pkt,
  * encap_hdr should point to the start of encapsulated pkt.
  * ip_encap_offset is the number of bytes to reach the ip header.
  * Returns pointer to udp data, or NULL on error.
- * On success, ip_ret and udphdr_ret will point to the headers. */
+ * On success, the headers are as for ip_udp_check(). */
 static char *
 ip_encap_check(int pkt_len, char *encap_hdr, int ip_encap_offset,
-		struct ip **ip_ret, struct udphdr **udphdr_ret)
+		struct ip **ip_ret, struct ip6_hdr **ip6_ret,
+		struct udphdr **udphdr_ret)
 {
 	*ip_ret = NULL;
+	*ip6_ret = NULL;
 	*udphdr_ret = NULL;
 
 	if (pkt_len < ip_encap_offset) {
@@ -579,11 +2879,439 @@ ip_encap_check(int pkt_len, char *encap_hdr, int ip_encap_offset,
 	}
 
 	return (ip_udp_check(pkt_len - ip_encap_offset,
-			encap_hdr + ip_encap_offset, ip_ret, udphdr_ret));
+			encap_hdr + ip_encap_offset, ip_ret, ip6_ret,
+			udphdr_ret));
+}
+
+/* DNS wire format. Offsets are from the start of the dns header. */
+#define DNS_HDR_LEN			12
+#define DNS_FLAGS_OFFSET		2
+#define DNS_QDCOUNT_OFFSET		4
+#define DNS_ANCOUNT_OFFSET		6
+#define DNS_RR_FIXED_LEN		10	/* type, class, ttl, rdlength */
+#define DNS_RR_TTL_OFFSET		4
+
+/* Valid recursive response flags. qr=1, rd=1, ra=1, rcode=0.
+ * Same test as the pcap filter. */
+#define DNS_FLAGS_MASK			0x8187
+#define DNS_FLAGS_RESP			0x8180
+/* A standard query, qr=0 and opcode=0. */
+#define DNS_FLAGS_QUERY_MASK		0xf800
+
+#define DNS_LABEL_PTR			0xc0
+#define DNS_LABEL_LEN_MAX		63
+
+#define DNS_RR_TYPE_A			1
+#define DNS_RR_TYPE_CNAME		5
+#define DNS_RR_TYPE_AAAA		28
+
+static inline uint16_t
+dns_get16(const uint8_t *p)
+{
+	return ((p[0] << 8) | p[1]);
+}
+
+/* A ttl with the top bit set is treated as 0 (RFC 2181 section 8). */
+static inline uint32_t
+dns_ttl(uint32_t ttl)
+{
+	return ((ttl & 0x80000000) ? 0 : ttl);
+}
+
+/* Skip over the (possibly compressed) name at off.
+ * Returns the offset just past the name, or -1 on error. */
+static int
+dns_name_skip(const uint8_t *pkt, int pkt_len, int off)
+{
+	int		label_len;
+
+	while (off < pkt_len) {
+		label_len = pkt[off];
+		if (label_len == 0) {
+			return (off + 1);
+		}
+		if ((label_len & DNS_LABEL_PTR) == DNS_LABEL_PTR) {
+			/* Pointer ends the name. */
+			return (off + 2 <= pkt_len ? off + 2 : -1);
+		}
+		if (label_len > DNS_LABEL_LEN_MAX) {
+			/* Reserved label types. */
+			return (-1);
+		}
+		off += label_len + 1;
+	}
+	return (-1);
+}
+
+/* Name copies. Each run of labels, up to a pointer or the root, is copied
+ * in one go, with the widest loads and stores the cpu has. The kernel is
+ * picked at startup, see dns_copy_init(). Finding the end of a run stays
+ * scalar: each label's length says where the next one starts. */
+typedef void (*dns_copy_fn)(uint8_t *dst, const uint8_t *src, int len);
+
+static void
+dns_copy_scalar(uint8_t *dst, const uint8_t *src, int len)
+{
+	memcpy(dst, src, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 16 bytes at a time, with the last 16 overlapping what's been copied
+ * already, so nothing is read or written outside of src and dst. */
+__attribute__((target("sse2")))
+static void
+dns_copy_sse2(uint8_t *dst, const uint8_t *src, int len)
+{
+	int		i;
+
+	if (len < 16) {
+		memcpy(dst, src, len);
+		return;
+	}
+	for (i = 0; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(dst + i),
+				_mm_loadu_si128((const __m128i *)(src + i)));
+	}
+	if (i < len) {
+		_mm_storeu_si128((__m128i *)(dst + len - 16),
+			_mm_loadu_si128((const __m128i *)(src + len - 16)));
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+dns_copy_avx2(uint8_t *dst, const uint8_t *src, int len)
+{
+	int		i;
+
+	if (len < 32) {
+		dns_copy_sse2(dst, src, len);
+		return;
+	}
+	for (i = 0; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				_mm256_loadu_si256((const __m256i *)(src + i)));
+	}
+	if (i < len) {
+		_mm256_storeu_si256((__m256i *)(dst + len - 32),
+			_mm256_loadu_si256((const __m256i *)(src + len - 32)));
+	}
+}
+
+static int
+dns_copy_have_sse2(void)
+{
+	return (__builtin_cpu_supports("sse2"));
+}
+
+static int
+dns_copy_have_avx2(void)
+{
+	return (__builtin_cpu_supports("avx2"));
+}
+#elif defined(__aarch64__)
+/* As dns_copy_sse2(). NEON is always there on aarch64. */
+static void
+dns_copy_neon(uint8_t *dst, const uint8_t *src, int len)
+{
+	int		i;
+
+	if (len < 16) {
+		memcpy(dst, src, len);
+		return;
+	}
+	for (i = 0; i + 16 <= len; i += 16) {
+		vst1q_u8(dst + i, vld1q_u8(src + i));
+	}
+	if (i < len) {
+		vst1q_u8(dst + len - 16, vld1q_u8(src + len - 16));
+	}
+}
+#endif
+
+static int
+dns_copy_have_any(void)
+{
+	return (1);
+}
+
+/* Best first. */
+static const struct {
+	const char	*name;
+	dns_copy_fn	fn;
+	int		(*supported)(void);
+} dns_copy_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2",	dns_copy_avx2,		dns_copy_have_avx2 },
+	{ "sse2",	dns_copy_sse2,		dns_copy_have_sse2 },
+#elif defined(__aarch64__)
+	{ "neon",	dns_copy_neon,		dns_copy_have_any },
+#endif
+	{ "scalar",	dns_copy_scalar,	dns_copy_have_any },
+};
+#define DNS_COPY_KERNELS_COUNT \
+	(sizeof(dns_copy_kernels) / sizeof(dns_copy_kernels[0]))
+
+static dns_copy_fn	dns_name_copy = dns_copy_scalar;
+static const char	*dns_copy_name = "scalar";
+
+/* Pick the named kernel (-N), or the best one the cpu supports if name is
+ * NULL. Returns -1 if there's no such kernel, or the cpu can't run it. */
+static int
+dns_copy_init(const char *name)
+{
+	int		i;
+
+	for (i = 0; i < DNS_COPY_KERNELS_COUNT; i++) {
+		if (name != NULL && strcmp(name, dns_copy_kernels[i].name)) {
+			continue;
+		}
+		if (dns_copy_kernels[i].supported()) {
+			dns_name_copy = dns_copy_kernels[i].fn;
+			dns_copy_name = dns_copy_kernels[i].name;
+			return (0);
+		}
+		if (name != NULL) {
+			break;
+		}
+	}
+	return (-1);
+}
+
+/* Unpack the (possibly compressed) name at off into buf, in uncompressed
+ * wire format - the same as ldns_rdf_data() of a dname. buf must have room
+ * for LDNS_MAX_DOMAINLEN bytes.
+ * Returns the length of the name, including the root label, or -1 on error.
+ * On success, *next_off is the offset just past the name in the pkt. */
+static int
+dns_name_unpack(const uint8_t *pkt, int pkt_len, int off, uint8_t *buf,
+		int *next_off)
+{
+	int		label_len, run, run_len, name_len = 0;
+	int		label_start = off;	/* Pointers must point before
+						   this to prevent loops. */
+
+	*next_off = -1;
+
+	while (off < pkt_len) {
+		/* Find the end of the run of labels at off. */
+		run = off;
+		while ((label_len = pkt[off]) != 0 &&
+		    label_len <= DNS_LABEL_LEN_MAX) {
+			off += label_len + 1;
+			if (off >= pkt_len) {
+				return (-1);
+			}
+		}
+		if (label_len == 0) {
+			off++;
+		} else if ((label_len & DNS_LABEL_PTR) != DNS_LABEL_PTR) {
+			/* Reserved label types. */
+			return (-1);
+		}
+		run_len = off - run;
+		if (name_len + run_len > LDNS_MAX_DOMAINLEN) {
+			return (-1);
+		}
+		dns_name_copy(buf + name_len, pkt + run, run_len);
+		name_len += run_len;
+		if (label_len == 0) {
+			if (*next_off == -1) {
+				*next_off = off;
+			}
+			return (name_len);
+		}
+
+		if (off + 2 > pkt_len) {
+			return (-1);
+		}
+		if (*next_off == -1) {
+			*next_off = off + 2;
+		}
+		off = dns_get16(pkt + off) & 0x3fff;
+		if (off >= label_start) {
+			return (-1);
+		}
+		label_start = off;
+	}
+	return (-1);
+}
+
+/* Cheap checks on the dns header and question type, done before any name
+ * unpacking. Most responses we aren't interested in (AAAA without -6, PTR,
+ * MX, etc., and empty answers) are dropped here. With -Q, queries that
+ * could get one of the responses we are interested in are let through as
+ * DNS_PREFILTER_QUERY. */
+static enum dns_prefilter_result
+dnsflow_dns_prefilter(int pkt_len, char *dns_pkt)
+{
+	const uint8_t		*pkt = (const uint8_t *)dns_pkt;
+	int			off, query = 0;
+	uint16_t		flags, qtype;
+
+	if (pkt_len < DNS_HDR_LEN) {
+		return (DNS_PREFILTER_SHORT);
+	}
+	flags = dns_get16(pkt + DNS_FLAGS_OFFSET);
+	if ((flags & DNS_FLAGS_MASK) != DNS_FLAGS_RESP) {
+		if (rtt_n_buckets == 0 || (flags & DNS_FLAGS_QUERY_MASK) != 0) {
+			return (DNS_PREFILTER_FLAGS);
+		}
+		query = 1;
+	}
+	if (dns_get16(pkt + DNS_QDCOUNT_OFFSET) != 1) {
+		return (DNS_PREFILTER_QDCOUNT);
+	}
+	if (!query && dns_get16(pkt + DNS_ANCOUNT_OFFSET) == 0) {
+		return (DNS_PREFILTER_ANCOUNT);
+	}
+
+	/* qtype follows the qname, which shouldn't be compressed. */
+	off = dns_name_skip(pkt, pkt_len, DNS_HDR_LEN);
+	if (off < 0 || off + 2 > pkt_len) {
+		return (DNS_PREFILTER_SHORT);
+	}
+	qtype = dns_get16(pkt + off);
+	if (qtype != DNS_RR_TYPE_A &&
+	    (qtype != DNS_RR_TYPE_AAAA || !enable_ip6)) {
+		return (DNS_PREFILTER_QTYPE);
+	}
+
+	return (query ? DNS_PREFILTER_QUERY : DNS_PREFILTER_PASS);
+}
+
+/* Add the name at off to the data set. Returns the offset just past the
+ * name in the pkt, or -1 on error. */
+static int
+dns_data_add_name(struct dns_data_set *data, const uint8_t *pkt, int pkt_len,
+		int off)
+{
+	uint8_t		*name = data->name_buf + data->name_buf_len;
+	int		name_len, next_off;
+
+	name_len = dns_name_unpack(pkt, pkt_len, off, name, &next_off);
+	if (name_len < 0) {
+		return (-1);
+	}
+	data->names[data->num_names] = name;
+	data->name_lens[data->num_names] = name_len;
+	data->num_names++;
+	data->name_buf_len += name_len;
+
+	return (next_off);
+}
+
+/* Parse the dns pkt straight from the wire. Does the same checks as
+ * dnsflow_ldns_check() and the same extraction as dnsflow_ldns_extract(),
+ * without allocating anything.
+ * Returns data, or NULL if the pkt is bad or not one we're interested in. */
+static struct dns_data_set *
+dnsflow_dns_parse(int pkt_len, char *dns_pkt, struct dns_data_set *data)
+{
+	const uint8_t		*pkt = (const uint8_t *)dns_pkt;
+	uint16_t		an_count, rr_type, rd_len, qtype;
+	uint32_t		ttl;
+	int			i, off;
+
+	data->num_names = 0;
+	data->num_ips = 0;
+	data->num_ips6 = 0;
+	data->name_buf_len = 0;
+	data->min_ttl = UINT32_MAX;
+
+	if (pkt_len < DNS_HDR_LEN) {
+		_log("Bad DNS pkt: short header");
+		return (NULL);
+	}
+
+	/* Looking for valid recursive replies */
+	if ((dns_get16(pkt + DNS_FLAGS_OFFSET) & DNS_FLAGS_MASK) !=
+			DNS_FLAGS_RESP) {
+		return (NULL);
+	}
+
+	/* Only one question. See dnsflow_ldns_check(). */
+	if (dns_get16(pkt + DNS_QDCOUNT_OFFSET) != 1) {
+		return (NULL);
+	}
+	an_count = dns_get16(pkt + DNS_ANCOUNT_OFFSET);
+
+	/* Question - qname, qtype, qclass */
+	off = dns_data_add_name(data, pkt, pkt_len, DNS_HDR_LEN);
+	if (off < 0 || off + 4 > pkt_len) {
+		_log("Bad DNS pkt: invalid question");
+		return (NULL);
+	}
+	qtype = dns_get16(pkt + off);
+	if (qtype != DNS_RR_TYPE_A &&
+	    (qtype != DNS_RR_TYPE_AAAA || !enable_ip6)) {
+		return (NULL);
+	}
+	off += 4;
+
+	for (i = 0; i < an_count; i++) {
+		if ((off = dns_name_skip(pkt, pkt_len, off)) < 0 ||
+		    off + DNS_RR_FIXED_LEN > pkt_len) {
+			_log("Bad DNS pkt: invalid answer");
+			return (NULL);
+		}
+		rr_type = dns_get16(pkt + off);
+		ttl = dns_ttl(((uint32_t)dns_get16(pkt + off +
+					DNS_RR_TTL_OFFSET) << 16) |
+				dns_get16(pkt + off + DNS_RR_TTL_OFFSET + 2));
+		rd_len = dns_get16(pkt + off + 8);
+		off += DNS_RR_FIXED_LEN;
+		if (off + rd_len > pkt_len) {
+			_log("Bad DNS pkt: invalid rdata");
+			return (NULL);
+		}
+
+		if (rr_type == DNS_RR_TYPE_CNAME) {
+			if (data->num_names == DNSFLOW_MAX_PARSE) {
+				_log("Too many names");
+			} else if (dns_data_add_name(data, pkt, off + rd_len,
+						off) < 0) {
+				_log("Invalid name");
+			} else {
+				data->name_ttls[data->num_names - 1] = ttl;
+				data->min_ttl = MIN(data->min_ttl, ttl);
+			}
+		} else if (rr_type == DNS_RR_TYPE_A && rd_len == 4) {
+			if (data->num_ips == DNSFLOW_MAX_PARSE) {
+				_log("Too many ips");
+			} else {
+				data->ip_ttls[data->num_ips] = ttl;
+				data->min_ttl = MIN(data->min_ttl, ttl);
+				memcpy(&data->ips[data->num_ips++], pkt + off,
+						sizeof(in_addr_t));
+			}
+		} else if (rr_type == DNS_RR_TYPE_AAAA && rd_len == 16 &&
+				qtype == DNS_RR_TYPE_AAAA) {
+			if (data->num_ips6 == DNSFLOW_MAX_PARSE) {
+				_log("Too many ips");
+			} else {
+				data->ip6_ttls[data->num_ips6] = ttl;
+				data->min_ttl = MIN(data->min_ttl, ttl);
+				memcpy(&data->ips6[data->num_ips6++],
+						pkt + off,
+						sizeof(struct in6_addr));
+			}
+		}
+		/* XXX Only looking at A and AAAA queries, so anything else
+		 * is unexpected rdata. */
+		off += rd_len;
+	}
+
+	/* Sanity checks */
+	if (data->num_ips == 0 && data->num_ips6 == 0) {
+		return (NULL);
+	}
+
+	return (data);
 }
 
 static ldns_pkt *
-dnsflow_dns_check(int pkt_len, char *dns_pkt)
+dnsflow_ldns_check(int pkt_len, char *dns_pkt)
 {
 	ldns_status		status;
 	ldns_pkt		*lp;
@@ -612,10 +3340,12 @@ dnsflow_dns_check(int pkt_len, char *dns_pkt)
 		return (NULL);
 	}
 
-	/* Only look at replies to A queries. Could possibly look at
-	 * CNAME queries as well, but those aren't generally used. */
+	/* Only look at replies to A (and with -6, AAAA) queries. Could
+	 * possibly look at CNAME queries as well, but those aren't generally
+	 * used. */
 	q_rr = ldns_rr_list_rr(ldns_pkt_question(lp), 0);
-	if (ldns_rr_get_type(q_rr) != LDNS_RR_TYPE_A) {
+	if (ldns_rr_get_type(q_rr) != LDNS_RR_TYPE_A &&
+	    (ldns_rr_get_type(q_rr) != LDNS_RR_TYPE_AAAA || !enable_ip6)) {
 		ldns_pkt_free(lp);
 		return (NULL);
 	}
@@ -626,21 +3356,21 @@ dnsflow_dns_check(int pkt_len, char *dns_pkt)
 /* NOTE: The names in the returned dns_data_set point to data inside the
  * ldns_pkt. So, don't free the packet until the names have been copied. */
 static struct dns_data_set *
-dnsflow_dns_extract(ldns_pkt *lp)
+dnsflow_ldns_extract(ldns_pkt *lp, struct dns_data_set *data)
 {
-	/* Statics */
-	static struct dns_data_set	data[1];
-
-	ldns_rr_type			rr_type;
+	ldns_rr_type			rr_type, q_type;
 	ldns_rr				*q_rr, *a_rr;
 	ldns_rdf			*rdf;
 
 	int				i, j;
 	in_addr_t			*ip_ptr;
+	uint32_t			ttl;
 
 
 	data->num_names = 0;
 	data->num_ips = 0;
+	data->num_ips6 = 0;
+	data->min_ttl = UINT32_MAX;
 
 	q_rr = ldns_rr_list_rr(ldns_pkt_question(lp), 0);
 
@@ -652,10 +3382,12 @@ dnsflow_dns_extract(ldns_pkt *lp)
 	data->names[data->num_names] = ldns_rdf_data(ldns_rr_owner(q_rr));
 	data->name_lens[data->num_names] = ldns_rdf_size(ldns_rr_owner(q_rr));
 	data->num_names++;
+	q_type = ldns_rr_get_type(q_rr);
 
 	for (i = 0; i < ldns_pkt_ancount(lp); i++) {
 		a_rr = ldns_rr_list_rr(ldns_pkt_answer(lp), i);
 		rr_type = ldns_rr_get_type(a_rr);
+		ttl = dns_ttl(ldns_rr_ttl(a_rr));
 
 		/* XXX Not necessary, remove when we have more confidence. */
 		/*
@@ -685,6 +3417,8 @@ dnsflow_dns_extract(ldns_pkt *lp)
 					ldns_rdf_data(rdf);
 				data->name_lens[data->num_names] =
 					ldns_rdf_size(rdf);
+				data->name_ttls[data->num_names] = ttl;
+				data->min_ttl = MIN(data->min_ttl, ttl);
 				data->num_names++;
 			} else if (rr_type == LDNS_RR_TYPE_A) {
 				if (data->num_ips == DNSFLOW_MAX_PARSE) {
@@ -692,10 +3426,23 @@ dnsflow_dns_extract(ldns_pkt *lp)
 					continue;
 				}
 				ip_ptr = (in_addr_t *) ldns_rdf_data(rdf);
+				data->ip_ttls[data->num_ips] = ttl;
+				data->min_ttl = MIN(data->min_ttl, ttl);
 				data->ips[data->num_ips++] = *ip_ptr;
+			} else if (rr_type == LDNS_RR_TYPE_AAAA &&
+					q_type == LDNS_RR_TYPE_AAAA) {
+				if (data->num_ips6 == DNSFLOW_MAX_PARSE) {
+					_log("Too many ips");
+					continue;
+				}
+				data->ip6_ttls[data->num_ips6] = ttl;
+				data->min_ttl = MIN(data->min_ttl, ttl);
+				memcpy(&data->ips6[data->num_ips6++],
+						ldns_rdf_data(rdf),
+						sizeof(struct in6_addr));
 			} else {
-				/* XXX Only looking at A queries, so this is
-				 * unexpected rdata. */
+				/* XXX Only looking at A and AAAA queries, so
+				 * this is unexpected rdata. */
 			}
 		}
 	}
@@ -704,263 +3451,4385 @@ dnsflow_dns_extract(ldns_pkt *lp)
 	if (data->num_names == 0) {
 		return (NULL);
 	}
-	if (data->num_ips == 0) {
+	if (data->num_ips == 0 && data->num_ips6 == 0) {
 		return (NULL);
 	}
 
 	return (data);
 }
 
+/* Validation mode - compare the native parse against ldns.
+ * Returns 0 if they match. */
+static int
+dnsflow_dns_compare(struct dns_data_set *a, struct dns_data_set *b)
+{
+	int		i;
+
+	if (a == NULL || b == NULL) {
+		return (a != b);
+	}
+	if (a->num_names != b->num_names || a->num_ips != b->num_ips ||
+	    a->num_ips6 != b->num_ips6) {
+		return (1);
+	}
+	for (i = 0; i < a->num_names; i++) {
+		if (a->name_lens[i] != b->name_lens[i] ||
+		    memcmp(a->names[i], b->names[i], a->name_lens[i]) != 0) {
+			return (1);
+		}
+	}
+	if (memcmp(a->ips, b->ips, a->num_ips * sizeof(in_addr_t)) != 0 ||
+	    memcmp(a->ips6, b->ips6,
+		    a->num_ips6 * sizeof(struct in6_addr)) != 0) {
+		return (1);
+	}
+	/* The qname has no ttl. */
+	if (a->min_ttl != b->min_ttl || (a->num_names > 1 &&
+	    memcmp(a->name_ttls + 1, b->name_ttls + 1,
+		    (a->num_names - 1) * sizeof(uint32_t)) != 0) ||
+	    memcmp(a->ip_ttls, b->ip_ttls,
+		    a->num_ips * sizeof(uint32_t)) != 0 ||
+	    memcmp(a->ip6_ttls, b->ip6_ttls,
+		    a->num_ips6 * sizeof(uint32_t)) != 0) {
+		return (1);
+	}
+	return (0);
+}
+
 static void
-dnsflow_pkt_send(struct dnsflow_buf *buf)
+dnsflow_dns_verify(struct dnsflow_worker *dw, int pkt_len, char *dns_pkt,
+		struct dns_data_set *native)
 {
-	static int 		udp_socket = 0;
-	struct pcap_pkthdr 	pkthdr;
-	int			i;
+	struct dns_data_set		*ld = NULL;
+	ldns_pkt			*lp;
 
-	if (pdump != NULL) {
-		gettimeofday(&pkthdr.ts, NULL);
-		buf->db_loop_hdr = PF_UNSPEC;
-		pkthdr.len = buf->db_len + 4; /* 4 for loopback hdr. */
-		pkthdr.caplen = pkthdr.len;
-		pcap_dump((u_char *)pdump, &pkthdr,
-				(u_char *)&buf->db_loop_hdr);
+	if ((lp = dnsflow_ldns_check(pkt_len, dns_pkt)) != NULL) {
+		ld = dnsflow_ldns_extract(lp, dw->dw_ldns_data);
+	}
+	if (dnsflow_dns_compare(native, ld) != 0) {
+		dw->dw_parser_mismatches++;
+		_log("DNS parser mismatch: native names=%d ips=%d, "
+				"ldns names=%d ips=%d",
+				native ? native->num_names : -1,
+				native ? native->num_ips : -1,
+				ld ? ld->num_names : -1, ld ? ld->num_ips : -1);
+	}
+	if (lp != NULL) {
+		ldns_pkt_free(lp);
 	}
+}
 
-	if (udp_num_dsts == 0) {
+/* -U. Connect to the collector's socket, with unix_lock held. */
+static void
+dnsflow_unix_connect(void)
+{
+	struct sockaddr_un	sun;
+	int			fd;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", unix_path);
+	unix_retry = time(NULL) + 1;
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+		_log("unix socket: %s", strerror(errno));
+		return;
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    (!unix_wait && fcntl(fd, F_SETFL, O_NONBLOCK) < 0)) {
+		close(fd);
 		return;
 	}
+	_log("connected to %s", unix_path);
+	unix_socket = fd;
+}
 
-	if (udp_socket == 0) {
-		if ((udp_socket = socket(PF_INET, SOCK_DGRAM, 0)) < 1) {
-			err(1, "socket failed");
+/* -U. Each flow pkt is one message. Until the collector is there, and
+ * when its socket is full, the pkts are counted in *errors. With -r, it
+ * waits for the collector instead, and resends what it was writing when
+ * the collector went away. */
+static void
+dnsflow_unix_send(struct iovec *iovs, int n_iovs, uint64_t *errors)
+{
+	int		i;
+
+	pthread_mutex_lock(&unix_lock);
+	for (i = 0; i < n_iovs; ) {
+		if (unix_socket < 0) {
+			if (time(NULL) < unix_retry) {
+				if (!unix_wait) {
+					break;
+				}
+				sleep(1);
+				continue;
+			}
+			dnsflow_unix_connect();
+			continue;
 		}
-	}
-	for (i = 0; i < udp_num_dsts; i++) {
-		if (sendto(udp_socket, &buf->db_pkt_hdr, buf->db_len, 0,
-				(struct sockaddr *)&dst_so_addrs[i],
-				sizeof(struct sockaddr_in)) < 0) {
-			warnx("send failed");
+		if (send(unix_socket, iovs[i].iov_base, iovs[i].iov_len,
+					0) >= 0) {
+			i++;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != ENOBUFS) {
+			_log("%s: %s, reconnecting", unix_path,
+					strerror(errno));
+			close(unix_socket);
+			unix_socket = -1;
+			if (unix_wait) {
+				continue;
+			}
 		}
+		break;
 	}
+	*errors += n_iovs - i;
+	pthread_mutex_unlock(&unix_lock);
 }
 
-static void
-dnsflow_pkt_send_data()
+/* -D. The length of the frame at pos, including its own 4 bytes. */
+static uint32_t
+dnsflow_tcp_frame_len(struct dnsflow_tcp *tc, uint64_t pos)
 {
-	if (data_buf->db_len == 0) {
-		return;
+	uint32_t	len;
+	uint8_t		*p = (uint8_t *)&len;
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		p[i] = tc->tc_spool[(pos + i) & tc->tc_mask];
 	}
-	data_buf->db_pkt_hdr.sequence_number = htonl(sequence_number++);
-	dnsflow_pkt_send(data_buf);
-	data_buf->db_len = 0;
-	last_send = time(NULL);
+	return (4 + ntohl(len));
 }
 
 static void
-dnsflow_push_cb(int fd, short event, void *arg) 
+dnsflow_tcp_copy(struct dnsflow_tcp *tc, const void *src, size_t len)
 {
-	time_t		now = time(NULL);
+	uint64_t	off = tc->tc_tail & tc->tc_mask;
+	size_t		n = MIN(len, tc->tc_mask + 1 - off);
+
+	memcpy(tc->tc_spool + off, src, n);
+	memcpy(tc->tc_spool, (const char *)src + n, len - n);
+	tc->tc_tail += len;
+}
 
-	if (now - last_send >= push_tv.tv_sec) {
-		dnsflow_pkt_send_data();
+/* Whether the oldest frame can be dropped. Not if it's partly written, or
+ * a tls write that's waiting to be repeated has already taken it. */
+static int
+dnsflow_tcp_evictable(struct dnsflow_tcp *tc)
+{
+	if (tc->tc_head != tc->tc_frame || tc->tc_frame == tc->tc_tail) {
+		return (0);
 	}
-	evtimer_add(&push_ev, jitter_tv(&push_tv));
+#if DNSFLOW_TLS
+	if (tc->tc_tls_len != 0) {
+		return (0);
+	}
+#endif
+	return (1);
 }
 
-/* XXX Need more care to prevent buffer overruns. */
+/* Frame the pkts into the spool. When it's full, the oldest frame is
+ * dropped to make room, unless it can't be (or with the new policy), in
+ * which case the pkt is. */
 static void
-dnsflow_pkt_build(in_addr_t client_ip, struct dns_data_set *dns_data)
+dnsflow_tcp_spool(struct dnsflow_tcp *tc, struct iovec *iovs, int n_iovs)
 {
-	struct dnsflow_hdr	*dnsflow_hdr;
-	struct dnsflow_set_hdr	*set_hdr;
-	char			*pkt_start, *pkt_cur, *pkt_end, *names_start;
-	int			i;
-	in_addr_t		*ip_ptr;
-	
+	uint64_t	size = tc->tc_mask + 1;
+	uint32_t	len;
+	int		i;
+
+	for (i = 0; i < n_iovs; i++) {
+		len = 4 + iovs[i].iov_len;
+		while (tc->tc_tail - tc->tc_frame + len > size &&
+		    !tc->tc_drop_new && dnsflow_tcp_evictable(tc)) {
+			tc->tc_frame += dnsflow_tcp_frame_len(tc,
+					tc->tc_frame);
+			tc->tc_head = tc->tc_frame;
+			tc->tc_dropped++;
+		}
+		if (tc->tc_tail - tc->tc_frame + len > size) {
+			tc->tc_dropped++;
+			continue;
+		}
+		len = htonl(iovs[i].iov_len);
+		dnsflow_tcp_copy(tc, &len, 4);
+		dnsflow_tcp_copy(tc, iovs[i].iov_base, iovs[i].iov_len);
+	}
+}
+
+/* Tell the main loop it has something to do. */
+static void
+dnsflow_tcp_wake(struct dnsflow_tcp *tc)
+{
+	char		c = 0;
+
+	if (!tc->tc_wait && write(tc->tc_wake[1], &c, 1) < 0) {
+		/* Full, so it's awake already. */
+	}
+}
+
+#if DNSFLOW_TLS
+static const char *
+dnsflow_tls_error(void)
+{
+	unsigned long	e;
+
+	if ((e = ERR_get_error()) != 0) {
+		return (ERR_reason_error_string(e));
+	}
+	return (errno != 0 ? strerror(errno) : "connection closed");
+}
+#endif
+
+/* Returns what was written, 0 if the socket's full, or -1 if the
+ * connection's gone. */
+static ssize_t
+dnsflow_tcp_write(struct dnsflow_tcp *tc, const void *p, size_t len)
+{
+	ssize_t		rv;
+#if DNSFLOW_TLS
+	int		n;
+
+	if (tc->tc_ssl != NULL) {
+		/* One that wanted to wait has to be repeated with the same
+		 * length. The data at tc_head doesn't change. */
+		n = tc->tc_tls_len != 0 ? tc->tc_tls_len :
+			(int)MIN(len, INT_MAX);
+		ERR_clear_error();
+		errno = 0;
+		if ((rv = SSL_write(tc->tc_ssl, p, n)) > 0) {
+			tc->tc_tls_len = 0;
+			return (rv);
+		}
+		tc->tc_tls_want = SSL_get_error(tc->tc_ssl, rv);
+		if (tc->tc_tls_want == SSL_ERROR_WANT_READ ||
+		    tc->tc_tls_want == SSL_ERROR_WANT_WRITE) {
+			tc->tc_tls_len = n;
+			return (0);
+		}
+		_log("%s: tls write failed: %s", tc->tc_name,
+				dnsflow_tls_error());
+		return (-1);
+	}
+#endif
+	if ((rv = send(tc->tc_fd, p, len, 0)) >= 0) {
+		return (rv);
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		return (0);
+	}
+	_log("%s: %s", tc->tc_name, strerror(errno));
+	return (-1);
+}
+
+static void dnsflow_tcp_close(struct dnsflow_tcp *tc);
+static void dnsflow_tcp_connect(struct dnsflow_tcp *tc);
+
+/* Write out the spool, until it's empty or the socket's full. With -r,
+ * until it's empty, connecting again as often as it takes. */
+static void
+dnsflow_tcp_flush(struct dnsflow_tcp *tc)
+{
+	uint64_t	off;
+	ssize_t		rv;
+
+	while (tc->tc_head < tc->tc_tail) {
+		if (tc->tc_wait && tc->tc_state == DNSFLOW_TCP_DOWN) {
+			/* -r. dnsflow_tcp_close() waited out the backoff. */
+			dnsflow_tcp_connect(tc);
+			continue;
+		}
+		if (tc->tc_state != DNSFLOW_TCP_UP || tc->tc_stalled) {
+			break;
+		}
+		off = tc->tc_head & tc->tc_mask;
+		rv = dnsflow_tcp_write(tc, tc->tc_spool + off,
+				MIN(tc->tc_tail - tc->tc_head,
+					tc->tc_mask + 1 - off));
+		if (rv < 0 && tc->tc_wait) {
+			/* No main loop to leave it to. */
+			_log("lost %s, reconnecting", tc->tc_name);
+			dnsflow_tcp_close(tc);
+		} else if (rv < 0) {
+			tc->tc_state = DNSFLOW_TCP_FAILED;
+			__sync_lock_test_and_set(&tc->tc_up, 0);
+			dnsflow_tcp_wake(tc);
+		} else if (rv == 0) {
+			if (tc->tc_wait) {
+				/* Interrupted. */
+				continue;
+			}
+			tc->tc_stalled = 1;
+			tc->tc_stalls++;
+			dnsflow_tcp_wake(tc);
+		} else {
+			tc->tc_head += rv;
+			while (tc->tc_frame < tc->tc_head &&
+			    tc->tc_frame + dnsflow_tcp_frame_len(tc,
+				    tc->tc_frame) <= tc->tc_head) {
+				tc->tc_frame += dnsflow_tcp_frame_len(tc,
+						tc->tc_frame);
+				tc->tc_sent++;
+			}
+		}
+	}
+}
+
+/* -D. Spool the pkts for shard (all of them without -k), and write out
+ * what the socket takes, unless the main loop's waiting on it. Pkts the
+ * spool drops are counted in *errors. */
+static void
+dnsflow_tcp_send(struct dnsflow_tcp *tc, struct dnsflow_buf **bufs,
+		struct iovec *iovs, int n_bufs, int shard, uint64_t *errors)
+{
+	struct iovec		mine[DNSFLOW_EXPORT_BATCH];
+	uint32_t		dropped;
+	int			i, n = 0;
+
+	for (i = 0; i < n_bufs; i++) {
+		if (bufs[i]->db_shard < 0 || bufs[i]->db_shard == shard) {
+			mine[n++] = iovs[i];
+		}
+	}
+	if (n == 0) {
+		return;
+	}
+	pthread_mutex_lock(&tc->tc_lock);
+	dropped = tc->tc_dropped;
+	dnsflow_tcp_spool(tc, mine, n);
+	dnsflow_tcp_flush(tc);
+	*errors += tc->tc_dropped - dropped;
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+static void dnsflow_tcp_read_cb(int fd, short event, void *arg);
+static void dnsflow_tcp_write_cb(int fd, short event, void *arg);
+
+/* Main loop, from here down, with tc_lock held. Close the connection and
+ * try again later, from the start of the frame that was going out. The
+ * wait doubles each time, up to DNSFLOW_TCP_BACKOFF_MAX, and is jittered
+ * so a fleet that lost the collector doesn't come back all at once. With
+ * -r, there's no main loop, so the sender waits it out here. */
+static void
+dnsflow_tcp_close(struct dnsflow_tcp *tc)
+{
+	struct timeval	tv;
+
+	if (tc->tc_fd >= 0) {
+		event_del(&tc->tc_read_ev);
+		event_del(&tc->tc_write_ev);
+#if DNSFLOW_TLS
+		if (tc->tc_ssl != NULL) {
+			SSL_free(tc->tc_ssl);
+			tc->tc_ssl = NULL;
+			tc->tc_tls_len = 0;
+		}
+#endif
+		close(tc->tc_fd);
+		tc->tc_fd = -1;
+	}
+	tc->tc_head = tc->tc_frame;
+	tc->tc_stalled = 0;
+	tc->tc_state = DNSFLOW_TCP_DOWN;
+	__sync_lock_test_and_set(&tc->tc_up, 0);
+
+	tv.tv_sec = tc->tc_backoff;
+	tv.tv_usec = random() % 1000000;
+	if (tc->tc_wait) {
+		sleep(tv.tv_sec);
+		usleep(tv.tv_usec);
+	} else {
+		evtimer_add(&tc->tc_retry_ev, &tv);
+	}
+	tc->tc_backoff = MIN(tc->tc_backoff * 2, DNSFLOW_TCP_BACKOFF_MAX);
+}
+
+static void
+dnsflow_tcp_up(struct dnsflow_tcp *tc)
+{
+	_log("connected to %s", tc->tc_name);
+	tc->tc_state = DNSFLOW_TCP_UP;
+	__sync_lock_test_and_set(&tc->tc_up, 1);
+	tc->tc_backoff = 1;
+	tc->tc_connects++;
+	if (!tc->tc_wait) {
+		/* With -r, the sender that reconnected is flushing. */
+		dnsflow_tcp_flush(tc);
+	}
+}
+
+#if DNSFLOW_TLS
+/* Returns 0 when it's done, 1 if it's waiting on the socket, and -1 if it
+ * failed. */
+static int
+dnsflow_tcp_handshake(struct dnsflow_tcp *tc)
+{
+	long		verify;
+	int		rv;
+
+	ERR_clear_error();
+	errno = 0;
+	if ((rv = SSL_connect(tc->tc_ssl)) == 1) {
+		return (0);
+	}
+	switch (SSL_get_error(tc->tc_ssl, rv)) {
+	case SSL_ERROR_WANT_READ:
+		/* tc_read_ev is always on. */
+		return (1);
+	case SSL_ERROR_WANT_WRITE:
+		event_add(&tc->tc_write_ev, NULL);
+		return (1);
+	}
+	if ((verify = SSL_get_verify_result(tc->tc_ssl)) != X509_V_OK) {
+		_log("%s: tls handshake failed: %s", tc->tc_name,
+				X509_verify_cert_error_string(verify));
+	} else {
+		_log("%s: tls handshake failed: %s", tc->tc_name,
+				dnsflow_tls_error());
+	}
+	return (-1);
+}
+
+static void
+dnsflow_tcp_handshake_next(struct dnsflow_tcp *tc)
+{
+	switch (dnsflow_tcp_handshake(tc)) {
+	case 0:
+		dnsflow_tcp_up(tc);
+		break;
+	case -1:
+		dnsflow_tcp_close(tc);
+		break;
+	}
+}
+#endif
+
+/* The tcp connect finished. */
+static void
+dnsflow_tcp_connected(struct dnsflow_tcp *tc)
+{
+	if (!tc->tc_wait) {
+		event_add(&tc->tc_read_ev, NULL);
+	}
+#if DNSFLOW_TLS
+	if (tc->tc_tls_ctx != NULL) {
+		if ((tc->tc_ssl = SSL_new(tc->tc_tls_ctx)) == NULL ||
+		    SSL_set_fd(tc->tc_ssl, tc->tc_fd) != 1) {
+			_log("%s: SSL_new failed", tc->tc_name);
+			dnsflow_tcp_close(tc);
+			return;
+		}
+		dnsflow_tcp_handshake_next(tc);
+		return;
+	}
+#endif
+	dnsflow_tcp_up(tc);
+}
+
+static void
+dnsflow_tcp_connect(struct dnsflow_tcp *tc)
+{
+	int		fd, on = 1;
+
+	if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+		_log("tcp socket: %s", strerror(errno));
+		dnsflow_tcp_close(tc);
+		return;
+	}
+	tc->tc_fd = fd;
+	tc->tc_state = DNSFLOW_TCP_CONNECTING;
+	/* So a collector that's gone quiet is noticed eventually. */
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	event_set(&tc->tc_read_ev, fd, EV_READ | EV_PERSIST,
+			dnsflow_tcp_read_cb, tc);
+	event_set(&tc->tc_write_ev, fd, EV_WRITE, dnsflow_tcp_write_cb, tc);
+	if (!tc->tc_wait && fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		_log("tcp socket: %s", strerror(errno));
+		dnsflow_tcp_close(tc);
+		return;
+	}
+	if (connect(fd, (struct sockaddr *)&tc->tc_addr,
+				sizeof(tc->tc_addr)) == 0) {
+		dnsflow_tcp_connected(tc);
+	} else if (errno == EINPROGRESS && !tc->tc_wait) {
+		event_add(&tc->tc_write_ev, NULL);
+	} else {
+		_log("can't connect to %s: %s", tc->tc_name, strerror(errno));
+		dnsflow_tcp_close(tc);
+	}
+}
+
+static void
+dnsflow_tcp_write_cb(int fd, short event, void *arg)
+{
+	struct dnsflow_tcp	*tc = arg;
+	socklen_t		len = sizeof(int);
+	int			error = 0;
+
+	pthread_mutex_lock(&tc->tc_lock);
+	if (tc->tc_state == DNSFLOW_TCP_CONNECTING) {
+#if DNSFLOW_TLS
+		if (tc->tc_ssl != NULL) {
+			dnsflow_tcp_handshake_next(tc);
+			pthread_mutex_unlock(&tc->tc_lock);
+			return;
+		}
+#endif
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+			error = errno;
+		}
+		if (error != 0) {
+			_log("can't connect to %s: %s", tc->tc_name,
+					strerror(error));
+			dnsflow_tcp_close(tc);
+		} else {
+			dnsflow_tcp_connected(tc);
+		}
+	} else if (tc->tc_state == DNSFLOW_TCP_UP) {
+		tc->tc_stalled = 0;
+		dnsflow_tcp_flush(tc);
+	}
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+/* The collector doesn't send anything, so this is for noticing it going
+ * away (and for tls, which has its own reasons to read). */
+static void
+dnsflow_tcp_read_cb(int fd, short event, void *arg)
+{
+	struct dnsflow_tcp	*tc = arg;
+	char			buf[4096];
+	ssize_t			rv;
+
+	pthread_mutex_lock(&tc->tc_lock);
+#if DNSFLOW_TLS
+	if (tc->tc_ssl != NULL) {
+		if (tc->tc_state == DNSFLOW_TCP_CONNECTING) {
+			dnsflow_tcp_handshake_next(tc);
+			pthread_mutex_unlock(&tc->tc_lock);
+			return;
+		}
+		ERR_clear_error();
+		if ((rv = SSL_read(tc->tc_ssl, buf, sizeof(buf))) <= 0) {
+			switch (SSL_get_error(tc->tc_ssl, rv)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				break;
+			default:
+				_log("%s closed the connection", tc->tc_name);
+				dnsflow_tcp_close(tc);
+				break;
+			}
+		}
+		if (tc->tc_state == DNSFLOW_TCP_UP && tc->tc_stalled &&
+		    tc->tc_tls_want == SSL_ERROR_WANT_READ) {
+			/* The write that was waiting for this. */
+			tc->tc_stalled = 0;
+			dnsflow_tcp_flush(tc);
+		}
+		pthread_mutex_unlock(&tc->tc_lock);
+		return;
+	}
+#endif
+	rv = recv(fd, buf, sizeof(buf), 0);
+	if (rv == 0) {
+		_log("%s closed the connection", tc->tc_name);
+		dnsflow_tcp_close(tc);
+	} else if (rv < 0 && errno != EAGAIN && errno != EINTR) {
+		_log("%s: %s", tc->tc_name, strerror(errno));
+		dnsflow_tcp_close(tc);
+	}
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+/* A sender stalled, or lost the connection. */
+static void
+dnsflow_tcp_wake_cb(int fd, short event, void *arg)
+{
+	struct dnsflow_tcp	*tc = arg;
+	char			buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		;
+	}
+	pthread_mutex_lock(&tc->tc_lock);
+	if (tc->tc_state == DNSFLOW_TCP_FAILED) {
+		_log("lost %s, reconnecting", tc->tc_name);
+		dnsflow_tcp_close(tc);
+	} else if (tc->tc_state == DNSFLOW_TCP_UP && tc->tc_stalled &&
+	    !event_pending(&tc->tc_write_ev, EV_WRITE, NULL)) {
+#if DNSFLOW_TLS
+		if (tc->tc_ssl != NULL &&
+		    tc->tc_tls_want == SSL_ERROR_WANT_READ) {
+			/* tc_read_ev will pick it up. */
+			pthread_mutex_unlock(&tc->tc_lock);
+			return;
+		}
+#endif
+		event_add(&tc->tc_write_ev, NULL);
+	}
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+static void
+dnsflow_tcp_retry_cb(int fd, short event, void *arg)
+{
+	struct dnsflow_tcp	*tc = arg;
+
+	pthread_mutex_lock(&tc->tc_lock);
+	if (tc->tc_state == DNSFLOW_TCP_DOWN) {
+		dnsflow_tcp_connect(tc);
+	}
+	pthread_mutex_unlock(&tc->tc_lock);
+}
+
+/* -D. The spool is spool_mb, rounded up to a power of 2. With wait (-r),
+ * the socket is blocking and connected here, and there are no events. With
+ * ca_file, it's tls, and the collector's cert has to be for its ip. */
+static struct dnsflow_tcp *
+dnsflow_tcp_new(const struct sockaddr_in *addr, int spool_mb, int drop_new,
+		int wait, const char *ca_file)
+{
+	struct dnsflow_tcp	*tc;
+	char			ip[INET_ADDRSTRLEN];
+	uint64_t		size;
+
+	if ((tc = calloc(1, sizeof(*tc))) == NULL) {
+		err(1, "calloc");
+	}
+	tc->tc_addr = *addr;
+	inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+	snprintf(tc->tc_name, sizeof(tc->tc_name), "%s:%u", ip,
+			ntohs(addr->sin_port));
+	tc->tc_drop_new = drop_new;
+	tc->tc_wait = wait;
+	tc->tc_fd = -1;
+	/* Until it's found to be down. */
+	tc->tc_up = 1;
+	tc->tc_backoff = 1;
+	pthread_mutex_init(&tc->tc_lock, NULL);
+	for (size = 1; size < (uint64_t)spool_mb << 20; size <<= 1) {
+		;
+	}
+	if ((tc->tc_spool = malloc(size)) == NULL) {
+		err(1, "tcp spool");
+	}
+	tc->tc_mask = size - 1;
+
+	if (ca_file != NULL) {
+#if DNSFLOW_TLS
+		if ((tc->tc_tls_ctx = SSL_CTX_new(TLS_client_method())) ==
+		    NULL) {
+			errx(1, "SSL_CTX_new failed");
+		}
+		if (SSL_CTX_set_min_proto_version(tc->tc_tls_ctx,
+					TLS1_2_VERSION) != 1) {
+			errx(1, "can't require tls 1.2");
+		}
+		if (SSL_CTX_load_verify_locations(tc->tc_tls_ctx, ca_file,
+					NULL) != 1) {
+			errx(1, "%s: %s", ca_file,
+				ERR_reason_error_string(ERR_get_error()));
+		}
+		SSL_CTX_set_verify(tc->tc_tls_ctx, SSL_VERIFY_PEER, NULL);
+		X509_VERIFY_PARAM_set1_ip(SSL_CTX_get0_param(tc->tc_tls_ctx),
+				(const unsigned char *)&addr->sin_addr, 4);
+		/* Writes straight from the spool, which retries from
+		 * wherever tc_head is. */
+		SSL_CTX_set_mode(tc->tc_tls_ctx,
+				SSL_MODE_ENABLE_PARTIAL_WRITE |
+				SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#else
+		errx(1, "-e needs tls, build with make TLS=1");
+#endif
+	}
+
+	/* The collector going away shouldn't take us with it. */
+	signal(SIGPIPE, SIG_IGN);
+	evtimer_set(&tc->tc_retry_ev, dnsflow_tcp_retry_cb, tc);
+	if (wait) {
+		dnsflow_tcp_connect(tc);
+		if (tc->tc_state != DNSFLOW_TCP_UP) {
+			errx(1, "can't connect to %s", tc->tc_name);
+		}
+		return (tc);
+	}
+	if (pipe(tc->tc_wake) < 0 ||
+	    fcntl(tc->tc_wake[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(tc->tc_wake[1], F_SETFL, O_NONBLOCK) < 0) {
+		err(1, "pipe");
+	}
+	event_set(&tc->tc_wake_ev, tc->tc_wake[0], EV_READ | EV_PERSIST,
+			dnsflow_tcp_wake_cb, tc);
+	event_add(&tc->tc_wake_ev, NULL);
+	dnsflow_tcp_connect(tc);
+	return (tc);
+}
+
+/* Free the replaced dsts lists that every worker has acked a newer gen
+ * than. Main thread only, like the reloads. */
+static void
+dnsflow_dsts_reap(void)
+{
+	struct dnsflow_dsts	*ds, **dsp;
+	uint64_t		gen;
+	int			i;
+
+	gen = __atomic_load_n(&dsts_gen, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n_workers; i++) {
+		gen = MIN(gen, __atomic_load_n(&workers[i]->dw_dsts_gen,
+					__ATOMIC_ACQUIRE));
+	}
+	for (dsp = &dsts_retired; (ds = *dsp) != NULL; ) {
+		if (ds->ds_retired_gen > gen) {
+			dsp = &ds->ds_retired_next;
+			continue;
+		}
+		*dsp = ds->ds_retired_next;
+		if (ds != &dsts_cmdline) {
+			free(ds);
+		}
+	}
+}
+
+/* -k. A dst's points only depend on its address, so adding or removing
+ * one, in a reload, only moves the clients it takes or gives up. */
+static uint32_t
+dnsflow_shard_point(const struct sockaddr_in *addr, int vnode)
+{
+	uint32_t	port = ntohs(addr->sin_port);
+
+	return (dnsflow_pipe_hash(ntohl(addr->sin_addr.s_addr) ^
+		dnsflow_pipe_hash((port << 16 | vnode) ^ DNSFLOW_SHARD_SEED)));
+}
+
+static int
+dnsflow_vnode_cmp(const void *a, const void *b)
+{
+	const struct dnsflow_vnode	*va = a, *vb = b;
+
+	if (va->vn_point != vb->vn_point) {
+		return (va->vn_point < vb->vn_point ? -1 : 1);
+	}
+	return ((int)va->vn_shard - (int)vb->vn_shard);
+}
+
+/* -k. Give each of ds's udp dsts a shard: the one it has in cur, or one
+ * no list that might still be in use has, so a new dst doesn't pick up
+ * another's sequence numbers or pkts. -1 if there aren't enough left. */
+static int
+dnsflow_shard_assign(struct dnsflow_dsts *ds, const struct dnsflow_dsts *cur)
+{
+	const struct dnsflow_dsts	*r;
+	uint8_t				used[DNSFLOW_SHARD_UDP];
+	int				i, j, shard;
+
+	bzero(used, sizeof(used));
+	for (r = dsts_retired; r != NULL; r = r->ds_retired_next) {
+		for (i = 0; i < r->ds_n; i++) {
+			used[r->ds_shards[i]] = 1;
+		}
+	}
+	for (i = 0; cur != NULL && i < cur->ds_n; i++) {
+		used[cur->ds_shards[i]] = 1;
+	}
+	for (i = 0; i < ds->ds_n; i++) {
+		ds->ds_shards[i] = -1;
+		for (j = 0; cur != NULL && j < cur->ds_n; j++) {
+			if (memcmp(&ds->ds_addrs[i], &cur->ds_addrs[j],
+				    sizeof(struct sockaddr_in)) == 0) {
+				ds->ds_shards[i] = cur->ds_shards[j];
+				break;
+			}
+		}
+	}
+	for (i = 0; i < ds->ds_n; i++) {
+		if (ds->ds_shards[i] >= 0) {
+			continue;
+		}
+		for (shard = 0; shard < DNSFLOW_SHARD_UDP && used[shard];
+		    shard++) {
+			;
+		}
+		if (shard == DNSFLOW_SHARD_UDP) {
+			return (-1);
+		}
+		used[shard] = 1;
+		ds->ds_shards[i] = shard;
+		/* Nothing's left from the dst it had before. */
+		__sync_lock_test_and_set(&shard_seqs[shard], 0);
+	}
+	return (0);
+}
+
+/* -k. The ring over ds's udp dsts and the -D collectors. */
+static void
+dnsflow_shard_ring_build(struct dnsflow_dsts *ds)
+{
+	struct dnsflow_vnode	*vn = ds->ds_vnodes;
+	int			i, j;
+
+	for (i = 0; i < ds->ds_n; i++) {
+		for (j = 0; j < DNSFLOW_SHARD_VNODES; j++, vn++) {
+			vn->vn_point = dnsflow_shard_point(&ds->ds_addrs[i], j);
+			vn->vn_shard = ds->ds_shards[i];
+		}
+	}
+	for (i = 0; i < n_tcp_exports; i++) {
+		for (j = 0; j < DNSFLOW_SHARD_VNODES; j++, vn++) {
+			vn->vn_point = dnsflow_shard_point(
+					&tcp_exports[i]->tc_addr, j);
+			vn->vn_shard = DNSFLOW_SHARD_UDP + i;
+		}
+	}
+	ds->ds_n_vnodes = vn - ds->ds_vnodes;
+	qsort(ds->ds_vnodes, ds->ds_n_vnodes, sizeof(struct dnsflow_vnode),
+			dnsflow_vnode_cmp);
+}
+
+/* Only the -D collectors can be down. */
+static int
+dnsflow_shard_up(int shard)
+{
+	if (shard < DNSFLOW_SHARD_UDP) {
+		return (1);
+	}
+	return (__sync_fetch_and_add(
+			&tcp_exports[shard - DNSFLOW_SHARD_UDP]->tc_up, 0));
+}
+
+/* -k. The shard for a client: the first point on the ring at or after the
+ * hash of the client ip (the low 4 bytes for ipv6, like
+ * dnsflow_client_key()). Collectors that are down are skipped, so their
+ * clients move on to the next one round the ring until they're back. If
+ * they're all down, the sets wait in the first one's spool. -1 if there
+ * are no dsts. */
+static int
+dnsflow_shard_pick(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6)
+{
+	struct dnsflow_dsts	*ds = dw->dw_dsts;
+	uint32_t		key = client_ip, h;
+	int			lo = 0, hi = ds->ds_n_vnodes, mid, i, shard;
+
+	if (client6 != NULL) {
+		memcpy(&key, (const char *)client6 + 12, sizeof(key));
+	}
+	h = dnsflow_pipe_hash(ntohl(key) ^ DNSFLOW_SHARD_SEED);
+	if (hi == 0) {
+		return (-1);
+	}
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ds->ds_vnodes[mid].vn_point < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (i = 0; i < ds->ds_n_vnodes; i++) {
+		shard = ds->ds_vnodes[(lo + i) % ds->ds_n_vnodes].vn_shard;
+		if (dnsflow_shard_up(shard)) {
+			return (shard);
+		}
+	}
+	return (ds->ds_vnodes[lo % ds->ds_n_vnodes].vn_shard);
+}
+
+/* Send bufs to the pcap file, the -H ring, the -U socket, the -D
+ * collectors, and every udp dst, in one sendmmsg() where available. With
+ * -k, a buf with a db_shard only goes to that dst, a udp one at db_dst even
+ * if a reload took it out since (and the pcap file, ring and unix socket
+ * get everything). Failed sends are skipped and counted in *errors. If the
+ * udp socket is out of buffer space, the rest of the batch is dropped
+ * instead. The ring, the unix socket and the tcp spool never block; what
+ * doesn't fit is counted in *errors.
+ *
+ * With gso, runs of bufs go out as a single UDP_SEGMENT send. All but the
+ * last segment of a run have to be exactly the segment size, so they're
+ * zero padded (readers stop after sets_count sets). A buf that's bigger
+ * than the segment size, i.e., a single huge set, goes on its own.
+ *
+ * Returns the number of pkts sent (per dst), or -1 if the batch was
+ * dropped. */
+static int
+dnsflow_pkt_send(struct dnsflow_buf **bufs, int n_bufs, uint64_t *errors)
+{
+	struct pcap_pkthdr 	pkthdr;
+	struct iovec		iovs[DNSFLOW_EXPORT_BATCH];
+#if __linux__
+	struct mmsghdr		msgs[DNSFLOW_EXPORT_BATCH *
+					DNSFLOW_UDP_MAX_DSTS];
+	struct {
+		int		start;
+		int		count;
+	} runs[DNSFLOW_EXPORT_BATCH];
+	union {
+		char		buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr	align;
+	} gso_cmsg[DNSFLOW_EXPORT_BATCH];
+	struct cmsghdr		*cm;
+	struct dnsflow_buf	*buf;
+	struct msghdr		*mh;
+	int			rv, r, n_runs, max_segs, last;
+#endif
+	struct dnsflow_dsts	*ds;
+	int			i, d, shard, n_msgs;
+
+	assert(n_bufs <= DNSFLOW_EXPORT_BATCH);
+
+	if (pdump != NULL) {
+		gettimeofday(&pkthdr.ts, NULL);
+		pthread_mutex_lock(&pdump_lock);
+		for (i = 0; i < n_bufs; i++) {
+			bufs[i]->db_loop_hdr = PF_UNSPEC;
+			/* 4 for loopback hdr. */
+			pkthdr.len = bufs[i]->db_len + 4;
+			pkthdr.caplen = pkthdr.len;
+			pcap_dump((u_char *)pdump, &pkthdr,
+					(u_char *)&bufs[i]->db_loop_hdr);
+		}
+		pthread_mutex_unlock(&pdump_lock);
+	}
+
+	ds = __sync_fetch_and_add(&dsts, 0);
+	if (ds->ds_n == 0 && export_ring == NULL && unix_path == NULL &&
+	    n_tcp_exports == 0) {
+		return (n_bufs);
+	}
+
+	for (i = 0; i < n_bufs; i++) {
+		iovs[i].iov_base = &bufs[i]->db_pkt_hdr;
+		iovs[i].iov_len = bufs[i]->db_len;
+	}
+	if (export_ring != NULL) {
+		*errors += n_bufs - dnsflow_ring_put(export_ring, iovs, n_bufs);
+	}
+	if (unix_path != NULL) {
+		dnsflow_unix_send(iovs, n_bufs, errors);
+	}
+	for (i = 0; i < n_tcp_exports; i++) {
+		dnsflow_tcp_send(tcp_exports[i], bufs, iovs, n_bufs,
+				DNSFLOW_SHARD_UDP + i, errors);
+	}
+	if (ds->ds_n == 0 && !shard_export) {
+		return (n_bufs);
+	}
+
+#if __linux__
+	/* Without gso, every run is a single buf. */
+	max_segs = 1;
+	if (udp_gso_size > 0) {
+		max_segs = MIN(DNSFLOW_GSO_MAX_SEGS,
+				DNSFLOW_PKT_TARGET_MAX / udp_gso_size);
+	}
+	n_runs = 0;
+	for (i = 0; i < n_bufs; i += runs[n_runs++].count) {
+		runs[n_runs].start = i;
+		runs[n_runs].count = 1;
+		if (bufs[i]->db_len > (uint32_t)udp_gso_size) {
+			continue;
+		}
+		/* last is the run's last buf so far. */
+		for (last = i; last - i + 1 < max_segs && last + 1 < n_bufs &&
+		    bufs[last + 1]->db_len <= (uint32_t)udp_gso_size &&
+		    bufs[last + 1]->db_shard == bufs[i]->db_shard &&
+		    memcmp(&bufs[last + 1]->db_dst, &bufs[i]->db_dst,
+			    sizeof(struct sockaddr_in)) == 0; last++) {
+			/* Pad it, another segment follows. */
+			buf = bufs[last];
+			bzero((char *)&buf->db_pkt_hdr + buf->db_len,
+					udp_gso_size - buf->db_len);
+			iovs[last].iov_len = udp_gso_size;
+		}
+		runs[n_runs].count = last - i + 1;
+	}
+
+	/* pkt major, so each dst sees the pkts in sequence order. */
+	n_msgs = 0;
+	for (r = 0; r < n_runs; r++) {
+		buf = bufs[runs[r].start];
+		shard = buf->db_shard;
+		if (shard >= DNSFLOW_SHARD_UDP) {
+			/* A -D collector's. */
+			continue;
+		}
+		for (d = 0; d < (shard < 0 ? ds->ds_n : 1); d++) {
+			mh = &msgs[n_msgs++].msg_hdr;
+			bzero(mh, sizeof(struct msghdr));
+			mh->msg_name = shard < 0 ? &ds->ds_addrs[d] :
+				&buf->db_dst;
+			mh->msg_namelen = sizeof(struct sockaddr_in);
+			mh->msg_iov = &iovs[runs[r].start];
+			mh->msg_iovlen = runs[r].count;
+			if (runs[r].count == 1) {
+				continue;
+			}
+			mh->msg_control = gso_cmsg[r].buf;
+			mh->msg_controllen = sizeof(gso_cmsg[r].buf);
+			cm = CMSG_FIRSTHDR(mh);
+			cm->cmsg_level = IPPROTO_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			*(uint16_t *)CMSG_DATA(cm) = udp_gso_size;
+		}
+	}
+	for (i = 0; i < n_msgs; ) {
+		rv = sendmmsg(udp_socket, &msgs[i], n_msgs - i, 0);
+		if (rv > 0) {
+			i += rv;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == ENOBUFS || errno == EAGAIN) {
+			*errors += n_msgs - i;
+			return (-1);
+		}
+		/* e.g., ECONNREFUSED from an earlier send. Skip the msg that
+		 * failed and carry on with the rest. */
+		(*errors)++;
+		i++;
+	}
+#else
+	n_msgs = n_bufs * ds->ds_n;
+	for (i = 0; i < n_msgs; i++) {
+		shard = bufs[i / ds->ds_n]->db_shard;
+		d = i % ds->ds_n;
+		if (shard >= DNSFLOW_SHARD_UDP || (shard >= 0 && d > 0)) {
+			continue;
+		}
+		if (sendto(udp_socket, iovs[i / ds->ds_n].iov_base,
+				iovs[i / ds->ds_n].iov_len, 0, shard >= 0 ?
+				(struct sockaddr *)&bufs[i / ds->ds_n]->db_dst :
+				(struct sockaddr *)&ds->ds_addrs[d],
+				sizeof(struct sockaddr_in)) < 0) {
+			if (errno == ENOBUFS || errno == EAGAIN) {
+				*errors += n_msgs - i;
+				return (-1);
+			}
+			(*errors)++;
+		}
+	}
+#endif
+
+	return (n_bufs);
+}
+
+/* -O: keep finished pkts with the chunk, to be sent in file order by
+ * dnsflow_chunk_send(). */
+static void
+dnsflow_chunk_save(struct dnsflow_chunk *dc, struct dnsflow_buf **bufs,
+		int n_bufs)
+{
+	size_t		need;
+	int		i;
+
+	for (i = 0; i < n_bufs; i++) {
+		need = dc->dc_out_len + DNSFLOW_CHUNK_REC + bufs[i]->db_len;
+		if (need > dc->dc_out_size) {
+			dc->dc_out_size = MAX(need, dc->dc_out_size * 2);
+			dc->dc_out = realloc(dc->dc_out, dc->dc_out_size);
+			if (dc->dc_out == NULL) {
+				err(1, "realloc");
+			}
+		}
+		memcpy(dc->dc_out + dc->dc_out_len, &bufs[i]->db_len,
+				sizeof(uint32_t));
+		memcpy(dc->dc_out + dc->dc_out_len + sizeof(uint32_t),
+				&bufs[i]->db_shard, sizeof(int32_t));
+		memcpy(dc->dc_out + dc->dc_out_len + 2 * sizeof(uint32_t),
+				&bufs[i]->db_dst, sizeof(struct sockaddr_in));
+		memcpy(dc->dc_out + dc->dc_out_len + DNSFLOW_CHUNK_REC,
+				&bufs[i]->db_pkt_hdr, bufs[i]->db_len);
+		dc->dc_out_len = need;
+	}
+}
+
+/* -W: hand the export queue over to the export worker, swapping in free
+ * bufs. If the export worker has fallen behind and there aren't enough,
+ * the rest of the queue is dropped (or with -r, waits). */
+static void
+dnsflow_pipe_export(struct dnsflow_worker *dw)
+{
+	struct dnsflow_buf	*buf;
+	void			*slot;
+	int			i;
+
+	for (i = 0; i < dw->dw_export_queued; i++) {
+		while ((slot = dnsflow_spsc_peek(dw->dw_bufs_free)) == NULL &&
+		    pipe_wait) {
+			usleep(DNSFLOW_PIPE_SLEEP_US);
+		}
+		if (slot == NULL) {
+			dw->dw_pipe_overflows += dw->dw_export_queued - i;
+			break;
+		}
+		buf = dw->dw_export_bufs[i];
+		dw->dw_export_bufs[i] = *(struct dnsflow_buf **)slot;
+		dnsflow_spsc_pop(dw->dw_bufs_free);
+		/* Never full, there's room for every buf. */
+		slot = dnsflow_spsc_slot(dw->dw_bufs_full);
+		*(struct dnsflow_buf **)slot = buf;
+		dnsflow_spsc_push(dw->dw_bufs_full);
+	}
+}
+
+/* Empty the export queue. With -k, the pkt being built is the shard's own,
+ * not on the queue, so it's kept. */
+static void
+dnsflow_export_reset(struct dnsflow_worker *dw)
+{
+	dw->dw_export_queued = 0;
+	if (!shard_export) {
+		dw->dw_data_buf = dw->dw_export_bufs[0];
+		dw->dw_data_buf->db_len = 0;
+	}
+}
+
+/* Send everything on the worker's export queue. */
+static void
+dnsflow_export_flush(struct dnsflow_worker *dw)
+{
+	int		rv;
+	uint64_t	t = 0;
+
+	if (dw->dw_export_queued == 0) {
+		return;
+	}
+	if (dw->dw_role == DNSFLOW_WORKER_PARSE) {
+		dnsflow_pipe_export(dw);
+		dnsflow_export_reset(dw);
+		dw->dw_last_send = time(NULL);
+		return;
+	}
+	if (dw->dw_chunk != NULL) {
+		dnsflow_chunk_save(dw->dw_chunk, dw->dw_export_bufs,
+				dw->dw_export_queued);
+		dnsflow_export_reset(dw);
+		return;
+	}
+	if (stage_timing) {
+		t = hist_ticks();
+	}
+	rv = dnsflow_pkt_send(dw->dw_export_bufs, dw->dw_export_queued,
+			&dw->dw_export_errors);
+	if (stage_timing) {
+		t = hist_ticks() - t;
+		hist_add(&dw->dw_stage_hist[DNSFLOW_STAGE_SEND], t);
+		dw->dw_send_ticks += t;
+	}
+	if (rv < 0) {
+		dw->dw_export_dropped++;
+	} else {
+		dw->dw_export_sent += rv;
+	}
+	dnsflow_export_reset(dw);
+	dw->dw_last_send = time(NULL);
+}
+
+/* Returns 0 if the kernel supports UDP_SEGMENT, -1 if not. The size is
+ * set per send, not on the socket, so lone pkts never get segmented. */
+static int
+udp_gso_check(int fd, int size)
+{
+#if __linux__
+	int		off = 0;
+
+	if (setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &size,
+				sizeof(size)) == 0) {
+		setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof(off));
+		return (0);
+	}
+#endif
+	return (-1);
+}
+
+/* Queue the current data pkt, and start a new one. With -k, the shard's
+ * pkt trades places with the free buf at the end of the queue, and builds
+ * on in that. */
+static void
+dnsflow_pkt_send_data(struct dnsflow_worker *dw)
+{
+	struct dnsflow_pkt_state	*ps = dw->dw_pkt;
+	struct dnsflow_buf		*data_buf = dw->dw_data_buf;
+
+	if (data_buf->db_len == 0) {
+		return;
+	}
+	data_buf->db_shard = ps->ps_shard;
+	/* With -O, numbered when the chunk is sent. */
+	if (dw->dw_chunk == NULL) {
+		data_buf->db_pkt_hdr.sequence_number =
+			htonl(dnsflow_shard_seq(ps->ps_shard));
+	}
+	dw->dw_export_bytes += data_buf->db_len;
+	if (shard_export) {
+		data_buf->db_dst = ps->ps_dst;
+		ps->ps_buf = dw->dw_export_bufs[dw->dw_export_queued];
+		dw->dw_export_bufs[dw->dw_export_queued] = data_buf;
+	}
+	if (++dw->dw_export_queued == DNSFLOW_EXPORT_BATCH) {
+		dnsflow_export_flush(dw);
+	}
+	dw->dw_data_buf = shard_export ? ps->ps_buf :
+		dw->dw_export_bufs[dw->dw_export_queued];
+	dw->dw_data_buf->db_len = 0;
+}
+
+/* Only data pkts are built in these, so there's room for pkt_buf_max but
+ * not necessarily the rest of the union. */
+static struct dnsflow_buf *
+dnsflow_data_buf_new(struct dnsflow_arena *ar)
+{
+	struct dnsflow_buf		*buf;
+
+	buf = dnsflow_arena_alloc(ar, offsetof(struct dnsflow_buf,
+				db_pkt_hdr) + pkt_buf_max);
+	buf->db_type = DNSFLOW_DATA;
+	buf->db_shard = -1;
+	return (buf);
+}
+
+/* -k. Build into shard's pkt from now on. Shard -1 (no dsts left after a
+ * reload) is dw_pkt_one, which goes everywhere. */
+static void
+dnsflow_shard_set(struct dnsflow_worker *dw, int shard)
+{
+	struct dnsflow_dsts		*ds = dw->dw_dsts;
+	struct dnsflow_pkt_state	*ps;
+	int				i;
+
+	ps = shard < 0 ? &dw->dw_pkt_one : dw->dw_shards[shard];
+	if (ps == NULL) {
+		ps = dnsflow_arena_alloc(&dw->dw_arena, sizeof(*ps));
+		ps->ps_buf = dnsflow_data_buf_new(&dw->dw_arena);
+		ps->ps_shard = shard;
+		for (i = 0; i < ds->ds_n; i++) {
+			if (ds->ds_shards[i] == shard) {
+				ps->ps_dst = ds->ds_addrs[i];
+			}
+		}
+		dw->dw_shards[shard] = ps;
+	}
+	dw->dw_pkt = ps;
+	dw->dw_data_buf = ps->ps_buf;
+}
+
+/* Queue whatever's been built, with -k in every shard. */
+static void
+dnsflow_pkt_send_pending(struct dnsflow_worker *dw)
+{
+	int		i;
+
+	if (!shard_export) {
+		dnsflow_pkt_send_data(dw);
+		return;
+	}
+	for (i = -1; i < DNSFLOW_SHARD_MAX; i++) {
+		if (i < 0 || dw->dw_shards[i] != NULL) {
+			dnsflow_shard_set(dw, i);
+			dnsflow_pkt_send_data(dw);
+		}
+	}
+}
+
+static void dnsflow_agg_flush(struct dnsflow_worker *dw);
+static struct dnsflow_topk_win *dnsflow_topk_win(struct dnsflow_worker *dw);
+
+/* Switch the worker to a new sample rate, or, after a reload, a new
+ * filter. With the default filter, the kernel does the sampling, so the
+ * filter is rebuilt for the new rate. Pkts that got through before it's
+ * replaced are sampled in userspace. The filter is replaced in place, so
+ * the capture keeps its buffer and fanout group. */
+static void
+dnsflow_worker_filter_set(struct dnsflow_worker *dw, uint32_t rate,
+		uint32_t gen)
+{
+	char		*filter = NULL;
+
+	pthread_mutex_lock(&filter_lock);
+	if (filter_default && (!sample_qname || gen != dw->dw_filter_gen)) {
+		filter = build_pcap_filter(filter_args.encap_offset,
+				filter_args.proc_i, filter_args.n_procs,
+				filter_args.enable_mdns, sample_qname ? 0 : rate);
+	} else if (!filter_default && gen != dw->dw_filter_gen) {
+		filter = filter_user;
+	}
+	dw->dw_sample_rate = rate;
+	dw->dw_filter_gen = gen;
+	if (filter != NULL && dcap_set_filter(dw->dw_dcap, filter) < 0) {
+		_log("worker %d: can't update the filter to %s", dw->dw_id,
+				filter);
+	}
+	pthread_mutex_unlock(&filter_lock);
+}
+
+/* A worker isn't holding on to any dsts list it loaded before this. With
+ * -k, the pkts it was building for the old list's dsts are sent on to
+ * them first, and its shards pick up the new list's addrs. A shard only
+ * changes addr once no list that had the old one is left. */
+static void
+dnsflow_dsts_ack(struct dnsflow_worker *dw)
+{
+	struct dnsflow_dsts	*ds;
+	uint64_t		gen;
+	int			i;
+
+	gen = __atomic_load_n(&dsts_gen, __ATOMIC_ACQUIRE);
+	if (gen == dw->dw_dsts_gen) {
+		return;
+	}
+	if (shard_export && dw->dw_role != DNSFLOW_WORKER_CAPTURE &&
+	    dw->dw_role != DNSFLOW_WORKER_EXPORT) {
+		dnsflow_pkt_send_pending(dw);
+		dnsflow_export_flush(dw);
+	}
+	ds = dw->dw_dsts = __sync_fetch_and_add(&dsts, 0);
+	for (i = 0; shard_export && i < ds->ds_n; i++) {
+		if (dw->dw_shards[ds->ds_shards[i]] != NULL) {
+			dw->dw_shards[ds->ds_shards[i]]->ps_dst =
+				ds->ds_addrs[i];
+		}
+	}
+	__atomic_store_n(&dw->dw_dsts_gen, gen, __ATOMIC_RELEASE);
+}
+
+static void
+dnsflow_push_cb(int fd, short event, void *arg) 
+{
+	struct dnsflow_worker	*dw = (struct dnsflow_worker *)arg;
+	time_t			now = time(NULL);
+	uint32_t		rate, gen;
+
+	dnsflow_dsts_ack(dw);
+	if (dw->dw_dcap != NULL) {
+		rate = __sync_fetch_and_add(&sample_rate, 0);
+		gen = __sync_fetch_and_add(&filter_gen, 0);
+		if (rate != dw->dw_sample_rate || gen != dw->dw_filter_gen) {
+			dnsflow_worker_filter_set(dw, rate, gen);
+		}
+	}
+	if (dw->dw_topk[0] != NULL) {
+		/* So the stats timer can have an idle worker's sketches. */
+		dnsflow_topk_win(dw);
+	}
+
+	if (dw->dw_role == DNSFLOW_WORKER_CAPTURE) {
+		/* Nothing to send. */
+	} else if (dw->dw_agg != NULL &&
+	    now - dw->dw_agg->ag_window_start >= agg_window) {
+		dnsflow_agg_flush(dw);
+		dnsflow_pkt_send_pending(dw);
+		dnsflow_export_flush(dw);
+	} else if (now - dw->dw_last_send >= push_tv.tv_sec) {
+		dnsflow_pkt_send_pending(dw);
+		dnsflow_export_flush(dw);
+	}
+	dw->dw_push_tv.tv_sec = push_tv.tv_sec;
+	evtimer_add(&dw->dw_push_ev, jitter_tv(&dw->dw_push_tv));
+}
+
+static int
+varint_put(uint8_t *p, uint32_t v)
+{
+	int		n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return (n);
+}
+
+static uint32_t
+zigzag(uint32_t a, uint32_t b)
+{
+	int32_t		d = (int32_t)(a - b);
+
+	return (((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+}
+
+/* Flags for a new data pkt. */
+static uint16_t
+dnsflow_data_flags(int compressed)
+{
+	uint16_t	flags = 0;
+
+	if (compressed) {
+		flags |= DNSFLOW_FLAG_COMPRESSED;
+	}
+	if (agg_n_entries) {
+		flags |= DNSFLOW_FLAG_HITS;
+	}
+	if (ttl_mode != DNSFLOW_TTL_NONE) {
+		flags |= DNSFLOW_FLAG_TTL;
+	}
+	if (ttl_mode == DNSFLOW_TTL_RR) {
+		flags |= DNSFLOW_FLAG_RR_TTLS;
+	}
+	if (rtt_n_buckets) {
+		flags |= DNSFLOW_FLAG_RTT;
+	}
+	return (htons(flags));
+}
+
+/* Room for the -L and -Q fields of a set, see the format. Compressed is
+ * the worst case, 5 byte varints. */
+static int
+dnsflow_set_tail_len(int names_count, int ips_count, int compressed)
+{
+	int		n = 0;
+
+	if (ttl_mode != DNSFLOW_TTL_NONE) {
+		n += 3;
+	}
+	if (ttl_mode == DNSFLOW_TTL_RR) {
+		n += MAX(names_count - 1, 0) + ips_count;
+	}
+	if (rtt_n_buckets) {
+		n++;
+	}
+	return (n * (compressed ? 5 : sizeof(uint32_t)));
+}
+
+static uint8_t *
+dnsflow_u32_put(uint8_t *pkt_cur, uint32_t v, int compressed)
+{
+	if (compressed) {
+		return (pkt_cur + varint_put(pkt_cur, v));
+	}
+	v = htonl(v);
+	memcpy(pkt_cur, &v, sizeof(uint32_t));
+	return (pkt_cur + sizeof(uint32_t));
+}
+
+/* Write the -L and -Q fields of a set at pkt_cur, after the hits. The ips
+ * are in set order, the A answers and then any AAAA. Returns the new
+ * pkt_cur. */
+static uint8_t *
+dnsflow_set_tail_put(struct dnsflow_worker *dw, uint8_t *pkt_cur,
+		struct dns_data_set *dns_data, int names_count, int ips_count,
+		int compressed)
+{
+	struct dnsflow_pkt_state	*ps = dw->dw_pkt;
+	uint32_t	ts = dns_data->tv.tv_sec;
+	int		i, rr = ttl_mode == DNSFLOW_TTL_RR;
+
+	if (ttl_mode != DNSFLOW_TTL_NONE) {
+		if (compressed) {
+			pkt_cur = dnsflow_u32_put(pkt_cur,
+					zigzag(ts, ps->ps_last_ts), 1);
+			ps->ps_last_ts = ts;
+		} else {
+			pkt_cur = dnsflow_u32_put(pkt_cur, ts, 0);
+		}
+		pkt_cur = dnsflow_u32_put(pkt_cur, dns_data->tv.tv_usec,
+				compressed);
+		/* Still UINT32_MAX if no answer had a ttl. */
+		pkt_cur = dnsflow_u32_put(pkt_cur,
+				dns_data->min_ttl == UINT32_MAX ? 0 :
+				dns_data->min_ttl, compressed);
+	}
+	for (i = 1; rr && i < names_count; i++) {
+		pkt_cur = dnsflow_u32_put(pkt_cur, dns_data->name_ttls[i],
+				compressed);
+	}
+	for (i = 0; rr && i < ips_count; i++) {
+		pkt_cur = dnsflow_u32_put(pkt_cur, i < dns_data->num_ips ?
+				dns_data->ip_ttls[i] :
+				dns_data->ip6_ttls[i - dns_data->num_ips],
+				compressed);
+	}
+	if (rtt_n_buckets) {
+		pkt_cur = dnsflow_u32_put(pkt_cur, dns_data->rtt, compressed);
+	}
+	return (pkt_cur);
+}
+
+/* Returns the name table index of the name, or -1 if it isn't in the pkt
+ * yet. Then *slot is where to add it, or -1 if the table is full. */
+static int
+dnsflow_cname_lookup(struct dnsflow_worker *dw, char *pkt_start,
+		uint8_t *name, int name_len, int *slot)
+{
+	struct dnsflow_pkt_state	*ps = dw->dw_pkt;
+	uint32_t	h = 2166136261u;
+	int		i, idx;
+
+	for (i = 0; i < name_len; i++) {
+		h = (h ^ name[i]) * 16777619u;
+	}
+	for (i = 0; i < DNSFLOW_CNAMES_HASH_SIZE; i++) {
+		h &= DNSFLOW_CNAMES_HASH_SIZE - 1;
+		if (ps->ps_cname_hash[h].gen != ps->ps_cname_gen ||
+		    ps->ps_cname_hash[h].idx >= ps->ps_cnames_n) {
+			/* Empty, or left over from a rolled back set. */
+			break;
+		}
+		idx = ps->ps_cname_hash[h].idx;
+		if (ps->ps_cname_len[idx] == name_len &&
+		    memcmp(pkt_start + ps->ps_cname_off[idx], name,
+			    name_len) == 0) {
+			return (idx);
+		}
+		h++;
+	}
+	*slot = -1;
+	if (i < DNSFLOW_CNAMES_HASH_SIZE &&
+	    ps->ps_cnames_n < DNSFLOW_CNAMES_MAX) {
+		*slot = h;
+	}
+	return (-1);
+}
+
+static void
+dnsflow_cname_add(struct dnsflow_worker *dw, int slot, int off, int len)
+{
+	struct dnsflow_pkt_state	*ps = dw->dw_pkt;
+	int		idx = ps->ps_cnames_n++;
+
+	ps->ps_cname_off[idx] = off;
+	ps->ps_cname_len[idx] = len;
+	ps->ps_cname_hash[slot].gen = ps->ps_cname_gen;
+	ps->ps_cname_hash[slot].idx = idx;
+}
+
+/* Write the set's names at pkt_cur, as name table references or literals.
+ * Returns the new pkt_cur. */
+static uint8_t *
+dnsflow_cnames_put(struct dnsflow_worker *dw, char *pkt_start,
+		uint8_t *pkt_cur, struct dns_data_set *dns_data, int names_count)
+{
+	int		i, idx, slot;
+
+	for (i = 0; i < names_count; i++) {
+		idx = dnsflow_cname_lookup(dw, pkt_start, dns_data->names[i],
+				dns_data->name_lens[i], &slot);
+		if (idx >= 0) {
+			pkt_cur += varint_put(pkt_cur, idx << 1);
+			continue;
+		}
+		pkt_cur += varint_put(pkt_cur,
+				(dns_data->name_lens[i] << 1) | 1);
+		if (slot >= 0) {
+			dnsflow_cname_add(dw, slot, (char *)pkt_cur - pkt_start,
+					dns_data->name_lens[i]);
+		}
+		dns_name_copy(pkt_cur, dns_data->names[i],
+				dns_data->name_lens[i]);
+		pkt_cur += dns_data->name_lens[i];
+	}
+	return (pkt_cur);
+}
+
+/* Version 3 version of dnsflow_pkt_build(). The set is encoded first, and
+ * if that takes the pkt over the target, rolled back and put in a new
+ * pkt. */
+static void
+dnsflow_pkt_build_v3(struct dnsflow_worker *dw, in_addr_t client_ip,
+		struct dns_data_set *dns_data, uint32_t hits)
+{
+	struct dnsflow_buf	*data_buf = dw->dw_data_buf;
+	struct dnsflow_hdr	*dnsflow_hdr;
+	char			*pkt_start;
+	uint8_t			*pkt_cur;
+	int			i, names_count, ips_count, max_len;
+	int			saved_cnames_n;
+	uint32_t		saved_len, saved_client, saved_ts, ip, prev_ip;
+	struct dnsflow_pkt_state	*ps = dw->dw_pkt;
+
+	names_count = MIN(dns_data->num_names, DNSFLOW_NAMES_COUNT_MAX);
+	ips_count = MIN(dns_data->num_ips, DNSFLOW_IPS_COUNT_MAX);
+
+	/* Worst case is no compression, and 5 byte varints. */
+	max_len = 5 + 2 + 4 + 5 * ips_count + 5 +
+		dnsflow_set_tail_len(names_count, ips_count, 1);
+	for (i = 0; i < names_count; i++) {
+		max_len += 2 + dns_data->name_lens[i];
+	}
+	if (data_buf->db_len != 0 &&
+	    data_buf->db_len + max_len > pkt_buf_max) {
+		dnsflow_pkt_send_data(dw);
+		data_buf = dw->dw_data_buf;
+	}
+	if (sizeof(struct dnsflow_hdr) + max_len > pkt_buf_max) {
+		dw->dw_drops[DNSFLOW_DROP_SET_SIZE]++;
+		return;
+	}
+
+	dnsflow_hdr = &data_buf->db_pkt_hdr;
+	pkt_start = DB_PKT(data_buf);
+	if (data_buf->db_len == 0) {
+		/* Starting a new pkt. */
+		bzero(dnsflow_hdr, sizeof(struct dnsflow_hdr));
+		data_buf->db_len += sizeof(struct dnsflow_hdr);
+		dnsflow_hdr->version = DNSFLOW_VERSION_COMPRESSED;
+		dnsflow_hdr->flags = dnsflow_data_flags(1);
+		ps->ps_cname_gen++;
+		ps->ps_cnames_n = 0;
+		ps->ps_last_client = 0;
+		ps->ps_last_ts = 0;
+	}
+	saved_len = data_buf->db_len;
+	saved_cnames_n = ps->ps_cnames_n;
+	saved_client = ps->ps_last_client;
+	saved_ts = ps->ps_last_ts;
+
+	pkt_cur = (uint8_t *)pkt_start + data_buf->db_len;
+	pkt_cur += varint_put(pkt_cur,
+			zigzag(ntohl(client_ip), ps->ps_last_client));
+	ps->ps_last_client = ntohl(client_ip);
+	*pkt_cur++ = names_count;
+	*pkt_cur++ = ips_count;
+
+	pkt_cur = dnsflow_cnames_put(dw, pkt_start, pkt_cur, dns_data,
+			names_count);
+
+	prev_ip = 0;
+	for (i = 0; i < ips_count; i++) {
+		ip = ntohl(dns_data->ips[i]);
+		if (i == 0) {
+			memcpy(pkt_cur, &dns_data->ips[i], sizeof(in_addr_t));
+			pkt_cur += sizeof(in_addr_t);
+		} else {
+			pkt_cur += varint_put(pkt_cur, zigzag(ip, prev_ip));
+		}
+		prev_ip = ip;
+	}
+	if (agg_n_entries) {
+		pkt_cur += varint_put(pkt_cur, hits);
+	}
+	pkt_cur = dnsflow_set_tail_put(dw, pkt_cur, dns_data, names_count,
+			ips_count, 1);
+	data_buf->db_len = (char *)pkt_cur - pkt_start;
+
+	if (data_buf->db_len > (uint32_t)pkt_target_size &&
+	    dnsflow_hdr->sets_count > 0) {
+		/* Doesn't fit. Undo, and start again in a new pkt. */
+		data_buf->db_len = saved_len;
+		ps->ps_cnames_n = saved_cnames_n;
+		ps->ps_last_client = saved_client;
+		ps->ps_last_ts = saved_ts;
+		dnsflow_pkt_send_data(dw);
+		dnsflow_pkt_build_v3(dw, client_ip, dns_data, hits);
+		return;
+	}
+
+	dnsflow_hdr->sets_count++;
+
+	if (data_buf->db_len >= (uint32_t)pkt_target_size ||
+	    dnsflow_hdr->sets_count == pkt_sets_max) {
+		/* Send */
+		dnsflow_pkt_send_data(dw);
+	}
+}
+
+/* Family of a version 4 set, see the format. */
+static int
+dnsflow_set_family(const struct in6_addr *client6,
+		struct dns_data_set *dns_data)
+{
+	return ((client6 != NULL || dns_data->num_ips6 > 0) ? 6 : 4);
+}
+
+static void
+ip6_mapped(struct in6_addr *a, in_addr_t ip)
+{
+	bzero(a, sizeof(struct in6_addr));
+	a->s6_addr[10] = a->s6_addr[11] = 0xff;
+	memcpy(&a->s6_addr[12], &ip, sizeof(in_addr_t));
+}
+
+/* ip i of a family 6 set: the A answers (v4-mapped), then the AAAA. */
+static void
+dns_data_ip6(struct dns_data_set *dns_data, int i, struct in6_addr *a)
+{
+	if (i < dns_data->num_ips) {
+		ip6_mapped(a, dns_data->ips[i]);
+	} else {
+		memcpy(a, &dns_data->ips6[i - dns_data->num_ips],
+				sizeof(struct in6_addr));
+	}
+}
+
+/* Prefix code a against prev, see the format. Returns the length. */
+static int
+ip6_prefix_put(uint8_t *p, const struct in6_addr *a,
+		const struct in6_addr *prev)
+{
+	int		n = 0;
+
+	while (n < 16 && a->s6_addr[n] == prev->s6_addr[n]) {
+		n++;
+	}
+	p[0] = n;
+	memcpy(p + 1, &a->s6_addr[n], 16 - n);
+	return (1 + 16 - n);
+}
+
+/* Compressed version of dnsflow_pkt_build6(), like dnsflow_pkt_build_v3(). */
+static void
+dnsflow_pkt_build6_v3(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6, struct dns_data_set *dns_data,
+		uint32_t hits)
+{
+	struct dnsflow_buf	*data_buf = dw->dw_data_buf;
+	struct dnsflow_hdr	*dnsflow_hdr;
+	struct in6_addr		addr, prev_addr, saved_client6;
+	char			*pkt_start;
+	uint8_t			*pkt_cur;
+	int			i, family, names_count, ips_count, max_len;
+	int			saved_cnames_n;
+	uint32_t		saved_len, saved_client, saved_ts, ip, prev_ip;
+	struct dnsflow_pkt_state	*ps = dw->dw_pkt;
+
+	family = dnsflow_set_family(client6, dns_data);
+	names_count = MIN(dns_data->num_names, DNSFLOW_NAMES_COUNT_MAX);
+	if (family == 6) {
+		ips_count = MIN(dns_data->num_ips + dns_data->num_ips6,
+				DNSFLOW_IPS_COUNT_MAX);
+	} else {
+		ips_count = MIN(dns_data->num_ips, DNSFLOW_IPS_COUNT_MAX);
+	}
+
+	/* Worst case is no compression, 17 byte addresses and 5 byte
+	 * varints. */
+	max_len = 1 + 17 + 2 + 17 * ips_count + 5 +
+		dnsflow_set_tail_len(names_count, ips_count, 1);
+	for (i = 0; i < names_count; i++) {
+		max_len += 2 + dns_data->name_lens[i];
+	}
+	if (data_buf->db_len != 0 &&
+	    data_buf->db_len + max_len > pkt_buf_max) {
+		dnsflow_pkt_send_data(dw);
+		data_buf = dw->dw_data_buf;
+	}
+	if (sizeof(struct dnsflow_hdr) + max_len > pkt_buf_max) {
+		dw->dw_drops[DNSFLOW_DROP_SET_SIZE]++;
+		return;
+	}
+
+	dnsflow_hdr = &data_buf->db_pkt_hdr;
+	pkt_start = DB_PKT(data_buf);
+	if (data_buf->db_len == 0) {
+		/* Starting a new pkt. */
+		bzero(dnsflow_hdr, sizeof(struct dnsflow_hdr));
+		data_buf->db_len += sizeof(struct dnsflow_hdr);
+		dnsflow_hdr->version = DNSFLOW_VERSION_IP6;
+		dnsflow_hdr->flags = dnsflow_data_flags(1);
+		ps->ps_cname_gen++;
+		ps->ps_cnames_n = 0;
+		ps->ps_last_client = 0;
+		bzero(&ps->ps_last_client6, sizeof(struct in6_addr));
+		ps->ps_last_ts = 0;
+	}
+	saved_len = data_buf->db_len;
+	saved_cnames_n = ps->ps_cnames_n;
+	saved_client = ps->ps_last_client;
+	saved_client6 = ps->ps_last_client6;
+	saved_ts = ps->ps_last_ts;
+
+	pkt_cur = (uint8_t *)pkt_start + data_buf->db_len;
+	*pkt_cur++ = family;
+	if (family == 6) {
+		if (client6 != NULL) {
+			addr = *client6;
+		} else {
+			ip6_mapped(&addr, client_ip);
+		}
+		pkt_cur += ip6_prefix_put(pkt_cur, &addr,
+				&ps->ps_last_client6);
+		ps->ps_last_client6 = addr;
+	} else {
+		pkt_cur += varint_put(pkt_cur,
+				zigzag(ntohl(client_ip), ps->ps_last_client));
+		ps->ps_last_client = ntohl(client_ip);
+	}
+	*pkt_cur++ = names_count;
+	*pkt_cur++ = ips_count;
+
+	pkt_cur = dnsflow_cnames_put(dw, pkt_start, pkt_cur, dns_data,
+			names_count);
+
+	if (family == 6) {
+		bzero(&prev_addr, sizeof(struct in6_addr));
+		for (i = 0; i < ips_count; i++) {
+			dns_data_ip6(dns_data, i, &addr);
+			pkt_cur += ip6_prefix_put(pkt_cur, &addr, &prev_addr);
+			prev_addr = addr;
+		}
+	} else {
+		prev_ip = 0;
+		for (i = 0; i < ips_count; i++) {
+			ip = ntohl(dns_data->ips[i]);
+			if (i == 0) {
+				memcpy(pkt_cur, &dns_data->ips[i],
+						sizeof(in_addr_t));
+				pkt_cur += sizeof(in_addr_t);
+			} else {
+				pkt_cur += varint_put(pkt_cur,
+						zigzag(ip, prev_ip));
+			}
+			prev_ip = ip;
+		}
+	}
+	if (agg_n_entries) {
+		pkt_cur += varint_put(pkt_cur, hits);
+	}
+	pkt_cur = dnsflow_set_tail_put(dw, pkt_cur, dns_data, names_count,
+			ips_count, 1);
+	data_buf->db_len = (char *)pkt_cur - pkt_start;
+
+	if (data_buf->db_len > (uint32_t)pkt_target_size &&
+	    dnsflow_hdr->sets_count > 0) {
+		/* Doesn't fit. Undo, and start again in a new pkt. */
+		data_buf->db_len = saved_len;
+		ps->ps_cnames_n = saved_cnames_n;
+		ps->ps_last_client = saved_client;
+		ps->ps_last_client6 = saved_client6;
+		ps->ps_last_ts = saved_ts;
+		dnsflow_pkt_send_data(dw);
+		dnsflow_pkt_build6_v3(dw, client_ip, client6, dns_data, hits);
+		return;
+	}
+
+	dnsflow_hdr->sets_count++;
+
+	if (data_buf->db_len >= (uint32_t)pkt_target_size ||
+	    dnsflow_hdr->sets_count == pkt_sets_max) {
+		/* Send */
+		dnsflow_pkt_send_data(dw);
+	}
+}
+
+/* Version 4 (-6) version of dnsflow_pkt_build(). client6 is NULL if the
+ * client is ipv4. Every set gets a family byte, so a pkt can mix ipv4 and
+ * ipv6 sets. */
+static void
+dnsflow_pkt_build6(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6, struct dns_data_set *dns_data,
+		uint32_t hits)
+{
+	struct dnsflow_buf	*data_buf = dw->dw_data_buf;
+	struct dnsflow_hdr	*dnsflow_hdr;
+	struct in6_addr		addr;
+	char			*pkt_start;
+	uint8_t			*pkt_cur, *names_start, *names_len_ptr;
+	int			i, family, addr_len, names_count, ips_count;
+	int			set_len;
+	uint16_t		names_len;
+	uint32_t		hits_n;
+
+	if (export_compress) {
+		dnsflow_pkt_build6_v3(dw, client_ip, client6, dns_data, hits);
+		return;
+	}
+
+	family = dnsflow_set_family(client6, dns_data);
+	names_count = MIN(dns_data->num_names, DNSFLOW_NAMES_COUNT_MAX);
+	if (family == 6) {
+		addr_len = sizeof(struct in6_addr);
+		ips_count = MIN(dns_data->num_ips + dns_data->num_ips6,
+				DNSFLOW_IPS_COUNT_MAX);
+	} else {
+		addr_len = sizeof(in_addr_t);
+		ips_count = MIN(dns_data->num_ips, DNSFLOW_IPS_COUNT_MAX);
+	}
+
+	/* As in dnsflow_pkt_build(), but the padding depends on where the
+	 * set starts, so assume the worst. */
+	set_len = 1 + addr_len + 4 + 3 + ips_count * addr_len;
+	for (i = 0; i < names_count; i++) {
+		set_len += dns_data->name_lens[i];
+	}
+	if (agg_n_entries) {
+		set_len += sizeof(uint32_t);
+	}
+	set_len += dnsflow_set_tail_len(names_count, ips_count, 0);
+	if (data_buf->db_len != 0 &&
+	    data_buf->db_len + set_len > (uint32_t)pkt_target_size) {
+		dnsflow_pkt_send_data(dw);
+		data_buf = dw->dw_data_buf;
+	}
+	if (sizeof(struct dnsflow_hdr) + set_len > pkt_buf_max) {
+		dw->dw_drops[DNSFLOW_DROP_SET_SIZE]++;
+		return;
+	}
+
+	dnsflow_hdr = &data_buf->db_pkt_hdr;
+	pkt_start = DB_PKT(data_buf);
+	if (data_buf->db_len == 0) {
+		/* Starting a new pkt. */
+		bzero(dnsflow_hdr, sizeof(struct dnsflow_hdr));
+		data_buf->db_len += sizeof(struct dnsflow_hdr);
+		dnsflow_hdr->version = DNSFLOW_VERSION_IP6;
+		dnsflow_hdr->flags = dnsflow_data_flags(0);
+	}
+
+	/* Nothing after the family byte is aligned, so memcpy it all. */
+	pkt_cur = (uint8_t *)pkt_start + data_buf->db_len;
+	*pkt_cur++ = family;
+	if (family == 6) {
+		if (client6 != NULL) {
+			addr = *client6;
+		} else {
+			ip6_mapped(&addr, client_ip);
+		}
+		memcpy(pkt_cur, &addr, sizeof(struct in6_addr));
+	} else {
+		memcpy(pkt_cur, &client_ip, sizeof(in_addr_t));
+	}
+	pkt_cur += addr_len;
+	*pkt_cur++ = names_count;
+	*pkt_cur++ = ips_count;
+	names_len_ptr = pkt_cur;
+	pkt_cur += sizeof(uint16_t);
+
+	names_start = pkt_cur;
+	for (i = 0; i < names_count; i++) {
+		dns_name_copy(pkt_cur, dns_data->names[i],
+				dns_data->name_lens[i]);
+		pkt_cur += dns_data->name_lens[i];
+	}
+	while (((char *)pkt_cur - pkt_start) % 4 != 0) {
+		/* Pad to word boundary. */
+		*pkt_cur++ = '\0';
+	}
+	names_len = htons(pkt_cur - names_start);
+	memcpy(names_len_ptr, &names_len, sizeof(uint16_t));
+
+	for (i = 0; i < ips_count; i++) {
+		if (family == 6) {
+			dns_data_ip6(dns_data, i, &addr);
+			memcpy(pkt_cur, &addr, sizeof(struct in6_addr));
+		} else {
+			memcpy(pkt_cur, &dns_data->ips[i], sizeof(in_addr_t));
+		}
+		pkt_cur += addr_len;
+	}
+	if (agg_n_entries) {
+		hits_n = htonl(hits);
+		memcpy(pkt_cur, &hits_n, sizeof(uint32_t));
+		pkt_cur += sizeof(uint32_t);
+	}
+	pkt_cur = dnsflow_set_tail_put(dw, pkt_cur, dns_data, names_count,
+			ips_count, 0);
+	data_buf->db_len = (char *)pkt_cur - pkt_start;
+
+	dnsflow_hdr->sets_count++;
+
+	if (data_buf->db_len >= (uint32_t)pkt_target_size ||
+	    dnsflow_hdr->sets_count == pkt_sets_max) {
+		/* Send */
+		dnsflow_pkt_send_data(dw);
+	}
+}
+
+/* -a. Make key a candidate with count, if there's room or it beats the
+ * lowest. Up to n_cands of them. */
+static void
+dnsflow_topk_offer(struct dnsflow_topk *tk, int n_cands, uint32_t hash,
+		const uint8_t *key, int key_len, uint32_t count)
+{
+	struct dnsflow_topk_cand	*kc = NULL;
+	uint32_t			old;
+	int				i;
+
+	if (tk->tk_n == n_cands && count <= tk->tk_min) {
+		/* Not on top. If it's a candidate, it's the lowest, and
+		 * already has count. */
+		return;
+	}
+	for (i = 0; i < tk->tk_n; i++) {
+		if (tk->tk_cands[i].kc_hash == hash &&
+		    tk->tk_cands[i].kc_len == key_len &&
+		    memcmp(tk->tk_cands[i].kc_key, key, key_len) == 0) {
+			kc = &tk->tk_cands[i];
+			break;
+		}
+	}
+	if (kc == NULL) {
+		if (tk->tk_n < n_cands) {
+			kc = &tk->tk_cands[tk->tk_n++];
+			old = 0;
+		} else {
+			/* Evict the lowest. */
+			for (i = 0; tk->tk_cands[i].kc_count != tk->tk_min;
+			    i++) {
+				;
+			}
+			kc = &tk->tk_cands[i];
+			old = tk->tk_min;
+		}
+		kc->kc_hash = hash;
+		kc->kc_len = key_len;
+		memcpy(kc->kc_key, key, key_len);
+	} else {
+		old = kc->kc_count;
+	}
+	kc->kc_count = count;
+	if (tk->tk_n == n_cands && old <= tk->tk_min) {
+		/* Just filled up, or the lowest went up. */
+		tk->tk_min = UINT32_MAX;
+		for (i = 0; i < tk->tk_n; i++) {
+			tk->tk_min = MIN(tk->tk_min, tk->tk_cands[i].kc_count);
+		}
+	}
+}
+
+/* -a. The Count-Min estimate for hash, after counting n more. The rows
+ * are indexed by double hashing. It's a conservative update: counters are
+ * only raised as far as the new estimate, which cuts the overcounting from
+ * collisions, and still never undercounts, even summed over workers. */
+static uint32_t
+dnsflow_topk_count(struct dnsflow_topk *tk, uint32_t hash, uint32_t n)
+{
+	uint32_t	h1 = dnsflow_pipe_hash(hash), est = UINT32_MAX;
+	uint32_t	h2 = dnsflow_pipe_hash(h1) | 1;
+	uint32_t	*c[DNSFLOW_TOPK_DEPTH];
+	int		i;
+
+	/* FNV-1a's low bits aren't mixed enough to index by. */
+	for (i = 0; i < DNSFLOW_TOPK_DEPTH; i++) {
+		c[i] = &tk->tk_counts[i][(h1 + i * h2) &
+			(DNSFLOW_TOPK_WIDTH - 1)];
+		est = MIN(est, *c[i]);
+	}
+	est += n;
+	for (i = 0; n != 0 && i < DNSFLOW_TOPK_DEPTH; i++) {
+		*c[i] = MAX(*c[i], est);
+	}
+	return (est);
+}
+
+/* -a. The worker's sketches for the current window, switching to the
+ * other ones if the stats timer has bumped topk_gen. */
+static struct dnsflow_topk_win *
+dnsflow_topk_win(struct dnsflow_worker *dw)
+{
+	uint32_t	gen = __atomic_load_n(&topk_gen, __ATOMIC_ACQUIRE);
+
+	if (gen != dw->dw_topk_gen) {
+		/* Done with the old ones. */
+		__atomic_store_n(&dw->dw_topk_gen, gen, __ATOMIC_RELEASE);
+	}
+	return (dw->dw_topk[gen & 1]);
+}
+
+/* -a. Count hits sets for the client (v4-mapped if it's ipv4) and the
+ * qname, case insensitively. */
+static void
+dnsflow_topk_add(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6, struct dns_data_set *dns_data,
+		uint32_t hits)
+{
+	struct dnsflow_topk_win	*tw = dnsflow_topk_win(dw);
+	struct in6_addr		addr;
+	uint8_t			name[DNSFLOW_TOPK_KEY_MAX];
+	uint32_t		h = 2166136261u;
+	int			i, n_cands = topk_n * DNSFLOW_TOPK_CANDS;
+
+	tw->tw_sets += hits;
+	if (client6 != NULL) {
+		addr = *client6;
+	} else {
+		bzero(&addr, sizeof(addr));
+		addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+		memcpy(&addr.s6_addr[12], &client_ip, sizeof(client_ip));
+	}
+	for (i = 0; i < sizeof(addr); i++) {
+		h = (h ^ addr.s6_addr[i]) * 16777619u;
+	}
+	dnsflow_topk_offer(&tw->tw_clients, n_cands, h, addr.s6_addr,
+			sizeof(addr), dnsflow_topk_count(&tw->tw_clients, h,
+				hits));
+
+	if (dns_data->num_names == 0 ||
+	    dns_data->name_lens[0] > DNSFLOW_TOPK_KEY_MAX) {
+		return;
+	}
+	/* Lowercased, so the candidates compare the way they're hashed. */
+	h = 2166136261u;
+	for (i = 0; i < dns_data->name_lens[0]; i++) {
+		name[i] = tolower(dns_data->names[0][i]);
+		h = (h ^ name[i]) * 16777619u;
+	}
+	dnsflow_topk_offer(&tw->tw_names, n_cands, h, name,
+			dns_data->name_lens[0], dnsflow_topk_count(
+				&tw->tw_names, h, hits));
+}
+
+static struct dnsflow_anon_cache *
+dnsflow_anon_cache_new(struct dnsflow_arena *ar)
+{
+	struct dnsflow_anon_cache	*ac;
+	struct in6_addr			zero6, anon6;
+	in_addr_t			anon4;
+	int				i;
+
+	ac = dnsflow_arena_alloc(ar, sizeof(struct dnsflow_anon_cache));
+	anon4 = dnsflow_anon_ip4(anon, 0);
+	bzero(&zero6, sizeof(zero6));
+	dnsflow_anon_ip6(anon, zero6.s6_addr, anon6.s6_addr);
+	for (i = 0; i < DNSFLOW_ANON_CACHE4; i++) {
+		ac->ac_ip4[i].a4_anon = anon4;
+	}
+	for (i = 0; i < DNSFLOW_ANON_CACHE6; i++) {
+		ac->ac_ip6[i].a6_anon = anon6;
+	}
+	return (ac);
+}
+
+/* -z. Returns the anonymised client_ip, or for a v6 client, puts the
+ * anonymised client6 in anon6. */
+static in_addr_t
+dnsflow_anon_client(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6, struct in6_addr *anon6)
+{
+	struct dnsflow_anon_cache	*ac = dw->dw_anon_cache;
+	struct dnsflow_anon_slot4	*s4;
+	struct dnsflow_anon_slot6	*s6;
+	uint32_t			w[4];
+
+	if (client6 == NULL) {
+		s4 = &ac->ac_ip4[dnsflow_pipe_hash(client_ip) &
+			(DNSFLOW_ANON_CACHE4 - 1)];
+		if (s4->a4_orig == client_ip) {
+			dw->dw_anon_hits++;
+		} else {
+			s4->a4_orig = client_ip;
+			s4->a4_anon = dnsflow_anon_ip4(anon, client_ip);
+			dw->dw_anon_misses++;
+		}
+		return (s4->a4_anon);
+	}
+
+	memcpy(w, client6, sizeof(w));
+	s6 = &ac->ac_ip6[dnsflow_pipe_hash(w[0] ^ w[1] ^ w[2] ^ w[3]) &
+		(DNSFLOW_ANON_CACHE6 - 1)];
+	if (memcmp(&s6->a6_orig, client6, sizeof(*client6)) == 0) {
+		dw->dw_anon_hits++;
+	} else {
+		s6->a6_orig = *client6;
+		dnsflow_anon_ip6(anon, client6->s6_addr, s6->a6_anon.s6_addr);
+		dw->dw_anon_misses++;
+	}
+	*anon6 = s6->a6_anon;
+	return (client_ip);
+}
+
+/* -z with labels to keep. Points the set's names at hashed copies, in
+ * dw_anon_names. */
+static void
+dnsflow_anon_names(struct dnsflow_worker *dw, struct dns_data_set *dns_data)
+{
+	uint8_t		*p = dw->dw_anon_names;
+	int		i;
+
+	for (i = 0; i < dns_data->num_names; i++) {
+		dns_data->name_lens[i] = dnsflow_anon_name(anon,
+				dns_data->names[i], dns_data->name_lens[i],
+				anon_keep_labels, p);
+		dns_data->names[i] = p;
+		p += dns_data->name_lens[i];
+	}
+}
+
+/* XXX Need more care to prevent buffer overruns. */
+static void
+dnsflow_pkt_build(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6, struct dns_data_set *dns_data,
+		uint32_t hits)
+{
+	struct dnsflow_buf	*data_buf;
+	struct dnsflow_hdr	*dnsflow_hdr;
+	struct dnsflow_set_hdr	*set_hdr;
+	char			*pkt_start, *pkt_cur, *pkt_end, *names_start;
+	int			i, names_count, ips_count, set_len;
+	in_addr_t		*ip_ptr;
+	struct in6_addr		anon6;
+	uint64_t		t = 0;
+
+	if (anon != NULL) {
+		/* Before anything else sees the client or the names. */
+		if (bench_loops > 0) {
+			t = hist_ticks();
+		}
+		client_ip = dnsflow_anon_client(dw, client_ip, client6,
+				&anon6);
+		if (client6 != NULL) {
+			client6 = &anon6;
+		}
+		if (anon_keep_labels >= 0) {
+			dnsflow_anon_names(dw, dns_data);
+		}
+		if (bench_loops > 0) {
+			dw->dw_anon_ticks += hist_ticks() - t;
+		}
+	}
+	if (topk_n > 0) {
+		dnsflow_topk_add(dw, client_ip, client6, dns_data, hits);
+	}
+	if (shard_export) {
+		dnsflow_shard_set(dw, dnsflow_shard_pick(dw, client_ip,
+					client6));
+	}
+	data_buf = dw->dw_data_buf;
+	if (enable_ip6) {
+		dnsflow_pkt_build6(dw, client_ip, client6, dns_data, hits);
+		return;
+	}
+	if (export_compress) {
+		dnsflow_pkt_build_v3(dw, client_ip, dns_data, hits);
+		return;
+	}
+
+	/* XXX Not warning if we're truncating names, ips. */
+	names_count = MIN(dns_data->num_names, DNSFLOW_NAMES_COUNT_MAX);
+	ips_count = MIN(dns_data->num_ips, DNSFLOW_IPS_COUNT_MAX);
+
+	/* Start a new pkt if the set won't fit, so pkts never go over the
+	 * target (only a set that's too big by itself does). */
+	set_len = 0;
+	for (i = 0; i < names_count; i++) {
+		set_len += dns_data->name_lens[i];
+	}
+	set_len = sizeof(struct dnsflow_set_hdr) + ((set_len + 3) & ~3) +
+		ips_count * sizeof(in_addr_t);
+	if (agg_n_entries) {
+		set_len += sizeof(uint32_t);
+	}
+	set_len += dnsflow_set_tail_len(names_count, ips_count, 0);
+	if (data_buf->db_len != 0 &&
+	    data_buf->db_len + set_len > (uint32_t)pkt_target_size) {
+		dnsflow_pkt_send_data(dw);
+		data_buf = dw->dw_data_buf;
+	}
+	if (sizeof(struct dnsflow_hdr) + set_len > pkt_buf_max) {
+		dw->dw_drops[DNSFLOW_DROP_SET_SIZE]++;
+		return;
+	}
+
 	dnsflow_hdr = &data_buf->db_pkt_hdr;
-	pkt_start = (char *)dnsflow_hdr;
+	pkt_start = DB_PKT(data_buf);
 	if (data_buf->db_len == 0) {
 		/* Starting a new pkt. */
 		bzero(dnsflow_hdr, sizeof(struct dnsflow_hdr));
 		data_buf->db_len += sizeof(struct dnsflow_hdr);
 		dnsflow_hdr->version = DNSFLOW_VERSION;
 		dnsflow_hdr->sets_count = 0;
+		dnsflow_hdr->flags = dnsflow_data_flags(0);
+	}
+	pkt_cur = pkt_start + data_buf->db_len;
+	pkt_end = pkt_start + pkt_buf_max - 1;
+
+	/* Start building new set. */
+	set_hdr = (struct dnsflow_set_hdr *)pkt_cur;
+	bzero(set_hdr, sizeof(struct dnsflow_set_hdr));
+	set_hdr->client_ip = client_ip;
+	set_hdr->names_count = names_count;
+	set_hdr->ips_count = ips_count;
+	data_buf->db_len += sizeof(struct dnsflow_set_hdr);
+	pkt_cur = pkt_start + data_buf->db_len;
+
+	names_start = pkt_cur;
+	for (i = 0; i < set_hdr->names_count; i++) {
+		if (dns_data->name_lens[i] > pkt_end - pkt_cur) {
+			/* Not enough room. Shouldn't happen. */
+			_log("Pkt create error");
+			data_buf->db_len = 0;
+			return;
+		}
+		dns_name_copy((uint8_t *)pkt_cur, dns_data->names[i],
+				dns_data->name_lens[i]);
+		data_buf->db_len += dns_data->name_lens[i];
+		pkt_cur = pkt_start + data_buf->db_len;
+	}
+	while (data_buf->db_len % 4 != 0) {
+		/* Pad to word boundary. */
+		pkt_start[data_buf->db_len++] = '\0';
+	}
+	pkt_cur = pkt_start + data_buf->db_len;
+	set_hdr->names_len = htons(pkt_cur - names_start);
+
+	for (i = 0; i < set_hdr->ips_count; i++) {
+		ip_ptr = (in_addr_t *)pkt_cur;
+		*ip_ptr = dns_data->ips[i];
+		data_buf->db_len += sizeof(in_addr_t);
+		pkt_cur = pkt_start + data_buf->db_len;
+	}
+	if (agg_n_entries) {
+		*(uint32_t *)pkt_cur = htonl(hits);
+		data_buf->db_len += sizeof(uint32_t);
+		pkt_cur = pkt_start + data_buf->db_len;
+	}
+	pkt_cur = (char *)dnsflow_set_tail_put(dw, (uint8_t *)pkt_cur, dns_data,
+			names_count, ips_count, 0);
+	data_buf->db_len = pkt_cur - pkt_start;
+
+	dnsflow_hdr->sets_count++;
+
+	if (data_buf->db_len >= (uint32_t)pkt_target_size ||
+	    dnsflow_hdr->sets_count == pkt_sets_max) {
+		/* Send */
+		dnsflow_pkt_send_data(dw);
+	}
+}
+
+/* Emit an entry as a set. */
+static void
+dnsflow_agg_emit(struct dnsflow_worker *dw, struct dnsflow_agg_entry *e)
+{
+	struct dns_data_set	*set = dw->dw_agg_set;
+	uint8_t			*p = e->ae_data;
+	int			i;
+
+	/* Entry names are valid wire names, no need to check much. */
+	for (i = 0; i < e->ae_names_count; i++) {
+		set->names[i] = p;
+		while (*p != 0) {
+			p += *p + 1;
+		}
+		p++;
+		set->name_lens[i] = p - set->names[i];
+	}
+	set->num_names = e->ae_names_count;
+	memcpy(set->ips, e->ae_data + e->ae_names_len,
+			e->ae_ips_count * sizeof(in_addr_t));
+	set->num_ips = e->ae_ips_count;
+	memcpy(set->ips6, e->ae_data + e->ae_names_len +
+			e->ae_ips_count * sizeof(in_addr_t),
+			e->ae_ips6_count * sizeof(struct in6_addr));
+	set->num_ips6 = e->ae_ips6_count;
+	set->min_ttl = e->ae_min_ttl;
+	set->tv = e->ae_tv;
+	set->rtt = e->ae_rtt;
+
+	dnsflow_pkt_build(dw, e->ae_client_ip,
+			e->ae_client_is6 ? &e->ae_client6 : NULL, set,
+			e->ae_hits);
+}
+
+static void
+dnsflow_agg_lru_unlink(struct dnsflow_agg *ag, uint32_t idx)
+{
+	struct dnsflow_agg_entry	*e = &ag->ag_entries[idx];
+
+	if (e->ae_lru_prev != DNSFLOW_AGG_NONE) {
+		ag->ag_entries[e->ae_lru_prev].ae_lru_next = e->ae_lru_next;
+	} else {
+		ag->ag_lru_head = e->ae_lru_next;
+	}
+	if (e->ae_lru_next != DNSFLOW_AGG_NONE) {
+		ag->ag_entries[e->ae_lru_next].ae_lru_prev = e->ae_lru_prev;
+	} else {
+		ag->ag_lru_tail = e->ae_lru_prev;
+	}
+}
+
+static void
+dnsflow_agg_lru_push(struct dnsflow_agg *ag, uint32_t idx)
+{
+	struct dnsflow_agg_entry	*e = &ag->ag_entries[idx];
+
+	e->ae_lru_prev = DNSFLOW_AGG_NONE;
+	e->ae_lru_next = ag->ag_lru_head;
+	if (ag->ag_lru_head != DNSFLOW_AGG_NONE) {
+		ag->ag_entries[ag->ag_lru_head].ae_lru_prev = idx;
+	} else {
+		ag->ag_lru_tail = idx;
+	}
+	ag->ag_lru_head = idx;
+}
+
+/* Remove the entry from the index, shifting back any later entries in
+ * the probe sequence so lookups don't need tombstones. */
+static void
+dnsflow_agg_index_del(struct dnsflow_agg *ag, uint32_t idx)
+{
+	uint32_t	i, j, k, mask = ag->ag_index_mask;
+
+	i = ag->ag_entries[idx].ae_hash & mask;
+	while (ag->ag_index[i] != idx + 1) {
+		i = (i + 1) & mask;
+	}
+	for (j = (i + 1) & mask; ag->ag_index[j] != 0; j = (j + 1) & mask) {
+		k = ag->ag_entries[ag->ag_index[j] - 1].ae_hash & mask;
+		/* j's entry can only move back to i if its home slot, k,
+		 * isn't cyclically in (i, j]. */
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		ag->ag_index[i] = ag->ag_index[j];
+		i = j;
+	}
+	ag->ag_index[i] = 0;
+}
+
+/* Emit everything, oldest first, and start a new window. */
+static void
+dnsflow_agg_flush(struct dnsflow_worker *dw)
+{
+	struct dnsflow_agg	*ag = dw->dw_agg;
+	uint32_t		idx;
+
+	if (ag == NULL) {
+		return;
+	}
+	for (idx = ag->ag_lru_tail; idx != DNSFLOW_AGG_NONE;
+			idx = ag->ag_entries[idx].ae_lru_prev) {
+		dnsflow_agg_emit(dw, &ag->ag_entries[idx]);
+	}
+	if (ag->ag_n_used > 0) {
+		bzero(ag->ag_index, (ag->ag_index_mask + 1) * sizeof(uint32_t));
+	}
+	ag->ag_n_used = 0;
+	ag->ag_lru_head = ag->ag_lru_tail = DNSFLOW_AGG_NONE;
+	ag->ag_window_start = time(NULL);
+}
+
+/* Add a set to the current window, or count it as a hit if it's already
+ * there. When the table is full, the least recently hit entry is emitted
+ * early to make room. */
+static void
+dnsflow_agg_add(struct dnsflow_worker *dw, in_addr_t client_ip,
+		const struct in6_addr *client6, struct dns_data_set *dns_data)
+{
+	struct dnsflow_agg		*ag = dw->dw_agg;
+	struct dnsflow_agg_entry	*e;
+	uint8_t				key[DNSFLOW_AGG_DATA_SIZE];
+	uint32_t			h = 2166136261u, i, idx;
+	int				n, names_count, ips_count, ips6_count;
+	int				names_len = 0, data_len;
+
+	names_count = MIN(dns_data->num_names, DNSFLOW_NAMES_COUNT_MAX);
+	ips_count = MIN(dns_data->num_ips, DNSFLOW_IPS_COUNT_MAX);
+	ips6_count = MIN(dns_data->num_ips6,
+			DNSFLOW_IPS_COUNT_MAX - ips_count);
+	for (n = 0; n < names_count; n++) {
+		names_len += dns_data->name_lens[n];
+	}
+	data_len = names_len + ips_count * sizeof(in_addr_t) +
+		ips6_count * sizeof(struct in6_addr);
+	if (data_len > DNSFLOW_AGG_DATA_SIZE) {
+		dw->dw_agg_bypassed++;
+		dnsflow_pkt_build(dw, client_ip, client6, dns_data, 1);
+		return;
+	}
+
+	/* Flatten to the entry format, to hash and compare. */
+	data_len = 0;
+	for (n = 0; n < names_count; n++) {
+		memcpy(key + data_len, dns_data->names[n],
+				dns_data->name_lens[n]);
+		data_len += dns_data->name_lens[n];
+	}
+	memcpy(key + data_len, dns_data->ips, ips_count * sizeof(in_addr_t));
+	data_len += ips_count * sizeof(in_addr_t);
+	memcpy(key + data_len, dns_data->ips6,
+			ips6_count * sizeof(struct in6_addr));
+	data_len += ips6_count * sizeof(struct in6_addr);
+
+	h = (h ^ client_ip) * 16777619u;
+	if (client6 != NULL) {
+		for (n = 0; n < sizeof(struct in6_addr); n++) {
+			h = (h ^ client6->s6_addr[n]) * 16777619u;
+		}
+	}
+	for (n = 0; n < data_len; n++) {
+		h = (h ^ key[n]) * 16777619u;
+	}
+
+	for (i = h & ag->ag_index_mask; ag->ag_index[i] != 0;
+			i = (i + 1) & ag->ag_index_mask) {
+		idx = ag->ag_index[i] - 1;
+		e = &ag->ag_entries[idx];
+		if (e->ae_hash == h && e->ae_client_ip == client_ip &&
+		    e->ae_client_is6 == (client6 != NULL) &&
+		    (client6 == NULL || memcmp(&e->ae_client6, client6,
+			    sizeof(struct in6_addr)) == 0) &&
+		    e->ae_names_count == names_count &&
+		    e->ae_ips_count == ips_count &&
+		    e->ae_ips6_count == ips6_count &&
+		    e->ae_names_len == names_len &&
+		    memcmp(e->ae_data, key, data_len) == 0) {
+			e->ae_hits++;
+			e->ae_min_ttl = MIN(e->ae_min_ttl, dns_data->min_ttl);
+			if (e->ae_rtt == 0) {
+				e->ae_rtt = dns_data->rtt;
+			}
+			dw->dw_agg_hits++;
+			dnsflow_agg_lru_unlink(ag, idx);
+			dnsflow_agg_lru_push(ag, idx);
+			return;
+		}
+	}
+
+	if (ag->ag_n_used < ag->ag_n_entries) {
+		idx = ag->ag_n_used++;
+	} else {
+		/* Full. Reuse the lru entry. */
+		idx = ag->ag_lru_tail;
+		dnsflow_agg_emit(dw, &ag->ag_entries[idx]);
+		dnsflow_agg_lru_unlink(ag, idx);
+		dnsflow_agg_index_del(ag, idx);
+		dw->dw_agg_evicted++;
+		/* The delete may have shifted entries into our probe
+		 * sequence, so find the free slot again. */
+		for (i = h & ag->ag_index_mask; ag->ag_index[i] != 0;
+				i = (i + 1) & ag->ag_index_mask)
+			;
+	}
+	e = &ag->ag_entries[idx];
+	e->ae_hash = h;
+	e->ae_client_ip = client_ip;
+	e->ae_client_is6 = (client6 != NULL);
+	if (client6 != NULL) {
+		e->ae_client6 = *client6;
+	}
+	e->ae_hits = 1;
+	e->ae_min_ttl = dns_data->min_ttl;
+	e->ae_tv = dns_data->tv;
+	e->ae_rtt = dns_data->rtt;
+	e->ae_names_count = names_count;
+	e->ae_ips_count = ips_count;
+	e->ae_ips6_count = ips6_count;
+	e->ae_names_len = names_len;
+	memcpy(e->ae_data, key, data_len);
+	ag->ag_index[i] = idx + 1;
+	dnsflow_agg_lru_push(ag, idx);
+}
+
+static struct dnsflow_agg *
+dnsflow_agg_new(struct dnsflow_arena *ar, uint32_t n_entries)
+{
+	struct dnsflow_agg	*ag;
+	uint32_t		index_size = 1;
+
+	/* At most half full. */
+	while (index_size < n_entries * 2) {
+		index_size <<= 1;
+	}
+	ag = dnsflow_arena_alloc(ar, sizeof(struct dnsflow_agg));
+	ag->ag_entries = dnsflow_arena_alloc(ar,
+			(size_t)n_entries * sizeof(struct dnsflow_agg_entry));
+	ag->ag_index = dnsflow_arena_alloc(ar,
+			(size_t)index_size * sizeof(uint32_t));
+	ag->ag_n_entries = n_entries;
+	ag->ag_index_mask = index_size - 1;
+	ag->ag_lru_head = ag->ag_lru_tail = DNSFLOW_AGG_NONE;
+	ag->ag_window_start = time(NULL);
+	return (ag);
+}
+
+static struct dnsflow_rtt *
+dnsflow_rtt_new(struct dnsflow_arena *ar, uint32_t n_buckets)
+{
+	struct dnsflow_rtt	*rt;
+
+	rt = dnsflow_arena_alloc(ar, sizeof(struct dnsflow_rtt));
+	rt->rt_buckets = dnsflow_arena_alloc(ar,
+			(size_t)n_buckets * sizeof(struct dnsflow_rtt_bucket));
+	rt->rt_n_buckets = n_buckets;
+	rt->rt_timeout = rtt_timeout;
+	return (rt);
+}
+
+static inline uint32_t
+dnsflow_sample_hash(uint32_t key)
+{
+	return ((uint32_t)(key * DNSFLOW_SAMPLE_MULT) >> 16);
+}
+
+/* The client ip (the low 4 bytes for ipv6) in host order, the same key the
+ * default filter uses for sampling and multi-proc. The client is the src
+ * of a query. */
+static inline uint32_t
+dnsflow_client_key(struct ip *ip, struct ip6_hdr *ip6, int query)
+{
+	uint32_t	key;
+
+	if (ip != NULL) {
+		return (ntohl(query ? ip->ip_src.s_addr : ip->ip_dst.s_addr));
+	}
+	memcpy(&key, (char *)(query ? &ip6->ip6_src : &ip6->ip6_dst) + 12,
+			sizeof(key));
+	return (ntohl(key));
+}
+
+/* Sampling is by client, so all of a sampled client's responses are kept.
+ * With -q, the key is mixed with the qname (FNV-1a, lower cased), which
+ * the filter can't get to. dns_pkt has been through the prefilter.
+ * Returns 1 if the pkt isn't sampled. */
+static int
+dnsflow_sample_skip(uint32_t rate, uint32_t key, int dns_len, char *dns_pkt)
+{
+	const uint8_t	*pkt = (const uint8_t *)dns_pkt;
+	int		off, end;
+
+	if (sample_qname) {
+		end = dns_name_skip(pkt, dns_len, DNS_HDR_LEN);
+		for (off = DNS_HDR_LEN; off < end; off++) {
+			key = (key ^ tolower(pkt[off])) * 16777619;
+		}
+	}
+	return (dnsflow_sample_hash(key) % rate != 0);
+}
+
+/* Parse a response that passed the prefilter, and add it to the flow pkt
+ * (or the aggregation table). client6 is NULL for ipv4 clients. tv is when
+ * the response was captured, and rtt the usec since its query (-Q), or 0.
+ * t is the start of the extract stage, with -t. */
+static void
+dnsflow_dns_process(struct dnsflow_worker *dw, const struct timeval *tv,
+		uint32_t rtt, in_addr_t client_ip, const struct in6_addr *client6,
+		int dns_len, char *dns_pkt, uint64_t t)
+{
+	ldns_pkt		*lp = NULL;
+	struct dns_data_set	*dns_data;
+	uint64_t		send_ticks = 0;
+
+	if (dns_parser == DNSFLOW_PARSER_LDNS) {
+		lp = dnsflow_ldns_check(dns_len, dns_pkt);
+		if (lp == NULL) {
+			/* Bad dns pkt, or one we're not interested in. */
+			dw->dw_drops[DNSFLOW_DROP_PARSE]++;
+			return;
+		}
+		dns_data = dnsflow_ldns_extract(lp, dw->dw_data_set);
+	} else {
+		dns_data = dnsflow_dns_parse(dns_len, dns_pkt,
+				dw->dw_data_set);
+		if (dns_parser == DNSFLOW_PARSER_VERIFY) {
+			dnsflow_dns_verify(dw, dns_len, dns_pkt, dns_data);
+		}
+	}
+
+	if (dns_data != NULL) {
+		dns_data->tv = *tv;
+		dns_data->rtt = rtt;
+		DW_STAGE_END(dw, DNSFLOW_STAGE_EXTRACT, t);
+		send_ticks = dw->dw_send_ticks;
+		/* Should be good to go. */
+		if (dw->dw_agg != NULL) {
+			dnsflow_agg_add(dw, client_ip, client6, dns_data);
+		} else {
+			dnsflow_pkt_build(dw, client_ip, client6, dns_data, 1);
+		}
+		t += dw->dw_send_ticks - send_ticks;
+		DW_STAGE_END(dw, DNSFLOW_STAGE_BUILD, t);
+	} else {
+		dw->dw_drops[DNSFLOW_DROP_PARSE]++;
+	}
+
+	if (lp != NULL) {
+		//ldns_pkt_print(stdout, lp);
+		ldns_pkt_free(lp);
+		lp = NULL;
+	}
+}
+
+/* -W: copy the response to a parse worker's ring. The worker is picked by
+ * client, so each client's sets stay together for -A. If the ring is full,
+ * the pkt is dropped; the capture never waits, except when reading a
+ * file. */
+static void
+dnsflow_pipe_put(struct dnsflow_worker *dw, const struct timeval *tv,
+		uint32_t rtt, in_addr_t client_ip, const struct in6_addr *client6,
+		uint32_t key, int dns_len, char *dns_pkt)
+{
+	struct dnsflow_pipe_rec	*rec;
+	struct dnsflow_spsc	*sp;
+
+	sp = dw->dw_pipe[dnsflow_pipe_hash(key) % dw->dw_pipe_n];
+	if (dns_len > DNSFLOW_PIPE_DNS_MAX) {
+		dw->dw_drops[DNSFLOW_DROP_PIPE]++;
+		return;
+	}
+	while ((rec = dnsflow_spsc_slot(sp)) == NULL) {
+		if (!pipe_wait) {
+			dw->dw_drops[DNSFLOW_DROP_PIPE]++;
+			return;
+		}
+		usleep(DNSFLOW_PIPE_SLEEP_US);
+	}
+	rec->pr_tv = *tv;
+	rec->pr_rtt = rtt;
+	rec->pr_client_ip = client_ip;
+	rec->pr_client_is6 = client6 != NULL;
+	if (client6 != NULL) {
+		rec->pr_client6 = *client6;
+	}
+	rec->pr_dns_len = dns_len;
+	memcpy(rec->pr_dns, dns_pkt, dns_len);
+	dnsflow_spsc_push(sp);
+}
+
+/* A response (or with -Q, a query) that made it through
+ * dnsflow_pkt_check(). */
+struct dnsflow_resp {
+	struct timeval	rs_tv;
+	struct ip	*rs_ip;		/* One of these two. */
+	struct ip6_hdr	*rs_ip6;
+	int		rs_dns_len;
+	char		*rs_dns;
+	int		rs_query;
+	uint16_t	rs_client_port;	/* -Q */
+};
+
+/* Free up the slots in b older than the timeout. Returns how many of them
+ * there were. */
+static int
+dnsflow_rtt_expire(struct dnsflow_rtt_bucket *b, uint32_t now,
+		uint32_t timeout)
+{
+	int		i, n = 0;
+
+	for (i = 0; i < DNSFLOW_RTT_BUCKET_SLOTS; i++) {
+		if (b->rb_tags[i] != 0 && now - b->rb_times[i] >= timeout) {
+			b->rb_tags[i] = 0;
+			n++;
+		}
+	}
+	return (n);
+}
+
+/* Turn the wheel up to now (pkt time, usec). Tick t sweeps its share of
+ * the buckets, the ones from (t % timeout) / timeout of the way through
+ * the table. If pkt time goes backwards (-b starting the file again),
+ * the wheel just starts from there. */
+static void
+dnsflow_rtt_advance(struct dnsflow_worker *dw, uint64_t now)
+{
+	struct dnsflow_rtt	*rt = dw->dw_rtt;
+	uint64_t		tick = now / 1000, t, pos;
+	uint32_t		i, end;
+
+	if (tick <= rt->rt_tick) {
+		if (tick < rt->rt_tick) {
+			rt->rt_tick = tick;
+		}
+		return;
+	}
+	if (tick - rt->rt_tick > rt->rt_timeout) {
+		/* Been a while, avoid doing ticks more than once. */
+		rt->rt_tick = tick - rt->rt_timeout;
+	}
+	for (t = rt->rt_tick + 1; t <= tick; t++) {
+		pos = t % rt->rt_timeout;
+		i = pos * rt->rt_n_buckets / rt->rt_timeout;
+		end = (pos + 1) * rt->rt_n_buckets / rt->rt_timeout;
+		for (; i < end; i++) {
+			dw->dw_rtt_expired += dnsflow_rtt_expire(
+					&rt->rt_buckets[i], now,
+					rt->rt_timeout * 1000);
+		}
+	}
+	rt->rt_tick = tick;
+}
+
+/* FNV-1a over (client ip, client port, dns id, qname), lower cased like
+ * -q. Has to be the same for a query and its response. */
+static uint64_t
+dnsflow_rtt_key(struct dnsflow_resp *rs)
+{
+	const uint8_t	*p, *dns = (const uint8_t *)rs->rs_dns;
+	uint64_t	h = 14695981039346656037ULL;
+	int		i, len, end;
+
+	if (rs->rs_ip != NULL) {
+		p = (const uint8_t *)(rs->rs_query ?
+				&rs->rs_ip->ip_src : &rs->rs_ip->ip_dst);
+		len = sizeof(struct in_addr);
+	} else {
+		p = (const uint8_t *)(rs->rs_query ?
+				&rs->rs_ip6->ip6_src : &rs->rs_ip6->ip6_dst);
+		len = sizeof(struct in6_addr);
+	}
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 1099511628211ULL;
+	}
+	p = (const uint8_t *)&rs->rs_client_port;
+	h = (h ^ p[0]) * 1099511628211ULL;
+	h = (h ^ p[1]) * 1099511628211ULL;
+	h = (h ^ dns[0]) * 1099511628211ULL;	/* id */
+	h = (h ^ dns[1]) * 1099511628211ULL;
+	/* The prefilter made sure the qname is there. */
+	end = dns_name_skip(dns, rs->rs_dns_len, DNS_HDR_LEN);
+	for (i = DNS_HDR_LEN; i < end; i++) {
+		h = (h ^ tolower(dns[i])) * 1099511628211ULL;
+	}
+	return (h);
+}
+
+static inline uint64_t
+tv_usec(const struct timeval *tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec);
+}
+
+/* Park a query until its response. A retry of a query that's still
+ * outstanding keeps the first one's time. When the bucket is full, the
+ * oldest query in it goes. */
+static void
+dnsflow_rtt_add(struct dnsflow_worker *dw, struct dnsflow_resp *rs)
+{
+	struct dnsflow_rtt		*rt = dw->dw_rtt;
+	struct dnsflow_rtt_bucket	*b;
+	uint64_t			key = dnsflow_rtt_key(rs);
+	uint64_t			now = tv_usec(&rs->rs_tv);
+	uint32_t			tag, age, oldest_age = 0;
+	int				i, slot = -1, oldest = 0;
+
+	dnsflow_rtt_advance(dw, now);
+	tag = (key >> 32) != 0 ? key >> 32 : 1;
+	b = &rt->rt_buckets[key & (rt->rt_n_buckets - 1)];
+	dw->dw_rtt_expired += dnsflow_rtt_expire(b, now,
+			rt->rt_timeout * 1000);
+	for (i = 0; i < DNSFLOW_RTT_BUCKET_SLOTS; i++) {
+		if (b->rb_tags[i] == 0) {
+			if (slot < 0) {
+				slot = i;
+			}
+			continue;
+		}
+		if (b->rb_tags[i] == tag) {
+			return;
+		}
+		age = (uint32_t)now - b->rb_times[i];
+		if (age >= oldest_age) {
+			oldest_age = age;
+			oldest = i;
+		}
+	}
+	if (slot < 0) {
+		dw->dw_rtt_evicted++;
+		slot = oldest;
+	}
+	b->rb_tags[slot] = tag;
+	b->rb_times[slot] = now;
+	dw->dw_rtt_queries++;
+}
+
+/* Returns the usec since the response's query, or 0 if it wasn't seen. */
+static uint32_t
+dnsflow_rtt_match(struct dnsflow_worker *dw, struct dnsflow_resp *rs)
+{
+	struct dnsflow_rtt		*rt = dw->dw_rtt;
+	struct dnsflow_rtt_bucket	*b;
+	uint64_t			key = dnsflow_rtt_key(rs);
+	uint64_t			now = tv_usec(&rs->rs_tv);
+	uint32_t			tag, age;
+	int				i;
+
+	dnsflow_rtt_advance(dw, now);
+	tag = (key >> 32) != 0 ? key >> 32 : 1;
+	b = &rt->rt_buckets[key & (rt->rt_n_buckets - 1)];
+	for (i = 0; i < DNSFLOW_RTT_BUCKET_SLOTS; i++) {
+		if (b->rb_tags[i] != tag) {
+			continue;
+		}
+		b->rb_tags[i] = 0;
+		age = (uint32_t)now - b->rb_times[i];
+		if (age >= rt->rt_timeout * 1000) {
+			dw->dw_rtt_expired++;
+			return (0);
+		}
+		dw->dw_rtt_matched++;
+		return (MAX(age, 1));
+	}
+	return (0);
+}
+
+/* The checks up to the dns prefilter. Drops are counted in drops, and the
+ * prefilter results in pf_counts, so a batch can add them up first.
+ * Returns 0 if the pkt is a response (or with -Q, a query), with it in
+ * rs. */
+static int
+dnsflow_pkt_check(struct dnsflow_worker *dw, int pkt_len, char *ip_pkt,
+		struct dnsflow_resp *rs, uint64_t *drops, uint64_t *pf_counts,
+		uint64_t *t)
+{
+	struct ip		*ip;
+	struct ip6_hdr		*ip6;
+	struct udphdr		*udphdr;
+	char			*udp_data;
+	int			ip_encap_offset = 0;
+	int			remaining = pkt_len;
+	int			dns_len;
+	enum dns_prefilter_result	pf;
+
+	if ((udp_data = ip_udp_check(pkt_len, ip_pkt, &ip, &ip6,
+				&udphdr)) == NULL) {
+		drops[ip == NULL && ip6 == NULL ?
+			DNSFLOW_DROP_NOT_IP : DNSFLOW_DROP_NOT_UDP]++;
+		return (-1);
+	}
+	remaining -= udp_data - ip_pkt;
+
+	/* Handle various encapsulations. */
+	if (udphdr->uh_dport == pcap_record_dst_port) {
+		/* pcap header, eth, ip, udp, dns */
+		ip_encap_offset = sizeof(struct pcap_sf_pkthdr)
+			+ sizeof(struct ether_header);
+	} else if (udphdr->uh_dport == jmirror_dst_port) {
+		/* jmirror, ip, udp, dns */
+		ip_encap_offset = sizeof(struct jmirror_hdr);
+	}
+	if (ip_encap_offset != 0) {
+		udp_data = ip_encap_check(remaining, udp_data, ip_encap_offset,
+				&ip, &ip6, &udphdr);
+		if (udp_data == NULL) {
+			drops[DNSFLOW_DROP_ENCAP]++;
+			return (-1);
+		}
+	}
+
+	if (ntohs(udphdr->uh_ulen) < sizeof(struct udphdr)) {
+		drops[DNSFLOW_DROP_UDP_LEN]++;
+		return (-1);
+	}
+	dns_len = ntohs(udphdr->uh_ulen) - sizeof(struct udphdr);
+	DW_STAGE_END(dw, DNSFLOW_STAGE_IP_UDP, *t);
+
+	pf = dnsflow_dns_prefilter(dns_len, udp_data);
+	pf_counts[pf]++;
+	if (pf != DNS_PREFILTER_PASS && pf != DNS_PREFILTER_QUERY) {
+		drops[DNSFLOW_DROP_PREFILTER]++;
+		return (-1);
+	}
+	rs->rs_ip = ip;
+	rs->rs_ip6 = ip6;
+	rs->rs_dns_len = dns_len;
+	rs->rs_dns = udp_data;
+	rs->rs_query = pf == DNS_PREFILTER_QUERY;
+	rs->rs_client_port = rs->rs_query ? udphdr->uh_sport :
+		udphdr->uh_dport;
+	return (0);
+}
+
+/* Sample, then process the response, or pass it on to a parse worker.
+ * With -Q, queries are parked here, and responses matched up with them,
+ * before they go to a parse worker. */
+static void
+dnsflow_resp_process(struct dnsflow_worker *dw, struct dnsflow_resp *rs,
+		uint64_t *drops, uint64_t t)
+{
+	struct in6_addr		client6;
+	uint32_t		key = 0, rtt = 0;
+
+	if (dw->dw_sample_rate > 1 || dw->dw_role == DNSFLOW_WORKER_CAPTURE) {
+		key = dnsflow_client_key(rs->rs_ip, rs->rs_ip6, rs->rs_query);
+	}
+	if (dw->dw_sample_rate > 1 && dnsflow_sample_skip(dw->dw_sample_rate,
+				key, rs->rs_dns_len, rs->rs_dns)) {
+		drops[DNSFLOW_DROP_SAMPLED]++;
+		return;
+	}
+	if (rs->rs_query) {
+		dnsflow_rtt_add(dw, rs);
+		return;
+	}
+	if (dw->dw_rtt != NULL) {
+		rtt = dnsflow_rtt_match(dw, rs);
+	}
+	DW_STAGE_END(dw, DNSFLOW_STAGE_DNS_CHECK, t);
+
+	if (rs->rs_ip6 != NULL) {
+		/* Copied, the hdr isn't necessarily aligned. */
+		memcpy(&client6, &rs->rs_ip6->ip6_dst, sizeof(struct in6_addr));
+	}
+	if (dw->dw_role == DNSFLOW_WORKER_CAPTURE) {
+		dnsflow_pipe_put(dw, &rs->rs_tv, rtt,
+				rs->rs_ip ? rs->rs_ip->ip_dst.s_addr : 0,
+				rs->rs_ip6 ? &client6 : NULL, key,
+				rs->rs_dns_len, rs->rs_dns);
+		return;
+	}
+	dnsflow_dns_process(dw, &rs->rs_tv, rtt,
+			rs->rs_ip ? rs->rs_ip->ip_dst.s_addr : 0,
+			rs->rs_ip6 ? &client6 : NULL, rs->rs_dns_len,
+			rs->rs_dns, t);
+}
+
+static void
+dnsflow_dcap_cb(struct timeval *tv, int pkt_len, char *ip_pkt, void *user)
+{
+	struct dnsflow_worker	*dw = (struct dnsflow_worker *)user;
+	struct dnsflow_resp	rs;
+	uint64_t		t = 0;
+
+	if (stage_timing) {
+		t = hist_ticks();
+	}
+	if (dnsflow_pkt_check(dw, pkt_len, ip_pkt, &rs, dw->dw_drops,
+				dw->dw_prefilter_counts, &t) == 0) {
+		rs.rs_tv = *tv;
+		dnsflow_resp_process(dw, &rs, dw->dw_drops, t);
+	}
+}
+
+/* The checks and the prefilter run over the whole batch first, with the
+ * pkts a few ahead prefetched, then only the responses are sampled and
+ * parsed. The counters are added to the worker's once per batch. With -t,
+ * the stages are timed per pkt, so each goes through dnsflow_dcap_cb(). */
+static void
+dnsflow_dcap_batch_cb(struct dcap_pkt *pkts, int n, void *user)
+{
+	struct dnsflow_worker	*dw = (struct dnsflow_worker *)user;
+	struct dnsflow_resp	resps[DCAP_BATCH_MAX];
+	uint64_t		drops[DNSFLOW_DROP_MAX];
+	uint64_t		pf_counts[DNS_PREFILTER_MAX];
+	int			i, n_resps = 0;
+
+	if (stage_timing) {
+		for (i = 0; i < n; i++) {
+			dnsflow_dcap_cb(&pkts[i].tv, pkts[i].len,
+					pkts[i].ip_pkt, user);
+		}
+		return;
+	}
+
+	bzero(drops, sizeof(drops));
+	bzero(pf_counts, sizeof(pf_counts));
+	for (i = 0; i < n; i++) {
+		if (i + DNSFLOW_PREFETCH_AHEAD < n) {
+			__builtin_prefetch(
+				pkts[i + DNSFLOW_PREFETCH_AHEAD].ip_pkt);
+		}
+		if (dnsflow_pkt_check(dw, pkts[i].len, pkts[i].ip_pkt,
+					&resps[n_resps], drops, pf_counts,
+					NULL) == 0) {
+			resps[n_resps++].rs_tv = pkts[i].tv;
+		}
+	}
+	for (i = 0; i < n_resps; i++) {
+		if (i + DNSFLOW_PREFETCH_AHEAD < n_resps) {
+			/* The question, for the sampling and the parse. */
+			__builtin_prefetch(
+				resps[i + DNSFLOW_PREFETCH_AHEAD].rs_dns +
+				DNS_HDR_LEN);
+		}
+		dnsflow_resp_process(dw, &resps[i], drops, 0);
+	}
+
+	for (i = 0; i < DNSFLOW_DROP_MAX; i++) {
+		dw->dw_drops[i] += drops[i];
+	}
+	for (i = 0; i < DNS_PREFILTER_MAX; i++) {
+		dw->dw_prefilter_counts[i] += pf_counts[i];
+	}
+}
+
+/* Adaptive sampling. Raise the rate when the kernel is dropping, and
+ * lower it again once it has kept up for a while. Rates only double or
+ * halve, so the clients sampled at a higher rate are a subset of the ones
+ * sampled at the lower rate. */
+static void
+dnsflow_sample_adapt(struct dcap_stat *ds)
+{
+	static uint64_t		last_recv = 0, last_drop = 0;
+	static int		quiet = 0;
+	uint64_t		recv, drop;
+	uint32_t		rate = sample_rate;
+
+	recv = ds->ps_recv - last_recv;
+	drop = ds->ps_drop - last_drop;
+	last_recv = ds->ps_recv;
+	last_drop = ds->ps_drop;
+
+	if (drop > 0) {
+		quiet = 0;
+		if (drop * DNSFLOW_SAMPLE_DROP_RATIO > recv &&
+		    rate * 2 <= sample_rate_max) {
+			rate *= 2;
+		}
+	} else if (++quiet >= DNSFLOW_SAMPLE_QUIET) {
+		quiet = 0;
+		if (rate / 2 >= sample_rate_min) {
+			rate /= 2;
+		}
+	}
+	if (rate != sample_rate) {
+		_log("%llu of %llu pkts dropped, sample_rate %u -> %u",
+				(unsigned long long)drop,
+				(unsigned long long)recv, sample_rate, rate);
+		__sync_lock_test_and_set(&sample_rate, rate);
+	}
+}
+
+static void
+dnsflow_stats_send(struct dnsflow_buf *buf, int shard,
+		const struct sockaddr_in *dst)
+{
+	struct dnsflow_buf		*bufp = buf;
+	uint64_t			errors = 0;
+
+	buf->db_shard = shard;
+	if (dst != NULL) {
+		buf->db_dst = *dst;
+	}
+	buf->db_pkt_hdr.sequence_number = htonl(dnsflow_shard_seq(shard));
+	if (dnsflow_pkt_send(&bufp, 1, &errors) < 0 || errors > 0) {
+		warnx("stats send failed");
+	}
+}
+
+/* To every dst, or with -k, each dst gets its own, in its own sequence. */
+static void
+dnsflow_stats_send_all(struct dnsflow_buf *buf)
+{
+	struct dnsflow_dsts	*ds;
+	int			i;
+
+	if (!shard_export) {
+		dnsflow_stats_send(buf, -1, NULL);
+		return;
+	}
+	ds = __sync_fetch_and_add(&dsts, 0);
+	for (i = 0; i < ds->ds_n; i++) {
+		dnsflow_stats_send(buf, ds->ds_shards[i], &ds->ds_addrs[i]);
+	}
+	for (i = 0; i < n_tcp_exports; i++) {
+		dnsflow_stats_send(buf, DNSFLOW_SHARD_UDP + i, NULL);
+	}
+}
+
+static int
+dnsflow_topk_cand_cmp(const void *a, const void *b)
+{
+	const struct dnsflow_topk_cand	*ka = a, *kb = b;
+
+	if (ka->kc_count != kb->kc_count) {
+		return (ka->kc_count > kb->kc_count ? -1 : 1);
+	}
+	return (0);
+}
+
+/* -a. Merge the workers' sketches into all: the counts first, so every
+ * candidate is estimated over all of them, then the candidates. */
+static void
+dnsflow_topk_merge(struct dnsflow_topk_win **wins, int n_wins,
+		struct dnsflow_topk_win *all)
+{
+	struct dnsflow_topk_cand	*kc;
+	struct dnsflow_topk		*tk, *all_tk;
+	int				i, j, k, kind;
+
+	bzero(all, sizeof(*all));
+	for (i = 0; i < n_wins; i++) {
+		all->tw_sets += wins[i]->tw_sets;
+		for (kind = 0; kind < 2; kind++) {
+			tk = kind ? &wins[i]->tw_names : &wins[i]->tw_clients;
+			all_tk = kind ? &all->tw_names : &all->tw_clients;
+			for (j = 0; j < DNSFLOW_TOPK_DEPTH; j++) {
+				for (k = 0; k < DNSFLOW_TOPK_WIDTH; k++) {
+					all_tk->tk_counts[j][k] +=
+						tk->tk_counts[j][k];
+				}
+			}
+		}
+	}
+	for (i = 0; i < n_wins; i++) {
+		for (kind = 0; kind < 2; kind++) {
+			tk = kind ? &wins[i]->tw_names : &wins[i]->tw_clients;
+			all_tk = kind ? &all->tw_names : &all->tw_clients;
+			for (j = 0; j < tk->tk_n; j++) {
+				kc = &tk->tk_cands[j];
+				dnsflow_topk_offer(all_tk, topk_n, kc->kc_hash,
+						kc->kc_key, kc->kc_len,
+						dnsflow_topk_count(all_tk,
+							kc->kc_hash, 0));
+			}
+		}
+	}
+	qsort(all->tw_clients.tk_cands, all->tw_clients.tk_n,
+			sizeof(struct dnsflow_topk_cand), dnsflow_topk_cand_cmp);
+	qsort(all->tw_names.tk_cands, all->tw_names.tk_n,
+			sizeof(struct dnsflow_topk_cand), dnsflow_topk_cand_cmp);
+}
+
+/* -a. Send the top clients and names for the last window. With final (the
+ * end of -r), for everything the workers have, since there's no timer. */
+static void
+dnsflow_topk_send(int final)
+{
+	static struct dnsflow_topk_win	all;
+	struct dnsflow_topk_win		*wins[DNSFLOW_MAX_WORKERS * 2];
+	struct dnsflow_worker		*dw;
+	struct dnsflow_buf		buf;
+	struct dnsflow_topk_pkt		*tp = &buf.db_topk_pkt;
+	struct dnsflow_topk_cand	*kc;
+	uint32_t			gen = topk_gen, count;
+	time_t				now = time(NULL), start, end;
+	uint8_t				*p;
+	int				i, n_wins = 0;
+
+	for (i = 0; i < n_workers; i++) {
+		dw = workers[i];
+		if (dw->dw_topk[0] == NULL) {
+			continue;
+		}
+		if (final) {
+			wins[n_wins++] = dw->dw_topk[0];
+			wins[n_wins++] = dw->dw_topk[1];
+		} else if (__atomic_load_n(&dw->dw_topk_gen,
+					__ATOMIC_ACQUIRE) == gen) {
+			/* Idle since it switched. Workers that haven't
+			 * switched yet are left for the next time. */
+			wins[n_wins++] = dw->dw_topk[(gen + 1) & 1];
+		}
+	}
+	dnsflow_topk_merge(wins, n_wins, &all);
+	for (i = 0; i < n_wins; i++) {
+		bzero(wins[i], sizeof(*wins[i]));
+	}
+	if (final) {
+		start = topk_last;
+		end = now;
+	} else {
+		start = topk_last;
+		end = topk_start;
+		topk_last = topk_start;
+		topk_start = now;
+		__atomic_store_n(&topk_gen, gen + 1, __ATOMIC_RELEASE);
+		if (start == end) {
+			/* The first time, nothing's been counted. */
+			return;
+		}
+	}
+
+	bzero(&buf, offsetof(struct dnsflow_buf, DB_dat) +
+			offsetof(struct dnsflow_topk_pkt, entries));
+	buf.db_type = DNSFLOW_TOPK;
+	buf.db_pkt_hdr.version = DNSFLOW_VERSION;
+	buf.db_pkt_hdr.sets_count = 1;
+	buf.db_pkt_hdr.flags = htons(DNSFLOW_FLAG_TOPK);
+	tp->ts_sec = htonl(end);
+	tp->window_sec = htonl(end - start);
+	tp->sets = htonl(all.tw_sets);
+	tp->clients_count = all.tw_clients.tk_n;
+	tp->names_count = all.tw_names.tk_n;
+
+	p = tp->entries;
+	for (i = 0; i < all.tw_clients.tk_n; i++) {
+		kc = &all.tw_clients.tk_cands[i];
+		memcpy(p, kc->kc_key, sizeof(struct in6_addr));
+		count = htonl(kc->kc_count);
+		memcpy(p + sizeof(struct in6_addr), &count, sizeof(count));
+		p += sizeof(struct in6_addr) + sizeof(count);
+	}
+	for (i = 0; i < all.tw_names.tk_n; i++) {
+		kc = &all.tw_names.tk_cands[i];
+		count = htonl(kc->kc_count);
+		memcpy(p, &count, sizeof(count));
+		memcpy(p + sizeof(count), kc->kc_key, kc->kc_len);
+		p += sizeof(count) + kc->kc_len;
+	}
+	buf.db_len = p - (uint8_t *)&buf.db_pkt_hdr;
+	dnsflow_stats_send_all(&buf);
+}
+
+static uint64_t
+dnsflow_htonll(uint64_t v)
+{
+	return (((uint64_t)htonl(v & 0xffffffff) << 32) | htonl(v >> 32));
+}
+
+static uint8_t *
+dnsflow_stats3_put(uint8_t *p, uint64_t v)
+{
+	v = dnsflow_htonll(v);
+	memcpy(p, &v, sizeof(v));
+	return (p + sizeof(v));
+}
+
+/* In the v3 stats format's order. If total isn't NULL, ct is added to it
+ * too. */
+static uint8_t *
+dnsflow_stats3_counters(uint8_t *p, const struct dnsflow_counters *ct,
+		struct dnsflow_counters *total)
+{
+	const uint64_t	vals[8] = {
+		ct->ct_captured, ct->ct_received, ct->ct_dropped,
+		ct->ct_ifdropped, ct->ct_export_sent, ct->ct_export_bytes,
+		ct->ct_export_errors, ct->ct_export_dropped,
+	};
+	int		i;
+
+	for (i = 0; i < 8; i++) {
+		p = dnsflow_stats3_put(p, vals[i]);
+	}
+	for (i = 0; i < DNSFLOW_DROP_MAX; i++) {
+		p = dnsflow_stats3_put(p, ct->ct_drops[i]);
+	}
+	for (i = 0; i < DNS_PREFILTER_MAX; i++) {
+		p = dnsflow_stats3_put(p, ct->ct_prefilter[i]);
+	}
+	if (total == NULL) {
+		return (p);
+	}
+	total->ct_captured += ct->ct_captured;
+	total->ct_received += ct->ct_received;
+	total->ct_dropped += ct->ct_dropped;
+	total->ct_ifdropped += ct->ct_ifdropped;
+	total->ct_export_sent += ct->ct_export_sent;
+	total->ct_export_bytes += ct->ct_export_bytes;
+	total->ct_export_errors += ct->ct_export_errors;
+	total->ct_export_dropped += ct->ct_export_dropped;
+	for (i = 0; i < DNSFLOW_DROP_MAX; i++) {
+		total->ct_drops[i] += ct->ct_drops[i];
 	}
-	pkt_cur = pkt_start + data_buf->db_len;
-	pkt_end = pkt_start + DNSFLOW_PKT_MAX_SIZE - 1;
+	for (i = 0; i < DNS_PREFILTER_MAX; i++) {
+		total->ct_prefilter[i] += ct->ct_prefilter[i];
+	}
+	return (p);
+}
 
-	/* Start building new set. */
-	set_hdr = (struct dnsflow_set_hdr *)pkt_cur;
-	bzero(set_hdr, sizeof(struct dnsflow_set_hdr));
-	set_hdr->client_ip = client_ip;
-	/* XXX Not warning if we're truncating names, ips. */
-	set_hdr->names_count =
-		MIN(dns_data->num_names, DNSFLOW_NAMES_COUNT_MAX);
-	set_hdr->ips_count =
-		MIN(dns_data->num_ips, DNSFLOW_IPS_COUNT_MAX);
-	data_buf->db_len += sizeof(struct dnsflow_set_hdr);
-	pkt_cur = pkt_start + data_buf->db_len;
+/* -B, the v3 stats pkt. The workers go after the totals and pipes, which
+ * are a fixed size, so they're written first and summed on the way. */
+static void
+dnsflow_stats3_send(void)
+{
+	struct dnsflow_buf		buf;
+	struct dnsflow_stats3_pkt	*sp = &buf.db_stats3_pkt;
+	struct dnsflow_counters		ct, total;
+	struct dnsflow_pipe_stat	pt[DNSFLOW_PIPE_STAGE_MAX];
+	struct dnsflow_worker		*dw;
+	uint32_t			ring_used, ring_size, v;
+	uint8_t				*p;
+	int				i;
 
-	names_start = pkt_cur;
-	for (i = 0; i < set_hdr->names_count; i++) {
-		if (dns_data->name_lens[i] > pkt_end - pkt_cur) {
-			/* Not enough room. Shouldn't happen. */
-			_log("Pkt create error");
-			data_buf->db_len = 0;
-			return;
+	bzero(&buf, offsetof(struct dnsflow_buf, DB_dat) +
+			offsetof(struct dnsflow_stats3_pkt, entries));
+	buf.db_type = DNSFLOW_STATS3;
+	buf.db_pkt_hdr.version = DNSFLOW_VERSION_STATS;
+	buf.db_pkt_hdr.sets_count = 1;
+	buf.db_pkt_hdr.flags = htons(DNSFLOW_FLAG_STATS);
+	sp->ts_sec = htonl(time(NULL));
+	sp->sample_rate = htonl(sample_rate);
+	sp->workers_count = n_workers;
+	sp->drops_count = DNSFLOW_DROP_MAX;
+	sp->prefilter_count = DNS_PREFILTER_MAX;
+	sp->pipes_count = pipe_threads > 0 ? DNSFLOW_PIPE_STAGE_MAX : 0;
+
+	bzero(&total, sizeof(total));
+	p = sp->entries + DNSFLOW_COUNTERS_MAX * sizeof(uint64_t) +
+		sp->pipes_count * 16;
+	for (i = 0; i < n_workers; i++) {
+		dw = workers[i];
+		dnsflow_get_counters(dw, &ct, &ring_used, &ring_size);
+		p[0] = dw->dw_id;
+		p[1] = dw->dw_role;
+		p[2] = p[3] = 0;
+		v = htonl(DW_LOAD(dw->dw_sample_rate));
+		memcpy(p + 4, &v, sizeof(v));
+		v = htonl(ring_used);
+		memcpy(p + 8, &v, sizeof(v));
+		v = htonl(ring_size);
+		memcpy(p + 12, &v, sizeof(v));
+		p = dnsflow_stats3_counters(p + 16, &ct, &total);
+	}
+	buf.db_len = p - (uint8_t *)&buf.db_pkt_hdr;
+
+	p = dnsflow_stats3_counters(sp->entries, &total, NULL);
+	if (sp->pipes_count > 0) {
+		dnsflow_get_pipe_stats(pt);
+		for (i = 0; i < DNSFLOW_PIPE_STAGE_MAX; i++) {
+			v = htonl(pt[i].pt_used);
+			memcpy(p, &v, sizeof(v));
+			v = htonl(pt[i].pt_size);
+			memcpy(p + 4, &v, sizeof(v));
+			p = dnsflow_stats3_put(p + 8, pt[i].pt_overflows);
 		}
-		memcpy(pkt_cur, dns_data->names[i], dns_data->name_lens[i]);
-		data_buf->db_len += dns_data->name_lens[i];
-		pkt_cur = pkt_start + data_buf->db_len;
 	}
-	while (data_buf->db_len % 4 != 0) {
-		/* Pad to word boundary. */
-		pkt_start[data_buf->db_len++] = '\0';
+	dnsflow_stats_send_all(&buf);
+}
+
+static void
+dnsflow_stats_cb(int fd, short event, void *arg) 
+{
+	struct dcap_stat		ds[1];
+	struct dnsflow_buf		buf;
+	struct dnsflow_stats_pkt	*sp = &buf.db_stats_pkt;
+	uint64_t			drops[DNSFLOW_DROP_MAX];
+	static struct hist		hists[DNSFLOW_STAGE_MAX];
+	static struct hist		prev_hists[DNSFLOW_STAGE_MAX];
+	struct hist			diff;
+	struct dnsflow_pipe_stat	pt[DNSFLOW_PIPE_STAGE_MAX];
+	struct dnsflow_stats_pipe	pipes[DNSFLOW_PIPE_STAGE_MAX];
+	struct dnsflow_stats_export	ex;
+	int				i;
+
+	static int			stats_counter = 0;
+
+	evtimer_add(&stats_ev, jitter_tv(&stats_tv));
+
+	dnsflow_get_stats(ds);
+	if (sample_rate_max != 0 && ds->ps_valid) {
+		dnsflow_sample_adapt(ds);
+	}
+	/* What the workers have let go of since the last reload. */
+	dnsflow_dsts_reap();
+	stats_counter++;
+	if (stats_counter % 6 == 0) {
+		/* Print stats once a minute. */
+		dnsflow_print_stats(ds);
 	}
-	pkt_cur = pkt_start + data_buf->db_len;
-	set_hdr->names_len = htons(pkt_cur - names_start);
 
-	for (i = 0; i < set_hdr->ips_count; i++) {
-		ip_ptr = (in_addr_t *)pkt_cur;
-		*ip_ptr = dns_data->ips[i];
-		data_buf->db_len += sizeof(in_addr_t);
-		pkt_cur = pkt_start + data_buf->db_len;
+	bzero(&buf, sizeof(buf));
+
+	buf.db_type = DNSFLOW_STATS;
+
+	buf.db_pkt_hdr.version = DNSFLOW_VERSION;
+	buf.db_pkt_hdr.sets_count = 1;
+	buf.db_pkt_hdr.flags = htons(DNSFLOW_FLAG_STATS |
+			DNSFLOW_FLAG_STATS_EXT);
+
+	buf.db_stats_pkt.pkts_captured = htonl(ds->captured);
+	buf.db_stats_pkt.pkts_received = htonl(ds->ps_recv);
+	buf.db_stats_pkt.pkts_dropped = htonl(ds->ps_drop);
+	buf.db_stats_pkt.pkts_ifdropped = htonl(ds->ps_ifdrop);
+	buf.db_stats_pkt.sample_rate = htonl(sample_rate);
+
+	dnsflow_get_worker_stats(ds, drops, hists);
+	sp->drops_count = DNSFLOW_DROP_MAX;
+	for (i = 0; i < DNSFLOW_DROP_MAX; i++) {
+		sp->drops[i] = htonl(drops[i]);
+	}
+	if (stage_timing) {
+		/* Percentiles for this interval only. */
+		sp->stages_count = DNSFLOW_STAGE_MAX;
+		for (i = 0; i < DNSFLOW_STAGE_MAX; i++) {
+			hist_diff(&diff, &hists[i], &prev_hists[i]);
+			sp->stages[i].samples = htonl(hist_count(&diff));
+			sp->stages[i].p50_ns = htonl(hist_ticks_to_ns(
+					hist_percentile(&diff, 50)));
+			sp->stages[i].p99_ns = htonl(hist_ticks_to_ns(
+					hist_percentile(&diff, 99)));
+			sp->stages[i].p999_ns = htonl(hist_ticks_to_ns(
+					hist_percentile(&diff, 99.9)));
+		}
+		memcpy(prev_hists, hists, sizeof(prev_hists));
+	}
+	if (pipe_threads > 0) {
+		sp->pipes_count = DNSFLOW_PIPE_STAGE_MAX;
+		dnsflow_get_pipe_stats(pt);
+		for (i = 0; i < DNSFLOW_PIPE_STAGE_MAX; i++) {
+			pipes[i].used = htonl(pt[i].pt_used);
+			pipes[i].size = htonl(pt[i].pt_size);
+			pipes[i].overflows = htonl(pt[i].pt_overflows);
+		}
+		/* Straight after the stages that are there. */
+		memcpy(&sp->stages[sp->stages_count], pipes, sizeof(pipes));
+	}
+	sp->exports_count = n_tcp_exports;
+	for (i = 0; i < n_tcp_exports; i++) {
+		dnsflow_get_tcp_stats(tcp_exports[i], &ex);
+		ex.queued = htonl(ex.queued);
+		ex.size = htonl(ex.size);
+		ex.sent = htonl(ex.sent);
+		ex.dropped = htonl(ex.dropped);
+		ex.stalls = htonl(ex.stalls);
+		ex.connects = htonl(ex.connects);
+		/* And after the pipes. */
+		memcpy((char *)&sp->stages[sp->stages_count] +
+				sp->pipes_count * sizeof(pipes[0]) +
+				i * sizeof(ex), &ex, sizeof(ex));
+	}
+	buf.db_len = sizeof(struct dnsflow_hdr) +
+		offsetof(struct dnsflow_stats_pkt, stages) +
+		sp->stages_count * sizeof(sp->stages[0]) +
+		sp->pipes_count * sizeof(pipes[0]) +
+		sp->exports_count * sizeof(ex);
+
+	dnsflow_stats_send_all(&buf);
+	if (stats_v3) {
+		dnsflow_stats3_send();
 	}
+	if (topk_n > 0) {
+		dnsflow_topk_send(0);
+	}
+}
 
-	dnsflow_hdr->sets_count++;
+/* The capture's link type, for checking a reloaded filter. Ethernet
+ * before there's a capture (opening it checks the filter), or without
+ * one, as in the -M parent. */
+static int
+dnsflow_datalink(void)
+{
+	int		i;
 
-	if (data_buf->db_len >= DNSFLOW_PKT_TARGET_SIZE ||
-	    dnsflow_hdr->sets_count == DNSFLOW_SETS_COUNT_MAX) {
-		/* Send */
-		dnsflow_pkt_send_data();
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i]->dw_dcap != NULL) {
+			return (dcap_get_datalink(workers[i]->dw_dcap));
+		}
+	}
+	return (DLT_EN10MB);
+}
+
+/* -c. Read the config file over the command line values in base. One
+ * setting per line, # comments:
+ *	dst <ip>		replaces all the -u dsts, one line each
+ *	sample <rate[:max]>	-s
+ *	push <sec>		flow pkt push interval
+ *	stats <sec>		stats pkt interval
+ *	filter <expression>	-f
+ * Returns -1 if any of it is bad, and cf shouldn't be used. */
+static int
+dnsflow_config_read(const char *path, const struct dnsflow_config *base,
+		struct dnsflow_config *cf)
+{
+	FILE		*fp;
+	char		line[DNSFLOW_CONFIG_FILTER_MAX + 16];
+	char		*key, *val, *p;
+	pcap_t		*pc;
+	struct bpf_program	bpf_program;
+	int		line_n = 0, have_dsts = 0, sec, rv = 0;
+
+	*cf = *base;
+	if ((fp = fopen(path, "r")) == NULL) {
+		_log("%s: %s", path, strerror(errno));
+		return (-1);
+	}
+	while (rv == 0 && fgets(line, sizeof(line), fp) != NULL) {
+		line_n++;
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			_log("%s:%d: line too long", path, line_n);
+			rv = -1;
+			break;
+		}
+		if ((p = strchr(line, '#')) != NULL) {
+			*p = '\0';
+		}
+		p = line + strlen(line);
+		while (p > line && isspace((unsigned char)p[-1])) {
+			*--p = '\0';
+		}
+		key = line + strspn(line, " \t");
+		if (*key == '\0') {
+			continue;
+		}
+		val = key + strcspn(key, " \t");
+		if (*val != '\0') {
+			*val++ = '\0';
+			val += strspn(val, " \t");
+		}
+
+		if (*val == '\0') {
+			rv = -1;
+		} else if (strcmp(key, "dst") == 0) {
+			if (!have_dsts) {
+				/* The file's list replaces -u. */
+				bzero(&cf->cf_dsts, sizeof(cf->cf_dsts));
+				have_dsts = 1;
+			}
+			rv = parse_dst(val, &cf->cf_dsts);
+		} else if (strcmp(key, "sample") == 0) {
+			rv = parse_sample_rate(val, &cf->cf_sample_min,
+					&cf->cf_sample_max);
+		} else if (strcmp(key, "push") == 0 ||
+		    strcmp(key, "stats") == 0) {
+			sec = strtol(val, &p, 10);
+			if (*p != '\0' || sec <= 0 ||
+			    sec > DNSFLOW_INTERVAL_MAX) {
+				rv = -1;
+			} else if (key[0] == 'p') {
+				cf->cf_push_sec = sec;
+			} else {
+				cf->cf_stats_sec = sec;
+			}
+		} else if (strcmp(key, "filter") == 0) {
+			/* Checked here, against what's being captured, so a
+			 * filter the workers can't set fails the reload. */
+			if ((pc = pcap_open_dead(dnsflow_datalink(),
+						65535)) == NULL) {
+				rv = -1;
+			} else if (pcap_compile(pc, &bpf_program, val, 1,
+						0) < 0) {
+				_log("%s:%d: %s", path, line_n,
+						pcap_geterr(pc));
+				rv = -1;
+			} else {
+				pcap_freecode(&bpf_program);
+				snprintf(cf->cf_filter, sizeof(cf->cf_filter),
+						"%s", val);
+			}
+			if (pc != NULL) {
+				pcap_close(pc);
+			}
+		} else {
+			_log("%s:%d: unknown setting %s", path, line_n, key);
+			rv = -1;
+			break;
+		}
+		if (rv < 0) {
+			_log("%s:%d: invalid %s", path, line_n, key);
+		}
 	}
+	fclose(fp);
+
+	return (rv);
 }
 
+/* Make cf the running config, from the main thread. The workers pick up
+ * the new sample rate and filter in their push timer, and the intervals
+ * take effect when the current ones are up. */
 static void
-dnsflow_dcap_cb(struct timeval *tv, int pkt_len, char *ip_pkt, void *user)
+dnsflow_config_apply(const struct dnsflow_config *cf)
 {
-	struct ip		*ip;
-	struct udphdr		*udphdr;
-	char			*udp_data;
-	int			ip_encap_offset = 0;
-	int			remaining = pkt_len;
+	struct dnsflow_dsts	*ds, *old;
+	char			*filter, *cur;
+
+	if (cf->cf_dsts.ds_n != dsts->ds_n ||
+	    memcmp(cf->cf_dsts.ds_addrs, dsts->ds_addrs,
+		    sizeof(dsts->ds_addrs)) != 0) {
+		if ((ds = malloc(sizeof(*ds))) == NULL) {
+			err(1, "malloc");
+		}
+		*ds = cf->cf_dsts;
+		dnsflow_dsts_reap();
+		if (shard_export && dnsflow_shard_assign(ds, dsts) < 0) {
+			/* Only until the workers are done with the lists
+			 * before. */
+			_log("no free shards for the new dsts yet, dsts "
+					"unchanged");
+			free(ds);
+		} else {
+			if (shard_export) {
+				dnsflow_shard_ring_build(ds);
+			}
+			old = __sync_lock_test_and_set(&dsts, ds);
+			old->ds_retired_gen = __atomic_add_fetch(&dsts_gen, 1,
+					__ATOMIC_RELEASE);
+			old->ds_retired_next = dsts_retired;
+			dsts_retired = old;
+			dnsflow_dsts_reap();
+		}
+	}
 
-	ldns_pkt		*lp;
-	struct dns_data_set	*dns_data;
+	if (cf->cf_sample_min != sample_rate_min ||
+	    cf->cf_sample_max != sample_rate_max) {
+		sample_rate_min = cf->cf_sample_min;
+		sample_rate_max = cf->cf_sample_max;
+		__sync_lock_test_and_set(&sample_rate, sample_rate_min);
+	}
+	__sync_lock_test_and_set(&push_tv.tv_sec, cf->cf_push_sec);
+	stats_tv.tv_sec = cf->cf_stats_sec;
+
+	filter = cf->cf_filter[0] != '\0' ? (char *)cf->cf_filter :
+		filter_cmdline;
+	cur = filter_default ? NULL : filter_user;
+	if (filter == cur || (filter != NULL && cur != NULL &&
+				strcmp(filter, cur) == 0)) {
+		return;
+	}
+	if (filter_fixed) {
+		_log("can't change the filter with -x, keeping it");
+		return;
+	}
+	pthread_mutex_lock(&filter_lock);
+	free(filter_user);
+	filter_user = NULL;
+	if (filter != NULL && (filter_user = strdup(filter)) == NULL) {
+		err(1, "strdup");
+	}
+	filter_default = filter == NULL;
+	pthread_mutex_unlock(&filter_lock);
+	__sync_add_and_fetch(&filter_gen, 1);
+}
+
+/* SIGHUP. With -M, each child reads the config file for itself. A bad
+ * config file changes nothing. */
+static void
+dnsflow_config_reload(void)
+{
+	struct dnsflow_config	cf[1];
+	int			i;
+
+	for (i = 0; i < n_mproc_children; i++) {
+		kill(mproc_children[i], SIGHUP);
+	}
+	if (config_file == NULL) {
+		_log("no config file (-c), nothing to reload");
+		return;
+	}
+	if (dnsflow_config_read(config_file, &config_cmdline, cf) < 0) {
+		_log("%s: reload failed, config unchanged", config_file);
+		return;
+	}
+	if (cf->cf_dsts.ds_n == 0 && pdump == NULL && export_ring == NULL &&
+	    unix_path == NULL && n_tcp_exports == 0) {
+		_log("%s: no dsts, config unchanged", config_file);
+		return;
+	}
+	dnsflow_config_apply(cf);
+	_log("reloaded %s: %d dsts, sample_rate %u%s, push %ds, stats %ds, "
+			"filter %s", config_file, dsts->ds_n,
+			sample_rate_min, sample_rate_max != 0 ? " adaptive" : "",
+			cf->cf_push_sec, cf->cf_stats_sec,
+			filter_default ? "default" : filter_user);
+}
+
+static void
+signal_cb(int signal, short event, void *arg) 
+{
+	int				stat_loc;
+	pid_t				pid;
+	struct dcap_stat		ds[1];
+
+	switch (signal) {
+	case SIGINT:
+	case SIGTERM:
+		_log("received exit signal: %d", signal);
+		clean_exit();	/* Doesn't return. */
+		break;
+	case SIGUSR1:
+		dnsflow_get_stats(ds);
+		dnsflow_print_stats(ds);
+		break;
+	case SIGHUP:
+		dnsflow_config_reload();
+		break;
+	case SIGCHLD:
+		pid = wait(&stat_loc);
+		_log("child exited: %d", pid);
+		clean_exit();
+		break;
+	default:
+		errx(1, "caught unexpected signal: %d", signal);
+		break;
+	}
+
+}
 
-	if ((udp_data = ip_udp_check(pkt_len, ip_pkt, &ip, &udphdr)) == NULL) {
+/* XXX Disable for production */
+static void
+dnsflow_event_log_cb(int severity, const char *msg)
+{
+	if (severity == _EVENT_LOG_DEBUG) {
 		return;
 	}
-	remaining -= udp_data - ip_pkt;
+	_log("event: %d: %s", severity, msg);
+}
 
-	/* Handle various encapsulations. */
-	if (udphdr->uh_dport == pcap_record_dst_port) {
-		/* pcap header, eth, ip, udp, dns */
-		ip_encap_offset = sizeof(struct pcap_sf_pkthdr)
-			+ sizeof(struct ether_header);
-	} else if (udphdr->uh_dport == jmirror_dst_port) {
-		/* jmirror, ip, udp, dns */
-		ip_encap_offset = sizeof(struct jmirror_hdr);
+/* The role for workers with a dcap. */
+static int
+dnsflow_capture_role(void)
+{
+	return (pipe_threads > 0 ? DNSFLOW_WORKER_CAPTURE :
+			DNSFLOW_WORKER_INLINE);
+}
+
+/* base is NULL to use the global event base. dcap is NULL for the parse
+ * and export workers. */
+static struct dnsflow_worker *
+dnsflow_worker_new(struct dcap *dcap, struct event_base *base, int role)
+{
+	struct dnsflow_worker		*dw;
+	struct dnsflow_arena		arena;
+	int				i;
+
+	if (n_workers == DNSFLOW_MAX_WORKERS) {
+		errx(1, "too many workers");
+	}
+	bzero(&arena, sizeof(arena));
+	dw = dnsflow_arena_alloc(&arena, sizeof(struct dnsflow_worker));
+	dw->dw_arena = arena;
+	dw->dw_id = n_workers;
+	dw->dw_cpu = -1;
+	dw->dw_ev_base = base;
+	dw->dw_role = role;
+	dw->dw_dcap = dcap;
+	dw->dw_sample_rate = sample_rate;
+	dw->dw_filter_gen = filter_gen;
+	dw->dw_dsts_gen = dsts_gen;
+	dw->dw_dsts = dsts;
+	if (dcap != NULL) {
+		dcap->user = dw;
+		dcap_set_decap(dcap, decap_flags);
+		if (dcap_set_batch_handler(dcap, dnsflow_dcap_batch_cb) < 0) {
+			errx(1, "dcap_set_batch_handler failed");
+		}
+	}
+	workers[n_workers++] = dw;
+
+	if (rtt_n_buckets > 0 && (role == DNSFLOW_WORKER_INLINE ||
+				role == DNSFLOW_WORKER_CAPTURE)) {
+		dw->dw_rtt = dnsflow_rtt_new(&dw->dw_arena, rtt_n_buckets);
+	}
+	if (role == DNSFLOW_WORKER_EXPORT) {
+		/* Just sends other workers' bufs. */
+		return (dw);
+	}
+	if (role != DNSFLOW_WORKER_CAPTURE) {
+		for (i = 0; i < DNSFLOW_EXPORT_BATCH; i++) {
+			dw->dw_export_bufs[i] =
+				dnsflow_data_buf_new(&dw->dw_arena);
+		}
+		dw->dw_data_buf = dw->dw_export_bufs[0];
+		dw->dw_pkt = &dw->dw_pkt_one;
+		dw->dw_pkt_one.ps_shard = -1;
+		if (shard_export) {
+			dw->dw_pkt_one.ps_buf = dw->dw_data_buf =
+				dnsflow_data_buf_new(&dw->dw_arena);
+		}
+		dw->dw_data_set = dnsflow_arena_alloc(&dw->dw_arena,
+				sizeof(struct dns_data_set));
+		if (anon != NULL) {
+			dw->dw_anon_cache = dnsflow_anon_cache_new(
+					&dw->dw_arena);
+			dw->dw_anon_names = dnsflow_arena_alloc(&dw->dw_arena,
+					DNSFLOW_NAME_BUF_SIZE);
+		}
+		if (topk_n > 0) {
+			for (i = 0; i < 2; i++) {
+				dw->dw_topk[i] = dnsflow_arena_alloc(
+						&dw->dw_arena,
+						sizeof(struct dnsflow_topk_win));
+			}
+		}
+		if (dns_parser == DNSFLOW_PARSER_VERIFY) {
+			dw->dw_ldns_data = dnsflow_arena_alloc(&dw->dw_arena,
+					sizeof(struct dns_data_set));
+		}
+		if (agg_n_entries > 0) {
+			dw->dw_agg = dnsflow_agg_new(&dw->dw_arena,
+					agg_n_entries);
+			dw->dw_agg_set = dnsflow_arena_alloc(&dw->dw_arena,
+					sizeof(struct dns_data_set));
+		}
+	}
+
+	/* Even if the flow pkt isn't full, send any buffered data every
+	 * second. */
+	dw->dw_push_tv = push_tv;
+	evtimer_set(&dw->dw_push_ev, dnsflow_push_cb, dw);
+	if (base != NULL) {
+		event_base_set(base, &dw->dw_push_ev);
+	}
+	evtimer_add(&dw->dw_push_ev, jitter_tv(&dw->dw_push_tv));
+
+	return (dw);
+}
+
+static void
+dnsflow_worker_free(struct dnsflow_worker *dw)
+{
+	struct dnsflow_arena		arena;
+
+	if (dw->dw_role == DNSFLOW_WORKER_PARSE) {
+		event_base_free(dw->dw_ev_base);
+	}
+	/* Everything else, even dw, is in the arena. The parse workers'
+	 * arenas have the -W rings and bufs. */
+	arena = dw->dw_arena;
+	dnsflow_arena_free(&arena);
+}
+
+/* Pin the calling thread to the worker's cpu, if it has one. */
+static void
+dnsflow_worker_pin(struct dnsflow_worker *dw)
+{
+#if __linux__
+	cpu_set_t			cpus;
+	int				rv;
+
+	if (dw->dw_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(dw->dw_cpu, &cpus);
+		if ((rv = pthread_setaffinity_np(pthread_self(),
+					sizeof(cpus), &cpus)) != 0) {
+			errx(1, "worker %d: can't pin to cpu %d: %s",
+					dw->dw_id, dw->dw_cpu, strerror(rv));
+		}
+	}
+#endif
+}
+
+/* -W parse worker. Takes responses off the rings from the capture workers,
+ * and runs its own timers in between. Only returns at the end of a -r
+ * file. */
+static void
+dnsflow_parse_loop(struct dnsflow_worker *dw)
+{
+	struct dnsflow_pipe_rec		*rec;
+	struct dnsflow_spsc		*sp;
+	uint64_t			t = 0;
+	int				i, j, n, eof, idle = 0, passes = 0;
+
+	for (;;) {
+		/* Before the pass, so an empty pass after eof means there's
+		 * nothing more coming. */
+		eof = __atomic_load_n(&pipe_eof, __ATOMIC_ACQUIRE);
+		n = 0;
+		for (i = 0; i < dw->dw_pipe_n; i++) {
+			sp = dw->dw_pipe[i];
+			for (j = 0; j < DNSFLOW_PIPE_BURST &&
+			    (rec = dnsflow_spsc_peek(sp)) != NULL; j++) {
+				if (stage_timing) {
+					t = hist_ticks();
+				}
+				dnsflow_dns_process(dw, &rec->pr_tv,
+					rec->pr_rtt, rec->pr_client_ip,
+					rec->pr_client_is6 ?
+					&rec->pr_client6 : NULL,
+					rec->pr_dns_len, rec->pr_dns, t);
+				dnsflow_spsc_pop(sp);
+			}
+			n += j;
+		}
+		if (n == 0 && eof) {
+			break;
+		}
+		if (n == 0 || ++passes == DNSFLOW_PIPE_TIMER_PASSES) {
+			passes = 0;
+			event_base_loop(dw->dw_ev_base, EVLOOP_NONBLOCK);
+		}
+		dnsflow_pipe_idle(n, &idle);
+	}
+
+	dnsflow_agg_flush(dw);
+	dnsflow_pkt_send_pending(dw);
+	dnsflow_export_flush(dw);
+	__atomic_store_n(&dw->dw_pipe_done, 1, __ATOMIC_RELEASE);
+}
+
+/* -W export worker. Sends the parse workers' flow pkts, a batch at a time,
+ * and gives the bufs back. Only returns when the parse workers are done
+ * with a -r file. */
+static void
+dnsflow_export_loop(struct dnsflow_worker *dw)
+{
+	struct dnsflow_buf		*bufs[DNSFLOW_EXPORT_BATCH];
+	struct dnsflow_worker		*pw;
+	void				*slot;
+	uint64_t			t = 0;
+	int				i, j, n, total, rv, done, idle = 0;
+
+	for (;;) {
+		dnsflow_dsts_ack(dw);
+		total = 0;
+		done = 1;
+		for (i = 0; i < n_pipe_parsers; i++) {
+			pw = pipe_parsers[i];
+			done &= __atomic_load_n(&pw->dw_pipe_done,
+					__ATOMIC_ACQUIRE);
+			for (n = 0; n < DNSFLOW_EXPORT_BATCH &&
+			    (slot = dnsflow_spsc_peek(pw->dw_bufs_full)) !=
+			    NULL; n++) {
+				bufs[n] = *(struct dnsflow_buf **)slot;
+				dnsflow_spsc_pop(pw->dw_bufs_full);
+			}
+			if (n == 0) {
+				continue;
+			}
+			if (stage_timing) {
+				t = hist_ticks();
+			}
+			rv = dnsflow_pkt_send(bufs, n, &dw->dw_export_errors);
+			if (stage_timing) {
+				hist_add(&dw->dw_stage_hist[DNSFLOW_STAGE_SEND],
+						hist_ticks() - t);
+			}
+			if (rv < 0) {
+				dw->dw_export_dropped++;
+			} else {
+				dw->dw_export_sent += rv;
+			}
+			for (j = 0; j < n; j++) {
+				/* Never full, like dw_bufs_full. */
+				slot = dnsflow_spsc_slot(pw->dw_bufs_free);
+				*(struct dnsflow_buf **)slot = bufs[j];
+				dnsflow_spsc_push(pw->dw_bufs_free);
+			}
+			total += n;
+		}
+		if (total == 0 && done) {
+			return;
+		}
+		dnsflow_pipe_idle(total, &idle);
+	}
+}
+
+static void *
+dnsflow_worker_run(void *arg)
+{
+	struct dnsflow_worker		*dw = (struct dnsflow_worker *)arg;
+	int				rv;
+
+	dnsflow_worker_pin(dw);
+	switch (dw->dw_role) {
+	case DNSFLOW_WORKER_PARSE:
+		_log("parse worker %d started, cpu %d", dw->dw_id,
+				dw->dw_cpu);
+		dnsflow_parse_loop(dw);
+		return (NULL);
+	case DNSFLOW_WORKER_EXPORT:
+		_log("export worker %d started, cpu %d", dw->dw_id,
+				dw->dw_cpu);
+		dnsflow_export_loop(dw);
+		return (NULL);
+	default:
+		_log("worker %d started on %s, cpu %d", dw->dw_id,
+				dw->dw_dcap->intf_name, dw->dw_cpu);
+		break;
+	}
+
+	rv = event_base_dispatch(dw->dw_ev_base);
+	errx(1, "worker %d: event_base_dispatch terminated: %d", dw->dw_id, rv);
+
+	return (NULL);
+}
+
+/* -W: add the parse workers and the export worker, and connect them to
+ * the capture workers (all the workers so far). The -K cpus carry on from
+ * where the capture workers left off. */
+static void
+dnsflow_pipe_init(int *cpus, int n_cpus)
+{
+	struct dnsflow_worker		*dw, *cw;
+	struct dnsflow_spsc		*sp;
+	struct event_base		*base;
+	void				*slot;
+	int				i, j, n_captures = n_workers;
+
+	if (n_captures + pipe_threads + 1 > DNSFLOW_MAX_WORKERS) {
+		errx(1, "too many workers");
 	}
-	if (ip_encap_offset != 0) {
-		udp_data = ip_encap_check(remaining, udp_data, ip_encap_offset,
-				&ip, &udphdr); 
-		if (udp_data == NULL) {
-			return;
+	for (i = 0; i < pipe_threads; i++) {
+		if ((base = event_base_new()) == NULL) {
+			errx(1, "event_base_new failed");
+		}
+		dw = dnsflow_worker_new(NULL, base, DNSFLOW_WORKER_PARSE);
+		for (j = 0; j < n_captures; j++) {
+			cw = workers[j];
+			sp = dnsflow_spsc_new(&dw->dw_arena, pipe_slots,
+					DNSFLOW_PIPE_SLOT_SIZE);
+			cw->dw_pipe[cw->dw_pipe_n++] = sp;
+			dw->dw_pipe[dw->dw_pipe_n++] = sp;
+		}
+		dw->dw_bufs_full = dnsflow_spsc_new(&dw->dw_arena,
+				DNSFLOW_PIPE_BUFS + DNSFLOW_EXPORT_BATCH,
+				sizeof(struct dnsflow_buf *));
+		dw->dw_bufs_free = dnsflow_spsc_new(&dw->dw_arena,
+				DNSFLOW_PIPE_BUFS + DNSFLOW_EXPORT_BATCH,
+				sizeof(struct dnsflow_buf *));
+		for (j = 0; j < DNSFLOW_PIPE_BUFS; j++) {
+			slot = dnsflow_spsc_slot(dw->dw_bufs_free);
+			*(struct dnsflow_buf **)slot =
+				dnsflow_data_buf_new(&dw->dw_arena);
+			dnsflow_spsc_push(dw->dw_bufs_free);
 		}
+		pipe_parsers[n_pipe_parsers++] = dw;
 	}
+	dnsflow_worker_new(NULL, NULL, DNSFLOW_WORKER_EXPORT);
 
-	lp = dnsflow_dns_check(ntohs(udphdr->uh_ulen), udp_data);
-	if (lp == NULL) {
-		/* Bad dns pkt, or one we're not interested in. */
-		return;
+	for (i = n_captures; n_cpus > 0 && i < n_workers; i++) {
+		workers[i]->dw_cpu = cpus[i % n_cpus];
 	}
+}
 
-	if ((dns_data = dnsflow_dns_extract(lp)) == NULL) {
-		ldns_pkt_free(lp);
-		return;
+/* -r with -W. The capture worker (workers[0]) reads the file on this
+ * thread, then waits for the rest of the pipeline to finish. */
+static void
+dnsflow_pipe_file_run(void)
+{
+	int		i, rv;
+
+	for (i = 1; i < n_workers; i++) {
+		if ((rv = pthread_create(&workers[i]->dw_thread, NULL,
+					dnsflow_worker_run, workers[i])) != 0) {
+			errx(1, "pthread_create: %s", strerror(rv));
+		}
 	}
+	dcap_loop_all(workers[0]->dw_dcap);
+	__atomic_store_n(&pipe_eof, 1, __ATOMIC_RELEASE);
+	for (i = 1; i < n_workers; i++) {
+		pthread_join(workers[i]->dw_thread, NULL);
+	}
+}
+
+/* Next chunk for a worker, or NULL when there are none left. With -O,
+ * waits while too many are done and waiting to be sent. */
+static struct dnsflow_chunk *
+dnsflow_chunk_next(void)
+{
+	struct dnsflow_chunk	*dc = NULL;
 
-	/* Should be good to go. */
-	dnsflow_pkt_build(ip->ip_dst.s_addr, dns_data);
+	pthread_mutex_lock(&chunks_lock);
+	while (offline_ordered && chunks_next < n_chunks &&
+	    chunks_next >= chunks_sent + n_workers * DNSFLOW_CHUNKS_AHEAD) {
+		pthread_cond_wait(&chunks_cond, &chunks_lock);
+	}
+	if (chunks_next < n_chunks) {
+		dc = &chunks[chunks_next++];
+	}
+	pthread_mutex_unlock(&chunks_lock);
 
-	//ldns_pkt_print(stdout, lp);
-	ldns_pkt_free(lp);
-	lp = NULL;
+	return (dc);
 }
 
+/* -O: number and send the chunk's pkts. Only the main thread sends, one
+ * chunk at a time in file order, so sequence numbers follow the file. */
 static void
-dnsflow_stats_cb(int fd, short event, void *arg) 
+dnsflow_chunk_send(struct dnsflow_chunk *dc, struct dnsflow_buf **bufs)
 {
-	struct dcap			*dcap = (struct dcap *)arg;
-	struct dcap_stat		*ds;
-	struct dnsflow_buf		buf;
+	struct dnsflow_worker	*dw = dc->dc_dw;
+	size_t			off = 0;
+	uint32_t		len;
+	int			n = 0, rv;
+
+	/* The worker doesn't touch its export counters with -O. */
+	while (off < dc->dc_out_len) {
+		memcpy(&len, dc->dc_out + off, sizeof(uint32_t));
+		bufs[n]->db_len = len;
+		memcpy(&bufs[n]->db_shard, dc->dc_out + off + sizeof(uint32_t),
+				sizeof(int32_t));
+		memcpy(&bufs[n]->db_dst, dc->dc_out + off + 2 * sizeof(uint32_t),
+				sizeof(struct sockaddr_in));
+		memcpy(&bufs[n]->db_pkt_hdr,
+				dc->dc_out + off + DNSFLOW_CHUNK_REC, len);
+		bufs[n]->db_pkt_hdr.sequence_number =
+			htonl(dnsflow_shard_seq(bufs[n]->db_shard));
+		off += DNSFLOW_CHUNK_REC + len;
+		if (++n == DNSFLOW_EXPORT_BATCH || off == dc->dc_out_len) {
+			rv = dnsflow_pkt_send(bufs, n, &dw->dw_export_errors);
+			if (rv < 0) {
+				dw->dw_export_dropped++;
+			} else {
+				dw->dw_export_sent += rv;
+			}
+			n = 0;
+		}
+	}
+	free(dc->dc_out);
+	dc->dc_out = NULL;
+	dc->dc_out_len = dc->dc_out_size = 0;
+}
 
-	static int			stats_counter = 0;
+static void *
+dnsflow_file_worker_run(void *arg)
+{
+	struct dnsflow_worker	*dw = (struct dnsflow_worker *)arg;
+	struct dnsflow_chunk	*dc;
+	size_t			end;
 
-	evtimer_add(&stats_ev, jitter_tv(&stats_tv));
+	dnsflow_worker_pin(dw);
 
-	ds = dcap_get_stats(dcap);
-	stats_counter++;
-	if (stats_counter % 6 == 0) {
-		/* Print stats once a minute. */
-		dnsflow_print_stats(ds);
-	}
+	while ((dc = dnsflow_chunk_next()) != NULL) {
+		dc->dc_dw = dw;
+		if (offline_ordered) {
+			dw->dw_chunk = dc;
+		}
+		end = dcap_loop_mmap(dw->dw_dcap, dc->dc_start, dc->dc_end);
+		if (end != dc->dc_end) {
+			if (dc != &chunks[n_chunks - 1]) {
+				errx(1, "chunk %d: lost record boundary at "
+					"offset %zu, try without -T",
+					(int)(dc - chunks), end);
+			}
+			warnx("truncated pcap file, at offset %zu", end);
+		}
 
-	bzero(&buf, sizeof(buf));
+		/* Each chunk's output is complete, so the chunks can be sent
+		 * in any order. */
+		dnsflow_agg_flush(dw);
+		dnsflow_pkt_send_pending(dw);
+		dnsflow_export_flush(dw);
+		dw->dw_chunk = NULL;
+
+		pthread_mutex_lock(&chunks_lock);
+		dc->dc_done = 1;
+		pthread_cond_broadcast(&chunks_cond);
+		pthread_mutex_unlock(&chunks_lock);
+	}
 
-	buf.db_type = DNSFLOW_STATS;
-	buf.db_len = sizeof(struct dnsflow_hdr) +
-		sizeof(struct dnsflow_stats_pkt);
+	return (NULL);
+}
 
-	buf.db_pkt_hdr.version = DNSFLOW_VERSION;
-	buf.db_pkt_hdr.sets_count = 1;
-	buf.db_pkt_hdr.flags = htons(DNSFLOW_FLAG_STATS);
-	buf.db_pkt_hdr.sequence_number = htonl(sequence_number++);
+/* -r with -T: split the mapped file into chunks, with a worker per thread,
+ * each reading the file through its own dcap. */
+static void
+dnsflow_file_init(struct dcap *dcap, int n_threads, int *cpus, int n_cpus)
+{
+	struct dnsflow_worker	*dw;
+	struct dcap		*wdcap;
+	size_t			*offsets;
+	int			i;
 
-	buf.db_stats_pkt.pkts_captured = htonl(ds->captured);
-	buf.db_stats_pkt.pkts_received = htonl(ds->ps_recv);
-	buf.db_stats_pkt.pkts_dropped = htonl(ds->ps_drop);
-	buf.db_stats_pkt.pkts_ifdropped = htonl(ds->ps_ifdrop);
-	buf.db_stats_pkt.sample_rate = htonl(dcap->sample_rate);
+	n_chunks = dcap_mmap_split(dcap, n_threads * DNSFLOW_CHUNKS_PER_THREAD,
+			DNSFLOW_CHUNK_SIZE, &offsets);
+	if ((chunks = calloc(n_chunks, sizeof(struct dnsflow_chunk))) == NULL) {
+		err(1, "calloc");
+	}
+	for (i = 0; i < n_chunks; i++) {
+		chunks[i].dc_start = offsets[i];
+		chunks[i].dc_end = offsets[i + 1];
+	}
+	free(offsets);
 
-	dnsflow_pkt_send(&buf);
+	for (i = 0; i < n_threads; i++) {
+		if ((wdcap = dcap_mmap_dup(dcap)) == NULL) {
+			errx(1, "dcap_mmap_dup failed");
+		}
+		dw = dnsflow_worker_new(wdcap, NULL, DNSFLOW_WORKER_INLINE);
+		if (n_cpus > 0) {
+			dw->dw_cpu = cpus[i % n_cpus];
+		}
+	}
 }
 
+/* Process all the chunks. Without -O, the workers send as they go, and
+ * the output is in file order only within each chunk. */
 static void
-signal_cb(int signal, short event, void *arg) 
+dnsflow_file_run(void)
 {
-	struct dcap			*dcap = (struct dcap *)arg;
-	int				stat_loc;
-	pid_t				pid;
+	struct dnsflow_buf	*bufs[DNSFLOW_EXPORT_BATCH];
+	struct dnsflow_arena	arena;
+	int			i, rv;
+
+	for (i = 0; i < n_workers; i++) {
+		if ((rv = pthread_create(&workers[i]->dw_thread, NULL,
+					dnsflow_file_worker_run,
+					workers[i])) != 0) {
+			errx(1, "pthread_create: %s", strerror(rv));
+		}
+	}
 
-	switch (signal) {
-	case SIGINT:
-	case SIGTERM:
-		_log("received exit signal: %d", signal);
-		clean_exit(dcap);	/* Doesn't return. */
-		break;
-	case SIGCHLD:
-		pid = wait(&stat_loc);
-		_log("child exited: %d", pid);
-		clean_exit(dcap);
-		break;
-	default:
-		errx(1, "caught unexpected signal: %d", signal);
-		break;
+	if (offline_ordered) {
+		bzero(&arena, sizeof(arena));
+		for (i = 0; i < DNSFLOW_EXPORT_BATCH; i++) {
+			bufs[i] = dnsflow_data_buf_new(&arena);
+		}
+		pthread_mutex_lock(&chunks_lock);
+		while (chunks_sent < n_chunks) {
+			while (!chunks[chunks_sent].dc_done) {
+				pthread_cond_wait(&chunks_cond, &chunks_lock);
+			}
+			pthread_mutex_unlock(&chunks_lock);
+			dnsflow_chunk_send(&chunks[chunks_sent], bufs);
+			pthread_mutex_lock(&chunks_lock);
+			chunks_sent++;
+			pthread_cond_broadcast(&chunks_cond);
+		}
+		pthread_mutex_unlock(&chunks_lock);
+		dnsflow_arena_free(&arena);
 	}
 
+	for (i = 0; i < n_workers; i++) {
+		pthread_join(workers[i]->dw_thread, NULL);
+	}
+	free(chunks);
+	chunks = NULL;
 }
 
-/* XXX Disable for production */
+/* One AF_XDP capture and worker thread per rx queue. The NIC's RSS does
+ * the load balancing. All the queues are opened before any workers are
+ * set up, so on failure there's nothing to undo but the dcaps.
+ * Returns the number of queues, or 0 if XDP isn't available. */
+static int
+dnsflow_xdp_init(char *intf_name, char *filter, int enable_mdns,
+		int *cpus, int n_cpus)
+{
+	struct dcap		*dcaps[DNSFLOW_MAX_WORKERS];
+	struct dnsflow_worker	*dw;
+	struct event_base	*base;
+	int			i, n_queues;
+
+	n_queues = dcap_xdp_queue_count(intf_name);
+	if (n_queues == 0 || n_queues > DNSFLOW_MAX_WORKERS) {
+		warnx("%s: can't use %d rx queues", intf_name, n_queues);
+		return (0);
+	}
+	for (i = 0; i < n_queues; i++) {
+		dcaps[i] = dcap_init_xdp(intf_name, i, filter, enable_mdns,
+				enable_ip6, dnsflow_dcap_cb);
+		if (dcaps[i] == NULL) {
+			while (--i >= 0) {
+				dcap_close(dcaps[i]);
+			}
+			return (0);
+		}
+	}
+
+	for (i = 0; i < n_queues; i++) {
+		if ((base = event_base_new()) == NULL) {
+			errx(1, "event_base_new failed");
+		}
+		if (dcap_event_set_base(dcaps[i], base) < 0) {
+			errx(1, "dcap_event_set failed");
+		}
+		dw = dnsflow_worker_new(dcaps[i], base,
+				dnsflow_capture_role());
+		if (n_cpus > 0) {
+			dw->dw_cpu = cpus[i % n_cpus];
+		}
+	}
+
+	return (n_queues);
+}
+
+/* Replay the pkts loaded by dcap_init_mem() n_loops times and log the
+ * cost per pkt. Without -u or -w, the flow pkts are built but not sent. */
 static void
-dnsflow_event_log_cb(int severity, const char *msg)
+dnsflow_bench(struct dnsflow_worker *dw, int n_loops)
 {
-	if (severity == _EVENT_LOG_DEBUG) {
+	struct dcap		*dcap = dw->dw_dcap;
+	struct timespec		ts0, ts1;
+	struct rusage		ru;
+	uint64_t		allocs = 0;
+	uint64_t		n_pkts;
+	double			sec;
+
+	if (dnsflow_alloc_count != NULL) {
+		allocs = dnsflow_alloc_count();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	dcap_loop_mem(dcap, n_loops);
+	dnsflow_agg_flush(dw);
+	dnsflow_pkt_send_pending(dw);	/* Send last pkt. */
+	dnsflow_export_flush(dw);
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	if (dnsflow_alloc_count != NULL) {
+		allocs = dnsflow_alloc_count() - allocs;
+	}
+
+	n_pkts = dcap->pkts_captured;
+	sec = (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9;
+	if (n_pkts == 0 || sec <= 0) {
+		_log("bench: no packets");
 		return;
 	}
-	_log("event: %d: %s", severity, msg);
+	_log("bench: %llu packets, %d loops, %.3f sec, %s name copies",
+			(unsigned long long)n_pkts, n_loops, sec, dns_copy_name);
+	_log("bench: %.0f pkts/sec, %.1f ns/pkt", n_pkts / sec,
+			sec * 1e9 / n_pkts);
+	if (dnsflow_alloc_count != NULL) {
+		_log("bench: %.3f allocs/pkt", (double)allocs / n_pkts);
+	} else {
+		_log("bench: allocs/pkt not counted (build with make bench)");
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	/* KB on linux, bytes on os x. */
+	_log("bench: peak rss %ld", ru.ru_maxrss);
+	_log("bench: exported %llu pkts, %llu bytes, %.1f bytes/pkt captured",
+			(unsigned long long)dw->dw_export_sent,
+			(unsigned long long)dw->dw_export_bytes,
+			(double)dw->dw_export_bytes / n_pkts);
+	if (anon != NULL) {
+		_log("bench: anonymised with %s, %.1f ns/pkt, "
+			"%llu client cache misses (%.1f%%)",
+			dnsflow_anon_aes_name(),
+			hist_ticks_to_ns(dw->dw_anon_ticks) / n_pkts,
+			(unsigned long long)dw->dw_anon_misses,
+			100.0 * dw->dw_anon_misses / MAX(1,
+				dw->dw_anon_hits + dw->dw_anon_misses));
+	}
 }
 
 static void
@@ -970,17 +7839,66 @@ usage(void)
 
 	fprintf(stderr, "Usage: %s [-hp] [-i interface] [-r pcap_file] "
 			"[-f filter_expression]\n", __progname);
-	fprintf(stderr, "\t[-P pidfile]  [-m proc_i/n_procs] [-M n_procs] "
-			"[-s sample_rate]\n");
+	fprintf(stderr, "\t[-P pidfile]  [-m proc_i/n_procs] [-M n_procs]\n");
+	fprintf(stderr, "\t[-c config_file] (dsts, sampling, intervals and "
+			"filter, SIGHUP reloads)\n");
+	/* Sampling options */
+	fprintf(stderr, "\t[-s sample_rate[:max_rate]] (1 in N clients, "
+			"adaptive up to max_rate)\n");
+	fprintf(stderr, "\t[-q] (sample by client and qname)\n");
+	/* Threaded capture options */
+	fprintf(stderr, "\t[-T n_threads] [-F fanout_mode (client, hash, cpu, "
+			"lb, queue)] [-K cpu_list]\n");
+	fprintf(stderr, "\t[-n] (threads and memory on the capture NIC's "
+			"numa node)\n");
+	fprintf(stderr, "\t[-O] (with -r and -T, keep the output "
+			"in file order)\n");
+	fprintf(stderr, "\t[-R n_blocks[:block_kb[:retire_ms]]] "
+			"(TPACKET_V3 ring capture)\n");
+	fprintf(stderr, "\t[-x] (AF_XDP capture, one thread per rx queue)\n");
+	fprintf(stderr, "\t[-W n_parse_threads[:ring_slots]] "
+			"(separate capture, parse and export threads)\n");
 	/* Encap options */
 	fprintf(stderr, "\t[-X pcap_record_recv_port] "
 			"[-J jmirror_port (usually 30030)]\n");
-	fprintf(stderr, "\t[-Y] (add mDNS port to filter)\n");
+	fprintf(stderr, "\t[-E encap,... (qinq, mpls[:depth], gre, erspan, "
+			"vxlan)]\n");
+	fprintf(stderr, "\t[-Y] (add mDNS port to filter) "
+			"[-6] (ipv6 and AAAA, version 4 sets)\n");
+	/* Parser options */
+	fprintf(stderr, "\t[-l] (parse with ldns) "
+			"[-V] (verify native parser against ldns)\n");
 	/* Output options */
 	fprintf(stderr, "\t[-u udp_dst] [-w pcap_file_dst]\n");
+	fprintf(stderr, "\t[-H ring_file[:mb]] (shared memory ring) "
+			"[-U unix_socket] (SOCK_SEQPACKET)\n");
+	fprintf(stderr, "\t[-D tcp_dst[:port[:spool_mb[:old|new]]]] "
+			"[-e ca_file] (tls)\n");
+	fprintf(stderr, "\t[-k] (shard the sets across the -u and -D dsts "
+			"by client)\n");
+	fprintf(stderr, "\t[-S pkt_size[:max_sets]] [-G] (udp gso) "
+			"[-C] (compressed, version 3 sets)\n");
+	fprintf(stderr, "\t[-A table_mb[:window_sec]] "
+			"(aggregate identical sets)\n");
+	fprintf(stderr, "\t[-L set|rr] (add the capture time and "
+			"answer ttls to the sets)\n");
+	fprintf(stderr, "\t[-Q table_mb[:timeout_ms]] (match queries, "
+			"add the resolver rtt to the sets)\n");
+	fprintf(stderr, "\t[-a top_n] (send the top clients and qnames "
+			"with the stats)\n");
+	fprintf(stderr, "\t[-B] (also send v3 stats, 64 bit counters "
+			"per thread)\n");
+	fprintf(stderr, "\t[-z key_file[:keep_labels]] (anonymise clients, "
+			"hash names but the last keep_labels)\n");
+	fprintf(stderr, "\t[-t] (time processing stages, "
+			"SIGUSR1 logs stats)\n");
+	fprintf(stderr, "\t[-b n_loops] (benchmark, replay -r file "
+			"from memory)\n");
+	fprintf(stderr, "\t[-N name_copy_kernel (avx2, sse2, neon, "
+			"scalar)]\n");
 
 	fprintf(stderr, "\n  Default filter: %s\n",
-			build_pcap_filter(0, 1, 1, 0));
+			build_pcap_filter(0, 1, 1, 0, 0));
 
 	exit(1);
 }
@@ -988,20 +7906,98 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	int			c, rv, promisc = 1;
+	int			c, i, rv, promisc = 1;
 	char			*pcap_file_read = NULL, *pcap_file_write = NULL;
 	char			*filter = NULL, *intf_name = NULL;
-	struct dcap		*dcap = NULL;
-	struct dcap_stat	*ds = NULL;
-	struct sockaddr_in	*so_addr = NULL;
+	struct dcap		*dcap = NULL, *file_dcap = NULL;
+	struct dcap_stat	ds[1];
+	struct dnsflow_config	config[1];
+	struct dnsflow_worker	*dw;
+	struct event_base	*base;
 	int			encap_offset = 0;
 	int			enable_mdns = 0;
 	uint32_t		n_procs = 1, proc_i = 1, auto_n_procs = 0;
 	int			is_child = 0;
-	uint16_t		sample_rate = 0;
-
-	while ((c = getopt(argc, argv, "i:J:r:f:m:M:pP:s:u:w:X:Yh")) != -1) {
+	int			n_threads = 0, n_cpus = 0;
+	int			cpus[DNSFLOW_MAX_WORKERS];
+	enum dcap_fanout_mode	fanout_mode = DCAP_FANOUT_CLIENT;
+	int			fanout_given = 0;
+	int			numa_local = 0;
+	struct dnsflow_topo	topo;
+	struct dcap_ring_config	ring_config[1];
+	int			use_ring = 0;
+	int			use_xdp = 0, n_queues = 0;
+	int			use_gso = 0;
+	uint32_t		agg_mb = 0, rtt_mb = 0;
+	char			*ring_path = NULL;
+	char			*anon_path = NULL;
+	int			ring_mb = DNSFLOW_RING_MB;
+	struct sockaddr_in	tcp_addrs[DNSFLOW_TCP_MAX_DSTS];
+	int			tcp_spool_mbs[DNSFLOW_TCP_MAX_DSTS];
+	int			tcp_drop_news[DNSFLOW_TCP_MAX_DSTS];
+	int			n_tcp_dsts = 0;
+	char			*copy_kernel = NULL;
+
+	while ((c = getopt(argc, argv, "6a:A:b:Bc:CD:e:E:i:J:kr:f:F:GH:K:lL:m:M:N:nOpP:qQ:R:s:S:tT:u:U:VW:w:xX:Yz:h"))
+			!= -1) {
 		switch (c) {
+		case '6':
+			enable_ip6 = 1;
+			break;
+		case 'a':
+			topk_n = atoi(optarg);
+			if (topk_n <= 0 || topk_n > DNSFLOW_TOPK_MAX) {
+				errx(1, "invalid top-k option -- %s", optarg);
+			}
+			break;
+		case 'A':
+			if (sscanf(optarg, "%u:%d", &agg_mb, &agg_window) < 1 ||
+			    agg_mb == 0 || agg_window <= 0) {
+				errx(1, "invalid aggregation option -- %s",
+						optarg);
+			}
+			/* Budget per worker. */
+			agg_n_entries = (uint64_t)agg_mb * 1024 * 1024 /
+				(sizeof(struct dnsflow_agg_entry) +
+				 2 * sizeof(uint32_t));
+			break;
+		case 'B':
+			stats_v3 = 1;
+			break;
+		case 'b':
+			bench_loops = atoi(optarg);
+			if (bench_loops <= 0) {
+				errx(1, "invalid loop count -- %s", optarg);
+			}
+			break;
+		case 'c':
+			config_file = optarg;
+			break;
+		case 'C':
+			export_compress = 1;
+			break;
+		case 'D':
+			if (n_tcp_dsts == DNSFLOW_TCP_MAX_DSTS) {
+				errx(1, "too many tcp dsts");
+			}
+			if (parse_tcp_dst(optarg, &tcp_addrs[n_tcp_dsts],
+						&tcp_spool_mbs[n_tcp_dsts],
+						&tcp_drop_news[n_tcp_dsts]) < 0) {
+				errx(1, "invalid tcp dst -- %s", optarg);
+			}
+			n_tcp_dsts++;
+			break;
+		case 'e':
+			tcp_ca_file = optarg;
+			break;
+		case 'k':
+			shard_export = 1;
+			break;
+		case 'E':
+			if (parse_decap(optarg) < 0) {
+				errx(1, "invalid encap option -- %s", optarg);
+			}
+			break;
 		case 'i':
 			intf_name = optarg;
 			break;
@@ -1015,6 +8011,54 @@ main(int argc, char *argv[])
 		case 'f':
 			filter = optarg;
 			break;
+		case 'F':
+			if (strcmp(optarg, "client") == 0) {
+				fanout_mode = DCAP_FANOUT_CLIENT;
+			} else if (strcmp(optarg, "hash") == 0) {
+				fanout_mode = DCAP_FANOUT_HASH;
+			} else if (strcmp(optarg, "cpu") == 0) {
+				fanout_mode = DCAP_FANOUT_CPU;
+			} else if (strcmp(optarg, "lb") == 0) {
+				fanout_mode = DCAP_FANOUT_LB;
+			} else if (strcmp(optarg, "queue") == 0) {
+				fanout_mode = DCAP_FANOUT_QUEUE;
+			} else {
+				errx(1, "invalid fanout mode -- %s", optarg);
+			}
+			fanout_given = 1;
+			break;
+		case 'G':
+			use_gso = 1;
+			break;
+		case 'H':
+			ring_path = strsep(&optarg, ":");
+			if (optarg != NULL && ((ring_mb = atoi(optarg)) <= 0 ||
+						ring_mb > 4096)) {
+				errx(1, "invalid ring size -- %s", optarg);
+			}
+			break;
+		case 'K':
+			n_cpus = parse_cpu_list(optarg, cpus,
+					DNSFLOW_MAX_WORKERS);
+			if (n_cpus <= 0) {
+				errx(1, "invalid cpu list -- %s", optarg);
+			}
+			break;
+		case 'l':
+			dns_parser = DNSFLOW_PARSER_LDNS;
+			break;
+		case 'n':
+			numa_local = 1;
+			break;
+		case 'L':
+			if (strcmp(optarg, "set") == 0) {
+				ttl_mode = DNSFLOW_TTL_SET;
+			} else if (strcmp(optarg, "rr") == 0) {
+				ttl_mode = DNSFLOW_TTL_RR;
+			} else {
+				errx(1, "invalid ttl mode -- %s", optarg);
+			}
+			break;
 		case 'm':
 			if (sscanf(optarg, "%u/%u", &proc_i, &n_procs) !=2 ) {
 				errx(1, "invalid multiproc option -- %s",
@@ -1032,6 +8076,12 @@ main(int argc, char *argv[])
 						optarg);
 			}
 			break;
+		case 'N':
+			copy_kernel = optarg;
+			break;
+		case 'O':
+			offline_ordered = 1;
+			break;
 		case 'p':
 			promisc = 0;
 			break;
@@ -1043,22 +8093,95 @@ main(int argc, char *argv[])
 		case 'r':
 			pcap_file_read = optarg;
 			break;
+		case 'R':
+			bzero(ring_config, sizeof(ring_config));
+			if (sscanf(optarg, "%u:%u:%u",
+					&ring_config->block_count,
+					&ring_config->block_size,
+					&ring_config->retire_tov) < 1) {
+				errx(1, "invalid ring option -- %s", optarg);
+			}
+			ring_config->block_size *= 1024;
+			use_ring = 1;
+			break;
+		case 'q':
+			sample_qname = 1;
+			break;
+		case 'Q':
+			if (sscanf(optarg, "%u:%d", &rtt_mb, &rtt_timeout) < 1 ||
+			    rtt_mb == 0 || rtt_mb > 4096 || rtt_timeout <= 0 ||
+			    rtt_timeout > DNSFLOW_RTT_TIMEOUT_MAX) {
+				errx(1, "invalid query matching option -- %s",
+						optarg);
+			}
+			/* Per worker, rounded down to a power of 2. */
+			rtt_n_buckets = 1;
+			while ((uint64_t)rtt_n_buckets * 2 *
+			    sizeof(struct dnsflow_rtt_bucket) <=
+			    (uint64_t)rtt_mb * 1024 * 1024) {
+				rtt_n_buckets <<= 1;
+			}
+			break;
 		case 's':
-			sample_rate = atoi(optarg);
+			if (parse_sample_rate(optarg, &sample_rate_min,
+					&sample_rate_max) < 0) {
+				errx(1, "invalid sample rate -- %s", optarg);
+			}
+			sample_rate = sample_rate_min;
+			break;
+		case 'S':
+			rv = sscanf(optarg, "%d:%d", &pkt_target_size,
+					&pkt_sets_max);
+			if (rv < 1 ||
+			    pkt_target_size < DNSFLOW_PKT_TARGET_MIN ||
+			    pkt_target_size > DNSFLOW_PKT_TARGET_MAX ||
+			    pkt_sets_max < 1 ||
+			    pkt_sets_max > DNSFLOW_SETS_COUNT_MAX) {
+				errx(1, "invalid pkt size option -- %s",
+						optarg);
+			}
+			break;
+		case 't':
+			stage_timing = 1;
+			break;
+		case 'T':
+			n_threads = atoi(optarg);
+			if (n_threads <= 0 || n_threads > DNSFLOW_MAX_WORKERS) {
+				errx(1, "invalid thread count -- %s", optarg);
+			}
 			break;
 		case 'u':
-			if (udp_num_dsts == DNSFLOW_UDP_MAX_DSTS) {
-				errx(1, "too many udp dsts");
-			}
-			so_addr = &dst_so_addrs[udp_num_dsts++];
-			bzero(so_addr, sizeof(struct sockaddr_in));
-			so_addr->sin_family = AF_INET;
-			so_addr->sin_port = htons(DNSFLOW_PORT);
-			if (inet_pton(AF_INET, optarg,
-					&so_addr->sin_addr) != 1) {
+			if (parse_dst(optarg, &dsts_cmdline) < 0) {
+				if (dsts_cmdline.ds_n == DNSFLOW_UDP_MAX_DSTS) {
+					errx(1, "too many udp dsts");
+				}
 				errx(1, "invalid ip: %s", optarg);
 			}
 			break;
+		case 'U':
+			if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->
+						sun_path)) {
+				errx(1, "unix socket path too long -- %s",
+						optarg);
+			}
+			unix_path = optarg;
+			break;
+		case 'V':
+			dns_parser = DNSFLOW_PARSER_VERIFY;
+			break;
+		case 'W':
+			if (sscanf(optarg, "%d:%u", &pipe_threads,
+					&pipe_slots) < 1 ||
+			    pipe_threads < 1 ||
+			    pipe_threads > DNSFLOW_PIPE_MAX ||
+			    pipe_slots < 1 || pipe_slots > (1 << 20)) {
+				errx(1, "invalid pipeline option -- %s",
+						optarg);
+			}
+			break;
+		case 'x':
+			use_xdp = 1;
+			break;
 		case 'X':
 			pcap_record_dst_port = htons(atoi(optarg));
 			if (filter == NULL) {
@@ -1070,6 +8193,15 @@ main(int argc, char *argv[])
 		case 'Y':
 			enable_mdns = 1;
 			break;
+		case 'z':
+			anon_path = strsep(&optarg, ":");
+			if (optarg != NULL && ((anon_keep_labels =
+			    atoi(optarg)) < 0 || anon_keep_labels > 127 ||
+			    !isdigit((unsigned char)*optarg))) {
+				errx(1, "invalid labels to keep -- %s",
+						optarg);
+			}
+			break;
 		case 'w':
 			pcap_file_write = optarg;
 			break;
@@ -1082,9 +8214,132 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (udp_num_dsts == 0 && pcap_file_write == NULL) {
+	/* What a reload starts from. */
+	if (shard_export) {
+		dnsflow_shard_assign(&dsts_cmdline, NULL);
+	}
+	filter_cmdline = filter;
+	config_cmdline.cf_dsts = dsts_cmdline;
+	config_cmdline.cf_sample_min = sample_rate_min;
+	config_cmdline.cf_sample_max = sample_rate_max;
+	config_cmdline.cf_push_sec = push_tv.tv_sec;
+	config_cmdline.cf_stats_sec = stats_tv.tv_sec;
+	if (config_file != NULL) {
+		if (dnsflow_config_read(config_file, &config_cmdline,
+					config) < 0) {
+			errx(1, "invalid config file -- %s", config_file);
+		}
+		if (use_xdp && config->cf_filter[0] != '\0') {
+			/* Like a reload, see filter_fixed. */
+			errx(1, "can't set filter in -c config with -x");
+		}
+		dnsflow_config_apply(config);
+		if (filter_user != NULL) {
+			filter = filter_user;
+		}
+	}
+	filter_fixed = use_xdp;
+
+	if (dns_copy_init(copy_kernel) < 0) {
+		errx(1, "unsupported name copy kernel -- %s", copy_kernel);
+	}
+	if (anon_path != NULL &&
+	    (anon = dnsflow_anon_open(anon_path)) == NULL) {
+		errx(1, "invalid key file -- %s", anon_path);
+	}
+	if (bench_loops > 0) {
+		if (pcap_file_read == NULL) {
+			errx(1, "-b requires -r");
+		}
+	} else if (dsts->ds_n == 0 && pcap_file_write == NULL &&
+	    ring_path == NULL && unix_path == NULL && n_tcp_dsts == 0) {
 		errx(1, "output dst missing");
 	}
+	if (tcp_ca_file != NULL && n_tcp_dsts == 0) {
+		errx(1, "-e requires -D");
+	}
+	if (shard_export && dsts->ds_n == 0 && n_tcp_dsts == 0) {
+		errx(1, "-k requires -u or -D");
+	}
+
+	if (n_threads > 0) {
+		if (pcap_file_read != NULL && bench_loops > 0) {
+			errx(1, "can't use -T and -b together");
+		}
+		if (n_procs > 1 || auto_n_procs > 0) {
+			errx(1, "can't use -T with -m or -M");
+		}
+		if (!fanout_given && (encap_offset != 0 || decap_flags != 0)) {
+			/* The outer addrs are the tunnel's, the flow hash
+			 * at least has its ports. */
+			fanout_mode = DCAP_FANOUT_HASH;
+		}
+	}
+	pkt_buf_max = MIN(pkt_target_size + DNSFLOW_PKT_SET_ROOM,
+			DNSFLOW_PKT_MAX_SIZE);
+	if (offline_ordered && (pcap_file_read == NULL || n_threads == 0)) {
+		errx(1, "-O requires -r and -T");
+	}
+	if (pipe_threads > 0 && pcap_file_read != NULL) {
+		if (n_threads > 0 || bench_loops > 0) {
+			errx(1, "can't use -W with -r and -T or -b");
+		}
+		/* Nothing to lose by waiting. */
+		pipe_wait = 1;
+	}
+	if (ttl_mode == DNSFLOW_TTL_RR && agg_n_entries) {
+		/* Aggregated sets only keep the lowest ttl. */
+		errx(1, "can't use -L rr with -A");
+	}
+	if (enable_ip6 && encap_offset != 0) {
+		/* The encap filter offsets are ipv4 only. */
+		errx(1, "can't use -6 with -J or -X");
+	}
+	if (use_xdp) {
+		/* The XDP program only knows the default filter. */
+		if (pcap_file_read != NULL || intf_name == NULL) {
+			errx(1, "-x requires -i");
+		}
+		if (n_threads > 0 || use_ring) {
+			errx(1, "can't use -x with -T or -R");
+		}
+		if (filter_cmdline != NULL || encap_offset != 0 ||
+		    decap_flags != 0 || vlan_depth != 1 || rtt_n_buckets > 0) {
+			errx(1, "can't use -x with -f, -E, -J, -Q or -X");
+		}
+		if (n_procs > 1 || auto_n_procs > 0) {
+			errx(1, "can't use -x with -m or -M");
+		}
+	}
+
+	if (numa_local) {
+		if (intf_name == NULL || pcap_file_read != NULL) {
+			errx(1, "-n requires -i");
+		}
+		/* Before anything big is allocated, or forked. */
+		dnsflow_topo_read(intf_name, &topo);
+		if (n_cpus == 0) {
+			n_cpus = dnsflow_topo_cpus(&topo, cpus,
+					DNSFLOW_MAX_WORKERS);
+		}
+		if (!fanout_given && n_threads > 0 && rtt_n_buckets == 0 &&
+		    topo.tp_n_queues > 1) {
+			/* -Q needs a query and its response on the same
+			 * thread, and RSS doesn't usually hash them the
+			 * same, so it keeps the client fanout. */
+			fanout_mode = DCAP_FANOUT_QUEUE;
+		}
+		dnsflow_topo_bind(&topo);
+	}
+
+	if (ring_path != NULL) {
+		/* Before the fork, so all the procs share it. */
+		export_ring = dnsflow_ring_create(ring_path,
+				(size_t)ring_mb * 1024 * 1024);
+		if (export_ring == NULL) {
+			errx(1, "can't create the ring");
+		}
+	}
 
 	/* Fork if requested, and not done manually. */
 	if (n_procs == 1 && auto_n_procs > 0) {
@@ -1098,6 +8353,10 @@ main(int argc, char *argv[])
 	}
 	my_pid = getpid();
 
+	if (stage_timing || (bench_loops > 0 && anon != NULL)) {
+		hist_calibrate();
+	}
+
 	/* Need some randomness for jitter. */
 	srandom(getpid());
 
@@ -1111,66 +8370,161 @@ main(int argc, char *argv[])
 	event_init();
 	event_set_log_callback(dnsflow_event_log_cb);
 
+	/* Set even with -f, a reload can go back to the default. */
+	filter_args.encap_offset = encap_offset;
+	filter_args.proc_i = proc_i;
+	filter_args.n_procs = n_procs;
+	filter_args.enable_mdns = enable_mdns;
 	if (filter == NULL) {
+		/* With threads, the kernel fanout does the load balancing,
+		 * so no multi-proc clause. */
+		filter_default = 1;
+		/* The qname isn't at a fixed offset, so with -q it's all
+		 * sampled in userspace. */
 		filter = build_pcap_filter(encap_offset, proc_i, n_procs,
-				enable_mdns);
+				enable_mdns, sample_qname ? 0 : sample_rate);
 	}
 
 	/* Init pcap */
-	if (pcap_file_read != NULL) {
-		dcap = dcap_init_file(pcap_file_read, filter, dnsflow_dcap_cb);
+	if (pcap_file_read != NULL && n_threads > 0 &&
+	    (file_dcap = dcap_init_mmap(pcap_file_read, filter,
+			dnsflow_dcap_cb)) != NULL) {
+		dnsflow_file_init(file_dcap, n_threads, cpus, n_cpus);
+		_log("reading from file %s with %d threads, %d chunks%s, "
+				"filter %s", pcap_file_read, n_threads,
+				n_chunks, offline_ordered ? ", ordered" : "",
+				filter);
+	} else if (pcap_file_read != NULL) {
+		if (n_threads > 0) {
+			_log("can't split %s, reading it with one thread",
+					pcap_file_read);
+		}
+		if (bench_loops > 0) {
+			dcap = dcap_init_mem(pcap_file_read, filter,
+					dnsflow_dcap_cb);
+		} else {
+			dcap = dcap_init_file(pcap_file_read, filter,
+					dnsflow_dcap_cb);
+		}
 		_log("reading from file %s, filter %s", pcap_file_read,
 				filter);
-
-	} else {
-		dcap = dcap_init_live(intf_name, promisc, filter,
-				dnsflow_dcap_cb);
+		if (dcap == NULL) {
+			exit(1);
+		}
+		dnsflow_worker_new(dcap, NULL, dnsflow_capture_role());
+	} else if (use_xdp && (n_queues = dnsflow_xdp_init(intf_name, filter,
+				enable_mdns, cpus, n_cpus)) > 0) {
+		_log("listening on %s with XDP on %d rx queues, filter %s",
+				intf_name, n_queues, filter);
+	} else if (n_threads == 0) {
+		if (use_xdp) {
+			_log("XDP not available on %s, falling back to pcap",
+					intf_name);
+		}
+		if (use_ring) {
+			dcap = dcap_init_ring(intf_name, promisc, filter,
+					ring_config, dnsflow_dcap_cb);
+		} else {
+			dcap = dcap_init_live(intf_name, promisc, filter,
+					dnsflow_dcap_cb);
+		}
 		if (dcap == NULL) {
 			errx(1, "dcap_init failed");
 		}
 		if (dcap_event_set(dcap) < 0) {
 			errx(1, "dcap_event_set failed");
 		}
+		dw = dnsflow_worker_new(dcap, NULL, dnsflow_capture_role());
+		if (n_cpus > 0) {
+			/* On the main thread. With -M, each proc takes a
+			 * different one. */
+			dw->dw_cpu = cpus[(proc_i - 1) % n_cpus];
+		}
 
 		_log("listening on %s, filter %s", dcap->intf_name, filter);
+	} else {
+		for (i = 0; i < n_threads; i++) {
+			if (use_ring) {
+				dcap = dcap_init_ring(intf_name, promisc,
+						filter, ring_config,
+						dnsflow_dcap_cb);
+			} else {
+				dcap = dcap_init_live(intf_name, promisc,
+						filter, dnsflow_dcap_cb);
+			}
+			if (dcap == NULL) {
+				errx(1, "dcap_init failed");
+			}
+			/* Group id just needs to be unique on the host. */
+			if (dcap_set_fanout(dcap, my_pid & 0xffff,
+						fanout_mode) < 0) {
+				errx(1, "dcap_set_fanout failed");
+			}
+			if ((base = event_base_new()) == NULL) {
+				errx(1, "event_base_new failed");
+			}
+			if (dcap_event_set_base(dcap, base) < 0) {
+				errx(1, "dcap_event_set failed");
+			}
+			dw = dnsflow_worker_new(dcap, base,
+					dnsflow_capture_role());
+			if (n_cpus > 0) {
+				dw->dw_cpu = cpus[i % n_cpus];
+			}
+		}
+
+		_log("listening on %s with %d threads, filter %s",
+				dcap->intf_name, n_threads, filter);
+	}
+
+	if (pipe_threads > 0) {
+		dnsflow_pipe_init(cpus, n_cpus);
+		_log("pipelined, %d parse threads, rings of %u slots",
+				pipe_threads, pipe_slots);
+	}
+	if (numa_local) {
+		dnsflow_topo_report(intf_name, &topo, n_queues > 0 ||
+				(n_threads > 0 &&
+				 fanout_mode == DCAP_FANOUT_QUEUE));
+	}
 
+	if (pcap_file_read == NULL) {
 		/* Send pcap stats every 10sec. */
 		bzero(&stats_ev, sizeof(stats_ev));
-		evtimer_set(&stats_ev, dnsflow_stats_cb, dcap);
+		evtimer_set(&stats_ev, dnsflow_stats_cb, NULL);
 		evtimer_add(&stats_ev, jitter_tv(&stats_tv));
 	}
-	if (dcap == NULL) {
-		exit(1);
-	}
 
-	/* Sampling */
-	if (sample_rate > 1) {
-		dcap->sample_rate = sample_rate;
+	if (sample_rate_max != 0) {
+		_log("sample_rate set to %u, adaptive up to %u", sample_rate,
+				sample_rate_max);
+	} else if (sample_rate > 1) {
 		_log("sample_rate set to %u", sample_rate);
 	}
 
-	/* Even if the flow pkt isn't full, send any buffered data every
-	 * second. */
-	bzero(&push_ev, sizeof(push_ev));
-	evtimer_set(&push_ev, dnsflow_push_cb, NULL);
-	evtimer_add(&push_ev, jitter_tv(&push_tv));
-
-	/* Set signal handlers. Do after dcap_init so dcap can be passed
-	 * as arg. */
+	/* Set signal handlers. */
 	bzero(&sigterm_ev, sizeof(sigterm_ev));
-	signal_set(&sigterm_ev, SIGTERM, signal_cb, dcap);
+	signal_set(&sigterm_ev, SIGTERM, signal_cb, NULL);
 	signal_add(&sigterm_ev, NULL);
 
 	bzero(&sigint_ev, sizeof(sigint_ev));
-	signal_set(&sigint_ev, SIGINT, signal_cb, dcap);
+	signal_set(&sigint_ev, SIGINT, signal_cb, NULL);
 	signal_add(&sigint_ev, NULL);
 
+	bzero(&sigusr1_ev, sizeof(sigusr1_ev));
+	signal_set(&sigusr1_ev, SIGUSR1, signal_cb, NULL);
+	signal_add(&sigusr1_ev, NULL);
+
+	bzero(&sighup_ev, sizeof(sighup_ev));
+	signal_set(&sighup_ev, SIGHUP, signal_cb, NULL);
+	signal_add(&sighup_ev, NULL);
+
 	bzero(&sigchld_ev, sizeof(sigchld_ev));
-	signal_set(&sigchld_ev, SIGCHLD, signal_cb, dcap);
+	signal_set(&sigchld_ev, SIGCHLD, signal_cb, NULL);
 	signal_add(&sigchld_ev, NULL);
 
 	if (is_child) {
-		check_parent_setup(dcap);
+		check_parent_setup();
 	}
 
 	if (pcap_file_write != NULL) {
@@ -1182,32 +8536,104 @@ main(int argc, char *argv[])
 		}
 	}
 
-	/* B/c of the union, this allocates more than max for the pkt, but
-	 * not a big deal. */
-	data_buf = calloc(1, sizeof(struct dnsflow_buf) + DNSFLOW_PKT_MAX_SIZE);
-	data_buf->db_type = DNSFLOW_DATA;
+	if (dsts->ds_n > 0 || config_file != NULL) {
+		/* A reload can add dsts. */
+		if ((udp_socket = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+			err(1, "socket failed");
+		}
+	}
+	if (unix_path != NULL) {
+		/* The collector going away shouldn't take us with it. */
+		signal(SIGPIPE, SIG_IGN);
+		unix_wait = pcap_file_read != NULL;
+		pthread_mutex_lock(&unix_lock);
+		dnsflow_unix_connect();
+		if (unix_socket < 0) {
+			_log("can't connect to %s yet: %s", unix_path,
+					strerror(errno));
+		}
+		pthread_mutex_unlock(&unix_lock);
+	}
+	for (i = 0; i < n_tcp_dsts; i++) {
+		/* Blocking with -r, like -U. */
+		tcp_exports[n_tcp_exports++] = dnsflow_tcp_new(&tcp_addrs[i],
+				tcp_spool_mbs[i], tcp_drop_news[i],
+				pcap_file_read != NULL, tcp_ca_file);
+	}
+	if (shard_export) {
+		dnsflow_shard_ring_build(dsts);
+	}
+	topk_start = topk_last = time(NULL);
+	if (use_gso && udp_socket >= 0) {
+		if (udp_gso_check(udp_socket, pkt_target_size) == 0) {
+			udp_gso_size = pkt_target_size;
+			_log("using udp gso, segment size %d", udp_gso_size);
+		} else {
+			_log("udp gso not available");
+		}
+	}
 
 	/* Pcap/event loop */
-	if (pcap_file_read != NULL) {
-		dcap_loop_all(dcap);
-		dcap_close(dcap);
-		dnsflow_pkt_send_data();	/* Send last pkt. */
+	if (file_dcap != NULL) {
+		dnsflow_file_run();
+		dnsflow_get_stats(ds);
+		for (i = 0; i < n_workers; i++) {
+			dcap_close(workers[i]->dw_dcap);
+		}
+		dcap_close(file_dcap);
+	} else if (pcap_file_read != NULL) {
+		dw = workers[0];
+		if (bench_loops > 0) {
+			dnsflow_bench(dw, bench_loops);
+		} else if (pipe_threads > 0) {
+			dnsflow_pipe_file_run();
+		} else {
+			dcap_loop_all(dw->dw_dcap);
+			dnsflow_agg_flush(dw);
+			dnsflow_pkt_send_pending(dw);	/* Send last pkt. */
+			dnsflow_export_flush(dw);
+		}
+		dnsflow_get_stats(ds);
+		dcap_close(dw->dw_dcap);
 	} else {
+		for (i = 0; i < n_workers; i++) {
+			dw = workers[i];
+			if (dw->dw_ev_base == NULL &&
+			    dw->dw_role != DNSFLOW_WORKER_EXPORT) {
+				/* Runs on the main loop. */
+				continue;
+			}
+			if ((rv = pthread_create(&dw->dw_thread, NULL,
+						dnsflow_worker_run, dw)) != 0) {
+				errx(1, "pthread_create: %s", strerror(rv));
+			}
+		}
+		for (i = 0; i < n_workers; i++) {
+			/* After the threads, so they don't inherit it. */
+			if (workers[i]->dw_ev_base == NULL &&
+			    workers[i]->dw_role != DNSFLOW_WORKER_EXPORT) {
+				dnsflow_worker_pin(workers[i]);
+			}
+		}
 		rv = event_dispatch();
-		dcap_close(dcap);
 		errx(1, "event_dispatch terminated: %d", rv);
 	}
+	if (topk_n > 0) {
+		/* -r, there was no stats timer. */
+		dnsflow_topk_send(1);
+	}
 
 	if (pdump != NULL) {
 		pcap_dump_close(pdump);
 		pcap_close(pc_dump);
 	}
 
-	free(data_buf);
-
-	ds = dcap_get_stats(dcap);
 	dnsflow_print_stats(ds);
 
+	for (i = 0; i < n_workers; i++) {
+		dnsflow_worker_free(workers[i]);
+	}
+
 	return (0);
 }
 
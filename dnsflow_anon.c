@@ -0,0 +1,462 @@
+/*
+ * dnsflow_anon.c
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of DeepField Networks, Inc. nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "dnsflow_anon.h"
+
+/* Encrypts n blocks in place. */
+typedef void (*anon_aes_fn)(const uint8_t *rk, uint8_t *blocks, int n);
+
+static uint8_t		aes_sbox[256];
+static anon_aes_fn	anon_aes = NULL;
+static const char	*anon_aes_impl = "soft";
+
+#define ROTL8(x, n)	((uint8_t)(((x) << (n)) | ((x) >> (8 - (n)))))
+
+static uint8_t
+aes_xtime(uint8_t x)
+{
+	return ((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+/* Walk the multiplicative group with a generator (3) and its inverse, so
+ * there's no 4KB of table to get wrong. */
+static void
+aes_sbox_init(void)
+{
+	uint8_t		p = 1, q = 1, x;
+
+	do {
+		p = p ^ aes_xtime(p);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80) {
+			q ^= 0x09;
+		}
+		x = q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4);
+		aes_sbox[p] = x ^ 0x63;
+	} while (p != 1);
+	aes_sbox[0] = 0x63;
+}
+
+/* The standard AES-128 schedule, in the layout AES-NI wants too. */
+static void
+aes_key_expand(const uint8_t *key, uint8_t *rk)
+{
+	uint8_t		t[4], tmp, rcon = 1;
+	int		i, j;
+
+	memcpy(rk, key, 16);
+	for (i = 16; i < 176; i += 4) {
+		memcpy(t, rk + i - 4, 4);
+		if (i % 16 == 0) {
+			tmp = t[0];
+			t[0] = aes_sbox[t[1]] ^ rcon;
+			t[1] = aes_sbox[t[2]];
+			t[2] = aes_sbox[t[3]];
+			t[3] = aes_sbox[tmp];
+			rcon = aes_xtime(rcon);
+		}
+		for (j = 0; j < 4; j++) {
+			rk[i + j] = rk[i - 16 + j] ^ t[j];
+		}
+	}
+}
+
+/* Byte at a time. Only used where there's no AES-NI, or to check it. */
+static void
+aes_encrypt_soft(const uint8_t *rk, uint8_t *blocks, int n)
+{
+	uint8_t		s[16], t[16], a0, a1, a2, a3, all;
+	uint8_t		*b;
+	int		i, r, c;
+
+	for (b = blocks; n > 0; n--, b += 16) {
+		for (i = 0; i < 16; i++) {
+			s[i] = b[i] ^ rk[i];
+		}
+		for (r = 1; r <= 10; r++) {
+			/* SubBytes and ShiftRows. Column major, row i % 4
+			 * moves left by that many columns. */
+			for (i = 0; i < 16; i++) {
+				t[i] = aes_sbox[s[(i + 4 * (i % 4)) % 16]];
+			}
+			if (r < 10) {
+				for (c = 0; c < 16; c += 4) {
+					a0 = t[c];
+					a1 = t[c + 1];
+					a2 = t[c + 2];
+					a3 = t[c + 3];
+					all = a0 ^ a1 ^ a2 ^ a3;
+					t[c] ^= all ^ aes_xtime(a0 ^ a1);
+					t[c + 1] ^= all ^ aes_xtime(a1 ^ a2);
+					t[c + 2] ^= all ^ aes_xtime(a2 ^ a3);
+					t[c + 3] ^= all ^ aes_xtime(a3 ^ a0);
+				}
+			}
+			for (i = 0; i < 16; i++) {
+				s[i] = t[i] ^ rk[r * 16 + i];
+			}
+		}
+		memcpy(b, s, 16);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 8 blocks in flight, to cover aesenc's latency. */
+__attribute__((target("aes,sse2")))
+static void
+aes_encrypt_ni(const uint8_t *rk, uint8_t *blocks, int n)
+{
+	__m128i		k[11], m[8];
+	int		i, j, r, w;
+
+	for (r = 0; r < 11; r++) {
+		k[r] = _mm_loadu_si128((const __m128i *)(rk + r * 16));
+	}
+	for (i = 0; i < n; i += w) {
+		w = n - i < 8 ? n - i : 8;
+		for (j = 0; j < w; j++) {
+			m[j] = _mm_xor_si128(k[0], _mm_loadu_si128(
+					(const __m128i *)(blocks + (i + j) * 16)));
+		}
+		for (r = 1; r < 10; r++) {
+			for (j = 0; j < w; j++) {
+				m[j] = _mm_aesenc_si128(m[j], k[r]);
+			}
+		}
+		for (j = 0; j < w; j++) {
+			_mm_storeu_si128((__m128i *)(blocks + (i + j) * 16),
+					_mm_aesenclast_si128(m[j], k[10]));
+		}
+	}
+}
+#endif
+
+static void
+anon_aes_init(void)
+{
+	static const uint8_t	key[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+	/* FIPS-197 C.1 */
+	static const uint8_t	pt[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+	static const uint8_t	ct[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+	uint8_t			rk[176], b[16];
+
+	if (anon_aes != NULL) {
+		return;
+	}
+	aes_sbox_init();
+	aes_key_expand(key, rk);
+	anon_aes = aes_encrypt_soft;
+	memcpy(b, pt, sizeof(b));
+	anon_aes(rk, b, 1);
+	if (memcmp(b, ct, sizeof(b)) != 0) {
+		errx(1, "aes self test failed");
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("aes")) {
+		memcpy(b, pt, sizeof(b));
+		aes_encrypt_ni(rk, b, 1);
+		if (memcmp(b, ct, sizeof(b)) == 0) {
+			anon_aes = aes_encrypt_ni;
+			anon_aes_impl = "aes-ni";
+		}
+	}
+#endif
+}
+
+const char *
+dnsflow_anon_aes_name(void)
+{
+	return (anon_aes_impl);
+}
+
+struct dnsflow_anon *
+dnsflow_anon_open(const char *key_path)
+{
+	struct dnsflow_anon	*an;
+	uint8_t			key[DNSFLOW_ANON_KEY_LEN], b[16];
+	int			fd, len = 0, n;
+
+	if ((fd = open(key_path, O_RDONLY)) < 0) {
+		warn("%s", key_path);
+		return (NULL);
+	}
+	while (len < sizeof(key) &&
+	    (n = read(fd, key + len, sizeof(key) - len)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			warn("%s", key_path);
+			close(fd);
+			return (NULL);
+		}
+		len += n;
+	}
+	close(fd);
+	if (len < sizeof(key)) {
+		warnx("%s: key is %d bytes, should be %d", key_path, len,
+				DNSFLOW_ANON_KEY_LEN);
+		return (NULL);
+	}
+	if ((an = calloc(1, sizeof(*an))) == NULL) {
+		warn("calloc");
+		return (NULL);
+	}
+
+	anon_aes_init();
+	aes_key_expand(key, an->an_rk);
+	memcpy(an->an_pad, key + 16, sizeof(an->an_pad));
+	anon_aes(an->an_rk, an->an_pad, 1);
+	memcpy(b, an->an_pad, sizeof(b));
+	anon_aes(an->an_rk, b, 1);
+	aes_key_expand(b, an->an_name_rk);
+
+	memset(key, 0, sizeof(key));
+	memset(b, 0, sizeof(b));
+	return (an);
+}
+
+void
+dnsflow_anon_close(struct dnsflow_anon *an)
+{
+	if (an != NULL) {
+		memset(an, 0, sizeof(*an));
+		free(an);
+	}
+}
+
+/* Crypto-PAn over the first bits bits of ip. Bit i of the result is bit i
+ * of ip flipped by the top bit of the encryption of ip's first i bits,
+ * padded out with the pad. The blocks don't depend on each other, so they
+ * all go to the AES at once. */
+static void
+anon_crypto_pan(const struct dnsflow_anon *an, const uint8_t *ip,
+		uint8_t *out, int bits)
+{
+	uint8_t		blocks[128 * 16], *b;
+	int		i, bytes = bits / 8, full, rem;
+
+	for (i = 0; i < bits; i++) {
+		b = blocks + i * 16;
+		memcpy(b, an->an_pad, 16);
+		full = i / 8;
+		rem = i % 8;
+		memcpy(b, ip, full);
+		if (rem) {
+			b[full] = (ip[full] & (0xff << (8 - rem))) |
+				(an->an_pad[full] & (0xff >> rem));
+		}
+	}
+	anon_aes(an->an_rk, blocks, bits);
+
+	memcpy(out, ip, bytes);
+	for (i = 0; i < bits; i++) {
+		out[i / 8] ^= (blocks[i * 16] >> 7) << (7 - i % 8);
+	}
+}
+
+uint32_t
+dnsflow_anon_ip4(const struct dnsflow_anon *an, uint32_t ip)
+{
+	uint32_t	out;
+
+	anon_crypto_pan(an, (const uint8_t *)&ip, (uint8_t *)&out, 32);
+	return (out);
+}
+
+void
+dnsflow_anon_ip6(const struct dnsflow_anon *an, const uint8_t *ip,
+		uint8_t *out)
+{
+	anon_crypto_pan(an, ip, out, 128);
+}
+
+/* Names are hashed with CBC-MAC, which is fine as a keyed hash as long as
+ * no message is a prefix of another. The first byte of each message sees
+ * to that: a label's length, or a tag and the length for the other two
+ * kinds. */
+#define ANON_MSG_PREFIX		0xfe
+#define ANON_MSG_NAME		0xff
+#define ANON_MSG_MAX		(2 + DNSFLOW_ANON_NAME_MAX + 15)
+#define ANON_LABEL_MSG_MAX	64	/* The length and a label. */
+#define ANON_LABELS_MAX		(DNSFLOW_ANON_NAME_MAX / 2 + 1)
+
+/* Lowercased, and zero padded to a whole block. Returns the length. */
+static int
+anon_msg(uint8_t *msg, int tag, const uint8_t *p, int len)
+{
+	int		i, n = 0;
+
+	if (tag >= 0) {
+		msg[n++] = tag;
+	}
+	msg[n++] = len;
+	for (i = 0; i < len; i++) {
+		msg[n++] = (p[i] >= 'A' && p[i] <= 'Z') ?
+			p[i] + ('a' - 'A') : p[i];
+	}
+	while (n % 16 != 0) {
+		msg[n++] = 0;
+	}
+	return (n);
+}
+
+/* MACs n messages, stride bytes apart, in step, so the AES gets a block of
+ * each at once instead of one at a time. */
+static void
+anon_mac(const struct dnsflow_anon *an, const uint8_t *msgs, int stride,
+		const int *lens, int n, uint8_t *macs)
+{
+	uint8_t		blocks[ANON_LABELS_MAX * 16];
+	int		idx[ANON_LABELS_MAX];
+	int		off, i, j, k, more = 1;
+
+	memset(macs, 0, n * 16);
+	for (off = 0; more; off += 16) {
+		for (i = 0, k = 0, more = 0; i < n; i++) {
+			if (off >= lens[i]) {
+				continue;
+			}
+			for (j = 0; j < 16; j++) {
+				blocks[k * 16 + j] = macs[i * 16 + j] ^
+					msgs[i * stride + off + j];
+			}
+			idx[k++] = i;
+			more |= off + 16 < lens[i];
+		}
+		anon_aes(an->an_name_rk, blocks, k);
+		for (j = 0; j < k; j++) {
+			memcpy(macs + idx[j] * 16, blocks + j * 16, 16);
+		}
+	}
+}
+
+/* The label for a MAC. Returns its length. */
+static int
+anon_label(const uint8_t *mac, uint8_t *out)
+{
+	static const char	hex[] = "0123456789abcdef";
+	int			i;
+
+	out[0] = DNSFLOW_ANON_LABEL_LEN;
+	for (i = 0; i < DNSFLOW_ANON_LABEL_LEN; i++) {
+		out[1 + i] = hex[(mac[i / 2] >> (i % 2 ? 0 : 4)) & 0xf];
+	}
+	return (1 + DNSFLOW_ANON_LABEL_LEN);
+}
+
+/* All of p as one label. */
+static int
+anon_hash_whole(const struct dnsflow_anon *an, int tag, const uint8_t *p,
+		int len, uint8_t *out)
+{
+	uint8_t		msg[ANON_MSG_MAX], mac[16];
+	int		msg_len;
+
+	msg_len = anon_msg(msg, tag, p, len);
+	anon_mac(an, msg, 0, &msg_len, 1, mac);
+	return (anon_label(mac, out));
+}
+
+int
+dnsflow_anon_name(const struct dnsflow_anon *an, const uint8_t *name,
+		int len, int keep, uint8_t *out)
+{
+	uint8_t		msgs[ANON_LABELS_MAX * ANON_LABEL_MSG_MAX];
+	uint8_t		macs[ANON_LABELS_MAX * 16];
+	int		labels[ANON_LABELS_MAX], lens[ANON_LABELS_MAX];
+	int		n_labels = 0, n_hash, kept_off, off, out_len, i;
+
+	off = 0;
+	if (len <= DNSFLOW_ANON_NAME_MAX) {
+		for (; off < len && name[off] != 0; off += 1 + name[off]) {
+			labels[n_labels++] = off;
+		}
+	}
+	if (off != len - 1) {
+		/* Not a name we parsed. Don't try to keep anything. */
+		out_len = anon_hash_whole(an, ANON_MSG_NAME, name,
+				len < DNSFLOW_ANON_NAME_MAX ?
+				len : DNSFLOW_ANON_NAME_MAX, out);
+		out[out_len] = 0;
+		return (out_len + 1);
+	}
+	n_hash = n_labels - keep;
+	if (n_hash <= 0) {
+		memcpy(out, name, len);
+		return (len);
+	}
+	kept_off = n_hash < n_labels ? labels[n_hash] : len - 1;
+
+	out_len = 0;
+	if (n_hash * (1 + DNSFLOW_ANON_LABEL_LEN) + len - kept_off <=
+	    DNSFLOW_ANON_NAME_MAX) {
+		for (i = 0; i < n_hash; i++) {
+			lens[i] = anon_msg(msgs + i * ANON_LABEL_MSG_MAX, -1,
+					name + labels[i] + 1, name[labels[i]]);
+		}
+		anon_mac(an, msgs, ANON_LABEL_MSG_MAX, lens, n_hash, macs);
+		for (i = 0; i < n_hash; i++) {
+			out_len += anon_label(macs + i * 16, out + out_len);
+		}
+	} else if (1 + DNSFLOW_ANON_LABEL_LEN + len - kept_off <=
+	    DNSFLOW_ANON_NAME_MAX) {
+		out_len = anon_hash_whole(an, ANON_MSG_PREFIX, name, kept_off,
+				out);
+	} else {
+		kept_off = len - 1;
+		out_len = anon_hash_whole(an, ANON_MSG_NAME, name, len, out);
+	}
+	memcpy(out + out_len, name + kept_off, len - kept_off);
+	return (out_len + len - kept_off);
+}
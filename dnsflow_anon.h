@@ -0,0 +1,58 @@
+/*
+ * dnsflow_anon.h
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ */
+
+#ifndef __DNSFLOW_ANON_H__
+#define __DNSFLOW_ANON_H__
+
+#include <stdint.h>
+
+/* Pseudonymising client ips and names before export (-z).
+ *
+ * Ips are mapped with Crypto-PAn (Xu et al., "Prefix-Preserving IP Address
+ * Anonymization", 2002): two addresses that share an n bit prefix map to
+ * two that share an n bit prefix, so subnets stay subnets. The key is the
+ * same 32 bytes the reference implementation takes, and gives the same v4
+ * mapping: the first 16 are the AES-128 key, the other 16 are encrypted
+ * with it to make the pad. v6 is done the same way, over 128 bits. Every
+ * bit of the result costs an AES block, so callers should cache.
+ *
+ * Name labels are replaced with a keyed hash of the label, as
+ * DNSFLOW_ANON_LABEL_LEN hex chars. The key for that is the pad encrypted
+ * again, so knowing a name mapping says nothing about the ip one. */
+#define DNSFLOW_ANON_KEY_LEN	32
+#define DNSFLOW_ANON_LABEL_LEN	8
+#define DNSFLOW_ANON_NAME_MAX	255	/* LDNS_MAX_DOMAINLEN */
+
+struct dnsflow_anon {
+	uint8_t		an_rk[176];	/* AES-128 round keys. */
+	uint8_t		an_pad[16];
+	uint8_t		an_name_rk[176];
+};
+
+/* Reads the key from the first DNSFLOW_ANON_KEY_LEN bytes of the file.
+ * Returns NULL, after a warning, if it can't. */
+struct dnsflow_anon *dnsflow_anon_open(const char *key_path);
+void dnsflow_anon_close(struct dnsflow_anon *an);
+
+/* Which AES is in use, "aes-ni" or "soft". */
+const char *dnsflow_anon_aes_name(void);
+
+/* Addresses in network byte order. */
+uint32_t dnsflow_anon_ip4(const struct dnsflow_anon *an, uint32_t ip);
+void dnsflow_anon_ip6(const struct dnsflow_anon *an, const uint8_t *ip,
+		uint8_t *out);
+
+/* Hash all but the last keep labels of name, in uncompressed wire format
+ * with the root label, into out, which needs DNSFLOW_ANON_NAME_MAX bytes.
+ * Hashed labels are lowercased first. If the result would be too long,
+ * those labels are hashed together into one, and failing that the whole
+ * name is. Returns the length of out. */
+int dnsflow_anon_name(const struct dnsflow_anon *an, const uint8_t *name,
+		int len, int keep, uint8_t *out);
+
+#endif /* __DNSFLOW_ANON_H__ */
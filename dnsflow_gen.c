@@ -0,0 +1,551 @@
+/*
+ * dnsflow_gen.c
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of DeepField Networks, Inc. nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Writes a pcap of synthetic resolver traffic, for dnsflow -b.
+ *
+ * Each response is for one of n_names qnames. The cname chain depth,
+ * answer count and qtype are picked per name, from the given ranges and
+ * mix, so a name always gets the same answer (like a real resolver within
+ * a TTL). Owner names are compressed like a real server would: the
+ * question, then each cname target, is pointed back to. A share of the
+ * clients (-6) are on ipv6 instead of ipv4. */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
+#include <pcap/pcap.h>
+
+#define GEN_PKT_MAX		8192
+#define GEN_CNAME_DEPTH_MAX	16
+#define GEN_ANSWERS_MAX		64
+
+#define DNS_HDR_LEN		12
+#define DNS_RR_TYPE_A		1
+#define DNS_RR_TYPE_CNAME	5
+#define DNS_RR_TYPE_PTR		12
+#define DNS_RR_TYPE_MX		15
+#define DNS_RR_TYPE_TXT		16
+#define DNS_RR_TYPE_AAAA	28
+
+struct gen_qtype {
+	const char	*name;
+	uint16_t	type;
+	int		weight;
+};
+
+static struct gen_qtype qtypes[] = {
+	{"a",		DNS_RR_TYPE_A,		0},
+	{"aaaa",	DNS_RR_TYPE_AAAA,	0},
+	{"mx",		DNS_RR_TYPE_MX,		0},
+	{"ptr",		DNS_RR_TYPE_PTR,	0},
+	{"txt",		DNS_RR_TYPE_TXT,	0},
+};
+#define GEN_N_QTYPES	(int)(sizeof(qtypes) / sizeof(qtypes[0]))
+
+static int	qtypes_total = 0;
+
+/* config */
+static int	cname_min = 0, cname_max = 3;
+static int	answers_min = 1, answers_max = 4;
+static uint32_t	n_names = 10000;
+static uint32_t	n_clients = 1000;
+static int	query_pct = 0;
+static int	ip6_pct = 0;
+
+/* xorshift32. Never seed with 0. */
+static uint32_t
+gen_rand(uint32_t *state)
+{
+	uint32_t	x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+static int
+gen_range(uint32_t *state, int min, int max)
+{
+	return (min + gen_rand(state) % (max - min + 1));
+}
+
+/* Write the dotted name to p in wire format. If ptr is non-zero, it
+ * replaces the last label (so "a.b" and ptr gives a, then the pointer).
+ * Returns the length. */
+static int
+gen_name(uint8_t *p, const char *name, int ptr)
+{
+	const char	*label, *dot;
+	int		len = 0, n;
+
+	for (label = name; *label != '\0'; label = dot + 1) {
+		if ((dot = strchr(label, '.')) == NULL) {
+			dot = label + strlen(label);
+		}
+		if (ptr != 0 && *dot == '\0') {
+			break;
+		}
+		n = dot - label;
+		p[len++] = n;
+		memcpy(p + len, label, n);
+		len += n;
+		if (*dot == '\0') {
+			break;
+		}
+	}
+	if (ptr != 0) {
+		p[len++] = 0xc0 | (ptr >> 8);
+		p[len++] = ptr & 0xff;
+	} else {
+		p[len++] = 0;
+	}
+	return (len);
+}
+
+static void
+gen_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+/* Fixed part of an rr, with a compressed owner. Returns the length. */
+static int
+gen_rr(uint8_t *p, int owner_off, uint16_t type, uint16_t rd_len)
+{
+	gen_put16(p, 0xc000 | owner_off);
+	gen_put16(p + 2, type);
+	gen_put16(p + 4, 1);		/* IN */
+	gen_put16(p + 6, 0);		/* ttl */
+	gen_put16(p + 8, 300);
+	gen_put16(p + 10, rd_len);
+	return (12);
+}
+
+/* Build the dns payload for name_i. Returns the length. */
+static int
+gen_dns(uint8_t *dns, uint32_t name_i, int is_query, uint16_t id)
+{
+	char		name[256];
+	uint32_t	state = name_i * 2654435761u + 1;
+	struct gen_qtype *qt;
+	int		i, w, depth, n_answers, len, owner_off, rd_off, rd_len;
+	int		an_count = 0;
+
+	/* Per name choices. */
+	w = gen_rand(&state) % qtypes_total;
+	for (i = 0; w >= qtypes[i].weight; i++) {
+		w -= qtypes[i].weight;
+	}
+	qt = &qtypes[i];
+	depth = gen_range(&state, cname_min, cname_max);
+	n_answers = gen_range(&state, answers_min, answers_max);
+
+	gen_put16(dns, id);
+	gen_put16(dns + 2, is_query ? 0x0100 : 0x8180);
+	gen_put16(dns + 4, 1);
+	gen_put16(dns + 6, 0);
+	gen_put16(dns + 8, 0);
+	gen_put16(dns + 10, 0);
+	len = DNS_HDR_LEN;
+
+	snprintf(name, sizeof(name), "www%u.site%u.com", name_i, name_i / 8);
+	len += gen_name(dns + len, name, 0);
+	gen_put16(dns + len, qt->type);
+	gen_put16(dns + len + 2, 1);
+	len += 4;
+	if (is_query) {
+		return (len);
+	}
+
+	owner_off = DNS_HDR_LEN;
+	for (i = 0; i < depth; i++) {
+		snprintf(name, sizeof(name), "e%u.c%d.cdn%u.net", name_i, i,
+				name_i % 4);
+		rd_off = len + 12;
+		rd_len = gen_name(dns + rd_off, name, 0);
+		len += gen_rr(dns + len, owner_off, DNS_RR_TYPE_CNAME, rd_len);
+		len += rd_len;
+		owner_off = rd_off;
+		an_count++;
+	}
+	for (i = 0; i < n_answers; i++) {
+		rd_off = len + 12;
+		switch (qt->type) {
+		case DNS_RR_TYPE_A:
+			rd_len = 4;
+			dns[rd_off] = 192;
+			dns[rd_off + 1] = 0;
+			gen_put16(dns + rd_off + 2, name_i * 8 + i);
+			break;
+		case DNS_RR_TYPE_AAAA:
+			rd_len = 16;
+			memset(dns + rd_off, 0, 16);
+			gen_put16(dns + rd_off, 0x2001);
+			gen_put16(dns + rd_off + 2, 0x0db8);
+			gen_put16(dns + rd_off + 12, name_i >> 16);
+			gen_put16(dns + rd_off + 14, name_i * 8 + i);
+			break;
+		case DNS_RR_TYPE_MX:
+			gen_put16(dns + rd_off, (i + 1) * 10);
+			snprintf(name, sizeof(name), "mx%d.x", i);
+			/* Pointer to the site domain in the question. */
+			rd_len = 2 + gen_name(dns + rd_off + 2, name,
+					DNS_HDR_LEN + dns[DNS_HDR_LEN] + 1);
+			break;
+		case DNS_RR_TYPE_PTR:
+			snprintf(name, sizeof(name), "host%u.example.net",
+					name_i + i);
+			rd_len = gen_name(dns + rd_off, name, 0);
+			break;
+		default:
+			rd_len = 1 + snprintf((char *)dns + rd_off + 1, 64,
+					"v=spf1 include:_spf%d.x ~all", i);
+			dns[rd_off] = rd_len - 1;
+			break;
+		}
+		len += gen_rr(dns + len, owner_off, qt->type, rd_len);
+		len += rd_len;
+		an_count++;
+	}
+	gen_put16(dns + 6, an_count);
+
+	return (len);
+}
+
+static uint16_t
+ip_cksum(const uint16_t *p, int len)
+{
+	uint32_t	sum = 0;
+
+	for (; len > 1; len -= 2) {
+		sum += *p++;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (~sum);
+}
+
+/* Ethernet, ipv4 and udp around the dns payload. Returns the length. */
+static int
+gen_pkt(uint8_t *pkt, uint32_t client, uint16_t client_port, int is_query,
+		uint8_t *dns, int dns_len)
+{
+	struct ether_header	*eh = (struct ether_header *)pkt;
+	struct ip		*ip = (struct ip *)(eh + 1);
+	struct udphdr		*udp = (struct udphdr *)(ip + 1);
+	in_addr_t		resolver = htonl(0x0a000035);	/* 10.0.0.53 */
+	in_addr_t		client_ip = htonl(0x0a010000 + client);
+
+	memset(eh, 0, sizeof(*eh));
+	eh->ether_type = htons(ETHERTYPE_IP);
+
+	memset(ip, 0, sizeof(*ip));
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(sizeof(*ip) + sizeof(*udp) + dns_len);
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_UDP;
+	ip->ip_src.s_addr = is_query ? client_ip : resolver;
+	ip->ip_dst.s_addr = is_query ? resolver : client_ip;
+	ip->ip_sum = ip_cksum((uint16_t *)ip, sizeof(*ip));
+
+	udp->uh_sport = is_query ? htons(client_port) : htons(53);
+	udp->uh_dport = is_query ? htons(53) : htons(client_port);
+	udp->uh_ulen = htons(sizeof(*udp) + dns_len);
+	udp->uh_sum = 0;
+
+	memcpy(udp + 1, dns, dns_len);
+	return (sizeof(*eh) + sizeof(*ip) + sizeof(*udp) + dns_len);
+}
+
+/* Same, with ipv6. The udp checksum isn't optional here. */
+static int
+gen_pkt6(uint8_t *pkt, uint32_t client, uint16_t client_port, int is_query,
+		uint8_t *dns, int dns_len)
+{
+	struct ether_header	*eh = (struct ether_header *)pkt;
+	struct ip6_hdr		*ip6 = (struct ip6_hdr *)(eh + 1);
+	struct udphdr		*udp = (struct udphdr *)(ip6 + 1);
+	struct in6_addr		resolver, client_ip;
+	uint16_t		pseudo[20];
+	uint32_t		sum = 0;
+	int			i, udp_len = sizeof(*udp) + dns_len;
+
+	/* 2001:db8::53 and 2001:db8:1::client */
+	memset(&resolver, 0, sizeof(resolver));
+	resolver.s6_addr[0] = 0x20;
+	resolver.s6_addr[1] = 0x01;
+	resolver.s6_addr[2] = 0x0d;
+	resolver.s6_addr[3] = 0xb8;
+	client_ip = resolver;
+	resolver.s6_addr[15] = 0x53;
+	client_ip.s6_addr[5] = 1;
+	client_ip.s6_addr[14] = client >> 8;
+	client_ip.s6_addr[15] = client;
+
+	memset(eh, 0, sizeof(*eh));
+	eh->ether_type = htons(ETHERTYPE_IPV6);
+
+	memset(ip6, 0, sizeof(*ip6));
+	ip6->ip6_vfc = 6 << 4;
+	ip6->ip6_plen = htons(udp_len);
+	ip6->ip6_nxt = IPPROTO_UDP;
+	ip6->ip6_hlim = 64;
+	ip6->ip6_src = is_query ? client_ip : resolver;
+	ip6->ip6_dst = is_query ? resolver : client_ip;
+
+	udp->uh_sport = is_query ? htons(client_port) : htons(53);
+	udp->uh_dport = is_query ? htons(53) : htons(client_port);
+	udp->uh_ulen = htons(udp_len);
+	udp->uh_sum = 0;
+	memcpy(udp + 1, dns, dns_len);
+	if (dns_len & 1) {
+		((uint8_t *)(udp + 1))[dns_len] = 0;
+	}
+
+	/* Pseudo header: src, dst, udp length, next header. */
+	memcpy(pseudo, &ip6->ip6_src, 32);
+	pseudo[16] = 0;
+	pseudo[17] = htons(udp_len);
+	pseudo[18] = 0;
+	pseudo[19] = htons(IPPROTO_UDP);
+	for (i = 0; i < 20; i++) {
+		sum += pseudo[i];
+	}
+	for (i = 0; i < (udp_len + 1) / 2; i++) {
+		sum += ((uint16_t *)udp)[i];
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	udp->uh_sum = (~sum & 0xffff) ? ~sum : 0xffff;
+
+	return (sizeof(*eh) + sizeof(*ip6) + udp_len);
+}
+
+/* "a:80,aaaa:15,mx:5" */
+static int
+parse_qtype_mix(char *str)
+{
+	char		*tok, *colon;
+	int		i, w;
+
+	for (i = 0; i < GEN_N_QTYPES; i++) {
+		qtypes[i].weight = 0;
+	}
+	qtypes_total = 0;
+	while ((tok = strsep(&str, ",")) != NULL) {
+		if ((colon = strchr(tok, ':')) == NULL) {
+			return (-1);
+		}
+		*colon = '\0';
+		if ((w = atoi(colon + 1)) <= 0) {
+			return (-1);
+		}
+		for (i = 0; i < GEN_N_QTYPES; i++) {
+			if (strcmp(tok, qtypes[i].name) == 0) {
+				break;
+			}
+		}
+		if (i == GEN_N_QTYPES) {
+			return (-1);
+		}
+		qtypes[i].weight += w;
+		qtypes_total += w;
+	}
+	return (0);
+}
+
+/* "n" or "min-max" */
+static int
+parse_range(const char *str, int *min, int *max, int limit)
+{
+	int		rv;
+
+	rv = sscanf(str, "%d-%d", min, max);
+	if (rv == 1) {
+		*max = *min;
+	}
+	if (rv < 1 || *min < 0 || *max < *min || *max > limit) {
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "Usage: %s [-h] -o pcap_file [-n n_pkts] "
+			"[-s seed]\n", __progname);
+	fprintf(stderr, "\t[-c cname_depth[-max]] [-a answers[-max]] "
+			"[-q qtype:weight,...]\n");
+	fprintf(stderr, "\t[-N n_names] [-C n_clients] "
+			"[-Q query_pct] [-6 ipv6_client_pct]\n");
+	fprintf(stderr, "\n  qtypes: a, aaaa, mx, ptr, txt. "
+			"Default mix a:80,aaaa:15,mx:5\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint8_t			pkt[GEN_PKT_MAX], dns[GEN_PKT_MAX];
+	char			default_mix[] = "a:80,aaaa:15,mx:5";
+	char			*pcap_file = NULL;
+	struct pcap_pkthdr	pkthdr;
+	pcap_t			*pc;
+	pcap_dumper_t		*pdump;
+	uint32_t		n_pkts = 100000, seed = 1, state, i;
+	uint32_t		name_i, client;
+	int			c, is_query, dns_len, len;
+
+	parse_qtype_mix(default_mix);
+
+	while ((c = getopt(argc, argv, "6:a:c:C:n:N:o:q:Q:s:h")) != -1) {
+		switch (c) {
+		case '6':
+			ip6_pct = atoi(optarg);
+			if (ip6_pct < 0 || ip6_pct > 100) {
+				errx(1, "invalid ipv6 percentage -- %s",
+						optarg);
+			}
+			break;
+		case 'a':
+			if (parse_range(optarg, &answers_min, &answers_max,
+					GEN_ANSWERS_MAX) < 0) {
+				errx(1, "invalid answer count -- %s", optarg);
+			}
+			break;
+		case 'c':
+			if (parse_range(optarg, &cname_min, &cname_max,
+					GEN_CNAME_DEPTH_MAX) < 0) {
+				errx(1, "invalid cname depth -- %s", optarg);
+			}
+			break;
+		case 'C':
+			if ((n_clients = atoi(optarg)) == 0 ||
+			    n_clients > 0xffff) {
+				errx(1, "invalid client count -- %s", optarg);
+			}
+			break;
+		case 'n':
+			n_pkts = strtoul(optarg, NULL, 10);
+			break;
+		case 'N':
+			if ((n_names = strtoul(optarg, NULL, 10)) == 0) {
+				errx(1, "invalid name count -- %s", optarg);
+			}
+			break;
+		case 'o':
+			pcap_file = optarg;
+			break;
+		case 'q':
+			if (parse_qtype_mix(optarg) < 0) {
+				errx(1, "invalid qtype mix -- %s", optarg);
+			}
+			break;
+		case 'Q':
+			query_pct = atoi(optarg);
+			if (query_pct < 0 || query_pct > 100) {
+				errx(1, "invalid query percentage -- %s",
+						optarg);
+			}
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	if (pcap_file == NULL) {
+		usage();
+	}
+
+	pc = pcap_open_dead(DLT_EN10MB, 65535);
+	if ((pdump = pcap_dump_open(pc, pcap_file)) == NULL) {
+		errx(1, "%s: %s", pcap_file, pcap_geterr(pc));
+	}
+
+	state = seed != 0 ? seed : 1;
+	pkthdr.ts.tv_sec = 1300000000;
+	pkthdr.ts.tv_usec = 0;
+	for (i = 0; i < n_pkts; i++) {
+		name_i = gen_rand(&state) % n_names;
+		client = gen_rand(&state) % n_clients;
+		is_query = (int)(gen_rand(&state) % 100) < query_pct;
+
+		dns_len = gen_dns(dns, name_i, is_query, i & 0xffff);
+		if ((int)(client % 100) < ip6_pct) {
+			len = gen_pkt6(pkt, client, 1024 + (i % 60000),
+					is_query, dns, dns_len);
+		} else {
+			len = gen_pkt(pkt, client, 1024 + (i % 60000),
+					is_query, dns, dns_len);
+		}
+
+		pkthdr.caplen = pkthdr.len = len;
+		pcap_dump((u_char *)pdump, &pkthdr, pkt);
+		/* 100k pkts/sec */
+		if ((pkthdr.ts.tv_usec += 10) >= 1000000) {
+			pkthdr.ts.tv_sec++;
+			pkthdr.ts.tv_usec = 0;
+		}
+	}
+
+	pcap_dump_close(pdump);
+	pcap_close(pc);
+
+	fprintf(stderr, "wrote %u packets to %s\n", n_pkts, pcap_file);
+
+	return (0);
+}
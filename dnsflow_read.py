@@ -4,13 +4,32 @@
 See dnsflow.c header comment for packet formats.
 '''
 
-import sys, time, argparse
-import socket
+import sys, os, time, argparse
+import socket, select
+import ctypes, ctypes.util
 import dpkt, pcap
 import struct
 import ipaddr
 
 DNSFLOW_FLAG_STATS = 0x0001
+DNSFLOW_FLAG_COMPRESSED = 0x0002
+DNSFLOW_FLAG_HITS = 0x0004
+DNSFLOW_FLAG_STATS_EXT = 0x0008
+DNSFLOW_FLAG_TTL = 0x0010
+DNSFLOW_FLAG_RR_TTLS = 0x0020
+DNSFLOW_FLAG_RTT = 0x0040
+DNSFLOW_FLAG_TOPK = 0x0080
+DNSFLOW_DROP_NAMES = ['not_ip', 'not_udp', 'encap', 'udp_len', 'prefilter',
+        'parse', 'sampled', 'pipe', 'set_size', 'truncated', 'runt',
+        'unknown_encap']
+DNSFLOW_STAGE_NAMES = ['ip_udp', 'dns_check', 'extract', 'build', 'send']
+DNSFLOW_PIPE_NAMES = ['parse', 'export']
+DNSFLOW_PREFILTER_NAMES = ['passed', 'short', 'flags', 'qdcount', 'ancount',
+        'qtype', 'query']
+DNSFLOW_COUNTER_NAMES = ['pkts_captured', 'pkts_received', 'pkts_dropped',
+        'pkts_ifdropped', 'export_pkts', 'export_bytes', 'export_errors',
+        'export_dropped']
+DNSFLOW_WORKER_ROLES = ['inline', 'capture', 'parse', 'export']
 DEFAULT_PCAP_FILTER = 'udp and dst port 5300'
 
 # Utility functions to simplify interface.
@@ -28,18 +47,47 @@ def pkt_iter(**kwargs):
 
 # Top-level interface for reading/capturing dnsflow. Instantiate object,
 # then iterate using flow_iter() or pkt_iter().
+# ring_file reads a dnsflow -H shared memory ring, unix_path listens
+# for dnsflow -U on a unix socket, and tcp_port for dnsflow -D.
 class reader(object):
     def __init__(self, interface=None, pcap_file=None,
-            pcap_filter=DEFAULT_PCAP_FILTER, stats_only=False):
-        if interface is None and pcap_file is None:
-            raise Exception('Specify interface or pcap_file')
-        if interface is not None and pcap_file is not None:
-            raise Exception('Specify only interface or pcap_file')
+            pcap_filter=DEFAULT_PCAP_FILTER, stats_only=False,
+            ring_file=None, unix_path=None, tcp_port=None):
+        n_inputs = len([x for x in [interface, pcap_file, ring_file,
+            unix_path, tcp_port] if x is not None])
+        if n_inputs == 0:
+            raise Exception('Specify interface, pcap_file, ring_file, '
+                    'unix_path or tcp_port')
+        if n_inputs > 1:
+            raise Exception('Specify only one of interface, pcap_file, '
+                    'ring_file, unix_path or tcp_port')
 
         self.interface = interface
         self.pcap_file = pcap_file
         self.pcap_filter = pcap_filter
         self.stats_only = stats_only
+        self.ring_file = ring_file
+        self.unix_path = unix_path
+        self.tcp_port = tcp_port
+
+        if self.ring_file is not None:
+            self._ring = ring(ring_file)
+            return
+        if self.unix_path is not None:
+            if os.path.exists(unix_path):
+                os.unlink(unix_path)
+            self._listen = socket.socket(socket.AF_UNIX,
+                    socket.SOCK_SEQPACKET)
+            self._listen.bind(unix_path)
+            self._listen.listen(64)
+            return
+        if self.tcp_port is not None:
+            self._listen = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self._listen.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR,
+                    1)
+            self._listen.bind(('', tcp_port))
+            self._listen.listen(64)
+            return
 
         self._pcap = pcap.pcapObject()
 
@@ -60,13 +108,30 @@ class reader(object):
         for pkt in self.pkt_iter():
             ts = pkt['header']['timestamp']
             if 'data' not in pkt:
-                # stats pkt
+                # stats or top-k pkt
                 continue
             for record in pkt['data']:
                 yield ts, record
 
     # Iterate over dnsflow pkts.
     def pkt_iter(self):
+        if self.ring_file is not None:
+            raw_iter = self._ring_iter()
+        elif self.unix_path is not None:
+            raw_iter = self._unix_iter()
+        elif self.tcp_port is not None:
+            raw_iter = self._tcp_iter()
+        else:
+            raw_iter = self._pcap_iter()
+        for dl_type, ts, buf in raw_iter:
+            pkt, err = process_pkt(dl_type, ts, buf,
+                    stats_only=self.stats_only)
+            if err is not None:
+                print err
+                continue
+            yield pkt
+
+    def _pcap_iter(self):
         while 1:
             rv = self._pcap.next()
             if rv == None:
@@ -77,12 +142,320 @@ class reader(object):
                     # interface, hit to_ms
                     continue
             pktlen, buf, ts = rv
-            pkt, err = process_pkt(self._pcap.datalink(), ts, buf,
-                    stats_only=self.stats_only)
-            if err is not None:
-                print err
-                continue
-            yield pkt
+            yield self._pcap.datalink(), ts, buf
+
+    # Bare flow pkts look like dnsflow -w output, loopback with AF_UNSPEC.
+    def _ring_iter(self):
+        while 1:
+            buf = self._ring.next(100)
+            if buf is not None:
+                yield dpkt.pcap.DLT_NULL, time.time(), _LOOP_UNSPEC + buf
+
+    def _unix_iter(self):
+        conns = []
+        while 1:
+            r, w, x = select.select([self._listen] + conns, [], [])
+            for so in r:
+                if so is self._listen:
+                    conns.append(self._listen.accept()[0])
+                    continue
+                buf = so.recv(65536)
+                if not buf:
+                    # dnsflow went away.
+                    conns.remove(so)
+                    so.close()
+                    continue
+                yield dpkt.pcap.DLT_NULL, time.time(), _LOOP_UNSPEC + buf
+
+    # Each flow pkt is framed by a 4 byte length.
+    def _tcp_iter(self):
+        conns = {}
+        while 1:
+            r, w, x = select.select([self._listen] + conns.keys(), [], [])
+            for so in r:
+                if so is self._listen:
+                    conns[self._listen.accept()[0]] = ''
+                    continue
+                buf = so.recv(65536)
+                if not buf:
+                    # dnsflow went away, and will start over from a whole
+                    # frame when it's back.
+                    del conns[so]
+                    so.close()
+                    continue
+                buf = conns[so] + buf
+                cp = 0
+                while len(buf) - cp >= 4:
+                    n = struct.unpack('!I', buf[cp:cp + 4])[0]
+                    if len(buf) - cp - 4 < n:
+                        break
+                    yield dpkt.pcap.DLT_NULL, time.time(), \
+                            _LOOP_UNSPEC + buf[cp + 4:cp + 4 + n]
+                    cp += 4 + n
+                conns[so] = buf[cp:]
+
+_LOOP_UNSPEC = struct.pack('=I', socket.AF_UNSPEC)
+
+# Binding for the reader side of libdnsflow_ring.so (make
+# libdnsflow_ring.so). DNSFLOW_RING_LIB can point at it; otherwise it's
+# looked for next to this script, then on the library path.
+class ring(object):
+    def __init__(self, path):
+        lib_path = os.environ.get('DNSFLOW_RING_LIB')
+        if lib_path is None:
+            lib_path = os.path.join(os.path.dirname(
+                os.path.abspath(__file__)), 'libdnsflow_ring.so')
+            if not os.path.exists(lib_path):
+                lib_path = ctypes.util.find_library('dnsflow_ring')
+        if lib_path is None:
+            raise Exception('libdnsflow_ring.so not found')
+        self._lib = ctypes.CDLL(lib_path)
+        self._lib.dnsflow_ring_open.restype = ctypes.c_void_p
+        self._lib.dnsflow_ring_open.argtypes = [ctypes.c_char_p]
+        self._lib.dnsflow_ring_next.restype = ctypes.c_void_p
+        self._lib.dnsflow_ring_next.argtypes = [ctypes.c_void_p,
+                ctypes.POINTER(ctypes.c_uint32), ctypes.c_int]
+        self._lib.dnsflow_ring_drops.restype = ctypes.c_uint64
+        self._lib.dnsflow_ring_drops.argtypes = [ctypes.c_void_p]
+        self._lib.dnsflow_ring_close.argtypes = [ctypes.c_void_p]
+        self._r = self._lib.dnsflow_ring_open(path)
+        if not self._r:
+            raise Exception('%s: not a dnsflow ring' % (path))
+        self._len = ctypes.c_uint32()
+
+    # The next flow pkt, or None after timeout_ms (-1 waits forever).
+    def next(self, timeout_ms=-1):
+        p = self._lib.dnsflow_ring_next(self._r, ctypes.byref(self._len),
+                timeout_ms)
+        if not p:
+            return None
+        # The record is only good until the next call, so copy it.
+        return ctypes.string_at(p, self._len.value)
+
+    # How many flow pkts dnsflow dropped because the ring was full.
+    def drops(self):
+        return self._lib.dnsflow_ring_drops(self._r)
+
+    def close(self):
+        if self._r:
+            self._lib.dnsflow_ring_close(self._r)
+            self._r = None
+
+# Returns (value, new_cp) for the LEB128 varint at cp.
+def _varint(buf, cp):
+    v = 0
+    shift = 0
+    while True:
+        b = ord(buf[cp])
+        cp += 1
+        v |= (b & 0x7f) << shift
+        if not b & 0x80:
+            return v, cp
+        shift += 7
+
+def _unzigzag(prev, v):
+    d = (v >> 1) ^ -(v & 1)
+    return (prev + d) & 0xffffffff
+
+# Splits an uncompressed dns name into a dotted string.
+def _wire_name(name_buf):
+    name = []
+    np = 0
+    label_len = ord(name_buf[np])
+    np += 1
+    while label_len != 0:
+        name.append(name_buf[np: np + label_len])
+        np += label_len
+        label_len = ord(name_buf[np])
+        np += 1
+    return '.'.join(name)
+
+# Version 4 compressed ipv6 address at cp, prefix coded against prev.
+# Returns (addr, new_cp).
+def _prefix_addr(buf, cp, prev):
+    n = ord(buf[cp])
+    cp += 1
+    addr = prev[:n] + buf[cp:cp + 16 - n]
+    if n > 16 or len(addr) != 16:
+        raise IndexError('bad prefix coded address')
+    return addr, cp + 16 - n
+
+def _ip6_str(addr):
+    return socket.inet_ntop(socket.AF_INET6, addr)
+
+# A DNSFLOW_FLAG_TOPK client, which is v4-mapped if it's ipv4.
+def _topk_client(addr):
+    if addr[:12] == '\x00' * 10 + '\xff\xff':
+        return socket.inet_ntop(socket.AF_INET, addr[12:])
+    return _ip6_str(addr)
+
+# DNSFLOW_FLAG_TOPK set at cp. Returns (topk, err).
+def _process_topk(dnsflow_pkt, cp):
+    tk = {}
+    try:
+        (tk['ts'], tk['window_sec'], tk['sets'], clients_count,
+                names_count, _) = struct.unpack('!IIIBBH',
+                dnsflow_pkt[cp:cp + 16])
+        cp += 16
+        tk['clients'] = []
+        for i in range(clients_count):
+            count = struct.unpack('!I', dnsflow_pkt[cp + 16:cp + 20])[0]
+            tk['clients'].append((_topk_client(dnsflow_pkt[cp:cp + 16]),
+                count))
+            cp += 20
+        tk['names'] = []
+        for i in range(names_count):
+            count = struct.unpack('!I', dnsflow_pkt[cp:cp + 4])[0]
+            cp += 4
+            name = _wire_name(dnsflow_pkt[cp:])
+            # Dotted labels, plus the length bytes and the root.
+            cp += len(name) + 2 if name else 1
+            tk['names'].append((name, count))
+    except (struct.error, IndexError), e:
+        return (tk, 'TOPK_PARSE_ERROR|%s' % (e))
+    return (tk, None)
+
+def _name_at(names, i, prefix):
+    if i < len(names):
+        return names[i]
+    return '%s%d' % (prefix, i)
+
+# v3 stats counters at cp, into d. Returns the new cp.
+def _stats3_counters(dnsflow_pkt, cp, d, drops_count, prefilter_count):
+    n = len(DNSFLOW_COUNTER_NAMES) + drops_count + prefilter_count
+    vals = struct.unpack('!%dQ' % (n), dnsflow_pkt[cp:cp + 8 * n])
+    for i, v in enumerate(vals):
+        if i < len(DNSFLOW_COUNTER_NAMES):
+            d[DNSFLOW_COUNTER_NAMES[i]] = v
+            continue
+        i -= len(DNSFLOW_COUNTER_NAMES)
+        if i < drops_count:
+            d['drop_' + _name_at(DNSFLOW_DROP_NAMES, i, 'drop')] = v
+        else:
+            i -= drops_count
+            d['prefilter_' + _name_at(DNSFLOW_PREFILTER_NAMES, i,
+                'prefilter')] = v
+    return cp + 8 * n
+
+# Version 5 stats set (-B) at cp. Returns (stats3, err).
+def _process_stats3(dnsflow_pkt, cp):
+    st = {}
+    try:
+        (st['ts'], st['sample_rate'], workers_count, drops_count,
+                prefilter_count, pipes_count, _) = struct.unpack('!IIBBBBI',
+                dnsflow_pkt[cp:cp + 16])
+        cp += 16
+        st['totals'] = {}
+        cp = _stats3_counters(dnsflow_pkt, cp, st['totals'], drops_count,
+                prefilter_count)
+        for i in range(pipes_count):
+            vals = struct.unpack('!IIQ', dnsflow_pkt[cp:cp + 16])
+            cp += 16
+            name = _name_at(DNSFLOW_PIPE_NAMES, i, 'pipe')
+            for k, v in zip(['used', 'size', 'overflows'], vals):
+                st['totals']['pipe_%s_%s' % (name, k)] = v
+        st['workers'] = []
+        for i in range(workers_count):
+            w = {}
+            (w['id'], role, _, w['sample_rate'], w['ring_used'],
+                    w['ring_size']) = struct.unpack('!BBHIII',
+                    dnsflow_pkt[cp:cp + 16])
+            cp += 16
+            w['role'] = _name_at(DNSFLOW_WORKER_ROLES, role, 'role')
+            cp = _stats3_counters(dnsflow_pkt, cp, w, drops_count,
+                    prefilter_count)
+            st['workers'].append(w)
+    except struct.error, e:
+        return (st, 'STATS3_PARSE_ERROR|%s' % (e))
+    return (st, None)
+
+# Number of per answer ttls in a DNSFLOW_FLAG_RR_TTLS set.
+def _n_ttls(names_count, ips_count):
+    return max(names_count - 1, 0) + ips_count
+
+# Splits the DNSFLOW_FLAG_RR_TTLS ttls into the set's data dict.
+def _set_ttls(data, ttls, names_count):
+    n = max(names_count - 1, 0)
+    data['name_ttls'] = list(ttls[:n])
+    data['ip_ttls'] = list(ttls[n:])
+
+# Version 3 (or 4) DNSFLOW_FLAG_COMPRESSED data sets. Returns (sets, err).
+def _process_compressed_sets(dnsflow_pkt, cp, sets_count, flags, vers):
+    sets = []
+    name_table = []
+    client_ip = 0
+    client6 = '\0' * 16
+    ts_sec = 0
+    try:
+        for i in range(sets_count):
+            family = 4
+            if vers == 4:
+                family = ord(dnsflow_pkt[cp])
+                cp += 1
+            if family == 6:
+                client6, cp = _prefix_addr(dnsflow_pkt, cp, client6)
+            else:
+                v, cp = _varint(dnsflow_pkt, cp)
+                client_ip = _unzigzag(client_ip, v)
+            names_count, ips_count = struct.unpack('!BB',
+                    dnsflow_pkt[cp:cp + 2])
+            cp += 2
+
+            names = []
+            for x in range(names_count):
+                v, cp = _varint(dnsflow_pkt, cp)
+                if v & 1:
+                    name = _wire_name(dnsflow_pkt[cp:cp + (v >> 1)])
+                    cp += v >> 1
+                    name_table.append(name)
+                else:
+                    name = name_table[v >> 1]
+                names.append(name)
+
+            ips = []
+            ip = 0
+            ip6 = '\0' * 16
+            for x in range(ips_count):
+                if family == 6:
+                    ip6, cp = _prefix_addr(dnsflow_pkt, cp, ip6)
+                    ips.append(_ip6_str(ip6))
+                    continue
+                if x == 0:
+                    ip = struct.unpack('!I', dnsflow_pkt[cp:cp + 4])[0]
+                    cp += 4
+                else:
+                    v, cp = _varint(dnsflow_pkt, cp)
+                    ip = _unzigzag(ip, v)
+                ips.append(str(ipaddr.IPAddress(ip)))
+
+            data = {}
+            if family == 6:
+                data['client_ip'] = _ip6_str(client6)
+            else:
+                data['client_ip'] = str(ipaddr.IPAddress(client_ip))
+            data['names'] = names
+            data['ips'] = ips
+            if flags & DNSFLOW_FLAG_HITS:
+                data['hits'], cp = _varint(dnsflow_pkt, cp)
+            if flags & DNSFLOW_FLAG_TTL:
+                v, cp = _varint(dnsflow_pkt, cp)
+                ts_sec = _unzigzag(ts_sec, v)
+                ts_usec, cp = _varint(dnsflow_pkt, cp)
+                data['ts'] = ts_sec + ts_usec / 1000000.0
+                data['min_ttl'], cp = _varint(dnsflow_pkt, cp)
+            if flags & DNSFLOW_FLAG_RR_TTLS:
+                ttls = []
+                for x in range(_n_ttls(names_count, ips_count)):
+                    v, cp = _varint(dnsflow_pkt, cp)
+                    ttls.append(v)
+                _set_ttls(data, ttls, names_count)
+            if flags & DNSFLOW_FLAG_RTT:
+                data['rtt'], cp = _varint(dnsflow_pkt, cp)
+            sets.append(data)
+    except (IndexError, struct.error) as e:
+        err = 'COMPRESSED_PARSE_ERROR|%d|%s' % (len(sets), e)
+        return (sets, err)
+    return (sets, None)
 
 #
 # Returns a tuple(pkt_contents, error_string).
@@ -138,8 +511,8 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
         return (pkt, err)
     cp += struct.calcsize(fmt)
 
-    # Version 0, 1, or 2
-    if (vers != 0 and vers != 1 and vers !=2) or sets_count == 0:
+    # Version 0, 1, 2, 3, 4 or 5
+    if vers not in (0, 1, 2, 3, 4, 5) or sets_count == 0:
         err = 'BAD_PKT|%s' % (src_ip)
         return (pkt, err)
    
@@ -152,7 +525,11 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
     hdr['sequence_number'] = seq_num
     pkt['header'] = hdr
     
-    if flags & DNSFLOW_FLAG_STATS:
+    if vers == 5:
+        # Stats set v3, with 64 bit counters
+        pkt['stats3'], err = _process_stats3(dnsflow_pkt, cp)
+
+    elif flags & DNSFLOW_FLAG_STATS:
         if vers == 2:
             fmt = '!5I'
         else:
@@ -171,14 +548,80 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
         sp['pkts_ifdropped'] = stats[3]
         if vers == 2:
             sp['sample_rate'] = stats[4]
+        cp += struct.calcsize(fmt)
+        if flags & DNSFLOW_FLAG_STATS_EXT:
+            try:
+                (drops_count, stages_count, pipes_count,
+                        exports_count) = struct.unpack('!BBBB',
+                        dnsflow_pkt[cp:cp + 4])
+                cp += 4
+                fmt = '!%dI' % (drops_count)
+                drops = struct.unpack(fmt,
+                        dnsflow_pkt[cp:cp + struct.calcsize(fmt)])
+                cp += struct.calcsize(fmt)
+                for i, v in enumerate(drops):
+                    if i < len(DNSFLOW_DROP_NAMES):
+                        name = DNSFLOW_DROP_NAMES[i]
+                    else:
+                        name = 'drop%d' % (i)
+                    sp['drop_' + name] = v
+                for i in range(stages_count):
+                    vals = struct.unpack('!4I', dnsflow_pkt[cp:cp + 16])
+                    cp += 16
+                    if i < len(DNSFLOW_STAGE_NAMES):
+                        name = DNSFLOW_STAGE_NAMES[i]
+                    else:
+                        name = 'stage%d' % (i)
+                    for k, v in zip(['n', 'p50_ns', 'p99_ns', 'p999_ns'],
+                            vals):
+                        sp['%s_%s' % (name, k)] = v
+                for i in range(pipes_count):
+                    vals = struct.unpack('!3I', dnsflow_pkt[cp:cp + 12])
+                    cp += 12
+                    if i < len(DNSFLOW_PIPE_NAMES):
+                        name = DNSFLOW_PIPE_NAMES[i]
+                    else:
+                        name = 'pipe%d' % (i)
+                    for k, v in zip(['used', 'size', 'overflows'], vals):
+                        sp['pipe_%s_%s' % (name, k)] = v
+                for i in range(exports_count):
+                    vals = struct.unpack('!6I', dnsflow_pkt[cp:cp + 24])
+                    cp += 24
+                    # One per -D collector, in command line order.
+                    name = 'tcp%d' % (i)
+                    for k, v in zip(['queued', 'size', 'sent', 'dropped',
+                            'stalls', 'connects'], vals):
+                        sp['export_%s_%s' % (name, k)] = v
+            except struct.error, e:
+                err = 'STATS_EXT_PARSE_ERROR|%s' % (e)
+                return (pkt, err)
         pkt['stats'] = sp
 
+    elif flags & DNSFLOW_FLAG_TOPK:
+        pkt['topk'], err = _process_topk(dnsflow_pkt, cp)
+
+    elif flags & DNSFLOW_FLAG_COMPRESSED:
+        if not stats_only:
+            pkt['data'], err = _process_compressed_sets(dnsflow_pkt, cp,
+                    sets_count, flags, vers)
+
     elif not stats_only:
         # data pkt
         pkt['data'] = []
         for i in range(sets_count):
+            family = 4
+            if vers == 4:
+                try:
+                    family = ord(dnsflow_pkt[cp])
+                except IndexError, e:
+                    err = 'DATA_PARSE_ERROR|family|%s' % (e)
+                    return (pkt, err)
+                cp += 1
             # client_ip, names_count, ips_count, names_len
-            fmt = '!IBBH'
+            if family == 6:
+                fmt = '!16sBBH'
+            else:
+                fmt = '!IBBH'
             try:
                 vals = struct.unpack(fmt,
                         dnsflow_pkt[cp:cp + struct.calcsize(fmt)])
@@ -187,7 +630,10 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
                 err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
                 return (pkt, err)
             cp += struct.calcsize(fmt)
-            client_ip = str(ipaddr.IPAddress(client_ip))
+            if family == 6:
+                client_ip = _ip6_str(client_ip)
+            else:
+                client_ip = str(ipaddr.IPAddress(client_ip))
 
             fmt = '%ds' % (names_len)
 
@@ -198,7 +644,7 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
                 err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
                 return (pkt, err)
             cp += struct.calcsize(fmt)
-            if vers == 1 or vers == 2:
+            if vers in (1, 2, 4):
                 # Each name is in the form of an uncompressed dns name.
                 # names are root domain (Nul) terminated, and padded with Nuls
                 # on the end to word align. 
@@ -228,7 +674,10 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
                 names = name_set.split('\0')
                 names = names[0:names_count]
 
-            fmt = '!%dI' % (ips_count)
+            if family == 6:
+                fmt = '%ds' % (16 * ips_count)
+            else:
+                fmt = '!%dI' % (ips_count)
             try:
                 ips = struct.unpack(fmt,
                         dnsflow_pkt[cp:cp + struct.calcsize(fmt)])
@@ -236,12 +685,54 @@ def process_pkt(dl_type, ts, buf, stats_only=False):
                 err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
                 return (pkt, err)
             cp += struct.calcsize(fmt)
-            ips = [str(ipaddr.IPAddress(x)) for x in ips]
+            if family == 6:
+                ips = [_ip6_str(ips[0][x:x + 16])
+                        for x in range(0, 16 * ips_count, 16)]
+            else:
+                ips = [str(ipaddr.IPAddress(x)) for x in ips]
 
             data = {}
             data['client_ip'] = client_ip
             data['names'] = names
             data['ips'] = ips
+            if flags & DNSFLOW_FLAG_HITS:
+                fmt = '!I'
+                try:
+                    data['hits'] = struct.unpack(fmt,
+                            dnsflow_pkt[cp:cp + struct.calcsize(fmt)])[0]
+                except struct.error, e:
+                    err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
+                    return (pkt, err)
+                cp += struct.calcsize(fmt)
+            if flags & DNSFLOW_FLAG_TTL:
+                fmt = '!III'
+                try:
+                    ts_sec, ts_usec, data['min_ttl'] = struct.unpack(fmt,
+                            dnsflow_pkt[cp:cp + struct.calcsize(fmt)])
+                except struct.error, e:
+                    err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
+                    return (pkt, err)
+                cp += struct.calcsize(fmt)
+                data['ts'] = ts_sec + ts_usec / 1000000.0
+            if flags & DNSFLOW_FLAG_RR_TTLS:
+                fmt = '!%dI' % (_n_ttls(names_count, ips_count))
+                try:
+                    ttls = struct.unpack(fmt,
+                            dnsflow_pkt[cp:cp + struct.calcsize(fmt)])
+                except struct.error, e:
+                    err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
+                    return (pkt, err)
+                cp += struct.calcsize(fmt)
+                _set_ttls(data, ttls, names_count)
+            if flags & DNSFLOW_FLAG_RTT:
+                fmt = '!I'
+                try:
+                    data['rtt'] = struct.unpack(fmt,
+                            dnsflow_pkt[cp:cp + struct.calcsize(fmt)])[0]
+                except struct.error, e:
+                    err = 'DATA_PARSE_ERROR|%s|%s' % (fmt, e)
+                    return (pkt, err)
+                cp += struct.calcsize(fmt)
             pkt['data'].append(data)
 
     return (pkt, err)
@@ -306,10 +797,41 @@ def _print_parsed_pkt(pkt):
         stats = pkt['stats']
         print "STATS|%s" % ('|'.join(['%s:%d' % (x[0], x[1])
             for x in stats.items()]))
+    elif 'stats3' in pkt:
+        st = pkt['stats3']
+        print 'STATS3|ts=%s|sample_rate=%d|%s' % (
+                time.strftime('%H:%M:%S', time.gmtime(st['ts'])),
+                st['sample_rate'], '|'.join(['%s:%d' % (x[0], x[1])
+                for x in st['totals'].items()]))
+        for w in st['workers']:
+            print 'STATS3_WORKER|%d|%s|%s' % (w['id'], w['role'],
+                    '|'.join(['%s:%d' % (k, v) for k, v in w.items()
+                    if k not in ('id', 'role')]))
+    elif 'topk' in pkt:
+        tk = pkt['topk']
+        print 'TOPK|ts=%s|window_sec=%d|sets=%d' % (
+                time.strftime('%H:%M:%S', time.gmtime(tk['ts'])),
+                tk['window_sec'], tk['sets'])
+        for client, count in tk['clients']:
+            print 'TOPK_CLIENT|%s|%d' % (client, count)
+        for name, count in tk['names']:
+            print 'TOPK_NAME|%s|%d' % (name, count)
     else:
         for data in pkt['data']:
-            print 'DATA|%s|%s|%s|%s' % (data['client_ip'], tstr,
+            line = 'DATA|%s|%s|%s|%s' % (data['client_ip'], tstr,
                     ','.join(data['names']), ','.join(data['ips']))
+            if 'hits' in data:
+                line += '|hits=%d' % (data['hits'])
+            if 'ts' in data:
+                line += '|resp_ts=%.6f|min_ttl=%d' % (data['ts'],
+                        data['min_ttl'])
+            if 'name_ttls' in data:
+                line += '|ttls=%s;%s' % (
+                        ','.join([str(x) for x in data['name_ttls']]),
+                        ','.join([str(x) for x in data['ip_ttls']]))
+            if 'rtt' in data:
+                line += '|rtt_us=%d' % (data['rtt'])
+            print line
 
 
 class SrcTracker(object):
@@ -325,6 +847,7 @@ class SrcTracker(object):
                     'n_records': 0,
                     'n_data_pkts': 0,
                     'n_stats_pkts': 0,
+                    'n_topk_pkts': 0,
                     'first_timestamp': hdr['timestamp'],
                     'seq': {
                         'seq_last': None,
@@ -352,6 +875,10 @@ class SrcTracker(object):
                 src['stats_delta_last'][k] = pkt['stats'][k] - src['stats_last'][k]
                 src['stats_delta_total'][k] += src['stats_delta_last'][k]
             src['stats_last'] = pkt['stats']
+        elif 'stats3' in pkt:
+            src['n_stats_pkts'] += 1
+        elif 'topk' in pkt:
+            src['n_topk_pkts'] += 1
         else:
             src['n_data_pkts'] += 1
             src['n_records'] += hdr['sets_count']
@@ -379,10 +906,12 @@ class SrcTracker(object):
         ts_delta = src['last_timestamp'] - src['first_timestamp']
         print '%s:%s' % (src_id[0], src_id[1])
         print '  %s' % (' '.join(['%s=%d' % (k, src[k])
-            for k in ['n_data_pkts', 'n_records', 'n_stats_pkts']]))
+            for k in ['n_data_pkts', 'n_records', 'n_stats_pkts',
+                'n_topk_pkts']]))
         if ts_delta > 0:
             print '  %s' % (' '.join(['%s/s=%.2f' % (k, src[k]/ts_delta)
-                for k in ['n_data_pkts', 'n_records', 'n_stats_pkts']]))
+                for k in ['n_data_pkts', 'n_records', 'n_stats_pkts',
+                'n_topk_pkts']]))
         if 'stats_delta_total' in src:
             print '  %s' % (' '.join(['%s=%d' % (x[0], x[1])
                 for x in src['stats_delta_total'].items()]))
@@ -409,6 +938,12 @@ def parse_args():
     input_group = p.add_mutually_exclusive_group(required=True)
     input_group.add_argument('-r', dest='pcap_file')
     input_group.add_argument('-i', dest='interface')
+    input_group.add_argument('-H', dest='ring_file',
+        help="read a dnsflow -H shared memory ring")
+    input_group.add_argument('-U', dest='unix_path',
+        help="listen for dnsflow -U on a unix socket")
+    input_group.add_argument('-D', dest='tcp_port', type=int,
+        help="listen for dnsflow -D on a tcp port")
     args = p.parse_args()
 
     return args
@@ -431,6 +966,12 @@ def main(argv):
     if args.pcap_file:
         diter = pkt_iter(pcap_file=args.pcap_file, pcap_filter=pcap_filter,
                 stats_only=parse_stats)
+    elif args.ring_file:
+        diter = pkt_iter(ring_file=args.ring_file, stats_only=parse_stats)
+    elif args.unix_path:
+        diter = pkt_iter(unix_path=args.unix_path, stats_only=parse_stats)
+    elif args.tcp_port:
+        diter = pkt_iter(tcp_port=args.tcp_port, stats_only=parse_stats)
     else:
         diter = pkt_iter(interface=args.interface, pcap_filter=pcap_filter,
                 stats_only=parse_stats)
@@ -440,7 +981,7 @@ def main(argv):
         for cnt, pkt in enumerate(diter):
             src_id = srcs.update(pkt)
             if args.stats_only:
-                if 'stats' in pkt:
+                if 'stats' in pkt or 'stats3' in pkt:
                     _print_parsed_pkt(pkt)
                     # XXX This is just printing the total so far, not since
                     # the last stats pkt.
@@ -0,0 +1,333 @@
+/*
+ * dnsflow_ring.c
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of DeepField Networks, Inc. nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#if __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnsflow_ring.h"
+
+#define RING_REC_LEN(len)	(((len) + sizeof(uint32_t) + \
+			DNSFLOW_RING_ALIGN - 1) & ~(DNSFLOW_RING_ALIGN - 1))
+
+static void
+ring_wake(struct dnsflow_ring_hdr *rh)
+{
+	__sync_add_and_fetch(&rh->rh_seq, 1);
+#if __linux__
+	syscall(SYS_futex, &rh->rh_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Sleep until a writer bumps rh_seq past seq, or the timeout is up. */
+static void
+ring_wait(struct dnsflow_ring_hdr *rh, uint32_t seq, int timeout_ms)
+{
+#if __linux__
+	struct timespec		ts, *tsp = NULL;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+		tsp = &ts;
+	}
+	syscall(SYS_futex, &rh->rh_seq, FUTEX_WAIT, seq, tsp, NULL, 0);
+#else
+	/* No futex, poll. */
+	if (timeout_ms < 0 || timeout_ms > 1) {
+		timeout_ms = 1;
+	}
+	usleep(timeout_ms * 1000);
+#endif
+}
+
+static struct dnsflow_ring *
+ring_map(int fd, size_t map_len)
+{
+	struct dnsflow_ring	*r;
+	void			*p;
+
+	p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		warn("mmap");
+		return (NULL);
+	}
+	if ((r = calloc(1, sizeof(*r))) == NULL) {
+		warn("calloc");
+		munmap(p, map_len);
+		return (NULL);
+	}
+	r->r_hdr = p;
+	r->r_map_len = map_len;
+	return (r);
+}
+
+/* A new ring at path, replacing any old one. A reader that still has the
+ * old one mapped has to open it again. */
+struct dnsflow_ring *
+dnsflow_ring_create(const char *path, size_t size)
+{
+	struct dnsflow_ring	*r;
+	struct dnsflow_ring_hdr	*rh;
+	pthread_mutexattr_t	attr;
+	size_t			pow2 = DNSFLOW_RING_MIN;
+	int			fd;
+
+	while (pow2 * 2 <= size) {
+		pow2 *= 2;
+	}
+	if (unlink(path) < 0 && errno != ENOENT) {
+		warn("%s", path);
+		return (NULL);
+	}
+	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+		warn("%s", path);
+		return (NULL);
+	}
+	if (ftruncate(fd, DNSFLOW_RING_DATA_OFF + pow2) < 0) {
+		warn("%s", path);
+		close(fd);
+		return (NULL);
+	}
+	r = ring_map(fd, DNSFLOW_RING_DATA_OFF + pow2);
+	close(fd);
+	if (r == NULL) {
+		return (NULL);
+	}
+
+	rh = r->r_hdr;
+	rh->rh_size = pow2;
+	rh->rh_data_off = DNSFLOW_RING_DATA_OFF;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#if __linux__
+	/* A -M proc that dies with it held doesn't stop the others. */
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&rh->rh_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	r->r_data = (uint8_t *)rh + DNSFLOW_RING_DATA_OFF;
+	r->r_mask = pow2 - 1;
+	/* Last, so a reader that opens it early sees it's not ready. */
+	rh->rh_version = DNSFLOW_RING_VERSION;
+	__sync_synchronize();
+	rh->rh_magic = DNSFLOW_RING_MAGIC;
+
+	return (r);
+}
+
+/* Copy in n flow pkts. Returns the number that fit; the rest are counted as
+ * drops. */
+int
+dnsflow_ring_put(struct dnsflow_ring *r, const struct iovec *iovs, int n)
+{
+	struct dnsflow_ring_hdr	*rh = r->r_hdr;
+	uint64_t		head, tail, off, need, skip;
+	int			i;
+
+#if __linux__
+	if (pthread_mutex_lock(&rh->rh_lock) == EOWNERDEAD) {
+		/* rh_head only moves past whole records. */
+		pthread_mutex_consistent(&rh->rh_lock);
+	}
+#else
+	pthread_mutex_lock(&rh->rh_lock);
+#endif
+	head = rh->rh_head;
+	tail = __atomic_load_n(&rh->rh_tail, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		need = RING_REC_LEN(iovs[i].iov_len);
+		off = head & r->r_mask;
+		skip = need > rh->rh_size - off ? rh->rh_size - off : 0;
+		if (head + skip + need - tail > rh->rh_size) {
+			break;
+		}
+		if (skip != 0) {
+			*(uint32_t *)(r->r_data + off) = DNSFLOW_RING_SKIP;
+			head += skip;
+			off = 0;
+		}
+		*(uint32_t *)(r->r_data + off) = iovs[i].iov_len;
+		memcpy(r->r_data + off + sizeof(uint32_t), iovs[i].iov_base,
+				iovs[i].iov_len);
+		head += need;
+	}
+	if (i < n) {
+		rh->rh_drops += n - i;
+	}
+	/* The records before the head. */
+	__atomic_store_n(&rh->rh_head, head, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rh->rh_lock);
+
+	/* Against the reader setting rh_waiting, then checking rh_head. */
+	__sync_synchronize();
+	if (i > 0 && rh->rh_waiting) {
+		ring_wake(rh);
+	}
+	return (i);
+}
+
+struct dnsflow_ring *
+dnsflow_ring_open(const char *path)
+{
+	struct dnsflow_ring	*r;
+	struct dnsflow_ring_hdr	*rh;
+	struct stat		st;
+	int			fd;
+
+	if ((fd = open(path, O_RDWR)) < 0) {
+		warn("%s", path);
+		return (NULL);
+	}
+	if (fstat(fd, &st) < 0) {
+		warn("%s", path);
+		close(fd);
+		return (NULL);
+	}
+	if (st.st_size < DNSFLOW_RING_DATA_OFF + DNSFLOW_RING_MIN) {
+		warnx("%s: not a dnsflow ring", path);
+		close(fd);
+		return (NULL);
+	}
+	r = ring_map(fd, st.st_size);
+	close(fd);
+	if (r == NULL) {
+		return (NULL);
+	}
+
+	rh = r->r_hdr;
+	if (rh->rh_magic != DNSFLOW_RING_MAGIC ||
+	    rh->rh_version != DNSFLOW_RING_VERSION ||
+	    rh->rh_data_off + rh->rh_size > (uint64_t)st.st_size ||
+	    (rh->rh_size & (rh->rh_size - 1)) != 0) {
+		warnx("%s: not a dnsflow ring, or not ready", path);
+		dnsflow_ring_close(r);
+		return (NULL);
+	}
+	r->r_data = (uint8_t *)rh + rh->rh_data_off;
+	r->r_mask = rh->rh_size - 1;
+	/* Carry on from the last reader; the writer hasn't overwritten
+	 * anything it didn't get to. */
+	r->r_tail = __atomic_load_n(&rh->rh_tail, __ATOMIC_ACQUIRE);
+
+	return (r);
+}
+
+static int64_t
+ring_now_ms(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+const void *
+dnsflow_ring_next(struct dnsflow_ring *r, uint32_t *len, int timeout_ms)
+{
+	struct dnsflow_ring_hdr	*rh = r->r_hdr;
+	uint64_t		head, off;
+	uint32_t		seq, rec_len;
+	int64_t			deadline = 0, left = -1;
+
+	if (r->r_pending != 0) {
+		dnsflow_ring_release(r);
+	}
+	if (timeout_ms > 0) {
+		deadline = ring_now_ms() + timeout_ms;
+	}
+	for (;;) {
+		head = __atomic_load_n(&rh->rh_head, __ATOMIC_ACQUIRE);
+		if (head == r->r_tail) {
+			if (timeout_ms >= 0) {
+				left = deadline - ring_now_ms();
+				if (timeout_ms == 0 || left <= 0) {
+					return (NULL);
+				}
+			}
+			seq = rh->rh_seq;
+			rh->rh_waiting = 1;
+			__sync_synchronize();
+			if (__atomic_load_n(&rh->rh_head,
+					__ATOMIC_ACQUIRE) == r->r_tail) {
+				ring_wait(rh, seq, left);
+			}
+			rh->rh_waiting = 0;
+			continue;
+		}
+		off = r->r_tail & r->r_mask;
+		rec_len = *(uint32_t *)(r->r_data + off);
+		if (rec_len == DNSFLOW_RING_SKIP) {
+			r->r_tail += rh->rh_size - off;
+			continue;
+		}
+		*len = rec_len;
+		r->r_pending = RING_REC_LEN(rec_len);
+		return (r->r_data + off + sizeof(uint32_t));
+	}
+}
+
+void
+dnsflow_ring_release(struct dnsflow_ring *r)
+{
+	r->r_tail += r->r_pending;
+	r->r_pending = 0;
+	__atomic_store_n(&r->r_hdr->rh_tail, r->r_tail, __ATOMIC_RELEASE);
+}
+
+uint64_t
+dnsflow_ring_drops(struct dnsflow_ring *r)
+{
+	return (__atomic_load_n(&r->r_hdr->rh_drops, __ATOMIC_RELAXED));
+}
+
+void
+dnsflow_ring_close(struct dnsflow_ring *r)
+{
+	munmap(r->r_hdr, r->r_map_len);
+	free(r);
+}
@@ -0,0 +1,90 @@
+/*
+ * dnsflow_ring.h
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ */
+
+#ifndef __DNSFLOW_RING_H__
+#define __DNSFLOW_RING_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Shared memory ring of flow pkts, for a collector on the same host (-H).
+ * The file is a header page, then the data. Each record is a uint32_t
+ * length and the flow pkt, from the dnsflow_hdr on, as it would be sent
+ * over udp, padded to DNSFLOW_RING_ALIGN. A record never wraps; one that
+ * doesn't fit before the end is put at the start, after a
+ * DNSFLOW_RING_SKIP length.
+ *
+ * Any number of writers, one reader. Writers take rh_lock, which is
+ * process-shared, so the -M procs can share a ring. A record is visible
+ * once rh_head is past it. The reader frees space by moving rh_tail. When
+ * the ring is full, the record is dropped and counted in rh_drops; the
+ * writer never waits for the reader. A reader that runs out sets
+ * rh_waiting and sleeps on rh_seq (a futex on Linux), which the writers
+ * bump after a commit if it's set.
+ *
+ * The reader only has to know the layout up to rh_tail, and can use
+ * rh_data_off to find the data. */
+#define DNSFLOW_RING_MAGIC	0x64667267	/* "dfrg" */
+#define DNSFLOW_RING_VERSION	1
+#define DNSFLOW_RING_ALIGN	8
+#define DNSFLOW_RING_SKIP	0xffffffff
+#define DNSFLOW_RING_DATA_OFF	4096
+#define DNSFLOW_RING_MIN	(1 << 20)
+
+struct dnsflow_ring_hdr {
+	/* Set once, by the writer that creates it. */
+	uint32_t	rh_magic;
+	uint32_t	rh_version;
+	uint64_t	rh_size;	/* Data bytes, a power of 2. */
+	uint64_t	rh_data_off;	/* From the start of the file. */
+	uint8_t		rh_pad0[40];
+
+	/* Writers */
+	uint64_t	rh_head;	/* Bytes committed, ever. */
+	uint64_t	rh_drops;	/* Records that didn't fit. */
+	uint32_t	rh_seq;
+	uint32_t	rh_waiting;
+	uint8_t		rh_pad1[40];
+
+	/* Reader */
+	uint64_t	rh_tail;	/* Bytes consumed, ever. */
+	uint8_t		rh_pad2[56];
+
+	pthread_mutex_t	rh_lock;
+};
+
+struct dnsflow_ring {
+	struct dnsflow_ring_hdr	*r_hdr;
+	uint8_t			*r_data;
+	uint64_t		r_mask;
+	size_t			r_map_len;
+	/* Reader */
+	uint64_t		r_tail;
+	uint32_t		r_pending;	/* Length of the record from
+						   dnsflow_ring_next(). */
+};
+
+/* Writer. size is rounded down to a power of 2. */
+struct dnsflow_ring *dnsflow_ring_create(const char *path, size_t size);
+int dnsflow_ring_put(struct dnsflow_ring *r, const struct iovec *iovs,
+		int n);
+
+/* Reader. dnsflow_ring_next() returns the next record in place, or NULL if
+ * there's none within timeout_ms (-1 waits forever). It's valid until
+ * dnsflow_ring_release(). */
+struct dnsflow_ring *dnsflow_ring_open(const char *path);
+const void *dnsflow_ring_next(struct dnsflow_ring *r, uint32_t *len,
+		int timeout_ms);
+void dnsflow_ring_release(struct dnsflow_ring *r);
+uint64_t dnsflow_ring_drops(struct dnsflow_ring *r);
+
+void dnsflow_ring_close(struct dnsflow_ring *r);
+
+#endif /* __DNSFLOW_RING_H__ */
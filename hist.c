@@ -0,0 +1,146 @@
+/*
+ * hist.c
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of DeepField Networks, Inc. nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+
+static double		ticks_per_ns = 1.0;
+
+/* Measure the tick rate against the monotonic clock. Takes ~50ms. */
+void
+hist_calibrate(void)
+{
+	struct timespec		ts0, ts1;
+	uint64_t		t0, t1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	t0 = hist_ticks();
+	usleep(50000);
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	t1 = hist_ticks();
+
+	ns = (uint64_t)(ts1.tv_sec - ts0.tv_sec) * 1000000000 +
+		ts1.tv_nsec - ts0.tv_nsec;
+	if (ns > 0 && t1 > t0) {
+		ticks_per_ns = (double)(t1 - t0) / ns;
+	}
+}
+
+double
+hist_ticks_to_ns(uint64_t ticks)
+{
+	return (ticks / ticks_per_ns);
+}
+
+void
+hist_merge(struct hist *dst, const struct hist *src)
+{
+	int		i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		/* src can still be counting, in another thread. */
+		dst->h_buckets[i] += __atomic_load_n(&src->h_buckets[i],
+				__ATOMIC_RELAXED);
+	}
+}
+
+/* dst = cur - prev, for the counts since an earlier copy. */
+void
+hist_diff(struct hist *dst, const struct hist *cur, const struct hist *prev)
+{
+	int		i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->h_buckets[i] = cur->h_buckets[i] - prev->h_buckets[i];
+	}
+}
+
+uint32_t
+hist_count(const struct hist *h)
+{
+	uint32_t	n = 0;
+	int		i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += h->h_buckets[i];
+	}
+	return (n);
+}
+
+/* Lower bound of bucket b. */
+static uint64_t
+hist_bucket_low(int b)
+{
+	int		e;
+
+	if (b < HIST_LINEAR) {
+		return (b);
+	}
+	b -= HIST_LINEAR;
+	e = b / (1 << HIST_SUB_BITS) + 4;
+	return ((uint64_t)((1 << HIST_SUB_BITS) +
+			b % (1 << HIST_SUB_BITS)) << (e - HIST_SUB_BITS));
+}
+
+/* Returns the value (middle of the bucket) at percentile pct (0-100), or
+ * 0 if there's nothing in the histogram. */
+uint64_t
+hist_percentile(const struct hist *h, double pct)
+{
+	uint64_t	target, n = 0, low, high;
+	uint32_t	total;
+	int		i;
+
+	if ((total = hist_count(h)) == 0) {
+		return (0);
+	}
+	target = (uint64_t)(total * pct / 100.0);
+	if (target >= total) {
+		target = total - 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += h->h_buckets[i];
+		if (n > target) {
+			break;
+		}
+	}
+	low = hist_bucket_low(i);
+	high = (i + 1 < HIST_BUCKETS) ? hist_bucket_low(i + 1) : low;
+	return (low + (high - low) / 2);
+}
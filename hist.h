@@ -0,0 +1,77 @@
+/*
+ * hist.h
+ *
+ * Copyright (c) 2011, DeepField Networks, Inc. <info@deepfield.net>
+ * All rights reserved.
+ *
+ */
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* Log-linear histogram of tick counts. Values under 16 get their own
+ * bucket, above that each power of 2 is split into 8 buckets, so a bucket
+ * is within 12.5% of the values in it. Only written by one thread;
+ * readers get a slightly stale, but good enough, view. */
+#define HIST_LINEAR		16
+#define HIST_SUB_BITS		3
+#define HIST_BUCKETS		(HIST_LINEAR + (64 - 4) * (1 << HIST_SUB_BITS))
+
+struct hist {
+	uint32_t	h_buckets[HIST_BUCKETS];
+};
+
+static inline int
+hist_bucket(uint64_t v)
+{
+	int		e;
+
+	if (v < HIST_LINEAR) {
+		return (v);
+	}
+	e = 63 - __builtin_clzll(v);
+	return (HIST_LINEAR + (e - 4) * (1 << HIST_SUB_BITS) +
+		((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1)));
+}
+
+static inline void
+hist_add(struct hist *h, uint64_t v)
+{
+	h->h_buckets[hist_bucket(v)]++;
+}
+
+/* Cheap timestamps. The TSC (or the arm generic timer) where there is
+ * one, otherwise the monotonic clock in ns. */
+static inline uint64_t
+hist_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t	lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return (((uint64_t)hi << 32) | lo);
+#elif defined(__aarch64__)
+	uint64_t	v;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+	return (v);
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+void hist_calibrate(void);
+double hist_ticks_to_ns(uint64_t ticks);
+void hist_merge(struct hist *dst, const struct hist *src);
+void hist_diff(struct hist *dst, const struct hist *cur,
+		const struct hist *prev);
+uint32_t hist_count(const struct hist *h);
+uint64_t hist_percentile(const struct hist *h, double pct);
+
+#endif /* __HIST_H__ */